@@ -0,0 +1,108 @@
+/*
+ * can_batch.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/can_batch.h>
+#include <assert.h>
+/*----------------------------------------------------------------------------*/
+void canBatchPoolInit(struct CanBatchPool *pool, PointerArray *frames,
+    PointerQueue *rxQueue, PointerQueue *txQueue)
+{
+  pool->pool = frames;
+  pool->rxQueue = rxQueue;
+  pool->txQueue = txQueue;
+  pool->rxAcquired = 0;
+  pool->txAcquired = 0;
+}
+/*----------------------------------------------------------------------------*/
+void canBatchPoolAcquireRx(struct CanBatchPool *pool,
+    struct CANFrameBatch *batch)
+{
+  size_t count = 0;
+
+  while (count < batch->count && !pointerQueueEmpty(pool->rxQueue))
+  {
+    batch->frames[count++] = pointerQueueFront(pool->rxQueue);
+    pointerQueuePopFront(pool->rxQueue);
+  }
+
+  pool->rxAcquired += count;
+  batch->count = count;
+}
+/*----------------------------------------------------------------------------*/
+void canBatchPoolAcquireTx(struct CanBatchPool *pool,
+    struct CANFrameBatch *batch)
+{
+  const size_t space = canBatchPoolTxSpace(pool);
+  const size_t count = batch->count < space ? batch->count : space;
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    batch->frames[index] = pointerArrayBack(pool->pool);
+    pointerArrayPopBack(pool->pool);
+  }
+
+  pool->txAcquired += count;
+  batch->count = count;
+}
+/*----------------------------------------------------------------------------*/
+void canBatchPoolReleaseRx(struct CanBatchPool *pool,
+    const struct CANFrameBatch *batch)
+{
+  assert(pool->rxAcquired >= batch->count);
+
+  for (size_t index = 0; index < batch->count; ++index)
+    pointerArrayPushBack(pool->pool, batch->frames[index]);
+  pool->rxAcquired -= batch->count;
+}
+/*----------------------------------------------------------------------------*/
+void canBatchPoolReleaseTx(struct CanBatchPool *pool,
+    const struct CANFrameBatch *batch)
+{
+  assert(pool->txAcquired >= batch->count);
+
+  for (size_t index = 0; index < batch->count; ++index)
+    pointerArrayPushBack(pool->pool, batch->frames[index]);
+  pool->txAcquired -= batch->count;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * The send function writes frames directly into the hardware buffers and
+ * returns the number of written frames, it is called only when the transmit
+ * queue is empty. No frames are queued when one of the frames is incorrect.
+ */
+bool canBatchPoolSubmit(struct CanBatchPool *pool,
+    const struct CANFrameBatch *batch,
+    size_t (*send)(void *, struct CANStandardMessage * const *, size_t),
+    void *argument)
+{
+  for (size_t index = 0; index < batch->count; ++index)
+  {
+    const struct CANStandardMessage * const message = batch->frames[index];
+
+    /* Flexible data-rate frames aren't supported */
+    if ((message->flags & CAN_FD) || message->length > 8)
+      return false;
+  }
+
+  assert(pool->txAcquired >= batch->count);
+  pool->txAcquired -= batch->count;
+
+  size_t index = 0;
+
+  if (pointerQueueEmpty(pool->txQueue))
+  {
+    index = send(argument, batch->frames, batch->count);
+
+    for (size_t sent = 0; sent < index; ++sent)
+      pointerArrayPushBack(pool->pool, batch->frames[sent]);
+  }
+
+  /* Queue slots for remaining frames were reserved during acquisition */
+  while (index < batch->count)
+    pointerQueuePushBack(pool->txQueue, batch->frames[index++]);
+
+  return true;
+}
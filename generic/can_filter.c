@@ -0,0 +1,286 @@
+/*
+ * can_filter.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/can_filter.h>
+#include <xcore/bits.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+#define EXT_ID_MASK   MASK(29)
+#define STD_ID_MASK   MASK(11)
+#define MIN_SLOTS     8
+/*----------------------------------------------------------------------------*/
+struct CanFilterEntry
+{
+  uint32_t id;
+  uint32_t mask;
+  bool ext;
+};
+
+struct CanFilterSlot
+{
+  /* Masked identifier */
+  uint32_t key;
+  /* Number of filters with the same identifier and mask */
+  uint16_t count;
+  /* Index of the mask group plus one, zero for empty slots */
+  uint16_t group;
+};
+/*----------------------------------------------------------------------------*/
+static size_t findGroup(const struct CanFilterSet *, uint32_t);
+static size_t hashKey(uint32_t, size_t);
+static void insertExtended(struct CanFilterSet *, uint32_t, uint32_t);
+static void insertStandard(struct CanFilterSet *, uint32_t, uint32_t);
+static void makeEntry(const struct CANFilter *, bool, struct CanFilterEntry *);
+static void rebuild(struct CanFilterSet *);
+/*----------------------------------------------------------------------------*/
+static size_t findGroup(const struct CanFilterSet *set, uint32_t mask)
+{
+  for (size_t index = 0; index < set->groups; ++index)
+  {
+    if (set->masks[index] == mask)
+      return index;
+  }
+
+  return set->groups;
+}
+/*----------------------------------------------------------------------------*/
+static size_t hashKey(uint32_t key, size_t group)
+{
+  /* Multiplicative hashing, upper bits are mixed into lower ones */
+  uint32_t value = (key ^ ((uint32_t)group << 24)) * 0x9E3779B1UL;
+  return (size_t)(value ^ (value >> 15));
+}
+/*----------------------------------------------------------------------------*/
+static void insertExtended(struct CanFilterSet *set, uint32_t id,
+    uint32_t mask)
+{
+  size_t group = findGroup(set, mask);
+
+  if (group == set->groups)
+    set->masks[set->groups++] = mask;
+
+  size_t index = hashKey(id, group) & set->slotMask;
+
+  while (set->slots[index].group)
+  {
+    struct CanFilterSlot * const slot = &set->slots[index];
+
+    if (slot->group == group + 1 && slot->key == id)
+    {
+      ++slot->count;
+      return;
+    }
+
+    index = (index + 1) & set->slotMask;
+  }
+
+  set->slots[index].key = id;
+  set->slots[index].count = 1;
+  set->slots[index].group = (uint16_t)(group + 1);
+}
+/*----------------------------------------------------------------------------*/
+static void insertStandard(struct CanFilterSet *set, uint32_t id,
+    uint32_t mask)
+{
+  const uint32_t free = ~mask & STD_ID_MASK;
+  uint32_t variant = free;
+
+  /* Enumerate all identifiers matching the filter */
+  do
+  {
+    const uint32_t value = id | variant;
+
+    set->standard[value >> 5] |= 1UL << (value & 31);
+    variant = (variant - 1) & free;
+  }
+  while (variant != free);
+}
+/*----------------------------------------------------------------------------*/
+static void makeEntry(const struct CANFilter *filter, bool ext,
+    struct CanFilterEntry *entry)
+{
+  const uint32_t width = ext ? EXT_ID_MASK : STD_ID_MASK;
+
+  entry->mask = filter->mask & width;
+  entry->id = filter->id & entry->mask;
+  entry->ext = ext;
+}
+/*----------------------------------------------------------------------------*/
+static void rebuild(struct CanFilterSet *set)
+{
+  memset(set->standard, 0, sizeof(set->standard));
+  if (set->slots != NULL)
+    memset(set->slots, 0, (set->slotMask + 1) * sizeof(*set->slots));
+  set->groups = 0;
+
+  for (size_t index = 0; index < set->count; ++index)
+  {
+    const struct CanFilterEntry * const entry = &set->entries[index];
+
+    if (entry->ext)
+      insertExtended(set, entry->id, entry->mask);
+    else
+      insertStandard(set, entry->id, entry->mask);
+  }
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Initialize the filter set.
+ * @param set Pointer to a filter set.
+ * @param capacity Maximum number of filters.
+ * @return @b true on success or @b false when memory allocation failed.
+ */
+bool canFilterSetInit(struct CanFilterSet *set, size_t capacity)
+{
+  assert(capacity < UINT16_MAX);
+
+  memset(set->standard, 0, sizeof(set->standard));
+  set->entries = NULL;
+  set->masks = NULL;
+  set->slots = NULL;
+  set->capacity = capacity;
+  set->count = 0;
+  set->groups = 0;
+  set->slotMask = 0;
+
+  if (!capacity)
+    return true;
+
+  /* Hash table load factor is kept below one half */
+  size_t slots = MIN_SLOTS;
+
+  while (slots < capacity * 2)
+    slots <<= 1;
+
+  set->entries = malloc(capacity * sizeof(*set->entries));
+  set->masks = malloc(capacity * sizeof(*set->masks));
+  set->slots = calloc(slots, sizeof(*set->slots));
+
+  if (set->entries == NULL || set->masks == NULL || set->slots == NULL)
+  {
+    canFilterSetDeinit(set);
+    return false;
+  }
+
+  set->slotMask = slots - 1;
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+void canFilterSetDeinit(struct CanFilterSet *set)
+{
+  free(set->slots);
+  free(set->masks);
+  free(set->entries);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Add an acceptance filter. Identifier bits are compared when
+ * the corresponding mask bits are set.
+ * @param set Pointer to a filter set.
+ * @param filter Identifier and mask of the filter.
+ * @param ext Filter for frames with extended identifiers.
+ * @return @b true on success or @b false when the set is full.
+ */
+bool canFilterSetAdd(struct CanFilterSet *set, const struct CANFilter *filter,
+    bool ext)
+{
+  if (canFilterSetFull(set))
+    return false;
+
+  struct CanFilterEntry * const entry = &set->entries[set->count++];
+
+  makeEntry(filter, ext, entry);
+
+  if (entry->ext)
+    insertExtended(set, entry->id, entry->mask);
+  else
+    insertStandard(set, entry->id, entry->mask);
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+void canFilterSetClear(struct CanFilterSet *set)
+{
+  set->count = 0;
+  rebuild(set);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Check whether a frame passes acceptance filtering.
+ * @param set Pointer to a filter set.
+ * @param id Frame identifier.
+ * @param ext Frame has an extended identifier.
+ * @return @b true when the frame should be accepted.
+ */
+bool canFilterSetMatch(const struct CanFilterSet *set, uint32_t id, bool ext)
+{
+  if (!set->count)
+    return true;
+
+  if (!ext)
+  {
+    id &= STD_ID_MASK;
+    return (set->standard[id >> 5] & (1UL << (id & 31))) != 0;
+  }
+
+  id &= EXT_ID_MASK;
+
+  for (size_t group = 0; group < set->groups; ++group)
+  {
+    const uint32_t key = id & set->masks[group];
+    size_t index = hashKey(key, group) & set->slotMask;
+
+    while (set->slots[index].group)
+    {
+      const struct CanFilterSlot * const slot = &set->slots[index];
+
+      if (slot->group == group + 1 && slot->key == key)
+        return true;
+
+      index = (index + 1) & set->slotMask;
+    }
+  }
+
+  return false;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Remove all filters with the same identifier and mask.
+ * @param set Pointer to a filter set.
+ * @param filter Identifier and mask of the filter.
+ * @param ext Filter for frames with extended identifiers.
+ * @return @b true when at least one filter was removed.
+ */
+bool canFilterSetRemove(struct CanFilterSet *set,
+    const struct CANFilter *filter, bool ext)
+{
+  struct CanFilterEntry target;
+  bool matched = false;
+
+  makeEntry(filter, ext, &target);
+
+  for (size_t index = 0; index < set->count;)
+  {
+    const struct CanFilterEntry * const entry = &set->entries[index];
+
+    if (entry->ext == target.ext && entry->id == target.id
+        && entry->mask == target.mask)
+    {
+      set->entries[index] = set->entries[--set->count];
+      matched = true;
+    }
+    else
+      ++index;
+  }
+
+  /* Open addressing does not support deletion, tables are rebuilt */
+  if (matched)
+    rebuild(set);
+
+  return matched;
+}
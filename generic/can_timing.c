@@ -0,0 +1,257 @@
+/*
+ * can_timing.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/can_timing.h>
+#include <stddef.h>
+/*----------------------------------------------------------------------------*/
+struct TimingScore
+{
+  /* Bit rate error in parts per million */
+  uint64_t error;
+  /* Sample point deviation in tenths of a percent */
+  uint16_t delta;
+};
+/*----------------------------------------------------------------------------*/
+static bool evaluate(uint32_t, const struct CanTimingLimits *,
+    const struct CanTimingRequest *, uint32_t, uint32_t, struct CanTiming *,
+    struct TimingScore *);
+static bool isBetter(const struct TimingScore *, const struct TimingScore *);
+static bool solveForPrescaler(uint32_t, const struct CanTimingLimits *,
+    const struct CanTimingRequest *, uint32_t, struct CanTiming *,
+    struct TimingScore *);
+/*----------------------------------------------------------------------------*/
+static bool evaluate(uint32_t clock, const struct CanTimingLimits *limits,
+    const struct CanTimingRequest *request, uint32_t prescaler,
+    uint32_t width, struct CanTiming *timing, struct TimingScore *score)
+{
+  const uint64_t period = (uint64_t)request->rate * prescaler * width;
+  const uint64_t difference = clock > period ? clock - period : period - clock;
+  const uint64_t error = difference * 1000000 / period;
+
+  if (error > request->tolerance)
+    return false;
+
+  /* Time quanta before the sample point, synchronization segment included */
+  const uint32_t sample = (width * request->samplePoint + 50) / 100;
+  uint32_t seg1 = sample > 1 ? sample - 1 : 1;
+
+  /* Move the sample point to the nearest position allowed by the limits */
+  if (seg1 < limits->minSeg1)
+    seg1 = limits->minSeg1;
+  if (seg1 > limits->maxSeg1)
+    seg1 = limits->maxSeg1;
+  if (seg1 + limits->minSeg2 + 1 > width)
+    seg1 = width - limits->minSeg2 - 1;
+  if (width - seg1 - 1 > limits->maxSeg2)
+    seg1 = width - limits->maxSeg2 - 1;
+
+  const uint32_t seg2 = width - seg1 - 1;
+  const uint32_t sjw = request->sjw ? request->sjw : 1;
+
+  if (seg1 < limits->minSeg1 || seg1 > limits->maxSeg1)
+    return false;
+  if (seg2 < limits->minSeg2 || seg2 > limits->maxSeg2)
+    return false;
+  if (sjw > limits->maxSjw || sjw > seg2)
+    return false;
+
+  const uint32_t position = (seg1 + 1) * 1000 / width;
+  const uint32_t target = (uint32_t)request->samplePoint * 10;
+
+  timing->prescaler = (uint16_t)prescaler;
+  timing->seg1 = (uint16_t)seg1;
+  timing->seg2 = (uint8_t)seg2;
+  timing->sjw = (uint8_t)sjw;
+
+  score->error = error;
+  score->delta = (uint16_t)(position > target ?
+      position - target : target - position);
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool isBetter(const struct TimingScore *candidate,
+    const struct TimingScore *current)
+{
+  if (candidate->error != current->error)
+    return candidate->error < current->error;
+  else
+    return candidate->delta < current->delta;
+}
+/*----------------------------------------------------------------------------*/
+static bool solveForPrescaler(uint32_t clock,
+    const struct CanTimingLimits *limits,
+    const struct CanTimingRequest *request, uint32_t prescaler,
+    struct CanTiming *timing, struct TimingScore *score)
+{
+  const uint32_t maxWidth = 1 + limits->maxSeg1 + limits->maxSeg2;
+  const uint32_t minWidth = 1 + limits->minSeg1 + limits->minSeg2;
+  const uint64_t quantum = (uint64_t)request->rate * prescaler;
+  const uint32_t lower = (uint32_t)(clock / quantum);
+  bool found = false;
+
+  /* Bit widths on both sides of the ideal value are checked */
+  for (uint32_t width = lower; width <= lower + 1; ++width)
+  {
+    struct CanTiming candidate;
+    struct TimingScore candidateScore;
+
+    if (width < minWidth || width > maxWidth)
+      continue;
+
+    if (evaluate(clock, limits, request, prescaler, width, &candidate,
+        &candidateScore) && (!found || isBetter(&candidateScore, score)))
+    {
+      *timing = candidate;
+      *score = candidateScore;
+      found = true;
+    }
+  }
+
+  return found;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Calculate bit timing with the least bit rate error. When several
+ * timings have the same error, the timing with the sample point closest
+ * to the requested one and with the largest number of time quanta is chosen.
+ * @param clock Clock frequency of the controller.
+ * @param limits Bit timing capabilities of the controller.
+ * @param request Desired bit rate, tolerance and sample point.
+ * @param timing Pointer to a result.
+ * @return @b true when a timing within the tolerance was found.
+ */
+bool canTimingCalc(uint32_t clock, const struct CanTimingLimits *limits,
+    const struct CanTimingRequest *request, struct CanTiming *timing)
+{
+  if (!clock || !request->rate)
+    return false;
+
+  const uint32_t maxWidth = 1 + limits->maxSeg1 + limits->maxSeg2;
+  const uint32_t minWidth = 1 + limits->minSeg1 + limits->minSeg2;
+  struct TimingScore score;
+  bool found = false;
+
+  for (uint32_t width = maxWidth; width >= minWidth; --width)
+  {
+    const uint64_t quantum = (uint64_t)request->rate * width;
+
+    if (quantum > clock)
+      continue;
+
+    const uint32_t lower = (uint32_t)(clock / quantum);
+
+    /* Prescalers on both sides of the ideal value are checked */
+    for (uint32_t prescaler = lower; prescaler <= lower + 1; ++prescaler)
+    {
+      struct CanTiming candidate;
+      struct TimingScore candidateScore;
+
+      if (prescaler > limits->prescaler)
+        break;
+
+      if (evaluate(clock, limits, request, prescaler, width, &candidate,
+          &candidateScore) && (!found || isBetter(&candidateScore, &score)))
+      {
+        *timing = candidate;
+        score = candidateScore;
+        found = true;
+
+        if (!score.error && !score.delta)
+          return true;
+      }
+    }
+  }
+
+  return found;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Calculate bit timings of the nominal and data phases of CAN FD frames.
+ * Timings with a common prescaler are preferred, in this case both phases
+ * have the same time quantum. The smallest common prescaler with the least
+ * total error is chosen. When no common prescaler exists, phases are
+ * calculated independently.
+ * @param clock Clock frequency of the controller.
+ * @param nominalLimits Capabilities of the controller in the nominal phase.
+ * @param nominalRequest Desired parameters of the nominal phase.
+ * @param dataLimits Capabilities of the controller in the data phase.
+ * @param dataRequest Desired parameters of the data phase.
+ * @param nominal Pointer to a result for the nominal phase.
+ * @param data Pointer to a result for the data phase.
+ * @return @b true when timings within the tolerance were found.
+ */
+bool canTimingCalcFd(uint32_t clock,
+    const struct CanTimingLimits *nominalLimits,
+    const struct CanTimingRequest *nominalRequest,
+    const struct CanTimingLimits *dataLimits,
+    const struct CanTimingRequest *dataRequest,
+    struct CanTiming *nominal, struct CanTiming *data)
+{
+  if (!clock || !nominalRequest->rate || !dataRequest->rate)
+    return false;
+
+  const uint32_t maxPrescaler = MIN(nominalLimits->prescaler,
+      dataLimits->prescaler);
+  struct TimingScore score;
+  bool found = false;
+
+  for (uint32_t prescaler = 1; prescaler <= maxPrescaler; ++prescaler)
+  {
+    struct CanTiming nominalCandidate;
+    struct CanTiming dataCandidate;
+    struct TimingScore nominalScore;
+    struct TimingScore dataScore;
+
+    /* Data phase is the shortest one, larger prescalers will not fit */
+    if ((uint64_t)dataRequest->rate * prescaler
+        * (1 + dataLimits->minSeg1 + dataLimits->minSeg2) > clock)
+    {
+      break;
+    }
+
+    if (!solveForPrescaler(clock, nominalLimits, nominalRequest, prescaler,
+        &nominalCandidate, &nominalScore))
+    {
+      continue;
+    }
+    if (!solveForPrescaler(clock, dataLimits, dataRequest, prescaler,
+        &dataCandidate, &dataScore))
+    {
+      continue;
+    }
+
+    const struct TimingScore candidateScore = {
+        .error = nominalScore.error + dataScore.error,
+        .delta = nominalScore.delta + dataScore.delta
+    };
+
+    if (!found || isBetter(&candidateScore, &score))
+    {
+      *nominal = nominalCandidate;
+      *data = dataCandidate;
+      score = candidateScore;
+      found = true;
+    }
+  }
+
+  if (found)
+    return true;
+
+  return canTimingCalc(clock, nominalLimits, nominalRequest, nominal)
+      && canTimingCalc(clock, dataLimits, dataRequest, data);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Calculate an actual bit rate.
+ * @param clock Clock frequency of the controller.
+ * @param timing Bit timing.
+ * @return Bit rate in bits per second.
+ */
+uint32_t canTimingGetRate(uint32_t clock, const struct CanTiming *timing)
+{
+  return clock / (timing->prescaler * (1 + timing->seg1 + timing->seg2));
+}
@@ -0,0 +1,169 @@
+/*
+ * clock_correlation.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/clock_correlation.h>
+#include <assert.h>
+/*----------------------------------------------------------------------------*/
+/* Weight of a new frequency measurement is 1/8 */
+#define FILTER_SHIFT  3
+/* Offset correction is limited to a half of the frequency ratio */
+#define SLEW_SHIFT    1
+/*----------------------------------------------------------------------------*/
+static uint64_t makeRatio(uint64_t, uint64_t);
+static uint64_t scale(uint64_t, uint64_t);
+/*----------------------------------------------------------------------------*/
+static uint64_t makeRatio(uint64_t numerator, uint64_t denominator)
+{
+  /* Numerator is reduced to avoid an overflow during the shift */
+  while (numerator > UINT32_MAX)
+  {
+    numerator >>= 1;
+    denominator >>= 1;
+  }
+
+  if (!denominator)
+    return UINT64_MAX;
+
+  return (numerator << 32) / denominator;
+}
+/*----------------------------------------------------------------------------*/
+static uint64_t scale(uint64_t value, uint64_t rate)
+{
+  /* 64-bit by 64-bit multiplication with 32 fractional bits in the rate */
+  const uint64_t valueHigh = value >> 32;
+  const uint64_t valueLow = value & UINT32_MAX;
+  const uint64_t rateHigh = rate >> 32;
+  const uint64_t rateLow = rate & UINT32_MAX;
+
+  return ((valueHigh * rateHigh) << 32) + valueHigh * rateLow
+      + valueLow * rateHigh + ((valueLow * rateLow) >> 32);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Initialize the clock correlation. Before the first sync point local
+ * values are converted with the nominal frequency ratio and zero offset.
+ * @param object Pointer to a clock correlation object.
+ * @param localFrequency Frequency of the local timebase.
+ * @param referenceFrequency Frequency of the reference clock.
+ */
+void clockCorrelationInit(struct ClockCorrelation *object,
+    uint32_t localFrequency, uint32_t referenceFrequency)
+{
+  assert(localFrequency && referenceFrequency);
+
+  object->nominal = ((uint64_t)referenceFrequency << 32) / localFrequency;
+  object->rate = object->nominal;
+
+  object->current.local = 0;
+  object->current.reference = 0;
+  object->current.rate = object->nominal;
+  object->previous = object->current;
+
+  object->lastLocal = 0;
+  object->lastReference = 0;
+  object->points = 0;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Convert a local time to the reference time.
+ * @param object Pointer to a clock correlation object.
+ * @param local Time in ticks of the local timebase.
+ * @return Time in ticks of the reference clock.
+ */
+uint64_t clockCorrelationConvert(const struct ClockCorrelation *object,
+    uint64_t local)
+{
+  /* Values preceding the current segment are mapped with the previous one */
+  const struct ClockSegment * const segment =
+      local >= object->current.local ? &object->current : &object->previous;
+
+  if (local >= segment->local)
+  {
+    return segment->reference + scale(local - segment->local, segment->rate);
+  }
+  else
+  {
+    const uint64_t offset = scale(segment->local - local, segment->rate);
+    return segment->reference > offset ? segment->reference - offset : 0;
+  }
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Add a sync point. Local and reference times should be sampled
+ * at the same moment, for example with interrupts disabled.
+ * @param object Pointer to a clock correlation object.
+ * @param local Time in ticks of the local timebase.
+ * @param reference Time in ticks of the reference clock.
+ * @return @b true when the sync point was accepted or @b false when one
+ * of the clocks did not advance since the previous sync point.
+ */
+bool clockCorrelationUpdate(struct ClockCorrelation *object, uint64_t local,
+    uint64_t reference)
+{
+  if (!object->points)
+  {
+    object->current.local = local;
+    object->current.reference = reference;
+    object->current.rate = object->nominal;
+    object->previous = object->current;
+
+    object->lastLocal = local;
+    object->lastReference = reference;
+    object->points = 1;
+    return true;
+  }
+
+  if (local <= object->lastLocal || reference < object->lastReference)
+    return false;
+
+  const uint64_t interval = local - object->lastLocal;
+  const uint64_t measured = makeRatio(reference - object->lastReference,
+      interval);
+
+  if (object->points == 1)
+  {
+    object->rate = measured;
+    object->points = 2;
+  }
+  else if (measured > object->rate)
+    object->rate += (measured - object->rate) >> FILTER_SHIFT;
+  else
+    object->rate -= (object->rate - measured) >> FILTER_SHIFT;
+
+  /* New segment starts at the predicted point to keep the mapping monotonic */
+  const uint64_t predicted = clockCorrelationConvert(object, local);
+  const uint64_t limit = object->rate >> SLEW_SHIFT;
+  struct ClockSegment segment = {
+      .local = local,
+      .reference = predicted,
+      .rate = object->rate
+  };
+
+  if (reference >= predicted)
+  {
+    const uint64_t correction = makeRatio(reference - predicted, interval);
+
+    /* Large positive offsets are stepped, time still moves forward */
+    if (correction <= limit)
+      segment.rate += correction;
+    else
+      segment.reference = reference;
+  }
+  else
+  {
+    const uint64_t correction = makeRatio(predicted - reference, interval);
+
+    /* Negative offsets are always slewed out by slowing down the mapping */
+    segment.rate -= MIN(correction, limit);
+  }
+
+  object->previous = object->current;
+  object->current = segment;
+  object->lastLocal = local;
+  object->lastReference = reference;
+
+  return true;
+}
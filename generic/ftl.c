@@ -0,0 +1,1022 @@
+/*
+ * ftl.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/ftl.h>
+#include <halm/irq.h>
+#include <halm/wq.h>
+#include <xcore/helpers.h>
+#include <xcore/memory.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_SPARE_SECTORS   2
+#define DEFAULT_WEAR_LIMIT      16
+#define FTL_MAGIC               0x4C544648UL
+/* Number of sectors that are available only for relocations */
+#define RESERVED_SECTORS        1
+
+#define HEADER_WORDS \
+    (sizeof(struct FtlSectorHeader) / sizeof(uint32_t))
+#define NO_SECTOR               0xFFFF
+#define UNMAPPED_SLOT           0xFFFF
+/*----------------------------------------------------------------------------*/
+enum [[gnu::packed]] SectorState
+{
+  SECTOR_FREE,
+  SECTOR_ACTIVE,
+  SECTOR_USED
+};
+
+/*
+ * Sector header is followed by a table with logical block numbers for each
+ * slot of the sector. Entries of the table are programmed after the data.
+ */
+struct FtlSectorHeader
+{
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t erases;
+  uint32_t slots;
+};
+
+struct FtlSector
+{
+  /* Allocation order of the sector */
+  uint32_t sequence;
+  /* Number of erase cycles */
+  uint32_t erases;
+  /* Number of slots with actual data */
+  uint16_t valid;
+  /* Current state */
+  enum SectorState state;
+};
+/*----------------------------------------------------------------------------*/
+static enum Result appendBlock(struct Ftl *, uint32_t, const void *,
+    uint16_t);
+static enum Result collectSector(struct Ftl *, uint16_t, bool);
+static enum Result collectStale(struct Ftl *);
+static void collectStaleTask(void *);
+static void collectTask(void *);
+static void getEraseCountRange(const struct Ftl *, uint32_t *, uint32_t *);
+static bool isWearLevelingRequired(const struct Ftl *);
+static enum Result memoryErase(struct Ftl *, uint16_t);
+static enum Result memoryRead(struct Ftl *, uint32_t, void *, size_t);
+static enum Result memoryWrite(struct Ftl *, uint32_t, const void *, size_t);
+static enum Result mountVolume(struct Ftl *);
+static enum Result openSector(struct Ftl *);
+static enum Result prepareSlot(struct Ftl *);
+static enum Result programEntry(struct Ftl *, uint16_t, uint32_t);
+static enum Result readBlocks(struct Ftl *, uint64_t, void *, size_t);
+static void scheduleCollection(struct Ftl *);
+static uint16_t selectVictim(const struct Ftl *, bool);
+static inline uint32_t slotAddress(const struct Ftl *, uint16_t, uint16_t);
+static size_t startTransfer(struct Ftl *, void *, size_t, bool);
+static void transferTask(void *);
+static enum Result writeBlocks(struct Ftl *, uint64_t, const void *, size_t);
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceInit(void *, const void *);
+static void interfaceDeinit(void *);
+static void interfaceSetCallback(void *, void (*)(void *), void *);
+static enum Result interfaceGetParam(void *, int, void *);
+static enum Result interfaceSetParam(void *, int, const void *);
+static size_t interfaceRead(void *, void *, size_t);
+static size_t interfaceWrite(void *, const void *, size_t);
+/*----------------------------------------------------------------------------*/
+const struct InterfaceClass * const Ftl = &(const struct InterfaceClass){
+    .size = sizeof(struct Ftl),
+    .init = interfaceInit,
+    .deinit = interfaceDeinit,
+
+    .setCallback = interfaceSetCallback,
+    .getParam = interfaceGetParam,
+    .setParam = interfaceSetParam,
+    .read = interfaceRead,
+    .write = interfaceWrite
+};
+/*----------------------------------------------------------------------------*/
+static enum Result appendBlock(struct Ftl *ftl, uint32_t block,
+    const void *data, uint16_t source)
+{
+  enum Result res;
+
+  if ((res = prepareSlot(ftl)) != E_OK)
+    return res;
+
+  const uint16_t sector = ftl->active;
+  const uint16_t slot = ftl->slot++;
+
+  /* Slot is skipped on failure because it may be partially programmed */
+  res = memoryWrite(ftl, slotAddress(ftl, sector, slot), data, FTL_BLOCK_SIZE);
+  if (res != E_OK)
+    return res;
+  if ((res = programEntry(ftl, slot, block)) != E_OK)
+    return res;
+
+  /* Mapping may be changed by discard requests from interrupt handlers */
+  const IrqState state = irqSave();
+  const uint16_t previous = ftl->map[block];
+
+  /* Copy of a block discarded during relocation is left stale */
+  if (source == UNMAPPED_SLOT || previous == source)
+  {
+    if (previous != UNMAPPED_SLOT)
+      --ftl->sectors[previous / ftl->slotCount].valid;
+
+    ftl->map[block] = sector * ftl->slotCount + slot;
+    ++ftl->sectors[sector].valid;
+  }
+
+  irqRestore(state);
+  ++ftl->statistics.memoryWrites;
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result collectSector(struct Ftl *ftl, uint16_t victim,
+    bool leveling)
+{
+  const uint32_t headerSize = ftl->headerSlots * FTL_BLOCK_SIZE;
+  enum Result res;
+
+  res = memoryRead(ftl, slotAddress(ftl, victim, 0), ftl->scratchHeader,
+      headerSize);
+  if (res != E_OK)
+    return res;
+
+  ftl->collecting = true;
+  ftl->leveling = leveling;
+
+  for (uint16_t slot = ftl->headerSlots; slot < ftl->slotCount; ++slot)
+  {
+    const uint32_t block =
+        fromLittleEndian32(ftl->scratchHeader[HEADER_WORDS + slot]);
+    const uint16_t source = victim * ftl->slotCount + slot;
+
+    if (block >= ftl->blocks || ftl->map[block] != source)
+      continue;
+
+    res = memoryRead(ftl, slotAddress(ftl, victim, slot), ftl->scratchBlock,
+        FTL_BLOCK_SIZE);
+    if (res == E_OK)
+      res = appendBlock(ftl, block, ftl->scratchBlock, source);
+    if (res != E_OK)
+      break;
+  }
+
+  ftl->collecting = false;
+  ftl->leveling = false;
+
+  if (res == E_OK)
+  {
+    /* Sector will be erased before the next allocation */
+    ftl->sectors[victim].state = SECTOR_FREE;
+    ftl->sectors[victim].valid = 0;
+    ++ftl->freeCount;
+    ++ftl->statistics.collections;
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result collectStale(struct Ftl *ftl)
+{
+  const uint16_t dataSlots = ftl->slotCount - ftl->headerSlots;
+
+  while (1)
+  {
+    const uint16_t victim = selectVictim(ftl, false);
+
+    if (victim == NO_SECTOR || ftl->sectors[victim].valid == dataSlots)
+      break;
+
+    const enum Result res = collectSector(ftl, victim, false);
+
+    if (res != E_OK)
+      return res;
+  }
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void collectStaleTask(void *argument)
+{
+  struct Ftl * const ftl = argument;
+
+  collectStale(ftl);
+
+  const IrqState state = irqSave();
+  --ftl->tasks;
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+static void collectTask(void *argument)
+{
+  struct Ftl * const ftl = argument;
+  const uint16_t dataSlots = ftl->slotCount - ftl->headerSlots;
+  uint16_t victim = NO_SECTOR;
+  bool leveling = false;
+
+  ftl->pending = false;
+
+  if (ftl->freeCount < ftl->spareCount)
+  {
+    victim = selectVictim(ftl, false);
+
+    /* Relocation of a sector without stale blocks frees nothing */
+    if (victim != NO_SECTOR && ftl->sectors[victim].valid == dataSlots)
+      victim = NO_SECTOR;
+  }
+
+  if (victim == NO_SECTOR && isWearLevelingRequired(ftl))
+  {
+    victim = selectVictim(ftl, true);
+    leveling = true;
+  }
+
+  if (victim != NO_SECTOR && collectSector(ftl, victim, leveling) == E_OK)
+    scheduleCollection(ftl);
+
+  const IrqState state = irqSave();
+  --ftl->tasks;
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+static bool isWearLevelingRequired(const struct Ftl *ftl)
+{
+  const uint16_t victim = selectVictim(ftl, true);
+
+  if (victim == NO_SECTOR)
+    return false;
+
+  uint32_t max;
+  uint32_t min;
+
+  getEraseCountRange(ftl, &min, &max);
+  return ftl->sectors[victim].erases + ftl->wearLimit < max;
+}
+/*----------------------------------------------------------------------------*/
+static void getEraseCountRange(const struct Ftl *ftl, uint32_t *min,
+    uint32_t *max)
+{
+  *max = 0;
+  *min = UINT32_MAX;
+
+  for (uint16_t index = 0; index < ftl->sectorCount; ++index)
+  {
+    const uint32_t erases = ftl->sectors[index].erases;
+
+    if (erases > *max)
+      *max = erases;
+    if (erases < *min)
+      *min = erases;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result memoryErase(struct Ftl *ftl, uint16_t sector)
+{
+  const uint32_t address = ftl->offset + slotAddress(ftl, sector, 0);
+  return ifSetParam(ftl->flash, IF_FLASH_ERASE_SECTOR, &address);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result memoryRead(struct Ftl *ftl, uint32_t address, void *buffer,
+    size_t length)
+{
+  const uint32_t position = ftl->offset + address;
+  enum Result res;
+
+  if ((res = ifSetParam(ftl->flash, IF_POSITION, &position)) != E_OK)
+    return res;
+
+  return ifRead(ftl->flash, buffer, length) == length ? E_OK : E_INTERFACE;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result memoryWrite(struct Ftl *ftl, uint32_t address,
+    const void *buffer, size_t length)
+{
+  const uint32_t position = ftl->offset + address;
+  enum Result res;
+
+  if ((res = ifSetParam(ftl->flash, IF_POSITION, &position)) != E_OK)
+    return res;
+
+  return ifWrite(ftl->flash, buffer, length) == length ? E_OK : E_INTERFACE;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result mountVolume(struct Ftl *ftl)
+{
+  const uint32_t headerSize = ftl->headerSlots * FTL_BLOCK_SIZE;
+  uint64_t eraseSum = 0;
+  uint32_t sequence = 0;
+  uint16_t used = 0;
+  enum Result res;
+
+  for (uint32_t block = 0; block < ftl->blocks; ++block)
+    ftl->map[block] = UNMAPPED_SLOT;
+
+  ftl->freeCount = 0;
+
+  for (uint16_t index = 0; index < ftl->sectorCount; ++index)
+  {
+    struct FtlSector * const sector = &ftl->sectors[index];
+    struct FtlSectorHeader header;
+
+    res = memoryRead(ftl, slotAddress(ftl, index, 0), &header, sizeof(header));
+    if (res != E_OK)
+      return res;
+
+    sector->valid = 0;
+
+    if (fromLittleEndian32(header.magic) == FTL_MAGIC
+        && fromLittleEndian32(header.slots) == ftl->slotCount)
+    {
+      sector->sequence = fromLittleEndian32(header.sequence);
+      sector->erases = fromLittleEndian32(header.erases);
+      sector->state = SECTOR_USED;
+
+      if (sector->sequence >= sequence)
+        sequence = sector->sequence + 1;
+      eraseSum += sector->erases;
+      ++used;
+    }
+    else
+    {
+      /* Sector is erased lazily, its content is undefined */
+      sector->sequence = 0;
+      sector->state = SECTOR_FREE;
+      ++ftl->freeCount;
+    }
+  }
+
+  /* Erase counts of the free sectors are lost, use an average value */
+  const uint32_t average = used ? (uint32_t)(eraseSum / used) : 0;
+
+  for (uint16_t index = 0; index < ftl->sectorCount; ++index)
+  {
+    if (ftl->sectors[index].state == SECTOR_FREE)
+      ftl->sectors[index].erases = average;
+  }
+
+  /* Replay mapping tables from the oldest sector to the newest one */
+  for (uint32_t last = 0, processed = 0; processed < used; ++processed)
+  {
+    uint16_t next = NO_SECTOR;
+
+    for (uint16_t index = 0; index < ftl->sectorCount; ++index)
+    {
+      const struct FtlSector * const sector = &ftl->sectors[index];
+
+      if (sector->state != SECTOR_USED)
+        continue;
+      if (processed && sector->sequence <= last)
+        continue;
+
+      if (next == NO_SECTOR || sector->sequence < ftl->sectors[next].sequence)
+        next = index;
+    }
+
+    assert(next != NO_SECTOR);
+    last = ftl->sectors[next].sequence;
+
+    res = memoryRead(ftl, slotAddress(ftl, next, 0), ftl->scratchHeader,
+        headerSize);
+    if (res != E_OK)
+      return res;
+
+    for (uint16_t slot = ftl->headerSlots; slot < ftl->slotCount; ++slot)
+    {
+      const uint32_t block =
+          fromLittleEndian32(ftl->scratchHeader[HEADER_WORDS + slot]);
+
+      if (block < ftl->blocks)
+        ftl->map[block] = next * ftl->slotCount + slot;
+    }
+  }
+
+  for (uint32_t block = 0; block < ftl->blocks; ++block)
+  {
+    if (ftl->map[block] != UNMAPPED_SLOT)
+      ++ftl->sectors[ftl->map[block] / ftl->slotCount].valid;
+  }
+
+  /*
+   * Partially written sectors are not reused after the initialization:
+   * slots after the last mapping entry may contain programmed data.
+   */
+  ftl->active = NO_SECTOR;
+  ftl->slot = 0;
+  ftl->sequence = sequence;
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result openSector(struct Ftl *ftl)
+{
+  uint16_t index = NO_SECTOR;
+
+  /*
+   * Select the least worn free sector. Cold data relocated during wear
+   * leveling is placed into the most worn sector instead.
+   */
+  for (uint16_t current = 0; current < ftl->sectorCount; ++current)
+  {
+    if (ftl->sectors[current].state != SECTOR_FREE)
+      continue;
+
+    if (index == NO_SECTOR)
+    {
+      index = current;
+      continue;
+    }
+
+    const uint32_t erases = ftl->sectors[current].erases;
+
+    if (ftl->leveling ? erases > ftl->sectors[index].erases :
+        erases < ftl->sectors[index].erases)
+    {
+      index = current;
+    }
+  }
+
+  if (index == NO_SECTOR)
+    return E_FULL;
+
+  struct FtlSector * const sector = &ftl->sectors[index];
+  enum Result res;
+
+  if ((res = memoryErase(ftl, index)) != E_OK)
+    return res;
+
+  ++sector->erases;
+  ++ftl->statistics.erases;
+
+  memset(ftl->header, 0xFF, ftl->headerSlots * FTL_BLOCK_SIZE);
+  ftl->header[0] = toLittleEndian32(FTL_MAGIC);
+  ftl->header[1] = toLittleEndian32(ftl->sequence);
+  ftl->header[2] = toLittleEndian32(sector->erases);
+  ftl->header[3] = toLittleEndian32(ftl->slotCount);
+
+  const size_t length = MAX(ftl->pageSize, sizeof(struct FtlSectorHeader));
+
+  if ((res = memoryWrite(ftl, slotAddress(ftl, index, 0), ftl->header,
+      length)) != E_OK)
+  {
+    return res;
+  }
+
+  sector->sequence = ftl->sequence++;
+  sector->valid = 0;
+  sector->state = SECTOR_ACTIVE;
+  --ftl->freeCount;
+
+  ftl->active = index;
+  ftl->slot = ftl->headerSlots;
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result prepareSlot(struct Ftl *ftl)
+{
+  if (ftl->active != NO_SECTOR)
+  {
+    if (ftl->slot < ftl->slotCount)
+      return E_OK;
+
+    ftl->sectors[ftl->active].state = SECTOR_USED;
+    ftl->active = NO_SECTOR;
+  }
+
+  if (!ftl->collecting)
+  {
+    const uint16_t dataSlots = ftl->slotCount - ftl->headerSlots;
+
+    while (ftl->freeCount <= RESERVED_SECTORS)
+    {
+      const uint16_t victim = selectVictim(ftl, false);
+
+      if (victim == NO_SECTOR || ftl->sectors[victim].valid == dataSlots)
+        return E_FULL;
+
+      const enum Result res = collectSector(ftl, victim, false);
+
+      if (res != E_OK)
+        return res;
+
+      /* Relocated blocks may leave free slots in the new sector */
+      if (ftl->active != NO_SECTOR && ftl->slot < ftl->slotCount)
+        return E_OK;
+    }
+  }
+
+  return openSector(ftl);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result programEntry(struct Ftl *ftl, uint16_t slot, uint32_t block)
+{
+  const size_t offset = (HEADER_WORDS + slot) * sizeof(uint32_t);
+  const size_t start = offset - offset % ftl->pageSize;
+
+  ftl->header[HEADER_WORDS + slot] = toLittleEndian32(block);
+
+  return memoryWrite(ftl, slotAddress(ftl, ftl->active, 0) + start,
+      (const uint8_t *)ftl->header + start, ftl->pageSize);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result readBlocks(struct Ftl *ftl, uint64_t position,
+    void *buffer, size_t length)
+{
+  const uint32_t first = (uint32_t)(position / FTL_BLOCK_SIZE);
+  const uint32_t count = (uint32_t)(length / FTL_BLOCK_SIZE);
+  uint8_t *data = buffer;
+
+  for (uint32_t block = first; block < first + count; ++block)
+  {
+    const uint16_t index = ftl->map[block];
+
+    if (index != UNMAPPED_SLOT)
+    {
+      const enum Result res = memoryRead(ftl,
+          slotAddress(ftl, index / ftl->slotCount, index % ftl->slotCount),
+          data, FTL_BLOCK_SIZE);
+
+      if (res != E_OK)
+        return res;
+    }
+    else
+      memset(data, 0xFF, FTL_BLOCK_SIZE);
+
+    data += FTL_BLOCK_SIZE;
+  }
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void scheduleCollection(struct Ftl *ftl)
+{
+  /*
+   * Blocking transfers may be started from interrupt handlers and can not
+   * be serialized with the work queue, therefore background collection
+   * is used in zero-copy mode only.
+   */
+  if (!ftl->zerocopy)
+    return;
+
+  /* Function is called from the work queue and from interrupt handlers */
+  const IrqState state = irqSave();
+
+  if (!ftl->pending
+      && (ftl->freeCount < ftl->spareCount || isWearLevelingRequired(ftl)))
+  {
+    if (wqAdd(ftl->wq, collectTask, ftl) == E_OK)
+    {
+      ftl->pending = true;
+      ++ftl->tasks;
+    }
+  }
+
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+static uint16_t selectVictim(const struct Ftl *ftl, bool wear)
+{
+  uint16_t victim = NO_SECTOR;
+
+  for (uint16_t index = 0; index < ftl->sectorCount; ++index)
+  {
+    const struct FtlSector * const candidate = &ftl->sectors[index];
+
+    if (candidate->state != SECTOR_USED)
+      continue;
+
+    if (victim == NO_SECTOR)
+    {
+      victim = index;
+      continue;
+    }
+
+    const struct FtlSector * const current = &ftl->sectors[victim];
+
+    if (wear)
+    {
+      /* Select the least worn sector with cold data */
+      if (candidate->erases < current->erases
+          || (candidate->erases == current->erases
+              && candidate->valid < current->valid))
+      {
+        victim = index;
+      }
+    }
+    else
+    {
+      /* Select the sector with the lowest relocation cost */
+      if (candidate->valid < current->valid
+          || (candidate->valid == current->valid
+              && candidate->erases < current->erases))
+      {
+        victim = index;
+      }
+    }
+  }
+
+  return victim;
+}
+/*----------------------------------------------------------------------------*/
+static inline uint32_t slotAddress(const struct Ftl *ftl, uint16_t sector,
+    uint16_t slot)
+{
+  return (uint32_t)sector * ftl->sectorSize + (uint32_t)slot * FTL_BLOCK_SIZE;
+}
+/*----------------------------------------------------------------------------*/
+static size_t startTransfer(struct Ftl *ftl, void *buffer, size_t length,
+    bool write)
+{
+  const uint64_t capacity = (uint64_t)ftl->blocks * FTL_BLOCK_SIZE;
+
+  if (ftl->position >= capacity)
+    return 0;
+  if (length > capacity - ftl->position)
+    length = (size_t)(capacity - ftl->position);
+
+  length -= length % FTL_BLOCK_SIZE;
+  if (!length)
+    return 0;
+
+  if (ftl->zerocopy)
+  {
+    if (ftl->transfer.status == E_BUSY)
+      return 0;
+
+    ftl->transfer.buffer = buffer;
+    ftl->transfer.length = length;
+    ftl->transfer.position = ftl->position;
+    ftl->transfer.status = E_BUSY;
+    ftl->transfer.write = write;
+
+    if (wqAdd(ftl->wq, transferTask, ftl) != E_OK)
+    {
+      ftl->transfer.status = E_ERROR;
+      return 0;
+    }
+  }
+  else
+  {
+    if (write)
+      ftl->transfer.status = writeBlocks(ftl, ftl->position, buffer, length);
+    else
+      ftl->transfer.status = readBlocks(ftl, ftl->position, buffer, length);
+
+    if (ftl->transfer.status != E_OK)
+      return 0;
+  }
+
+  return length;
+}
+/*----------------------------------------------------------------------------*/
+static void transferTask(void *argument)
+{
+  struct Ftl * const ftl = argument;
+
+  if (ftl->transfer.write)
+  {
+    ftl->transfer.status = writeBlocks(ftl, ftl->transfer.position,
+        ftl->transfer.buffer, ftl->transfer.length);
+  }
+  else
+  {
+    ftl->transfer.status = readBlocks(ftl, ftl->transfer.position,
+        ftl->transfer.buffer, ftl->transfer.length);
+  }
+
+  if (ftl->callback != NULL)
+    ftl->callback(ftl->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result writeBlocks(struct Ftl *ftl, uint64_t position,
+    const void *buffer, size_t length)
+{
+  const uint32_t first = (uint32_t)(position / FTL_BLOCK_SIZE);
+  const uint32_t count = (uint32_t)(length / FTL_BLOCK_SIZE);
+  const uint8_t *data = buffer;
+  enum Result res = E_OK;
+
+  for (uint32_t block = first; block < first + count; ++block)
+  {
+    if ((res = appendBlock(ftl, block, data, UNMAPPED_SLOT)) != E_OK)
+      break;
+
+    ++ftl->statistics.hostWrites;
+    data += FTL_BLOCK_SIZE;
+  }
+
+  scheduleCollection(ftl);
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceInit(void *object, const void *configBase)
+{
+  const struct FtlConfig * const config = configBase;
+  assert(config != NULL);
+  assert(config->flash != NULL);
+  assert(!config->spare || config->spare >= DEFAULT_SPARE_SECTORS);
+
+  struct Ftl * const ftl = object;
+  uint32_t value;
+
+  ftl->callback = NULL;
+  ftl->flash = config->flash;
+  ftl->wq = config->wq;
+  ftl->offset = config->offset;
+  ftl->spareCount = config->spare ? config->spare : DEFAULT_SPARE_SECTORS;
+  ftl->wearLimit = config->wear ? config->wear : DEFAULT_WEAR_LIMIT;
+
+  if (config->sector)
+  {
+    ftl->sectorSize = config->sector;
+  }
+  else
+  {
+    if (ifGetParam(ftl->flash, IF_FLASH_SECTOR_SIZE, &value) != E_OK)
+      return E_INVALID;
+    ftl->sectorSize = value;
+  }
+
+  if (ifGetParam(ftl->flash, IF_FLASH_PAGE_SIZE, &value) != E_OK)
+    value = 0;
+  ftl->pageSize = (uint16_t)MAX(value, sizeof(uint32_t));
+
+  if (config->size)
+  {
+    value = config->size;
+  }
+  else
+  {
+    if (ifGetParam(ftl->flash, IF_SIZE, &value) != E_OK)
+      return E_INVALID;
+    if (value <= ftl->offset)
+      return E_VALUE;
+    value -= ftl->offset;
+  }
+
+  if (!ftl->sectorSize || ftl->sectorSize % FTL_BLOCK_SIZE)
+    return E_VALUE;
+  if (ftl->pageSize > FTL_BLOCK_SIZE
+      || (ftl->pageSize & (ftl->pageSize - 1)) != 0)
+  {
+    return E_VALUE;
+  }
+
+  const uint32_t sectorCount = value / ftl->sectorSize;
+  const uint32_t slotCount = ftl->sectorSize / FTL_BLOCK_SIZE;
+  const uint32_t headerSlots = (sizeof(struct FtlSectorHeader)
+      + slotCount * sizeof(uint32_t) + FTL_BLOCK_SIZE - 1) / FTL_BLOCK_SIZE;
+
+  /* Physical slot indices should fit into the 16-bit mapping table */
+  if (sectorCount <= ftl->spareCount || headerSlots >= slotCount
+      || sectorCount * slotCount > UNMAPPED_SLOT)
+  {
+    return E_VALUE;
+  }
+
+  ftl->sectorCount = (uint16_t)sectorCount;
+  ftl->slotCount = (uint16_t)slotCount;
+  ftl->headerSlots = (uint16_t)headerSlots;
+  ftl->blocks = (sectorCount - ftl->spareCount) * (slotCount - headerSlots);
+
+  /* Buffers and tables are placed in a single arena */
+  const size_t headerSize = headerSlots * FTL_BLOCK_SIZE;
+  uint8_t * const arena = malloc(headerSize * 2 + FTL_BLOCK_SIZE
+      + sectorCount * sizeof(struct FtlSector)
+      + ftl->blocks * sizeof(uint16_t));
+
+  if (arena == NULL)
+    return E_MEMORY;
+
+  ftl->header = (uint32_t *)arena;
+  ftl->scratchHeader = (uint32_t *)(arena + headerSize);
+  ftl->scratchBlock = arena + headerSize * 2;
+  ftl->sectors = (struct FtlSector *)(ftl->scratchBlock + FTL_BLOCK_SIZE);
+  ftl->map = (uint16_t *)(ftl->sectors + sectorCount);
+
+  ftl->position = 0;
+  ftl->transfer.status = E_OK;
+  memset(&ftl->statistics, 0, sizeof(ftl->statistics));
+
+  ftl->collecting = false;
+  ftl->leveling = false;
+  ftl->pending = false;
+  ftl->zerocopy = false;
+  ftl->tasks = 0;
+
+  /* Underlying memory is always used in blocking mode */
+  ifSetParam(ftl->flash, IF_BLOCKING, NULL);
+
+  const enum Result res = mountVolume(ftl);
+
+  if (res != E_OK)
+    free(arena);
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static void interfaceDeinit(void *object)
+{
+  struct Ftl * const ftl = object;
+
+  /* Header buffer is placed at the beginning of the arena */
+  free(ftl->header);
+}
+/*----------------------------------------------------------------------------*/
+static void interfaceSetCallback(void *object, void (*callback)(void *),
+    void *argument)
+{
+  struct Ftl * const ftl = object;
+
+  ftl->callbackArgument = argument;
+  ftl->callback = callback;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceGetParam(void *object, int parameter, void *data)
+{
+  struct Ftl * const ftl = object;
+
+  switch ((enum FtlParameter)parameter)
+  {
+    case IF_FTL_STATISTICS:
+    {
+      struct FtlStatistics * const statistics = data;
+
+      *statistics = ftl->statistics;
+      getEraseCountRange(ftl, &statistics->minEraseCount,
+          &statistics->maxEraseCount);
+      return E_OK;
+    }
+
+    default:
+      break;
+  }
+
+  switch ((enum FlashParameter)parameter)
+  {
+    case IF_FLASH_SECTOR_SIZE:
+      *(uint32_t *)data = FTL_BLOCK_SIZE;
+      return E_OK;
+
+    default:
+      break;
+  }
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_POSITION:
+      if (ftl->position > UINT32_MAX)
+        return E_VALUE;
+
+      *(uint32_t *)data = (uint32_t)ftl->position;
+      return E_OK;
+
+    case IF_POSITION_64:
+      *(uint64_t *)data = ftl->position;
+      return E_OK;
+
+    case IF_SIZE:
+      *(uint32_t *)data = ftl->blocks * FTL_BLOCK_SIZE;
+      return E_OK;
+
+    case IF_SIZE_64:
+      *(uint64_t *)data = (uint64_t)ftl->blocks * FTL_BLOCK_SIZE;
+      return E_OK;
+
+    case IF_STATUS:
+      return ftl->transfer.status;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceSetParam(void *object, int parameter,
+    const void *data)
+{
+  struct Ftl * const ftl = object;
+
+  switch ((enum FtlParameter)parameter)
+  {
+    case IF_FTL_COLLECT:
+      /* Relocations are serialized with zero-copy transfers */
+      if (ftl->zerocopy)
+      {
+        const IrqState state = irqSave();
+        const enum Result res = wqAdd(ftl->wq, collectStaleTask, ftl);
+
+        if (res == E_OK)
+          ++ftl->tasks;
+
+        irqRestore(state);
+        return res;
+      }
+
+      return collectStale(ftl);
+
+    default:
+      break;
+  }
+
+  switch ((enum FlashParameter)parameter)
+  {
+    case IF_FLASH_SYNC:
+    {
+      if (ftl->transfer.status == E_BUSY)
+        return E_BUSY;
+
+      /* Blocks are programmed immediately, only the memory is synchronized */
+      const enum Result res = ifSetParam(ftl->flash, IF_FLASH_SYNC, NULL);
+      return res != E_INVALID ? res : E_OK;
+    }
+
+    case IF_FLASH_ERASE_SECTOR:
+    {
+      /* Discard a single logical block, mapping is updated in memory only */
+      const uint32_t address = *(const uint32_t *)data;
+      const uint32_t block = address / FTL_BLOCK_SIZE;
+
+      if (address % FTL_BLOCK_SIZE || block >= ftl->blocks)
+        return E_ADDRESS;
+      if (ftl->transfer.status == E_BUSY)
+        return E_BUSY;
+
+      /* Request may preempt relocation of the same block */
+      const IrqState state = irqSave();
+      const uint16_t slot = ftl->map[block];
+
+      if (slot != UNMAPPED_SLOT)
+      {
+        --ftl->sectors[slot / ftl->slotCount].valid;
+        ftl->map[block] = UNMAPPED_SLOT;
+      }
+
+      irqRestore(state);
+
+      if (slot != UNMAPPED_SLOT)
+        scheduleCollection(ftl);
+      return E_OK;
+    }
+
+    default:
+      break;
+  }
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_POSITION:
+    {
+      const uint32_t position = *(const uint32_t *)data;
+
+      if (position % FTL_BLOCK_SIZE || position / FTL_BLOCK_SIZE >= ftl->blocks)
+        return E_ADDRESS;
+
+      ftl->position = position;
+      return E_OK;
+    }
+
+    case IF_POSITION_64:
+    {
+      const uint64_t position = *(const uint64_t *)data;
+
+      if (position % FTL_BLOCK_SIZE || position / FTL_BLOCK_SIZE >= ftl->blocks)
+        return E_ADDRESS;
+
+      ftl->position = position;
+      return E_OK;
+    }
+
+    case IF_BLOCKING:
+      /* Background tasks should not run concurrently with blocking calls */
+      if (ftl->transfer.status == E_BUSY || ftl->tasks)
+        return E_BUSY;
+
+      ftl->zerocopy = false;
+      return E_OK;
+
+    case IF_ZEROCOPY:
+      if (ftl->wq == NULL)
+        return E_INVALID;
+
+      ftl->zerocopy = true;
+      return E_OK;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static size_t interfaceRead(void *object, void *buffer, size_t length)
+{
+  return startTransfer(object, buffer, length, false);
+}
+/*----------------------------------------------------------------------------*/
+static size_t interfaceWrite(void *object, const void *buffer, size_t length)
+{
+  return startTransfer(object, (void *)buffer, length, true);
+}
@@ -9,17 +9,46 @@
 #include <halm/generic/mmcsd_defs.h>
 #include <halm/generic/sdio.h>
 #include <halm/generic/sdio_defs.h>
+#include <halm/timer.h>
 #include <xcore/asm.h>
 #include <xcore/bits.h>
 #include <xcore/memory.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 /*----------------------------------------------------------------------------*/
 #define DEFAULT_BLOCK_SIZE 512
 
+enum InitStep
+{
+  INIT_RESET,
+  INIT_MMC_PROBE,
+  INIT_MMC_READ_OCR,
+  INIT_SD_RESET,
+  INIT_SD_READ_CONDITION,
+  INIT_SD_APP_COMMAND,
+  INIT_SD_READ_OCR,
+  INIT_ENABLE_CRC,
+  INIT_SPI_READ_OCR,
+  INIT_READ_CID,
+  INIT_READ_RCA,
+  INIT_SET_RCA,
+  INIT_READ_CSD,
+  INIT_GET_STATUS,
+  INIT_SELECT_CARD,
+  INIT_SET_BLOCK_LENGTH,
+  INIT_MMC_SET_BUS_WIDTH,
+  INIT_MMC_SET_HIGH_SPEED,
+  INIT_SD_BUS_APP_COMMAND,
+  INIT_SD_SET_BUS_WIDTH,
+  INIT_READ_EXT_CSD,
+  INIT_DONE
+};
+
 enum State
 {
   STATE_IDLE,
+  STATE_INIT,
   STATE_GET_STATUS,
   STATE_SELECT_CARD,
   STATE_TRANSFER,
@@ -28,43 +57,77 @@ enum State
   STATE_ERROR
 };
 /*----------------------------------------------------------------------------*/
-static enum Result initStepEnableCrc(struct MMCSD *);
-static enum Result initStepMmcReadOCR(struct MMCSD *);
-static enum Result initStepMmcSetBusWidth(struct MMCSD *);
-static enum Result initStepMmcSetHighSpeed(struct MMCSD *, enum MMCSDSpeed);
-static enum Result initStepReadCondition(struct MMCSD *);
-static enum Result initStepReadCID(struct MMCSD *);
-static enum Result initStepReadCSD(struct MMCSD *);
-static enum Result initStepReadExtCSD(struct MMCSD *);
-static enum Result initStepReadRCA(struct MMCSD *);
-static enum Result initStepSdReadOCR(struct MMCSD *);
-static enum Result initStepSdSetBusWidth(struct MMCSD *);
-static enum Result initStepSendReset(struct MMCSD *);
-static enum Result initStepSetBlockLength(struct MMCSD *);
-static enum Result initStepSetRCA(struct MMCSD *, uint32_t);
-static enum Result initStepSpiReadOCR(struct MMCSD *);
+struct InitStepEntry
+{
+  /* Start the command, returns E_BUSY when the command is still running */
+  enum Result (*enter)(struct MMCSD *);
+  /* Process the command result and select the next step */
+  enum Result (*advance)(struct MMCSD *, enum Result);
+};
+/*----------------------------------------------------------------------------*/
+static enum Result initResetEnter(struct MMCSD *);
+static enum Result initResetAdvance(struct MMCSD *, enum Result);
+static enum Result initMmcProbeEnter(struct MMCSD *);
+static enum Result initMmcProbeAdvance(struct MMCSD *, enum Result);
+static enum Result initMmcReadOcrEnter(struct MMCSD *);
+static enum Result initMmcReadOcrAdvance(struct MMCSD *, enum Result);
+static enum Result initSdResetAdvance(struct MMCSD *, enum Result);
+static enum Result initSdReadConditionEnter(struct MMCSD *);
+static enum Result initSdReadConditionAdvance(struct MMCSD *, enum Result);
+static enum Result initSdAppCommandEnter(struct MMCSD *);
+static enum Result initSdAppCommandAdvance(struct MMCSD *, enum Result);
+static enum Result initSdReadOcrEnter(struct MMCSD *);
+static enum Result initSdReadOcrAdvance(struct MMCSD *, enum Result);
+static enum Result initEnableCrcEnter(struct MMCSD *);
+static enum Result initSpiReadOcrEnter(struct MMCSD *);
+static enum Result initSpiReadOcrAdvance(struct MMCSD *, enum Result);
+static enum Result initReadCidEnter(struct MMCSD *);
+static enum Result initReadRcaEnter(struct MMCSD *);
+static enum Result initReadRcaAdvance(struct MMCSD *, enum Result);
+static enum Result initSetRcaEnter(struct MMCSD *);
+static enum Result initSetRcaAdvance(struct MMCSD *, enum Result);
+static enum Result initReadCsdEnter(struct MMCSD *);
+static enum Result initReadCsdAdvance(struct MMCSD *, enum Result);
+static enum Result initGetStatusEnter(struct MMCSD *);
+static enum Result initGetStatusAdvance(struct MMCSD *, enum Result);
+static enum Result initSelectCardEnter(struct MMCSD *);
+static enum Result initSetBlockLengthEnter(struct MMCSD *);
+static enum Result initMmcSetBusWidthEnter(struct MMCSD *);
+static enum Result initMmcSetHighSpeedEnter(struct MMCSD *);
+static enum Result initSdBusAppCommandEnter(struct MMCSD *);
+static enum Result initSdSetBusWidthEnter(struct MMCSD *);
+static enum Result initReadExtCsdEnter(struct MMCSD *);
+static enum Result initReadExtCsdAdvance(struct MMCSD *, enum Result);
+static enum Result initStepAdvance(struct MMCSD *, enum Result);
 /*----------------------------------------------------------------------------*/
+static enum Result awaitCompletion(struct MMCSD *);
 static enum Result eraseSectorGroup(struct MMCSD *, uint32_t);
 static enum Result executeCommand(struct MMCSD *, uint32_t, uint32_t,
     uint32_t *, bool);
 static bool extractBit(const uint32_t *, unsigned int);
 static uint32_t extractBits(const uint32_t *, unsigned int, unsigned int);
-static enum Result identifyCard(struct MMCSD *);
+static enum Result initExecuteCommand(struct MMCSD *, uint32_t, uint32_t);
+static void initFinish(struct MMCSD *, enum Result);
+static bool initIsStepRequired(const struct MMCSD *, enum InitStep);
+static void initNextStep(struct MMCSD *);
+static enum Result initRun(struct MMCSD *, enum Result);
+static void initStartDelay(struct MMCSD *, uint32_t);
 static enum Result initializeCard(struct MMCSD *);
 static void interruptHandler(void *);
 static enum Result isCardReady(struct MMCSD *);
 static bool onCardSelectionFinished(struct MMCSD *);
 static bool onTransferStateSetupFinished(struct MMCSD *);
 static void parseCardSpecificData(struct MMCSD *, const uint32_t *);
-static enum Result setTransferState(struct MMCSD *);
 static enum Result startCardSelection(struct MMCSD *);
 static enum Result startTransfer(struct MMCSD *);
 static enum Result startTransferStateSetup(struct MMCSD *);
 static enum Result terminateTransfer(struct MMCSD *);
+static void timerInterruptHandler(void *);
 static enum Result transferBuffer(struct MMCSD *, uint32_t, uint32_t,
     uintptr_t, size_t);
 /*----------------------------------------------------------------------------*/
 static enum Result cardInit(void *, const void *);
+static void cardDeinit(void *);
 static void cardSetCallback(void *, void (*)(void *), void *);
 static enum Result cardGetParam(void *, int, void *);
 static enum Result cardSetParam(void *, int, const void *);
@@ -74,7 +137,7 @@ static size_t cardWrite(void *, const void *, size_t);
 const struct InterfaceClass * const MMCSD = &(const struct InterfaceClass){
     .size = sizeof(struct MMCSD),
     .init = cardInit,
-    .deinit = NULL, /* Default destructor */
+    .deinit = cardDeinit,
 
     .setCallback = cardSetCallback,
     .getParam = cardGetParam,
@@ -83,344 +146,586 @@ const struct InterfaceClass * const MMCSD = &(const struct InterfaceClass){
     .write = cardWrite
 };
 /*----------------------------------------------------------------------------*/
-static enum Result initStepEnableCrc(struct MMCSD *device)
+static const struct InitStepEntry initStepTable[] = {
+    [INIT_RESET] = {
+        initResetEnter,
+        initResetAdvance
+    },
+    [INIT_MMC_PROBE] = {
+        initMmcProbeEnter,
+        initMmcProbeAdvance
+    },
+    [INIT_MMC_READ_OCR] = {
+        initMmcReadOcrEnter,
+        initMmcReadOcrAdvance
+    },
+    [INIT_SD_RESET] = {
+        initResetEnter,
+        initSdResetAdvance
+    },
+    [INIT_SD_READ_CONDITION] = {
+        initSdReadConditionEnter,
+        initSdReadConditionAdvance
+    },
+    [INIT_SD_APP_COMMAND] = {
+        initSdAppCommandEnter,
+        initSdAppCommandAdvance
+    },
+    [INIT_SD_READ_OCR] = {
+        initSdReadOcrEnter,
+        initSdReadOcrAdvance
+    },
+    [INIT_ENABLE_CRC] = {
+        initEnableCrcEnter,
+        initStepAdvance
+    },
+    [INIT_SPI_READ_OCR] = {
+        initSpiReadOcrEnter,
+        initSpiReadOcrAdvance
+    },
+    [INIT_READ_CID] = {
+        initReadCidEnter,
+        initStepAdvance
+    },
+    [INIT_READ_RCA] = {
+        initReadRcaEnter,
+        initReadRcaAdvance
+    },
+    [INIT_SET_RCA] = {
+        initSetRcaEnter,
+        initSetRcaAdvance
+    },
+    [INIT_READ_CSD] = {
+        initReadCsdEnter,
+        initReadCsdAdvance
+    },
+    [INIT_GET_STATUS] = {
+        initGetStatusEnter,
+        initGetStatusAdvance
+    },
+    [INIT_SELECT_CARD] = {
+        initSelectCardEnter,
+        initStepAdvance
+    },
+    [INIT_SET_BLOCK_LENGTH] = {
+        initSetBlockLengthEnter,
+        initStepAdvance
+    },
+    [INIT_MMC_SET_BUS_WIDTH] = {
+        initMmcSetBusWidthEnter,
+        initStepAdvance
+    },
+    [INIT_MMC_SET_HIGH_SPEED] = {
+        initMmcSetHighSpeedEnter,
+        initStepAdvance
+    },
+    [INIT_SD_BUS_APP_COMMAND] = {
+        initSdBusAppCommandEnter,
+        initStepAdvance
+    },
+    [INIT_SD_SET_BUS_WIDTH] = {
+        initSdSetBusWidthEnter,
+        initStepAdvance
+    },
+    [INIT_READ_EXT_CSD] = {
+        initReadExtCsdEnter,
+        initReadExtCsdAdvance
+    }
+};
+/*----------------------------------------------------------------------------*/
+static enum Result initResetEnter(struct MMCSD *device)
 {
-  return executeCommand(device,
-      SDIO_COMMAND(CMD59_CRC_ON_OFF, MMCSD_RESPONSE_R1, 0),
-      CMD59_CRC_ENABLED, NULL, true);
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD0_GO_IDLE_STATE, MMCSD_RESPONSE_NONE, SDIO_INITIALIZE),
+      0);
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepMmcReadOCR(struct MMCSD *device)
+static enum Result initResetAdvance(struct MMCSD *device, enum Result status)
 {
-  uint32_t ocr = 0;
-  enum Result res;
-
-  for (unsigned int counter = 100; counter; --counter)
-  {
-    if (!ocr)
-    {
-      res = executeCommand(device,
-          SDIO_COMMAND(CMD1_SEND_OP_COND, MMCSD_RESPONSE_R3, 0),
-          0, &ocr, true);
-
-      if (res == E_OK)
-        ocr = OCR_HCS | (ocr & OCR_VOLTAGE_MASK_2V7_3V6);
-      else
-        ocr = 0;
-    }
-
-    if (ocr)
-    {
-      uint32_t response;
-
-      res = executeCommand(device,
-          SDIO_COMMAND(CMD1_SEND_OP_COND, MMCSD_RESPONSE_R3, 0),
-          ocr, &response, true);
+  if (status != E_OK && status != E_IDLE)
+    return status;
 
-      if (res == E_OK)
-      {
-        /* Busy bit is active low */
-        if (response & OCR_BUSY)
-        {
-          if (response & OCR_MMC_SECTOR_MODE)
-          {
-            /* Card capacity is greater than 2GB */
-            device->info.capacityType = CAPACITY_HC;
-          }
-          else
-          {
-            /* Card capacity is less then or equal to 2GB */
-            device->info.capacityType = CAPACITY_SC;
-          }
-
-          device->info.cardType = CARD_MMC;
-        }
-        else
-          res = E_BUSY;
-      }
-    }
+  /* Try to initialize as MMC */
+  device->init.delay = CMD0_IDLE_DELAY;
+  device->init.retries = CMD1_RETRIES;
+  device->init.step = INIT_MMC_PROBE;
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initMmcProbeEnter(struct MMCSD *device)
+{
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD1_SEND_OP_COND, MMCSD_RESPONSE_R3, 0),
+      0);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initMmcProbeAdvance(struct MMCSD *device,
+    enum Result status)
+{
+  uint32_t response;
 
-    if (res != E_BUSY)
-      break;
+  if (status == E_OK)
+    status = ifGetParam(device->interface, IF_SDIO_RESPONSE, &response);
 
-    udelay(CMD1_RETRY_DELAY);
+  if (status == E_OK)
+  {
+    device->init.ocr = OCR_HCS | (response & OCR_VOLTAGE_MASK_2V7_3V6);
+    device->init.step = INIT_MMC_READ_OCR;
+  }
+  else
+  {
+    /* Card is not MMC, try to initialize as SD */
+    device->init.step = INIT_SD_RESET;
   }
 
-  return res;
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepMmcSetBusWidth(struct MMCSD *device)
+static enum Result initMmcReadOcrEnter(struct MMCSD *device)
 {
-  uint32_t mode = MMC_BUS_WIDTH_PATTERN;
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD1_SEND_OP_COND, MMCSD_RESPONSE_R3, 0),
+      device->init.ocr);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initMmcReadOcrAdvance(struct MMCSD *device,
+    enum Result status)
+{
+  uint32_t response;
 
-  switch (device->mode)
+  if (status == E_OK)
+    status = ifGetParam(device->interface, IF_SDIO_RESPONSE, &response);
+
+  if (status != E_OK)
   {
-    case SDIO_4BIT:
-      mode |= MMC_BUS_WIDTH_4BIT;
-      break;
+    /* Card is not MMC, try to initialize as SD */
+    device->init.step = INIT_SD_RESET;
+    return E_OK;
+  }
 
-    case SDIO_8BIT:
-      mode |= MMC_BUS_WIDTH_8BIT;
-      break;
+  /* Busy bit is active low */
+  if (response & OCR_BUSY)
+  {
+    if (response & OCR_MMC_SECTOR_MODE)
+    {
+      /* Card capacity is greater than 2GB */
+      device->info.capacityType = CAPACITY_HC;
+    }
+    else
+    {
+      /* Card capacity is less then or equal to 2GB */
+      device->info.capacityType = CAPACITY_SC;
+    }
 
-    default:
-      mode |= MMC_BUS_WIDTH_1BIT;
-      break;
+    device->info.cardType = CARD_MMC;
+    initNextStep(device);
+  }
+  else if (--device->init.retries)
+  {
+    device->init.delay = CMD1_RETRY_DELAY;
+  }
+  else
+  {
+    /* Card is still busy, try to initialize as SD */
+    device->init.step = INIT_SD_RESET;
   }
 
-  return executeCommand(device,
-      SDIO_COMMAND(CMD6_SWITCH, MMCSD_RESPONSE_R1B, SDIO_CHECK_CRC),
-      mode, NULL, true);
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepMmcSetHighSpeed(struct MMCSD *device,
-    enum MMCSDSpeed speed)
+static enum Result initSdResetAdvance(struct MMCSD *device,
+    enum Result status)
 {
-  uint32_t mode = MMC_HS_TIMING_PATTERN;
+  if (status != E_OK && status != E_IDLE)
+    return status;
 
-  switch (speed)
+  device->init.retries = CMD8_RETRIES;
+  device->init.step = INIT_SD_READ_CONDITION;
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdReadConditionEnter(struct MMCSD *device)
+{
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD8_SEND_IF_COND, MMCSD_RESPONSE_R7, 0),
+      CMD8_CONDITION_PATTERN);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdReadConditionAdvance(struct MMCSD *device,
+    enum Result status)
+{
+  if (status == E_OK || status == E_IDLE)
   {
-    case SPEED_HS:
-      mode |= MMC_HS_TIMING_HS;
-      break;
+    uint32_t response;
+    const enum Result res = ifGetParam(device->interface, IF_SDIO_RESPONSE,
+        &response);
 
-    case SPEED_HS200:
-      mode |= MMC_HS_TIMING_HS200;
-      break;
+    if (res != E_OK)
+      return res;
 
-    case SPEED_HS400:
-      mode |= MMC_HS_TIMING_HS400;
-      break;
+    /* Response should be equal to the command argument */
+    if (response == CMD8_CONDITION_PATTERN)
+    {
+      device->info.cardType = CARD_SD_2_0;
 
-    default:
-      mode |= MMC_HS_TIMING_COMPATIBLE;
-      break;
+      device->init.ocr = OCR_HCS;
+      if (device->mode != SDIO_SPI)
+        device->init.ocr |= OCR_VOLTAGE_MASK_2V7_3V6;
+
+      device->init.retries = ACMD41_RETRIES;
+      device->init.step = INIT_SD_APP_COMMAND;
+      return E_OK;
+    }
+  }
+  else if (status != E_INVALID && status != E_TIMEOUT)
+  {
+    /* Other error, it's not an unsupported command */
+    return status;
   }
 
-  return executeCommand(device,
-      SDIO_COMMAND(CMD6_SWITCH, MMCSD_RESPONSE_R1B, SDIO_CHECK_CRC),
-      mode, NULL, true);
+  if (!--device->init.retries)
+    return E_DEVICE;
+
+  device->init.delay = CMD8_RETRY_DELAY;
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdAppCommandEnter(struct MMCSD *device)
+{
+  const enum MMCSDResponse response = device->mode == SDIO_SPI ?
+      MMCSD_RESPONSE_NONE : MMCSD_RESPONSE_R1;
+
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD55_APP_CMD, response, 0),
+      0);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdAppCommandAdvance(struct MMCSD *device,
+    enum Result status)
+{
+  if (status != E_OK && status != E_IDLE)
+    return status;
+
+  device->init.step = INIT_SD_READ_OCR;
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepReadCondition(struct MMCSD *device)
+static enum Result initSdReadOcrEnter(struct MMCSD *device)
 {
-  enum Result status = E_DEVICE;
+  const enum MMCSDResponse response = device->mode == SDIO_SPI ?
+      MMCSD_RESPONSE_NONE : MMCSD_RESPONSE_R1;
 
-  for (unsigned int counter = 10; counter; --counter)
+  return initExecuteCommand(device,
+      SDIO_COMMAND(ACMD41_SD_SEND_OP_COND, response, 0),
+      device->init.ocr);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdReadOcrAdvance(struct MMCSD *device,
+    enum Result status)
+{
+  if (device->mode != SDIO_SPI)
   {
     uint32_t response;
-    const enum Result res = executeCommand(device,
-        SDIO_COMMAND(CMD8_SEND_IF_COND, MMCSD_RESPONSE_R7, 0),
-        CMD8_CONDITION_PATTERN, &response, true);
 
-    if (res == E_OK || res == E_IDLE)
+    if (status == E_OK)
+      status = ifGetParam(device->interface, IF_SDIO_RESPONSE, &response);
+
+    /* Busy bit is active low */
+    if (status == E_OK && (response & OCR_BUSY))
     {
-      /* Response should be equal to the command argument */
-      if (response == CMD8_CONDITION_PATTERN)
-      {
-        device->info.cardType = CARD_SD_2_0;
+      /* Check card capacity information */
+      if (response & OCR_SD_CCS)
+        device->info.capacityType = CAPACITY_HC;
 
-        status = E_OK;
-        break;
-      }
+      initNextStep(device);
+      return E_OK;
     }
-    else if (res != E_INVALID && res != E_TIMEOUT)
+  }
+  else
+  {
+    if (status == E_OK)
     {
-      /* Other error, it's not an unsupported command */
-      status = res;
-      break;
+      initNextStep(device);
+      return E_OK;
     }
-
-    udelay(CMD8_RETRY_DELAY);
+    else if (status != E_IDLE)
+      return status;
   }
 
-  return status;
+  if (!--device->init.retries)
+    return E_TIMEOUT;
+
+  device->init.delay = ACMD41_RETRY_DELAY;
+  device->init.step = INIT_SD_APP_COMMAND;
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepReadCID(struct MMCSD *device)
+static enum Result initEnableCrcEnter(struct MMCSD *device)
 {
-  return executeCommand(device,
-      SDIO_COMMAND(CMD2_ALL_SEND_CID, MMCSD_RESPONSE_R2, SDIO_CHECK_CRC),
-      0, NULL, true);
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD59_CRC_ON_OFF, MMCSD_RESPONSE_R1, 0),
+      CMD59_CRC_ENABLED);
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepReadCSD(struct MMCSD *device)
+static enum Result initSpiReadOcrEnter(struct MMCSD *device)
 {
-  uint32_t response[4];
-  const enum Result res = executeCommand(device,
-      SDIO_COMMAND(CMD9_SEND_CSD, MMCSD_RESPONSE_R2, SDIO_CHECK_CRC),
-      (device->info.cardAddress << 16), response, true);
-
-  if (res == E_OK)
-    parseCardSpecificData(device, response);
-  return res;
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD58_READ_OCR, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
+      0);
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepReadExtCSD(struct MMCSD *device)
+static enum Result initSpiReadOcrAdvance(struct MMCSD *device,
+    enum Result status)
 {
-  static const uint32_t command = SDIO_COMMAND(CMD8_SEND_EXT_CSD,
-      MMCSD_RESPONSE_R1, SDIO_DATA_MODE | SDIO_CHECK_CRC);
+  uint32_t response;
 
-  uint8_t csd[DEFAULT_BLOCK_SIZE];
-  enum Result res;
+  if (status != E_OK)
+    return status;
 
-  res = ifSetParam(device->interface, IF_SDIO_COMMAND, &command);
-  if (res != E_OK)
-    return res;
-  res = ifSetParam(device->interface, IF_SDIO_ARGUMENT, &(uint32_t){0});
-  if (res != E_OK)
-    return res;
+  status = ifGetParam(device->interface, IF_SDIO_RESPONSE, &response);
+  if (status != E_OK)
+    return status;
 
-  const size_t queued = ifRead(device->interface, csd, sizeof(csd));
-  enum Result status;
+  if (response & OCR_SD_CCS)
+    device->info.capacityType = CAPACITY_HC;
 
-  if (queued == sizeof(csd))
-  {
-    do
-    {
-      status = ifGetParam(device->interface, IF_STATUS, NULL);
-      barrier();
-    }
-    while (status == E_BUSY);
-  }
-  else
-    return E_INTERFACE;
+  initNextStep(device);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initReadCidEnter(struct MMCSD *device)
+{
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD2_ALL_SEND_CID, MMCSD_RESPONSE_R2, SDIO_CHECK_CRC),
+      0);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initReadRcaEnter(struct MMCSD *device)
+{
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD3_SEND_RELATIVE_ADDR, MMCSD_RESPONSE_R6, SDIO_CHECK_CRC),
+      0);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initReadRcaAdvance(struct MMCSD *device, enum Result status)
+{
+  uint32_t response;
 
-  /* Process SEC_COUNT parameter [215:212] */
-  uint32_t sectors;
-  memcpy(&sectors, &csd[212], sizeof(sectors));
-  device->info.sectorCount = fromLittleEndian32(sectors);
+  if (status != E_OK)
+    return status;
 
-  /* Process HC_ERASE_GRP_SIZE parameter [224] */
-  if (csd[224] != 0)
-  {
-    device->info.eraseGroupSize = csd[224] * ((512 * 1024) >> BLOCK_POW);
-  }
+  status = ifGetParam(device->interface, IF_SDIO_RESPONSE, &response);
+  if (status != E_OK)
+    return status;
+
+  device->info.cardAddress = response >> 16;
 
+  initNextStep(device);
   return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepReadRCA(struct MMCSD *device)
+static enum Result initSetRcaEnter(struct MMCSD *device)
 {
-  uint32_t response;
-  const enum Result res = executeCommand(device,
-      SDIO_COMMAND(CMD3_SEND_RELATIVE_ADDR, MMCSD_RESPONSE_R6, SDIO_CHECK_CRC),
-      0, &response, true);
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD3_SET_RELATIVE_ADDR, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
+      (1UL << 16));
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSetRcaAdvance(struct MMCSD *device, enum Result status)
+{
+  if (status != E_OK)
+    return status;
 
-  if (res == E_OK)
-    device->info.cardAddress = response >> 16;
-  return res;
+  device->info.cardAddress = 1;
+
+  initNextStep(device);
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepSdReadOCR(struct MMCSD *device)
+static enum Result initReadCsdEnter(struct MMCSD *device)
 {
-  const enum MMCSDResponse responseType = device->mode == SDIO_SPI ?
-      MMCSD_RESPONSE_NONE : MMCSD_RESPONSE_R1;
-  uint32_t responseValue;
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD9_SEND_CSD, MMCSD_RESPONSE_R2, SDIO_CHECK_CRC),
+      (device->info.cardAddress << 16));
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initReadCsdAdvance(struct MMCSD *device, enum Result status)
+{
+  uint32_t response[4];
 
-  unsigned int counter = 100;
-  uint32_t ocr = 0;
-  enum Result res;
+  if (status != E_OK)
+    return status;
 
-  if (device->info.cardType == CARD_SD_2_0)
-    ocr |= OCR_HCS;
-  if (device->mode != SDIO_SPI)
-    ocr |= OCR_VOLTAGE_MASK_2V7_3V6;
+  status = ifGetParam(device->interface, IF_SDIO_RESPONSE, response);
+  if (status != E_OK)
+    return status;
 
-  for (; counter; --counter)
-  {
-    res = executeCommand(device,
-        SDIO_COMMAND(CMD55_APP_CMD, responseType, 0),
-        0, NULL, true);
-    if (res != E_OK && res != E_IDLE)
-      break;
+  parseCardSpecificData(device, response);
 
-    res = executeCommand(device,
-        SDIO_COMMAND(ACMD41_SD_SEND_OP_COND, responseType, 0),
-        ocr,
-        responseType == MMCSD_RESPONSE_R1 ? &responseValue : NULL,
-        true);
+  initNextStep(device);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initGetStatusEnter(struct MMCSD *device)
+{
+  /* Relative card address should be initialized */
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD13_SEND_STATUS, MMCSD_RESPONSE_R1,
+          SDIO_WAIT_DATA | SDIO_CHECK_CRC),
+      (device->info.cardAddress << 16));
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initGetStatusAdvance(struct MMCSD *device,
+    enum Result status)
+{
+  uint32_t response;
 
-    if (responseType == MMCSD_RESPONSE_R1)
-    {
-      if (res == E_OK && (responseValue & OCR_BUSY))
-      {
-        /* Check card capacity information */
-        if (responseValue & OCR_SD_CCS)
-          device->info.capacityType = CAPACITY_HC;
-        break;
-      }
-    }
-    else
-    {
-      if (res != E_IDLE)
-        break;
-    }
+  if (status != E_OK)
+    return status;
 
-    udelay(ACMD41_RETRY_DELAY);
-  }
+  status = ifGetParam(device->interface, IF_SDIO_RESPONSE, &response);
+  if (status != E_OK)
+    return status;
 
-  if (!counter)
-    res = E_TIMEOUT;
+  if (CURRENT_STATE(response) == CARD_STANDBY)
+    device->init.step = INIT_SELECT_CARD;
+  else
+    initNextStep(device);
 
-  return res;
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepSdSetBusWidth(struct MMCSD *device)
+static enum Result initSelectCardEnter(struct MMCSD *device)
 {
-  enum Result res;
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD7_SELECT_CARD, MMCSD_RESPONSE_R1B,
+          SDIO_WAIT_DATA | SDIO_CHECK_CRC),
+      (device->info.cardAddress << 16));
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSetBlockLengthEnter(struct MMCSD *device)
+{
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD16_SET_BLOCKLEN, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
+      (1UL << BLOCK_POW));
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initMmcSetBusWidthEnter(struct MMCSD *device)
+{
+  uint32_t mode = MMC_BUS_WIDTH_PATTERN;
 
-  res = executeCommand(device,
-      SDIO_COMMAND(CMD55_APP_CMD, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
-      (device->info.cardAddress << 16), NULL, true);
-  if (res != E_OK)
-    return res;
+  switch (device->mode)
+  {
+    case SDIO_4BIT:
+      mode |= MMC_BUS_WIDTH_4BIT;
+      break;
 
-  const uint8_t busMode = device->mode == SDIO_4BIT ?
+    case SDIO_8BIT:
+      mode |= MMC_BUS_WIDTH_8BIT;
+      break;
+
+    default:
+      mode |= MMC_BUS_WIDTH_1BIT;
+      break;
+  }
+
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD6_SWITCH, MMCSD_RESPONSE_R1B, SDIO_CHECK_CRC),
+      mode);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initMmcSetHighSpeedEnter(struct MMCSD *device)
+{
+  /* Enable high-speed mode by default */
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD6_SWITCH, MMCSD_RESPONSE_R1B, SDIO_CHECK_CRC),
+      MMC_HS_TIMING_PATTERN | MMC_HS_TIMING_HS);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdBusAppCommandEnter(struct MMCSD *device)
+{
+  return initExecuteCommand(device,
+      SDIO_COMMAND(CMD55_APP_CMD, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
+      (device->info.cardAddress << 16));
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initSdSetBusWidthEnter(struct MMCSD *device)
+{
+  const uint32_t busMode = device->mode == SDIO_4BIT ?
       ACMD6_BUS_WIDTH_4BIT : ACMD6_BUS_WIDTH_1BIT;
 
-  return executeCommand(device,
+  return initExecuteCommand(device,
       SDIO_COMMAND(ACMD6_SET_BUS_WIDTH, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
-      busMode, NULL, true);
+      busMode);
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepSendReset(struct MMCSD *device)
+static enum Result initReadExtCsdEnter(struct MMCSD *device)
 {
-  const enum Result res = executeCommand(device,
-      SDIO_COMMAND(CMD0_GO_IDLE_STATE, MMCSD_RESPONSE_NONE, SDIO_INITIALIZE),
-      0, NULL, true);
+  static const uint32_t command = SDIO_COMMAND(CMD8_SEND_EXT_CSD,
+      MMCSD_RESPONSE_R1, SDIO_DATA_MODE | SDIO_CHECK_CRC);
+  enum Result res;
+
+  res = ifSetParam(device->interface, IF_SDIO_COMMAND, &command);
+  if (res != E_OK)
+    return res;
+  res = ifSetParam(device->interface, IF_SDIO_ARGUMENT, &(uint32_t){0});
+  if (res != E_OK)
+    return res;
 
-  return (res != E_OK && res != E_IDLE) ? res : E_OK;
+  const size_t queued = ifRead(device->interface, device->init.buffer,
+      DEFAULT_BLOCK_SIZE);
+
+  if (queued != DEFAULT_BLOCK_SIZE)
+    return E_INTERFACE;
+
+  return device->timer == NULL ? awaitCompletion(device) : E_BUSY;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepSetBlockLength(struct MMCSD *device)
+static enum Result initReadExtCsdAdvance(struct MMCSD *device,
+    enum Result status)
 {
-  return executeCommand(device,
-      SDIO_COMMAND(CMD16_SET_BLOCKLEN, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
-      (1UL << BLOCK_POW), NULL, true);
+  uint8_t * const csd = device->init.buffer;
+
+  if (status == E_OK)
+  {
+    /* Process SEC_COUNT parameter [215:212] */
+    uint32_t sectors;
+    memcpy(&sectors, &csd[212], sizeof(sectors));
+    device->info.sectorCount = fromLittleEndian32(sectors);
+
+    /* Process HC_ERASE_GRP_SIZE parameter [224] */
+    if (csd[224] != 0)
+    {
+      device->info.eraseGroupSize = csd[224] * ((512 * 1024) >> BLOCK_POW);
+    }
+
+    initNextStep(device);
+  }
+
+  return status;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepSetRCA(struct MMCSD *device, uint32_t address)
+static enum Result initStepAdvance(struct MMCSD *device, enum Result status)
 {
-  const enum Result res = executeCommand(device,
-      SDIO_COMMAND(CMD3_SEND_RELATIVE_ADDR, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
-      (address << 16), NULL, true);
+  if (status != E_OK)
+    return status;
 
-  if (res == E_OK)
-    device->info.cardAddress = address;
-  return res;
+  initNextStep(device);
+  return E_OK;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result initStepSpiReadOCR(struct MMCSD *device)
+static enum Result awaitCompletion(struct MMCSD *device)
 {
-  uint32_t response;
-  const enum Result res = executeCommand(device,
-      SDIO_COMMAND(CMD58_READ_OCR, MMCSD_RESPONSE_R1, SDIO_CHECK_CRC),
-      0, &response, true);
+  enum Result status;
 
-  if (res == E_OK && (response & OCR_SD_CCS))
-    device->info.capacityType = CAPACITY_HC;
-  return res;
+  do
+  {
+    status = ifGetParam(device->interface, IF_STATUS, NULL);
+    barrier();
+  }
+  while (status == E_BUSY);
+
+  return status;
 }
 /*----------------------------------------------------------------------------*/
 static enum Result eraseSectorGroup(struct MMCSD *device, uint32_t sector)
@@ -479,12 +784,7 @@ static enum Result executeCommand(struct MMCSD *device, uint32_t command,
     if (!await)
       return E_BUSY;
 
-    do
-    {
-      status = ifGetParam(device->interface, IF_STATUS, NULL);
-      barrier();
-    }
-    while (status == E_BUSY);
+    status = awaitCompletion(device);
   }
 
   if (status != E_OK && status != E_IDLE)
@@ -523,101 +823,140 @@ static uint32_t extractBits(const uint32_t *data, unsigned int start,
   return value & MASK(end - start + 1);
 }
 /*----------------------------------------------------------------------------*/
-static enum Result identifyCard(struct MMCSD *device)
+static enum Result initExecuteCommand(struct MMCSD *device, uint32_t command,
+    uint32_t argument)
 {
-  enum Result res;
+  /* Wait for command completion when initialization is blocking */
+  return executeCommand(device, command, argument, NULL,
+      device->timer == NULL);
+}
+/*----------------------------------------------------------------------------*/
+static void initFinish(struct MMCSD *device, enum Result res)
+{
+  /* Restore original interface rate */
+  ifSetParam(device->interface, IF_RATE, &device->init.rate);
 
-  /* Send Reset command */
-  if ((res = initStepSendReset(device)) != E_OK)
-    return res;
-  udelay(CMD0_IDLE_DELAY);
+  /* Release the bus */
+  ifSetCallback(device->interface, NULL, NULL);
+  ifSetParam(device->interface, IF_RELEASE, NULL);
 
-  /* Try to initialize as MMC */
-  if ((res = initStepMmcReadOCR(device)) != E_OK)
+  if (device->transfer.state == STATE_INIT)
   {
-    /* Send Reset command */
-    if ((res = initStepSendReset(device)) != E_OK)
-      return res;
-
-    /* Card is not MMC, try to initialize as SD */
-    if ((res = initStepReadCondition(device)) != E_OK)
-      return res;
+    device->transfer.state = res == E_OK ? STATE_IDLE : STATE_ERROR;
 
-    res = initStepSdReadOCR(device);
-    if (res != E_OK)
-      return res;
+    if (device->callback != NULL)
+      device->callback(device->callbackArgument);
   }
+}
+/*----------------------------------------------------------------------------*/
+static bool initIsStepRequired(const struct MMCSD *device, enum InitStep step)
+{
+  const bool spi = device->mode == SDIO_SPI;
 
-  /* Enable optional integrity checking */
-  if (device->mode == SDIO_SPI && device->crc)
+  switch (step)
   {
-    if ((res = initStepEnableCrc(device)) != E_OK)
-      return res;
-  }
+    case INIT_ENABLE_CRC:
+      /* Enable optional integrity checking */
+      return spi && device->crc;
 
-  /* Read card capacity information when SPI mode is used */
-  if (device->mode == SDIO_SPI && device->info.cardType == CARD_SD_2_0)
-  {
-    if ((res = initStepSpiReadOCR(device)) != E_OK)
-      return res;
-  }
+    case INIT_SPI_READ_OCR:
+      /* Read card capacity information when SPI mode is used */
+      return spi && device->info.cardType == CARD_SD_2_0;
 
-  /* Read CID and RCA information */
-  if (device->mode != SDIO_SPI)
-  {
-    if ((res = initStepReadCID(device)) != E_OK)
-      return res;
+    case INIT_READ_CID:
+    case INIT_GET_STATUS:
+    case INIT_SET_BLOCK_LENGTH:
+      return !spi;
 
-    if (device->info.cardType >= CARD_MMC)
-      res = initStepSetRCA(device, 1);
-    else
-      res = initStepReadRCA(device);
-    if (res != E_OK)
-      return res;
+    case INIT_READ_RCA:
+      return !spi && device->info.cardType < CARD_MMC;
+
+    case INIT_SET_RCA:
+      return !spi && device->info.cardType >= CARD_MMC;
+
+    case INIT_SELECT_CARD:
+      /* Card selection depends on the result of the status request */
+      return false;
+
+    case INIT_MMC_SET_BUS_WIDTH:
+    case INIT_MMC_SET_HIGH_SPEED:
+      return !spi && device->info.cardType == CARD_MMC_4_0;
+
+    case INIT_SD_BUS_APP_COMMAND:
+    case INIT_SD_SET_BUS_WIDTH:
+      return !spi && device->info.cardType != CARD_MMC_4_0;
+
+    case INIT_READ_EXT_CSD:
+      /* Read Extended CSD register of the MMC */
+      return device->info.cardType == CARD_MMC_4_0
+          && device->info.capacityType == CAPACITY_HC;
+
+    default:
+      return true;
   }
+}
+/*----------------------------------------------------------------------------*/
+static void initNextStep(struct MMCSD *device)
+{
+  enum InitStep step = device->init.step;
 
-  /* Read and process CSD register */
-  if ((res = initStepReadCSD(device)) != E_OK)
-    return res;
+  do
+    ++step;
+  while (step != INIT_DONE && !initIsStepRequired(device, step));
 
-  /* Configure block length and bus width */
-  if (device->mode != SDIO_SPI)
+  device->init.step = step;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result initRun(struct MMCSD *device, enum Result status)
+{
+  while (1)
   {
-    if ((res = setTransferState(device)) != E_OK)
-      return res;
-    if ((res = initStepSetBlockLength(device)) != E_OK)
+    const enum Result res =
+        initStepTable[device->init.step].advance(device, status);
+
+    if (res != E_OK)
       return res;
+    if (device->init.step == INIT_DONE)
+      return E_OK;
 
-    if (device->info.cardType == CARD_MMC_4_0)
+    if (device->init.delay)
     {
-      if ((res = initStepMmcSetBusWidth(device)) != E_OK)
-        return res;
+      const uint32_t delay = device->init.delay;
+
+      device->init.delay = 0;
 
-      /* Enable high-speed mode by default */
-      if ((res = initStepMmcSetHighSpeed(device, SPEED_HS)) != E_OK)
-        return res;
+      if (device->timer != NULL)
+      {
+        /* Initialization will be resumed from the timer interrupt */
+        initStartDelay(device, delay);
+        return E_BUSY;
+      }
+      else
+        udelay(delay);
     }
-    else
+
+    status = initStepTable[device->init.step].enter(device);
+
+    if (status == E_BUSY)
     {
-      if ((res = initStepSdSetBusWidth(device)) != E_OK)
-        return res;
+      /* Initialization will be resumed from the interface interrupt */
+      return E_BUSY;
     }
   }
+}
+/*----------------------------------------------------------------------------*/
+static void initStartDelay(struct MMCSD *device, uint32_t delay)
+{
+  const uint32_t frequency = timerGetFrequency(device->timer);
+  const uint64_t timeout = (delay * (1ULL << 32)) / 1000000;
+  const uint32_t overflow = (frequency * timeout + ((1ULL << 32) - 1)) >> 32;
 
-  /* Read Extended CSD register of the MMC */
-  if (device->info.cardType == CARD_MMC_4_0
-      && device->info.capacityType == CAPACITY_HC)
-  {
-    if ((res = initStepReadExtCSD(device)) != E_OK)
-      return res;
-  }
-
-  return E_OK;
+  timerSetOverflow(device->timer, overflow);
+  timerEnable(device->timer);
 }
 /*----------------------------------------------------------------------------*/
 static enum Result initializeCard(struct MMCSD *device)
 {
-  uint32_t workRate;
   enum Result res;
 
   /* Get the type of the bus */
@@ -634,7 +973,7 @@ static enum Result initializeCard(struct MMCSD *device)
     goto error;
   ifSetCallback(device->interface, interruptHandler, device);
 
-  res = ifGetParam(device->interface, IF_RATE, &workRate);
+  res = ifGetParam(device->interface, IF_RATE, &device->init.rate);
   if (res != E_OK)
     goto error;
 
@@ -649,11 +988,33 @@ static enum Result initializeCard(struct MMCSD *device)
   if (res != E_OK)
     goto error;
 
-  /* Initialize memory card */
-  res = identifyCard(device);
+  /* Initialize memory card, start with the Reset command */
+  if (device->timer != NULL)
+    device->transfer.state = STATE_INIT;
+  device->init.step = INIT_RESET;
 
-  /* Restore original interface rate */
-  ifSetParam(device->interface, IF_RATE, &workRate);
+  res = initStepTable[device->init.step].enter(device);
+  if (res != E_BUSY)
+    res = initRun(device, res);
+
+  if (res == E_BUSY)
+  {
+    /* Identification will be continued in the background */
+    return E_OK;
+  }
+
+  if (res == E_OK && device->timer != NULL)
+  {
+    /* Completion is reported from the timer interrupt as in background mode */
+    initStartDelay(device, 1);
+    return E_OK;
+  }
+
+  /* Initialization is completed, restore rate and release the bus */
+  if (device->transfer.state == STATE_INIT)
+    device->transfer.state = res == E_OK ? STATE_IDLE : STATE_ERROR;
+  initFinish(device, res);
+  return res;
 
 error:
   /* Release the bus */
@@ -670,6 +1031,16 @@ static void interruptHandler(void *object)
 
   switch ((enum State)device->transfer.state)
   {
+    case STATE_INIT:
+    {
+      const enum Result res = initRun(device,
+          ifGetParam(device->interface, IF_STATUS, NULL));
+
+      if (res != E_BUSY)
+        initFinish(device, res);
+      break;
+    }
+
     case STATE_GET_STATUS:
       if (!onTransferStateSetupFinished(device))
       {
@@ -856,36 +1227,6 @@ static void parseCardSpecificData(struct MMCSD *device,
   }
 }
 /*----------------------------------------------------------------------------*/
-static enum Result setTransferState(struct MMCSD *device)
-{
-  /* Relative card address should be initialized */
-  const uint32_t address = device->info.cardAddress << 16;
-  const uint32_t flags = SDIO_WAIT_DATA | SDIO_CHECK_CRC;
-  uint32_t response;
-  enum Result res;
-
-  res = executeCommand(device,
-      SDIO_COMMAND(CMD13_SEND_STATUS, MMCSD_RESPONSE_R1, flags),
-      address, &response, true);
-  if (res != E_OK)
-    return res;
-
-  const uint8_t state = CURRENT_STATE(response);
-
-  if (state == CARD_STANDBY)
-  {
-    return executeCommand(device,
-        SDIO_COMMAND(CMD7_SELECT_CARD, MMCSD_RESPONSE_R1B, flags),
-        address, NULL, true);
-  }
-  else if (state != CARD_TRANSFER)
-  {
-    return res;
-  }
-  else
-    return E_OK;
-}
-/*----------------------------------------------------------------------------*/
 static enum Result startCardSelection(struct MMCSD *device)
 {
   const uint32_t address = device->info.cardAddress << 16;
@@ -964,6 +1305,27 @@ static enum Result terminateTransfer(struct MMCSD *device)
   return executeCommand(device, command, 0, NULL, false);
 }
 /*----------------------------------------------------------------------------*/
+static void timerInterruptHandler(void *object)
+{
+  struct MMCSD * const device = object;
+  enum Result res;
+
+  if (device->init.step == INIT_DONE)
+  {
+    /* Identification was completed without waiting */
+    initFinish(device, E_OK);
+    return;
+  }
+
+  /* Delay is elapsed, continue initialization from the current step */
+  res = initStepTable[device->init.step].enter(device);
+  if (res != E_BUSY)
+    res = initRun(device, res);
+
+  if (res != E_BUSY)
+    initFinish(device, res);
+}
+/*----------------------------------------------------------------------------*/
 static enum Result transferBuffer(struct MMCSD *device,
     uint32_t command, uint32_t argument, uintptr_t buffer, size_t length)
 {
@@ -1027,6 +1389,7 @@ static enum Result cardInit(void *object, const void *configBase)
   device->callback = NULL;
 
   device->interface = config->interface;
+  device->timer = config->timer;
   device->transfer.position = 0;
 
   device->info.sectorCount = 0;
@@ -1045,7 +1408,56 @@ static enum Result cardInit(void *object, const void *configBase)
   device->transfer.state = STATE_IDLE;
   device->transfer.autostop = false;
 
-  return initializeCard(device);
+  device->init.rate = 0;
+  device->init.ocr = 0;
+  device->init.delay = 0;
+  device->init.retries = 0;
+  device->init.step = INIT_RESET;
+
+  /* Initialization steps may be executed in the interrupt context */
+  device->init.buffer = malloc(DEFAULT_BLOCK_SIZE);
+  if (device->init.buffer == NULL)
+    return E_MEMORY;
+
+  if (device->timer != NULL)
+  {
+    timerSetAutostop(device->timer, true);
+    timerSetCallback(device->timer, timerInterruptHandler, device);
+  }
+
+  const enum Result res = initializeCard(device);
+
+  if (res != E_OK && device->timer != NULL)
+    timerSetCallback(device->timer, NULL, NULL);
+
+  if (res != E_OK || device->timer == NULL)
+  {
+    /* Identification is finished, release the temporary buffer */
+    free(device->init.buffer);
+    device->init.buffer = NULL;
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static void cardDeinit(void *object)
+{
+  struct MMCSD * const device = object;
+
+  if (device->timer != NULL)
+  {
+    timerDisable(device->timer);
+    timerSetCallback(device->timer, NULL, NULL);
+  }
+
+  if (device->transfer.state == STATE_INIT)
+  {
+    /* Background initialization is still in progress, release the bus */
+    ifSetCallback(device->interface, NULL, NULL);
+    ifSetParam(device->interface, IF_RELEASE, NULL);
+  }
+
+  free(device->init.buffer);
 }
 /*----------------------------------------------------------------------------*/
 static void cardSetCallback(void *object, void (*callback)(void *),
@@ -1213,7 +1625,7 @@ static size_t cardRead(void *object, void *buffer, size_t length)
   const uint32_t blocks = length >> BLOCK_POW;
   struct MMCSD * const device = object;
 
-  if (!blocks)
+  if (!blocks || device->transfer.state == STATE_INIT)
     return 0;
 
   uint32_t flags = SDIO_DATA_MODE;
@@ -1243,7 +1655,7 @@ static size_t cardWrite(void *object, const void *buffer, size_t length)
   const uint32_t blocks = length >> BLOCK_POW;
   struct MMCSD * const device = object;
 
-  if (!blocks)
+  if (!blocks || device->transfer.state == STATE_INIT)
     return 0;
 
   uint32_t flags = SDIO_DATA_MODE | SDIO_WRITE_MODE;
@@ -4,14 +4,20 @@
  * Project is distributed under the terms of the MIT License
  */
 
-#include <halm/generic/flash.h>
 #include <halm/generic/ram_proxy.h>
+#include <halm/timer.h>
+#include <xcore/asm.h>
 #include <assert.h>
 #include <string.h>
 /*----------------------------------------------------------------------------*/
 #define DEFAULT_GRANULE_SIZE 1024
 /*----------------------------------------------------------------------------*/
+static bool isProgrammable(const uint8_t *, const uint8_t *, size_t);
+static void onTimerOverflow(void *);
+static void startOperation(struct RamProxy *, uint32_t, size_t);
+/*----------------------------------------------------------------------------*/
 static enum Result interfaceInit(void *, const void *);
+static void interfaceDeinit(void *);
 static void interfaceSetCallback(void *, void (*)(void *), void *);
 static enum Result interfaceGetParam(void *, int, void *);
 static enum Result interfaceSetParam(void *, int, const void *);
@@ -22,7 +28,7 @@ const struct InterfaceClass * const RamProxy =
     &(const struct InterfaceClass){
     .size = sizeof(struct RamProxy),
     .init = interfaceInit,
-    .deinit = NULL, /* Default destructor */
+    .deinit = interfaceDeinit,
 
     .setCallback = interfaceSetCallback,
     .getParam = interfaceGetParam,
@@ -31,6 +37,61 @@ const struct InterfaceClass * const RamProxy =
     .write = interfaceWrite
 };
 /*----------------------------------------------------------------------------*/
+static bool isProgrammable(const uint8_t *memory, const uint8_t *data,
+    size_t length)
+{
+  /* Programming can only clear bits of the erased memory */
+  while (length--)
+  {
+    if ((*data++ & ~*memory++) != 0)
+      return false;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static void onTimerOverflow(void *argument)
+{
+  struct RamProxy * const interface = argument;
+
+  interface->busy = false;
+
+  if (!interface->blocking && interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static void startOperation(struct RamProxy *interface, uint32_t latency,
+    size_t units)
+{
+  const uint64_t time = (uint64_t)latency * units;
+
+  interface->statistics.busyTime += time;
+
+  if (interface->timer == NULL)
+    return;
+
+  const uint32_t frequency = timerGetFrequency(interface->timer);
+  uint64_t overflow = (time * frequency + 999999) / 1000000;
+
+  /* Zero-copy operations are always completed from the timer interrupt */
+  if (!overflow)
+    overflow = 1;
+  else if (overflow > UINT32_MAX)
+    overflow = UINT32_MAX;
+
+  interface->busy = true;
+
+  timerSetOverflow(interface->timer, (uint32_t)overflow);
+  timerSetValue(interface->timer, 0);
+  timerEnable(interface->timer);
+
+  if (interface->blocking)
+  {
+    while (interface->busy)
+      barrier();
+  }
+}
+/*----------------------------------------------------------------------------*/
 static enum Result interfaceInit(void *object, const void *configBase)
 {
   const struct RamProxyConfig * const config = configBase;
@@ -43,11 +104,42 @@ static enum Result interfaceInit(void *object, const void *configBase)
   interface->arena = config->arena;
   interface->capacity = config->capacity;
   interface->granule = config->granule ? config->granule : DEFAULT_GRANULE_SIZE;
+  interface->page = config->page;
   interface->position = 0;
 
+  interface->latency.read = config->latency.read;
+  interface->latency.program = config->latency.program;
+  interface->latency.erase = config->latency.erase;
+  memset(&interface->statistics, 0, sizeof(interface->statistics));
+
+  interface->status = E_OK;
+  interface->busy = false;
+  interface->blocking = true;
+  interface->flash = config->flash;
+
+  if (config->timer != NULL)
+  {
+    interface->timer = config->timer;
+    timerSetAutostop(interface->timer, true);
+    timerSetCallback(interface->timer, onTimerOverflow, interface);
+  }
+  else
+    interface->timer = NULL;
+
   return E_OK;
 }
 /*----------------------------------------------------------------------------*/
+static void interfaceDeinit(void *object)
+{
+  struct RamProxy * const interface = object;
+
+  if (interface->timer != NULL)
+  {
+    timerDisable(interface->timer);
+    timerSetCallback(interface->timer, NULL, NULL);
+  }
+}
+/*----------------------------------------------------------------------------*/
 static void interfaceSetCallback(void *object, void (*callback)(void *),
     void *argument)
 {
@@ -61,12 +153,33 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
 {
   struct RamProxy * const interface = object;
 
+  switch ((enum RamProxyParameter)parameter)
+  {
+    case IF_RAM_PROXY_STATISTICS:
+      *(struct RamProxyStatistics *)data = interface->statistics;
+      return E_OK;
+
+    default:
+      break;
+  }
+
   switch ((enum FlashParameter)parameter)
   {
     case IF_FLASH_SECTOR_SIZE:
       *(uint32_t *)data = interface->granule;
       return E_OK;
 
+    case IF_FLASH_PAGE_SIZE:
+      if (!interface->page)
+        return E_INVALID;
+
+      *(uint32_t *)data = interface->page;
+      return E_OK;
+
+    case IF_FLASH_MEMORY_MAPPED_ADDRESS:
+      *(uintptr_t *)data = (uintptr_t)interface->arena;
+      return E_OK;
+
     default:
       break;
   }
@@ -90,7 +203,7 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
       return E_OK;
 
     case IF_STATUS:
-      return E_OK;
+      return interface->busy ? E_BUSY : interface->status;
 
     default:
       return E_INVALID;
@@ -102,15 +215,38 @@ static enum Result interfaceSetParam(void *object, int parameter,
 {
   struct RamProxy * const interface = object;
 
+  switch ((enum RamProxyParameter)parameter)
+  {
+    case IF_RAM_PROXY_RESET_STATISTICS:
+      memset(&interface->statistics, 0, sizeof(interface->statistics));
+      return E_OK;
+
+    default:
+      break;
+  }
+
   switch ((enum FlashParameter)parameter)
   {
     case IF_FLASH_ERASE_SECTOR:
     {
       const uint32_t address = *(const uint32_t *)data;
 
+      if (interface->busy)
+        return E_BUSY;
+
       if (address < interface->capacity && (address % interface->granule) == 0)
       {
-        memset(interface->arena + address, 0, interface->granule);
+        memset(interface->arena + address, interface->flash ? 0xFF : 0,
+            interface->granule);
+
+        /*
+         * Erase is completed synchronously, the timer is not started and
+         * the callback is not called, latency is only added to statistics.
+         */
+        interface->status = E_OK;
+        interface->statistics.busyTime += interface->latency.erase;
+        ++interface->statistics.erases;
+
         return E_OK;
       }
       else
@@ -129,7 +265,7 @@ static enum Result interfaceSetParam(void *object, int parameter,
 
       if (address < interface->capacity)
       {
-        interface->position = *(uint32_t *)data;
+        interface->position = address;
         return E_OK;
       }
       else
@@ -142,7 +278,7 @@ static enum Result interfaceSetParam(void *object, int parameter,
 
       if (address < (uint64_t)interface->capacity)
       {
-        interface->position = (uint32_t)*(uint32_t *)data;
+        interface->position = (size_t)address;
         return E_OK;
       }
       else
@@ -150,9 +286,11 @@ static enum Result interfaceSetParam(void *object, int parameter,
     }
 
     case IF_BLOCKING:
+      interface->blocking = true;
       return E_OK;
 
     case IF_ZEROCOPY:
+      interface->blocking = false;
       return E_OK;
 
     default:
@@ -164,10 +302,20 @@ static size_t interfaceRead(void *object, void *buffer, size_t length)
 {
   struct RamProxy * const interface = object;
 
+  if (interface->busy)
+    return 0;
+
   if (interface->position + length > interface->capacity)
     length = interface->capacity - interface->position;
   memcpy(buffer, interface->arena + interface->position, length);
 
+  interface->status = E_OK;
+  interface->statistics.bytesRead += length;
+  ++interface->statistics.reads;
+
+  startOperation(interface, interface->latency.read, interface->page ?
+      (length + interface->page - 1) / interface->page : 1);
+
   return length;
 }
 /*----------------------------------------------------------------------------*/
@@ -175,9 +323,28 @@ static size_t interfaceWrite(void *object, const void *buffer, size_t length)
 {
   struct RamProxy * const interface = object;
 
+  if (interface->busy)
+    return 0;
+
   if (interface->position + length > interface->capacity)
     length = interface->capacity - interface->position;
+
+  if (interface->flash && !isProgrammable(
+      interface->arena + interface->position, buffer, length))
+  {
+    interface->status = E_VALUE;
+    ++interface->statistics.violations;
+    return 0;
+  }
+
   memcpy(interface->arena + interface->position, buffer, length);
 
+  interface->status = E_OK;
+  interface->statistics.bytesWritten += length;
+  ++interface->statistics.writes;
+
+  startOperation(interface, interface->latency.program, interface->page ?
+      (length + interface->page - 1) / interface->page : 1);
+
   return length;
 }
@@ -7,7 +7,9 @@
 #ifndef HALM_GENERIC_CAN_H_
 #define HALM_GENERIC_CAN_H_
 /*----------------------------------------------------------------------------*/
+#include <xcore/helpers.h>
 #include <xcore/interface.h>
+#include <stddef.h>
 #include <stdint.h>
 /*----------------------------------------------------------------------------*/
 struct CANFilter
@@ -21,7 +23,11 @@ enum CANFlags
   CAN_EXT_ID  = 0x01,
   CAN_RTR     = 0x02,
   CAN_FD      = 0x04,
-  CAN_SELF_RX = 0x08
+  CAN_SELF_RX = 0x08,
+  /** Data phase of a flexible data-rate frame uses a higher bit rate. */
+  CAN_BRS     = 0x10,
+  /** Transmitting node of a flexible data-rate frame is error passive. */
+  CAN_ESI     = 0x20
 };
 
 enum CANParameter
@@ -74,12 +80,42 @@ enum CANParameter
   /** Number of received frames. Parameter type is \a uint32_t. */
   IF_CAN_RX_COUNT,
   /** Number of transmitted frames. Parameter type is \a uint32_t. */
-  IF_CAN_TX_COUNT
+  IF_CAN_TX_COUNT,
+
+  /**
+   * Borrow received frames without copying. Parameter type is
+   * \a struct \a CANFrameBatch. Frames are removed from the receive queue
+   * and should be returned with the \a IF_CAN_RX_RELEASE parameter.
+   */
+  IF_CAN_RX_ACQUIRE,
+  /**
+   * Return borrowed received frames to the frame pool.
+   * Parameter type is \a struct \a CANFrameBatch.
+   */
+  IF_CAN_RX_RELEASE,
+  /**
+   * Take empty frames from the frame pool for in-place filling. Each frame
+   * reserves a slot in the transmit queue. Parameter type is
+   * \a struct \a CANFrameBatch. Frames should be passed back with
+   * the \a IF_CAN_TX_SUBMIT or \a IF_CAN_TX_RELEASE parameters.
+   */
+  IF_CAN_TX_ACQUIRE,
+  /**
+   * Return unused transmit frames to the frame pool.
+   * Parameter type is \a struct \a CANFrameBatch.
+   */
+  IF_CAN_TX_RELEASE,
+  /**
+   * Queue filled frames for transmission. Frames are returned to the pool
+   * by the driver. When one of the frames is incorrect, no frames are queued.
+   * Parameter type is \a struct \a CANFrameBatch.
+   */
+  IF_CAN_TX_SUBMIT
 };
 /*----------------------------------------------------------------------------*/
 struct CANMessage
 {
-  uint32_t timestamp;
+  uint64_t timestamp;
   uint32_t id;
   uint8_t flags;
   uint8_t length;
@@ -88,7 +124,7 @@ struct CANMessage
 
 struct CANStandardMessage
 {
-  uint32_t timestamp;
+  uint64_t timestamp;
   uint32_t id;
   uint8_t flags;
   uint8_t length;
@@ -97,11 +133,61 @@ struct CANStandardMessage
 
 struct CANFlexibleDataMessage
 {
-  uint32_t timestamp;
+  uint64_t timestamp;
   uint32_t id;
   uint8_t flags;
   uint8_t length;
   uint8_t data[64];
 };
+
+/** Group of frames owned by the user of the zero-copy interface. */
+struct CANFrameBatch
+{
+  /** Array of frame pointers. */
+  struct CANStandardMessage **frames;
+  /**
+   * Number of frames. When frames are acquired, it holds the size of
+   * the array on entry and the number of acquired frames on return.
+   */
+  size_t count;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+/**
+ * Convert a data length code to a payload length.
+ * @param dlc Data length code of a frame.
+ * @return Payload length in bytes.
+ */
+static inline uint8_t canDlcToLength(uint8_t dlc)
+{
+  static const uint8_t lengths[] = {
+      0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+  };
+
+  return lengths[dlc & 0x0F];
+}
+
+/**
+ * Convert a payload length to a data length code. Lengths not supported
+ * by flexible data-rate frames are rounded up to the next valid length.
+ * @param length Payload length in bytes.
+ * @return Data length code of a frame.
+ */
+static inline uint8_t canLengthToDlc(uint8_t length)
+{
+  if (length <= 8)
+    return length;
+  else if (length <= 24)
+    return 8 + (length - 5) / 4;
+  else if (length <= 32)
+    return 13;
+  else if (length <= 48)
+    return 14;
+  else
+    return 15;
+}
+
+END_DECLS
 /*----------------------------------------------------------------------------*/
 #endif /* HALM_GENERIC_CAN_H_ */
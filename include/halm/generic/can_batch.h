@@ -0,0 +1,68 @@
+/*
+ * halm/generic/can_batch.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_GENERIC_CAN_BATCH_H_
+#define HALM_GENERIC_CAN_BATCH_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/generic/can.h>
+#include <halm/generic/pointer_array.h>
+#include <halm/generic/pointer_queue.h>
+#include <stdbool.h>
+#include <stddef.h>
+/*----------------------------------------------------------------------------*/
+/*
+ * Zero-copy access to the frame pool of a CAN driver. Frames lent to
+ * the user keep their slots in the receive and transmit queues, therefore
+ * interrupt handlers never find the pool empty. Functions should be called
+ * with the interrupts of the driver disabled.
+ */
+struct CanBatchPool
+{
+  /* Message pool of the driver */
+  PointerArray *pool;
+  /* Queue for received messages */
+  PointerQueue *rxQueue;
+  /* Queue for transmitting messages */
+  PointerQueue *txQueue;
+
+  /* Received frames borrowed by the user */
+  size_t rxAcquired;
+  /* Transmit frames acquired by the user */
+  size_t txAcquired;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+void canBatchPoolInit(struct CanBatchPool *, PointerArray *, PointerQueue *,
+    PointerQueue *);
+void canBatchPoolAcquireRx(struct CanBatchPool *, struct CANFrameBatch *);
+void canBatchPoolAcquireTx(struct CanBatchPool *, struct CANFrameBatch *);
+void canBatchPoolReleaseRx(struct CanBatchPool *,
+    const struct CANFrameBatch *);
+void canBatchPoolReleaseTx(struct CanBatchPool *,
+    const struct CANFrameBatch *);
+bool canBatchPoolSubmit(struct CanBatchPool *, const struct CANFrameBatch *,
+    size_t (*)(void *, struct CANStandardMessage * const *, size_t), void *);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+static inline size_t canBatchPoolRxSpace(const struct CanBatchPool *pool)
+{
+  return pointerQueueCapacity(pool->rxQueue)
+      - pointerQueueSize(pool->rxQueue) - pool->rxAcquired;
+}
+
+static inline size_t canBatchPoolTxSpace(const struct CanBatchPool *pool)
+{
+  return pointerQueueCapacity(pool->txQueue)
+      - pointerQueueSize(pool->txQueue) - pool->txAcquired;
+}
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_GENERIC_CAN_BATCH_H_ */
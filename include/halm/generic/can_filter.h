@@ -0,0 +1,80 @@
+/*
+ * halm/generic/can_filter.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_GENERIC_CAN_FILTER_H_
+#define HALM_GENERIC_CAN_FILTER_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/generic/can.h>
+#include <xcore/helpers.h>
+#include <stdbool.h>
+#include <stddef.h>
+/*----------------------------------------------------------------------------*/
+#define CAN_FILTER_STD_IDS (1UL << 11)
+
+struct CanFilterEntry;
+struct CanFilterSlot;
+
+/*
+ * Software acceptance filter. Standard identifiers are checked with
+ * a bitmap in constant time. Extended filters are grouped by mask and
+ * masked identifiers of each group are stored in a hash table, therefore
+ * lookup time depends on the number of distinct masks only. An empty set
+ * accepts all frames.
+ */
+struct CanFilterSet
+{
+  /* Acceptance bitmap for standard identifiers */
+  uint32_t standard[CAN_FILTER_STD_IDS / 32];
+
+  /* Configured filters */
+  struct CanFilterEntry *entries;
+  /* Distinct masks of extended filters */
+  uint32_t *masks;
+  /* Hash table with masked identifiers of extended filters */
+  struct CanFilterSlot *slots;
+
+  /* Maximum number of filters */
+  size_t capacity;
+  /* Number of configured filters */
+  size_t count;
+  /* Number of distinct masks of extended filters */
+  size_t groups;
+  /* Hash table size minus one */
+  size_t slotMask;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+bool canFilterSetInit(struct CanFilterSet *, size_t);
+void canFilterSetDeinit(struct CanFilterSet *);
+bool canFilterSetAdd(struct CanFilterSet *, const struct CANFilter *, bool);
+void canFilterSetClear(struct CanFilterSet *);
+bool canFilterSetMatch(const struct CanFilterSet *, uint32_t, bool);
+bool canFilterSetRemove(struct CanFilterSet *, const struct CANFilter *,
+    bool);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+static inline bool canFilterSetEmpty(const struct CanFilterSet *set)
+{
+  return set->count == 0;
+}
+
+static inline bool canFilterSetFull(const struct CanFilterSet *set)
+{
+  return set->count == set->capacity;
+}
+
+static inline size_t canFilterSetSize(const struct CanFilterSet *set)
+{
+  return set->count;
+}
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_GENERIC_CAN_FILTER_H_ */
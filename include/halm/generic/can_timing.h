@@ -0,0 +1,74 @@
+/*
+ * halm/generic/can_timing.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_GENERIC_CAN_TIMING_H_
+#define HALM_GENERIC_CAN_TIMING_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/helpers.h>
+#include <stdbool.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+/** Bit timing capabilities of a CAN controller for a single bit phase. */
+struct CanTimingLimits
+{
+  /** Maximum value of the prescaler, minimal value is one. */
+  uint16_t prescaler;
+  /** Minimal length of the segment before the sample point. */
+  uint16_t minSeg1;
+  /** Maximum length of the segment before the sample point. */
+  uint16_t maxSeg1;
+  /** Minimal length of the segment after the sample point. */
+  uint8_t minSeg2;
+  /** Maximum length of the segment after the sample point. */
+  uint8_t maxSeg2;
+  /** Maximum synchronization jump width. */
+  uint8_t maxSjw;
+};
+
+/** Desired bit timing parameters of a single bit phase. */
+struct CanTimingRequest
+{
+  /** Bit rate in bits per second. */
+  uint32_t rate;
+  /**
+   * Maximum allowed deviation of the bit rate in parts per million.
+   * Zero value requires an exact bit rate.
+   */
+  uint32_t tolerance;
+  /** Sample point location in percents of the bit time. */
+  uint8_t samplePoint;
+  /** Synchronization jump width in time quanta. */
+  uint8_t sjw;
+};
+
+/** Bit timing of a single bit phase. */
+struct CanTiming
+{
+  /** Prescaler of the controller clock. */
+  uint16_t prescaler;
+  /**
+   * Length of the segment before the sample point in time quanta,
+   * synchronization segment excluded.
+   */
+  uint16_t seg1;
+  /** Length of the segment after the sample point in time quanta. */
+  uint8_t seg2;
+  /** Synchronization jump width in time quanta. */
+  uint8_t sjw;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+bool canTimingCalc(uint32_t, const struct CanTimingLimits *,
+    const struct CanTimingRequest *, struct CanTiming *);
+bool canTimingCalcFd(uint32_t, const struct CanTimingLimits *,
+    const struct CanTimingRequest *, const struct CanTimingLimits *,
+    const struct CanTimingRequest *, struct CanTiming *, struct CanTiming *);
+uint32_t canTimingGetRate(uint32_t, const struct CanTiming *);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_GENERIC_CAN_TIMING_H_ */
@@ -0,0 +1,69 @@
+/*
+ * halm/generic/clock_correlation.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_GENERIC_CLOCK_CORRELATION_H_
+#define HALM_GENERIC_CLOCK_CORRELATION_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/helpers.h>
+#include <stdbool.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+/* Linear piece of the mapping between local and reference time */
+struct ClockSegment
+{
+  /* Local time at the beginning of the segment */
+  uint64_t local;
+  /* Reference time at the beginning of the segment */
+  uint64_t reference;
+  /* Reference ticks per local tick, fixed point with 32 fractional bits */
+  uint64_t rate;
+};
+
+/*
+ * Mapping of a local timebase, for example a time stamp timer of a bus
+ * controller, to a common monotonic reference clock. The mapping is updated
+ * with pairs of local and reference times sampled at the same moment.
+ * Frequency drift is estimated from consecutive sync points and the offset
+ * is slewed out during the next sync interval, therefore converted values
+ * never go backwards while local values increase.
+ */
+struct ClockCorrelation
+{
+  /* Current and previous segments of the mapping */
+  struct ClockSegment current;
+  struct ClockSegment previous;
+
+  /* Last sync point */
+  uint64_t lastLocal;
+  uint64_t lastReference;
+
+  /* Nominal frequency ratio */
+  uint64_t nominal;
+  /* Filtered frequency ratio */
+  uint64_t rate;
+
+  /* Number of accepted sync points, saturated at two */
+  uint8_t points;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+void clockCorrelationInit(struct ClockCorrelation *, uint32_t, uint32_t);
+uint64_t clockCorrelationConvert(const struct ClockCorrelation *, uint64_t);
+bool clockCorrelationUpdate(struct ClockCorrelation *, uint64_t, uint64_t);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+static inline bool clockCorrelationReady(const struct ClockCorrelation *object)
+{
+  return object->points > 0;
+}
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_GENERIC_CLOCK_CORRELATION_H_ */
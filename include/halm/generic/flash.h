@@ -10,6 +10,10 @@
 #include <xcore/interface.h>
 #include <stdint.h>
 /*----------------------------------------------------------------------------*/
+/*
+ * Generic flash parameters. Interfaces that handle these parameters and
+ * define their own ones place their identifiers after \a IF_FLASH_SYNC.
+ */
 enum FlashParameter
 {
   /** Get block size. Parameter type is \a uint32_t. */
@@ -23,7 +27,19 @@ enum FlashParameter
   /** Erase sector at a relative address. Parameter type is \a uint32_t. */
   IF_FLASH_ERASE_SECTOR,
   /** Erase page at a relative address. Parameter type is \a uint32_t. */
-  IF_FLASH_ERASE_PAGE
+  IF_FLASH_ERASE_PAGE,
+  /**
+   * Get the address of the memory-mapped content. Parameter is available
+   * only when the content can be read directly from the address space.
+   * Direct reads bypass statistics, emulated timings and asynchronous
+   * transfers of the interface. Parameter type is \a uintptr_t.
+   */
+  IF_FLASH_MEMORY_MAPPED_ADDRESS,
+  /**
+   * Write cached data to the persistent storage and wait for completion.
+   * Parameter should be left uninitialized.
+   */
+  IF_FLASH_SYNC
 };
 
 struct FlashGeometry
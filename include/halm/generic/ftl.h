@@ -0,0 +1,170 @@
+/*
+ * halm/generic/ftl.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_GENERIC_FTL_H_
+#define HALM_GENERIC_FTL_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/generic/flash.h>
+/*----------------------------------------------------------------------------*/
+#define FTL_BLOCK_SIZE 512
+/*----------------------------------------------------------------------------*/
+extern const struct InterfaceClass * const Ftl;
+
+/*
+ * Flash Translation Layer parameters. Parameter \a IF_FLASH_ERASE_SECTOR
+ * discards a single logical block. Discarded blocks are unmapped in memory
+ * only and reappear after remounting until their sectors are reclaimed
+ * by garbage collection.
+ */
+enum FtlParameter
+{
+  /** Get statistics. Parameter type is \a struct FtlStatistics. */
+  IF_FTL_STATISTICS = IF_FLASH_SYNC + 1,
+  /**
+   * Relocate valid blocks from all sectors containing stale blocks.
+   * Parameter should be left uninitialized. Relocation is enqueued
+   * to the work queue in zero-copy mode and performed synchronously
+   * in blocking mode.
+   */
+  IF_FTL_COLLECT
+};
+
+struct FtlStatistics
+{
+  /** Number of logical blocks written by the user. */
+  uint64_t hostWrites;
+  /** Number of blocks programmed into the memory including relocations. */
+  uint64_t memoryWrites;
+  /** Number of sector erase operations since initialization. */
+  uint32_t erases;
+  /** Number of garbage collection cycles since initialization. */
+  uint32_t collections;
+  /** Minimal erase count of the memory sectors. */
+  uint32_t minEraseCount;
+  /** Maximal erase count of the memory sectors. */
+  uint32_t maxEraseCount;
+};
+
+struct FtlConfig
+{
+  /**
+   * Mandatory: underlying flash memory. Memory should support repeated
+   * programming of a page when programming only clears erased bits,
+   * mapping entries are programmed one by one.
+   */
+  void *flash;
+  /**
+   * Optional: work queue for zero-copy transfers and background garbage
+   * collection. Zero-copy mode is unavailable when the work queue is not
+   * set. In blocking mode the work queue is not used and garbage
+   * collection is performed synchronously during write operations.
+   */
+  void *wq;
+  /** Optional: offset of the memory region in bytes. */
+  uint32_t offset;
+  /**
+   * Optional: size of the memory region in bytes. A region from the offset
+   * to the end of the memory will be used when the size is left
+   * uninitialized.
+   */
+  uint32_t size;
+  /**
+   * Optional: size of the erase unit in bytes. The value is read from
+   * the memory interface when left uninitialized. All sectors in the memory
+   * region should have the same size.
+   */
+  uint32_t sector;
+  /**
+   * Optional: number of sectors reserved for garbage collection.
+   * Minimal and default value is two sectors.
+   */
+  uint16_t spare;
+  /**
+   * Optional: difference between maximal and minimal erase counts that
+   * triggers relocation of rarely modified data. Default value is 16.
+   */
+  uint16_t wear;
+};
+
+struct FtlSector;
+
+struct Ftl
+{
+  struct Interface base;
+
+  void (*callback)(void *);
+  void *callbackArgument;
+
+  /* Underlying memory interface */
+  struct Interface *flash;
+  /* Work queue for deferred tasks */
+  void *wq;
+
+  /* Mapping of logical blocks to physical slots */
+  uint16_t *map;
+  /* Runtime state of the memory sectors */
+  struct FtlSector *sectors;
+  /* Copy of the header of the active sector */
+  uint32_t *header;
+  /* Buffer for headers of the sectors being processed */
+  uint32_t *scratchHeader;
+  /* Buffer for a single block during relocations */
+  uint8_t *scratchBlock;
+
+  /* Current position in bytes */
+  uint64_t position;
+  /* Pending zero-copy transfer */
+  struct
+  {
+    uint8_t *buffer;
+    size_t length;
+    uint64_t position;
+    enum Result status;
+    bool write;
+  } transfer;
+
+  struct FtlStatistics statistics;
+
+  /* Offset of the memory region */
+  uint32_t offset;
+  /* Size of the erase unit */
+  uint32_t sectorSize;
+  /* Number of logical blocks */
+  uint32_t blocks;
+  /* Sequence number for the next allocated sector */
+  uint32_t sequence;
+  /* Minimal programming unit for mapping entries */
+  uint16_t pageSize;
+  /* Number of sectors in the memory region */
+  uint16_t sectorCount;
+  /* Number of free sectors */
+  uint16_t freeCount;
+  /* Number of sectors reserved for garbage collection */
+  uint16_t spareCount;
+  /* Erase count difference that triggers static wear leveling */
+  uint16_t wearLimit;
+  /* Index of the sector being written */
+  uint16_t active;
+  /* Next free slot in the active sector */
+  uint16_t slot;
+  /* Number of slots in each sector */
+  uint16_t slotCount;
+  /* Number of slots occupied by a sector header */
+  uint16_t headerSlots;
+  /* Number of enqueued or running garbage collection tasks */
+  uint8_t tasks;
+
+  /* Relocation of the blocks is in progress */
+  bool collecting;
+  /* Relocated blocks contain rarely modified data */
+  bool leveling;
+  /* Garbage collection task is enqueued */
+  bool pending;
+  /* Zero-copy mode is enabled */
+  bool zerocopy;
+};
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_GENERIC_FTL_H_ */
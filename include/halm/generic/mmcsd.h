@@ -13,6 +13,8 @@
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const MMCSD;
 
+struct Timer;
+
 enum MMCSDParameter
 {
   /** Size of the erase group in bytes. Parameter type is \a uint32_t. */
@@ -27,6 +29,14 @@ struct MMCSDConfig
 {
   /** Mandatory: hardware interface. */
   void *interface;
+  /**
+   * Optional: timer for non-blocking card initialization. When the timer
+   * is set, the card is identified in the background and the interface
+   * reports busy status until the identification is finished. Timer
+   * interrupts should have lower or equal priority than hardware
+   * interface interrupts.
+   */
+  void *timer;
   /** Optional: enable integrity checking for all transfers. */
   bool crc;
 };
@@ -40,6 +50,8 @@ struct MMCSD
 
   /* Hardware interface */
   struct Interface *interface;
+  /* Timer for delays during non-blocking initialization */
+  struct Timer *timer;
   /* Subclass of the hardware interface */
   uint8_t mode;
   /* Enable blocking mode */
@@ -61,6 +73,22 @@ struct MMCSD
     uint8_t cardType;
   } info;
 
+  struct
+  {
+    /* Temporary buffer for the Extended CSD register */
+    uint8_t *buffer;
+    /* Interface rate to be restored after initialization */
+    uint32_t rate;
+    /* Argument for operation condition commands */
+    uint32_t ocr;
+    /* Delay before the next step in microseconds */
+    uint32_t delay;
+    /* Number of retries left for the current step */
+    uint16_t retries;
+    /* Current initialization step */
+    uint8_t step;
+  } init;
+
   struct
   {
     /* Address of the user-space buffer */
@@ -15,6 +15,7 @@
 #define CMD0_IDLE_DELAY                 100000
 /*------------------CMD1------------------------------------------------------*/
 #define CMD1_RETRY_DELAY                10000
+#define CMD1_RETRIES                    100
 /*------------------CMD6------------------------------------------------------*/
 #define MMC_BUS_WIDTH_PATTERN           0x03B70000UL
 #define MMC_BUS_WIDTH_1BIT              0x00000000UL
@@ -29,6 +30,7 @@
 /*------------------CMD8------------------------------------------------------*/
 #define CMD8_CONDITION_PATTERN          0x000001AAUL
 #define CMD8_RETRY_DELAY                10000
+#define CMD8_RETRIES                    10
 /*------------------CMD59-----------------------------------------------------*/
 #define CMD59_CRC_ENABLED               0x00000001UL
 /*------------------ACMD6-----------------------------------------------------*/
@@ -36,6 +38,7 @@
 #define ACMD6_BUS_WIDTH_4BIT            0x00000002UL
 /*------------------ACMD41----------------------------------------------------*/
 #define ACMD41_RETRY_DELAY              10000
+#define ACMD41_RETRIES                  100
 /*------------------OCR register----------------------------------------------*/
 /* Voltage range from 2.7V to 3.6V */
 #define OCR_VOLTAGE_MASK_2V7_3V6        0x00FF8000UL
@@ -7,11 +7,39 @@
 #ifndef HALM_GENERIC_RAM_PROXY_H_
 #define HALM_GENERIC_RAM_PROXY_H_
 /*----------------------------------------------------------------------------*/
-#include <xcore/interface.h>
-#include <stdint.h>
+#include <halm/generic/flash.h>
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const RamProxy;
 
+struct Timer;
+
+/* RAM proxy parameters */
+enum RamProxyParameter
+{
+  /** Get statistics. Parameter type is \a struct RamProxyStatistics. */
+  IF_RAM_PROXY_STATISTICS = IF_FLASH_SYNC + 1,
+  /** Reset statistics. Parameter should be left uninitialized. */
+  IF_RAM_PROXY_RESET_STATISTICS
+};
+
+struct RamProxyStatistics
+{
+  /** Number of bytes read. */
+  uint64_t bytesRead;
+  /** Number of bytes written. */
+  uint64_t bytesWritten;
+  /** Total emulated busy time in microseconds. */
+  uint64_t busyTime;
+  /** Number of read operations. */
+  uint32_t reads;
+  /** Number of write operations. */
+  uint32_t writes;
+  /** Number of sector erase operations. */
+  uint32_t erases;
+  /** Number of rejected writes that tried to set programmed bits. */
+  uint32_t violations;
+};
+
 struct RamProxyConfig
 {
   /** Mandatory: memory arena. */
@@ -23,6 +51,36 @@ struct RamProxyConfig
    * 1 KiB granule size will be used.
    */
   size_t granule;
+  /**
+   * Optional: size of the program unit in bytes. When initialized, the size
+   * is reported as a flash page size and latencies are calculated per page.
+   */
+  size_t page;
+  /**
+   * Optional: timer for latency emulation. When the timer is set, operations
+   * are completed after the emulated latency: blocking calls wait for
+   * the timer and zero-copy calls are completed with the callback.
+   * Sector erase is always completed synchronously, its latency is only
+   * accounted in statistics.
+   */
+  void *timer;
+
+  struct
+  {
+    /** Optional: read time of a page in microseconds. */
+    uint32_t read;
+    /** Optional: program time of a page in microseconds. */
+    uint32_t program;
+    /** Optional: erase time of a sector in microseconds. */
+    uint32_t erase;
+  } latency;
+
+  /**
+   * Optional: enable flash memory emulation. Erased memory is filled with
+   * 0xFF and writes that try to change bits from 0 to 1 are rejected.
+   * Erased memory is filled with zeros when emulation is disabled.
+   */
+  bool flash;
 };
 
 struct RamProxy
@@ -32,10 +90,32 @@ struct RamProxy
   void (*callback)(void *);
   void *callbackArgument;
 
+  /* Timer for latency emulation */
+  struct Timer *timer;
+
   uint8_t *arena;
   size_t capacity;
   size_t granule;
+  size_t page;
   size_t position;
+
+  struct RamProxyStatistics statistics;
+
+  struct
+  {
+    uint32_t read;
+    uint32_t program;
+    uint32_t erase;
+  } latency;
+
+  /* Status of the last operation */
+  enum Result status;
+  /* Emulated operation is in progress */
+  bool busy;
+  /* Blocking mode is enabled */
+  bool blocking;
+  /* Flash memory emulation is enabled */
+  bool flash;
 };
 /*----------------------------------------------------------------------------*/
 #endif /* HALM_GENERIC_RAM_PROXY_H_ */
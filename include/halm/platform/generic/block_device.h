@@ -0,0 +1,44 @@
+/*
+ * halm/platform/generic/block_device.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_PLATFORM_GENERIC_BLOCK_DEVICE_H_
+#define HALM_PLATFORM_GENERIC_BLOCK_DEVICE_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/interface.h>
+#include <stdbool.h>
+#include <stddef.h>
+/*----------------------------------------------------------------------------*/
+extern const struct InterfaceClass * const BlockDevice;
+
+/*
+ * Block device handles the \a IF_FLASH_SYNC parameter to flush written data
+ * to the underlying storage, other flash parameters are not supported.
+ */
+
+struct BlockDeviceConfig
+{
+  /** Mandatory: path to the image file or to the block device. */
+  const char *path;
+  /**
+   * Optional: maximal number of requests submitted concurrently. Each
+   * transfer is split into several requests of equal size. Four requests
+   * are used by default.
+   */
+  size_t depth;
+  /**
+   * Optional: alignment of positions and lengths in bytes. Default value
+   * is 512 bytes. When direct access is enabled, the value should be equal
+   * to or larger than the logical block size of the underlying device.
+   */
+  size_t alignment;
+  /**
+   * Optional: bypass the page cache of the operating system. Buffers,
+   * positions and lengths should be aligned to the alignment value.
+   */
+  bool direct;
+};
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_PLATFORM_GENERIC_BLOCK_DEVICE_H_ */
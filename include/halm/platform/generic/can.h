@@ -0,0 +1,51 @@
+/*
+ * halm/platform/generic/can.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_PLATFORM_GENERIC_CAN_H_
+#define HALM_PLATFORM_GENERIC_CAN_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/interface.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+extern const struct InterfaceClass * const Can;
+
+struct CanConfig
+{
+  /**
+   * Optional: timer for a message time stamp generation. Reception time
+   * provided by the kernel in microseconds is used when both timers
+   * are not set.
+   */
+  void *timer;
+  /**
+   * Optional: 64-bit timer for a message time stamp generation.
+   * It takes precedence over the \a timer field.
+   */
+  void *timer64;
+  /** Mandatory: name of the network interface, for example "vcan0". */
+  const char *device;
+  /**
+   * Optional: baud rate. Bit timing of the network interface is configured
+   * by the operating system, the value is reported back to the user only.
+   */
+  uint32_t rate;
+  /** Optional: number of filtering rules. */
+  size_t filters;
+  /** Mandatory: input queue size. */
+  size_t rxBuffers;
+  /** Mandatory: output queue size. */
+  size_t txBuffers;
+  /**
+   * Optional: enable flexible data-rate frames when the network interface
+   * supports them. Read buffers should be able to hold a whole
+   * \a CANFlexibleDataMessage, larger frames are dropped otherwise.
+   */
+  bool fd;
+};
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_PLATFORM_GENERIC_CAN_H_ */
@@ -7,6 +7,7 @@
 #ifndef HALM_PLATFORM_GENERIC_CONSOLE_H_
 #define HALM_PLATFORM_GENERIC_CONSOLE_H_
 /*----------------------------------------------------------------------------*/
+#include <halm/platform/generic/stream_statistics.h>
 #include <xcore/interface.h>
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const Console;
@@ -7,8 +7,37 @@
 #ifndef HALM_PLATFORM_GENERIC_MMF_H_
 #define HALM_PLATFORM_GENERIC_MMF_H_
 /*----------------------------------------------------------------------------*/
-#include <xcore/interface.h>
+#include <halm/generic/flash.h>
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const MemoryMappedFile;
+
+/* Memory mapped file parameters */
+enum MemoryMappedFileParameter
+{
+  /**
+   * Schedule writeback of modified pages without waiting for completion.
+   * Parameter should be left uninitialized.
+   */
+  IF_MMF_FLUSH = IF_FLASH_SYNC + 1,
+  /**
+   * Set the period of background writeback in milliseconds. Zero value
+   * disables periodic writeback. Parameter type is \a uint32_t.
+   */
+  IF_MMF_FLUSH_PERIOD,
+  /** Set access pattern hint. Parameter type is \a enum MmfAdvice. */
+  IF_MMF_ADVICE
+};
+
+enum [[gnu::packed]] MmfAdvice
+{
+  /** Default read-ahead and caching behavior. */
+  MMF_ADVICE_NORMAL,
+  /** Pages will be accessed sequentially, aggressive read-ahead. */
+  MMF_ADVICE_SEQUENTIAL,
+  /** Pages will be accessed in random order, read-ahead is disabled. */
+  MMF_ADVICE_RANDOM,
+  /** Back the mapping with huge pages when supported by the system. */
+  MMF_ADVICE_HUGEPAGE
+};
 /*----------------------------------------------------------------------------*/
 #endif /* HALM_PLATFORM_GENERIC_MMF_H_ */
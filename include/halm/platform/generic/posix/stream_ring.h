@@ -0,0 +1,251 @@
+/*
+ * halm/platform/generic/posix/stream_ring.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_PLATFORM_GENERIC_POSIX_STREAM_RING_H_
+#define HALM_PLATFORM_GENERIC_POSIX_STREAM_RING_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/helpers.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+/*----------------------------------------------------------------------------*/
+/*
+ * Lock-free byte ring for a single producer thread and a single consumer
+ * thread. Positions are free-running counters, capacity is a power of two.
+ */
+struct StreamRing
+{
+  uint8_t *data;
+  size_t mask;
+
+  /* Updated by the producer only */
+  atomic_size_t head;
+  /* Updated by the consumer only */
+  atomic_size_t tail;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+static inline bool streamRingInit(struct StreamRing *ring, size_t capacity)
+{
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+  ring->data = malloc(capacity);
+  if (ring->data == NULL)
+    return false;
+
+  ring->mask = capacity - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  return true;
+}
+
+static inline void streamRingDeinit(struct StreamRing *ring)
+{
+  free(ring->data);
+}
+
+static inline size_t streamRingCapacity(const struct StreamRing *ring)
+{
+  return ring->mask + 1;
+}
+
+static inline size_t streamRingSize(struct StreamRing *ring)
+{
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  return head - tail;
+}
+
+static inline size_t streamRingSpace(struct StreamRing *ring)
+{
+  return streamRingCapacity(ring) - streamRingSize(ring);
+}
+
+/* Producer functions */
+
+/**
+ * Get free regions of the ring for a scatter read.
+ * @param ring Pointer to a ring.
+ * @param vectors Array of two vectors to be filled.
+ * @return Number of filled vectors, zero when the ring is full.
+ */
+static inline unsigned int streamRingPushVectors(struct StreamRing *ring,
+    struct iovec *vectors)
+{
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  const size_t space = streamRingCapacity(ring) - (head - tail);
+
+  if (!space)
+    return 0;
+
+  const size_t offset = head & ring->mask;
+  const size_t first = MIN(space, streamRingCapacity(ring) - offset);
+
+  vectors[0].iov_base = ring->data + offset;
+  vectors[0].iov_len = first;
+
+  if (first == space)
+    return 1;
+
+  vectors[1].iov_base = ring->data;
+  vectors[1].iov_len = space - first;
+  return 2;
+}
+
+/**
+ * Publish data written into the regions returned by streamRingPushVectors.
+ * @param ring Pointer to a ring.
+ * @param length Number of bytes written.
+ */
+static inline void streamRingPushCommit(struct StreamRing *ring,
+    size_t length)
+{
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + length, memory_order_release);
+}
+
+static inline size_t streamRingPush(struct StreamRing *ring,
+    const void *buffer, size_t length)
+{
+  struct iovec vectors[2];
+  const unsigned int count = streamRingPushVectors(ring, vectors);
+  const uint8_t *position = buffer;
+  size_t pushed = 0;
+
+  for (unsigned int index = 0; index < count && pushed < length; ++index)
+  {
+    const size_t chunk = MIN(length - pushed, vectors[index].iov_len);
+
+    memcpy(vectors[index].iov_base, position + pushed, chunk);
+    pushed += chunk;
+  }
+
+  streamRingPushCommit(ring, pushed);
+  return pushed;
+}
+
+/**
+ * Read all available data from a non-blocking descriptor into the ring.
+ * Data that does not fit into the ring is read and dropped to avoid
+ * spinning in the event loop.
+ * @param ring Pointer to a ring.
+ * @param descriptor File descriptor to read from.
+ * @param dropped Pointer to a variable for the number of dropped bytes.
+ * @return Total number of bytes read from the descriptor.
+ */
+static inline size_t streamRingPushFrom(struct StreamRing *ring,
+    int descriptor, size_t *dropped)
+{
+  size_t received = 0;
+
+  *dropped = 0;
+
+  while (1)
+  {
+    struct iovec vectors[2];
+    const unsigned int count = streamRingPushVectors(ring, vectors);
+    ssize_t length;
+
+    if (count)
+    {
+      /* Fill free regions of the ring directly */
+      length = readv(descriptor, vectors, (int)count);
+      if (length <= 0)
+        break;
+
+      streamRingPushCommit(ring, (size_t)length);
+    }
+    else
+    {
+      uint8_t buffer[64];
+
+      /* Ring is full, drop data */
+      length = read(descriptor, buffer, sizeof(buffer));
+      if (length <= 0)
+        break;
+
+      *dropped += (size_t)length;
+    }
+
+    received += (size_t)length;
+  }
+
+  return received;
+}
+
+/* Consumer functions */
+
+/**
+ * Get occupied regions of the ring for a gather write.
+ * @param ring Pointer to a ring.
+ * @param vectors Array of two vectors to be filled.
+ * @return Number of filled vectors, zero when the ring is empty.
+ */
+static inline unsigned int streamRingPopVectors(struct StreamRing *ring,
+    struct iovec *vectors)
+{
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  const size_t size = head - tail;
+
+  if (!size)
+    return 0;
+
+  const size_t offset = tail & ring->mask;
+  const size_t first = MIN(size, streamRingCapacity(ring) - offset);
+
+  vectors[0].iov_base = ring->data + offset;
+  vectors[0].iov_len = first;
+
+  if (first == size)
+    return 1;
+
+  vectors[1].iov_base = ring->data;
+  vectors[1].iov_len = size - first;
+  return 2;
+}
+
+/**
+ * Release data read from the regions returned by streamRingPopVectors.
+ * @param ring Pointer to a ring.
+ * @param length Number of bytes read.
+ */
+static inline void streamRingPopCommit(struct StreamRing *ring, size_t length)
+{
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + length, memory_order_release);
+}
+
+static inline size_t streamRingPop(struct StreamRing *ring, void *buffer,
+    size_t length)
+{
+  struct iovec vectors[2];
+  const unsigned int count = streamRingPopVectors(ring, vectors);
+  uint8_t *position = buffer;
+  size_t popped = 0;
+
+  for (unsigned int index = 0; index < count && popped < length; ++index)
+  {
+    const size_t chunk = MIN(length - popped, vectors[index].iov_len);
+
+    memcpy(position + popped, vectors[index].iov_base, chunk);
+    popped += chunk;
+  }
+
+  streamRingPopCommit(ring, popped);
+  return popped;
+}
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_PLATFORM_GENERIC_POSIX_STREAM_RING_H_ */
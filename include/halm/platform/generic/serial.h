@@ -7,8 +7,9 @@
 #ifndef HALM_PLATFORM_GENERIC_SERIAL_H_
 #define HALM_PLATFORM_GENERIC_SERIAL_H_
 /*----------------------------------------------------------------------------*/
-#include <halm/generic/serial.h>
+#include <halm/platform/generic/stream_statistics.h>
 #include <xcore/interface.h>
+#include <stddef.h>
 #include <stdint.h>
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const Serial;
@@ -19,6 +20,12 @@ struct SerialConfig
   const char *device;
   /** Mandatory: baud rate. */
   uint32_t rate;
+  /**
+   * Optional: size of the output queue in bytes, the value should be
+   * a power of two. Data is queued and transmitted from the event loop
+   * when the queue is enabled, otherwise writes are performed directly.
+   */
+  size_t txLength;
   /** Optional: parity bit setting. */
   enum SerialParity parity;
 };
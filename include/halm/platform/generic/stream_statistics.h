@@ -0,0 +1,29 @@
+/*
+ * halm/platform/generic/stream_statistics.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_PLATFORM_GENERIC_STREAM_STATISTICS_H_
+#define HALM_PLATFORM_GENERIC_STREAM_STATISTICS_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/generic/serial.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+enum StreamStatisticsParameter
+{
+  /** Get transfer statistics. Parameter type is \a struct StreamStatistics. */
+  IF_STREAM_STATISTICS = IF_SERIAL_PARAMETER_END
+};
+
+struct StreamStatistics
+{
+  /** Number of bytes received. */
+  uint64_t rxBytes;
+  /** Number of received bytes dropped due to an input queue overflow. */
+  uint64_t rxOverruns;
+  /** Number of bytes transmitted. */
+  uint64_t txBytes;
+};
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_PLATFORM_GENERIC_STREAM_STATISTICS_H_ */
@@ -8,6 +8,8 @@
 #define HALM_PLATFORM_GENERIC_UDP_H_
 /*----------------------------------------------------------------------------*/
 #include <xcore/interface.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const Udp;
@@ -17,6 +19,27 @@ struct UdpConfig
   const char *clientAddress;
   uint16_t clientPort;
   uint16_t serverPort;
+  /**
+   * Optional: size of the input queue in bytes. Reception is suspended
+   * while the queue has no space for a datagram of the maximum size,
+   * pending datagrams are left in the socket buffer. The value should be
+   * at least 1538 bytes, default value is 2048 bytes.
+   */
+  size_t rxLength;
+  /**
+   * Optional: size of the output queue in bytes. Data is queued and
+   * transmitted from the event loop with batched system calls when the
+   * queue is enabled, otherwise writes are performed directly. In packet
+   * mode the value should be at least 1538 bytes and queued datagrams
+   * are limited to 1536 bytes.
+   */
+  size_t txLength;
+  /**
+   * Optional: preserve datagram boundaries. Each read returns a single
+   * datagram and each write sends a single datagram. Received datagrams
+   * longer than 1536 bytes are dropped.
+   */
+  bool packets;
 };
 /*----------------------------------------------------------------------------*/
 #endif /* HALM_PLATFORM_GENERIC_UDP_H_ */
@@ -0,0 +1,116 @@
+/*
+ * halm/platform/generic/usb_device.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+/**
+ * @file
+ * Virtual USB device controller. Bus traffic is generated by a host model
+ * running in the same process: host functions play the role of the
+ * interrupt handler and invoke request callbacks in the calling thread.
+ */
+
+#ifndef HALM_PLATFORM_GENERIC_USB_DEVICE_H_
+#define HALM_PLATFORM_GENERIC_USB_DEVICE_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/usb/usb.h>
+#include <stddef.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+extern const struct UsbDeviceClass * const UsbDevice;
+
+struct UsbDeviceConfig
+{
+  /** Mandatory: Vendor Identifier. */
+  uint16_t vid;
+  /** Mandatory: Product Identifier. */
+  uint16_t pid;
+  /** Optional: enable High Speed mode, Full Speed is used by default. */
+  bool hs;
+};
+/*----------------------------------------------------------------------------*/
+struct UsbEndpointConfig
+{
+  /** Mandatory: hardware device. */
+  struct UsbDevice *parent;
+  /** Mandatory: logical address of the endpoint. */
+  uint8_t address;
+};
+/*----------------------------------------------------------------------------*/
+struct UsbEndpointStatistics
+{
+  /** Number of payload bytes transferred. */
+  uint64_t bytes;
+  /** Number of packets transferred, including zero-length packets. */
+  uint64_t packets;
+  /** Number of completed requests. */
+  uint64_t requests;
+  /** Sum of request completion latencies in nanoseconds. */
+  uint64_t latency;
+  /** Maximum request completion latency in nanoseconds. */
+  uint64_t maxLatency;
+  /** Time from the first submission to the last completion in nanoseconds. */
+  uint64_t elapsed;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+/**
+ * Perform a control transfer on the default pipe.
+ * @param device Pointer to an UsbDevice object.
+ * @param packet Setup packet with fields in host byte order.
+ * @param data Payload for OUT transfers or a response buffer of
+ * @b packet->length bytes for IN transfers.
+ * @param length Pointer to a response length for IN transfers, may be
+ * a null pointer for OUT transfers.
+ * @return @b E_OK on success, @b E_INVALID when the request is stalled,
+ * @b E_BUSY when the device does not respond or @b E_IDLE when the device
+ * is disconnected or suspended.
+ */
+enum Result usbDevHostControl(struct UsbDevice *, const struct UsbSetupPacket *,
+    void *, uint16_t *);
+
+/**
+ * Read one transfer from an IN endpoint. The transfer ends with a short
+ * packet, when the buffer is full or when the endpoint has no more data.
+ * @param device Pointer to an UsbDevice object.
+ * @param address Endpoint address, direction bit is set automatically.
+ * @param buffer Pointer to a buffer for the received data.
+ * @param capacity Size of the buffer.
+ * @param length Pointer to a number of received bytes.
+ * @return @b E_OK when at least one packet was transferred, @b E_EMPTY
+ * when no requests are queued, @b E_INVALID when the endpoint is stalled
+ * or @b E_IDLE when the endpoint is disabled.
+ */
+enum Result usbDevHostRead(struct UsbDevice *, uint8_t, void *, size_t,
+    size_t *);
+
+/**
+ * Write one transfer to an OUT endpoint. Data is split into packets,
+ * the zero-length packet is sent only when the length is zero.
+ * @param device Pointer to an UsbDevice object.
+ * @param address Endpoint address.
+ * @param buffer Pointer to the data.
+ * @param length Number of bytes to be sent.
+ * @param written Pointer to a number of accepted bytes.
+ * @return @b E_OK when all data was accepted, @b E_EMPTY when the endpoint
+ * ran out of requests, @b E_VALUE when a packet overflowed the request,
+ * @b E_INVALID when the endpoint is stalled or @b E_IDLE when the endpoint
+ * is disabled.
+ */
+enum Result usbDevHostWrite(struct UsbDevice *, uint8_t, const void *, size_t,
+    size_t *);
+
+void usbDevHostFrame(struct UsbDevice *);
+enum Result usbDevHostReset(struct UsbDevice *);
+void usbDevHostResume(struct UsbDevice *);
+void usbDevHostSuspend(struct UsbDevice *);
+
+void usbDevHostGetStatistics(const struct UsbDevice *, uint8_t,
+    struct UsbEndpointStatistics *);
+void usbDevHostResetStatistics(struct UsbDevice *);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_PLATFORM_GENERIC_USB_DEVICE_H_ */
@@ -17,6 +17,12 @@ struct CanConfig
 {
   /** Optional: timer for a message time stamp generation. */
   void *timer;
+  /**
+   * Optional: 64-bit timer for a message time stamp generation,
+   * for example a LifetimeTimer64 object. It takes precedence over
+   * the \a timer field.
+   */
+  void *timer64;
   /** Mandatory: baud rate. */
   uint32_t rate;
   /** Optional: number of filtering rules. */
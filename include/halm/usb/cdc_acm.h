@@ -41,10 +41,18 @@ struct CdcAcmConfig
   /**
    * Optional: memory region for receive and transmit buffers.
    * When the pointer is left uninitialized, buffers will be allocated on
-   * the heap. Pointer address should be aligned. Buffers have fixed size of
-   * 64 bytes for full-speed devices and 512 bytes for high-speed devices.
+   * the heap. Pointer address should be aligned. Each buffer has a size
+   * of the \a bufferSize field.
    */
   void *arena;
+  /**
+   * Optional: size of each receive and transmit buffer. Size should be
+   * a multiple of the maximum packet size: 64 bytes for full-speed devices
+   * and 512 bytes for high-speed devices. The value is limited to 16384 bytes
+   * and defaults to one packet. Buffers larger than one packet are supported
+   * only by controllers with multi-packet transfers.
+   */
+  size_t bufferSize;
   /** Mandatory: number of receive buffers. */
   size_t rxBuffers;
   /** Mandatory: number of transmit buffers. */
@@ -0,0 +1,84 @@
+/*
+ * halm/usb/cdc_ncm.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_USB_CDC_NCM_H_
+#define HALM_USB_CDC_NCM_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/interface.h>
+#include <xcore/stream.h>
+#include <stdbool.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+enum CdcNcmParameter
+{
+  /**
+   * Retrieve extended information about current interface status.
+   * Interface status is a bitmask, possible values are defined in the
+   * \a enum \a CdcNcmFlags. Parameter type is \a uint8_t.
+   */
+  IF_CDC_NCM_STATUS = IF_PARAMETER_END
+};
+
+enum CdcNcmFlags
+{
+  CDC_NCM_CONNECTED = 0x01,
+  CDC_NCM_SUSPENDED = 0x02
+};
+/*----------------------------------------------------------------------------*/
+extern const struct InterfaceClass * const CdcNcm;
+
+struct CdcNcm;
+
+struct CdcNcmConfig
+{
+  /** Mandatory: USB device. */
+  void *device;
+
+  /**
+   * Mandatory: media access control address of the network interface
+   * on the host side. Address should differ from the address used by
+   * the network stack of the device.
+   */
+  uint64_t address;
+  /**
+   * Optional: maximum size of the transfer block. Size should be
+   * a multiple of 512 bytes and should be in the range from 2048
+   * to 65535 bytes. Default size is 2048 bytes.
+   */
+  size_t ntbSize;
+  /** Mandatory: number of receive transfer blocks. */
+  size_t rxBuffers;
+  /**
+   * Mandatory: number of transmit transfer blocks. One block is sent by
+   * the endpoint, one is filled with datagrams and the rest hold completed
+   * blocks waiting for the endpoint.
+   */
+  size_t txBuffers;
+  /** Mandatory: number of pending receive stream requests. */
+  size_t rxSize;
+
+  struct
+  {
+    /** Mandatory: identifier of the notification endpoint. */
+    uint8_t interrupt;
+    /** Mandatory: identifier of the input data endpoint. */
+    uint8_t rx;
+    /** Mandatory: identifier of the output data endpoint. */
+    uint8_t tx;
+  } endpoints;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+struct Stream *cdcNcmGetInput(struct CdcNcm *);
+struct Stream *cdcNcmGetOutput(struct CdcNcm *);
+
+void cdcNcmOnEvent(struct CdcNcm *, unsigned int);
+void cdcNcmOnInterfaceChanged(struct CdcNcm *, bool);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_USB_CDC_NCM_H_ */
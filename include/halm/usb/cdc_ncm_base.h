@@ -0,0 +1,48 @@
+/*
+ * halm/usb/cdc_ncm_base.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_USB_CDC_NCM_BASE_H_
+#define HALM_USB_CDC_NCM_BASE_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/usb/usb.h>
+/*----------------------------------------------------------------------------*/
+extern const struct UsbDriverClass * const CdcNcmBase;
+
+struct CdcNcm;
+struct CdcNcmBase;
+
+struct CdcNcmBaseConfig
+{
+  /** Mandatory: pointer to an upper half of the driver. */
+  struct CdcNcm *owner;
+  /** Mandatory: USB device. */
+  void *device;
+
+  /** Mandatory: media access control address of the host interface. */
+  uint64_t address;
+  /** Mandatory: maximum size of the transfer block. */
+  uint16_t ntbSize;
+
+  struct
+  {
+    /** Mandatory: identifier of the notification endpoint. */
+    uint8_t interrupt;
+    /** Mandatory: identifier of the input data endpoint. */
+    uint8_t rx;
+    /** Mandatory: identifier of the output data endpoint. */
+    uint8_t tx;
+  } endpoints;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+uint8_t cdcNcmBaseGetInterfaceIndex(const struct CdcNcmBase *);
+uint16_t cdcNcmBaseGetNtbInputSize(const struct CdcNcmBase *);
+enum UsbSpeed cdcNcmBaseGetUsbSpeed(const struct CdcNcmBase *);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_USB_CDC_NCM_BASE_H_ */
@@ -0,0 +1,134 @@
+/*
+ * halm/usb/cdc_ncm_defs.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_USB_CDC_NCM_DEFS_H_
+#define HALM_USB_CDC_NCM_DEFS_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/usb/cdc_acm_defs.h>
+/*----------------------------------------------------------------------------*/
+#define CDC_NCM_SUBCLASS                0x0D
+#define CDC_NCM_DATA_PROTOCOL           0x01
+
+/* Maximum size of an Ethernet frame without the frame check sequence */
+#define CDC_NCM_MAX_SEGMENT_SIZE        1514
+/* Minimal size of the NTB, defined by the specification */
+#define CDC_NCM_MIN_NTB_SIZE            2048
+
+/* Alignment of datagrams and datagram pointer tables */
+#define CDC_NCM_NDP_ALIGNMENT           4
+#define CDC_NCM_NDP_DIVISOR             4
+
+#define CDC_NCM_NTB16_FORMAT            BIT(0)
+
+#define CDC_NCM_NTH16_SIGNATURE         0x484D434EUL /* NCMH */
+#define CDC_NCM_NDP16_NOCRC_SIGNATURE   0x304D434EUL /* NCM0 */
+#define CDC_NCM_NDP16_CRC_SIGNATURE     0x314D434EUL /* NCM1 */
+/*----------------------------------------------------------------------------*/
+/* Class-Specific Request Codes */
+enum
+{
+  CDC_SET_ETHERNET_MULTICAST_FILTERS  = 0x40,
+  CDC_SET_ETHERNET_PM_FILTER          = 0x41,
+  CDC_GET_ETHERNET_PM_FILTER          = 0x42,
+  CDC_SET_ETHERNET_PACKET_FILTER      = 0x43,
+  CDC_GET_ETHERNET_STATISTIC          = 0x44,
+  CDC_GET_NTB_PARAMETERS              = 0x80,
+  CDC_GET_NET_ADDRESS                 = 0x81,
+  CDC_SET_NET_ADDRESS                 = 0x82,
+  CDC_GET_NTB_FORMAT                  = 0x83,
+  CDC_SET_NTB_FORMAT                  = 0x84,
+  CDC_GET_NTB_INPUT_SIZE              = 0x85,
+  CDC_SET_NTB_INPUT_SIZE              = 0x86,
+  CDC_GET_MAX_DATAGRAM_SIZE           = 0x87,
+  CDC_SET_MAX_DATAGRAM_SIZE           = 0x88,
+  CDC_GET_CRC_MODE                    = 0x89,
+  CDC_SET_CRC_MODE                    = 0x8A
+};
+
+enum
+{
+  CDC_SUBTYPE_ETHERNET                = 0x0F,
+  CDC_SUBTYPE_NCM                     = 0x1A
+};
+/*----------------------------------------------------------------------------*/
+struct [[gnu::packed]] CdcEthernetDescriptor
+{
+  uint8_t length;
+  uint8_t descriptorType;
+  uint8_t descriptorSubType;
+  uint8_t macAddress;
+  uint32_t ethernetStatistics;
+  uint16_t maxSegmentSize;
+  uint16_t numberMCFilters;
+  uint8_t numberPowerFilters;
+};
+
+struct [[gnu::packed]] CdcNcmDescriptor
+{
+  uint8_t length;
+  uint8_t descriptorType;
+  uint8_t descriptorSubType;
+  uint16_t ncmVersion;
+  uint8_t networkCapabilities;
+};
+/*----------------------------------------------------------------------------*/
+struct [[gnu::packed]] CdcNotification
+{
+  uint8_t requestType;
+  uint8_t request;
+  uint16_t value;
+  uint16_t index;
+  uint16_t length;
+};
+
+struct [[gnu::packed]] CdcSpeedChange
+{
+  struct CdcNotification header;
+  uint32_t downlinkBitRate;
+  uint32_t uplinkBitRate;
+};
+
+struct [[gnu::packed]] CdcNtbParameters
+{
+  uint16_t length;
+  uint16_t ntbFormatsSupported;
+  uint32_t ntbInMaxSize;
+  uint16_t ndpInDivisor;
+  uint16_t ndpInPayloadRemainder;
+  uint16_t ndpInAlignment;
+  uint16_t reserved;
+  uint32_t ntbOutMaxSize;
+  uint16_t ndpOutDivisor;
+  uint16_t ndpOutPayloadRemainder;
+  uint16_t ndpOutAlignment;
+  uint16_t ntbOutMaxDatagrams;
+};
+/*----------------------------------------------------------------------------*/
+/* NCM Transfer Header for 16-bit NTB */
+struct [[gnu::packed]] CdcNth16
+{
+  uint32_t signature;
+  uint16_t headerLength;
+  uint16_t sequence;
+  uint16_t blockLength;
+  uint16_t ndpIndex;
+};
+
+/* NCM Datagram Pointer Table for 16-bit NTB */
+struct [[gnu::packed]] CdcNdp16
+{
+  uint32_t signature;
+  uint16_t length;
+  uint16_t nextNdpIndex;
+};
+
+struct [[gnu::packed]] CdcNdp16Entry
+{
+  uint16_t index;
+  uint16_t length;
+};
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_USB_CDC_NCM_DEFS_H_ */
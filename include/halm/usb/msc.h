@@ -15,6 +15,43 @@ extern const struct UsbDriverClass * const Msc;
 struct Msc;
 struct MscQueryHandler;
 
+enum MscDiscard
+{
+  /** Unmap command is not supported. */
+  MSC_DISCARD_NONE,
+  /** Sectors are erased with the generic flash interface. */
+  MSC_DISCARD_FLASH,
+  /** Erase groups are erased with the memory card interface. */
+  MSC_DISCARD_MMCSD
+};
+
+struct MscUnitConfig
+{
+  /** Mandatory: storage interface. */
+  void *interface;
+  /**
+   * Optional: pointer to the beginning of the storage content. Read data
+   * is sent directly from the memory, therefore the content should always
+   * be up to date: storages with write-back caches or deferred writes
+   * should leave the pointer uninitialized.
+   */
+  const void *memory;
+  /**
+   * Optional: work queue for erase operations of the Unmap command.
+   * Erasing may take a long time, therefore it is never performed
+   * in the interrupt context. Unmap command is not supported when
+   * the work queue is not set.
+   */
+  void *wq;
+  /**
+   * Optional: method used to discard unmapped blocks. Unmap command is
+   * supported only when the method matches the class of the storage
+   * interface. Good status is returned to the host after all erase
+   * operations are completed.
+   */
+  enum MscDiscard discard;
+};
+
 struct MscConfig
 {
   /** Mandatory: USB device. */
@@ -28,6 +65,33 @@ struct MscConfig
   void *arena;
   /** Mandatory: buffer size. */
   size_t size;
+  /**
+   * Optional: number of queries for pipelined data transfers. The buffer
+   * is split into equal parts, storage and USB transfers are performed
+   * on different parts simultaneously. Two queries are used by default.
+   */
+  size_t depth;
+  /**
+   * Optional: number of logical units. Single logical unit will be
+   * configured when the value is left uninitialized.
+   */
+  uint8_t luns;
+
+  struct
+  {
+    /**
+     * Optional: size of the logical block in bytes. Power of two values
+     * from 512 to 4096 are allowed, 512-byte blocks are used by default.
+     */
+    uint16_t logical;
+    /**
+     * Optional: size of the physical block in bytes. The value should be
+     * a power of two multiple of the logical block size, for example
+     * 4096-byte physical blocks with 512-byte logical blocks. Physical
+     * block size is equal to the logical block size by default.
+     */
+    uint16_t physical;
+  } block;
 
   struct
   {
@@ -41,6 +105,9 @@ struct MscConfig
 BEGIN_DECLS
 
 enum Result mscAttachUnit(struct Msc *, uint8_t, void *);
+enum Result mscAttachMappedUnit(struct Msc *, uint8_t, void *, const void *);
+enum Result mscAttachConfiguredUnit(struct Msc *, uint8_t,
+    const struct MscUnitConfig *);
 void mscDetachUnit(struct Msc *, uint8_t);
 bool mscIsUnitFailed(const struct Msc *, uint8_t);
 bool mscIsUnitLocked(const struct Msc *, uint8_t);
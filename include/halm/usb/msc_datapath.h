@@ -12,15 +12,18 @@
 #include <stddef.h>
 #include <stdint.h>
 /*----------------------------------------------------------------------------*/
-struct Msc;
 struct MscQueryHandler;
+struct MscUnit;
+struct UsbEndpoint;
 /*----------------------------------------------------------------------------*/
 BEGIN_DECLS
 
-enum Result datapathInit(struct MscQueryHandler *, struct Msc *,
-    void (*)(struct Msc *));
+enum Result datapathInit(struct MscQueryHandler *, struct UsbEndpoint *,
+    struct UsbEndpoint *, void (*)(void *), void *, size_t);
 void datapathDeinit(struct MscQueryHandler *);
 enum Result datapathStatus(const struct MscQueryHandler *);
+void datapathSetPacketSize(struct MscQueryHandler *, uint16_t);
+bool datapathAbort(struct MscQueryHandler *);
 
 bool datapathReceiveControl(struct MscQueryHandler *, void *, size_t);
 bool datapathSendResponseAndStatus(struct MscQueryHandler *,
@@ -29,10 +32,12 @@ bool datapathSendResponse(struct MscQueryHandler *,
     const void *, size_t);
 bool datapathSendStatus(struct MscQueryHandler *,
     uint32_t, uint32_t, uint8_t);
-bool datapathReceiveAndWriteData(struct MscQueryHandler *, void *, size_t,
-    uint64_t, size_t);
-bool datapathReadAndSendData(struct MscQueryHandler *, void *, size_t,
-    uint64_t, size_t);
+bool datapathReceiveAndWriteData(struct MscQueryHandler *, struct MscUnit *,
+    void *, size_t, uint64_t, size_t);
+bool datapathReadAndSendData(struct MscQueryHandler *, struct MscUnit *,
+    void *, size_t, uint64_t, size_t);
+bool datapathDiscardBlocks(struct MscQueryHandler *, struct MscUnit *,
+    const void *, size_t);
 
 END_DECLS
 /*----------------------------------------------------------------------------*/
@@ -16,7 +16,18 @@
 #define MSC_DATA_EP_SIZE_HS 512
 
 #define MSC_BLOCK_SIZE      512
+#define MSC_MAX_BLOCK_SIZE  4096
+#define MSC_MAX_LUN_COUNT   16
+#define MSC_MIN_QUERY_COUNT 2
 #define DATA_QUEUE_SIZE     (MSC_BLOCK_SIZE / MSC_DATA_EP_SIZE + 1)
+
+/*
+ * Maximum number of block descriptors in an Unmap command, parameter list
+ * should fit into a single full-speed packet.
+ */
+#define MSC_UNMAP_DESCRIPTOR_COUNT  ((MSC_DATA_EP_SIZE - 8) / 16)
+/* Maximum number of erase units discarded by a single Unmap command */
+#define MSC_UNMAP_GRANULE_COUNT     16
 /*----------------------------------------------------------------------------*/
 enum
 {
@@ -35,12 +46,33 @@ enum
   SCSI_READ10                 = 0x28,
   SCSI_WRITE10                = 0x2A,
   SCSI_VERIFY10               = 0x2F,
+  SCSI_SYNCHRONIZE_CACHE10    = 0x35,
+  SCSI_UNMAP                  = 0x42,
   SCSI_MODE_SELECT10          = 0x55,
   SCSI_MODE_SENSE10           = 0x5A,
+  SCSI_READ16                 = 0x88,
+  SCSI_WRITE16                = 0x8A,
+  SCSI_SYNCHRONIZE_CACHE16    = 0x91,
+  SCSI_SERVICE_ACTION_IN16    = 0x9E,
   SCSI_READ12                 = 0xA8,
   SCSI_WRITE12                = 0xAA
 };
 
+/* Service actions of the Service Action In (16) command */
+enum
+{
+  SCSI_SAI_READ_CAPACITY16    = 0x10
+};
+
+/* Vital Product Data pages */
+enum
+{
+  SCSI_VPD_SUPPORTED_PAGES    = 0x00,
+  SCSI_VPD_BLOCK_LIMITS       = 0xB0,
+  SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS = 0xB1,
+  SCSI_VPD_LOGICAL_BLOCK_PROVISIONING   = 0xB2
+};
+
 /* Sense Key */
 enum
 {
@@ -72,10 +104,12 @@ enum
 #define SCSI_ASC_ME_READERROR           0x1100
 
 /* Sense Key 0x05 */
+#define SCSI_ASC_IR_PARAMETERLENGTH     0x1A00
 #define SCSI_ASC_IR_INVALIDCOMMAND      0x2000
 #define SCSI_ASC_IR_LBAOUTOFRANGE       0x2100
 #define SCSI_ASC_IR_INVALIDFIELDINCBA   0x2400
 #define SCSI_ASC_IR_INVALIDLUN          0x2500
+#define SCSI_ASC_IR_INVALIDFIELDINPL    0x2600
 
 /* Sense Key 0x06 */
 #define SCSI_ASC_UA_READYTRANSITION     0x2800
@@ -193,6 +227,24 @@ enum
 #define READCAPACITY10_FLAGS_0_RELADR   BIT(0)
 #define READCAPACITY10_FLAGS_1_PMI      BIT(0)
 
+#define READCAPACITY16_FLAGS_PMI        BIT(0)
+#define READCAPACITY16_SA_MASK          BIT_FIELD(MASK(5), 0)
+/* Logical Blocks per Physical Block Exponent */
+#define READCAPACITY16_FLAGS_1_LBPPBE(value) BIT_FIELD((value), 0)
+/* Logical Block Provisioning Read Zeros */
+#define READCAPACITY16_FLAGS_2_LBPRZ    BIT(6)
+/* Logical Block Provisioning Management Enabled */
+#define READCAPACITY16_FLAGS_2_LBPME    BIT(7)
+
+/* Unmap Granularity Alignment Valid */
+#define BLOCKLIMITS_UGAVALID            BIT(31)
+/* Medium Rotation Rate for solid state devices */
+#define BDC_NON_ROTATING_MEDIUM         0x0001
+/* Logical Block Provisioning Unmap */
+#define LBP_FLAGS_LBPU                  BIT(7)
+/* Provisioning Type: thin provisioned */
+#define LBP_PROVISIONING_TYPE_THIN      0x02
+
 #define SENSE_FLAGS_ILI                 BIT(5)
 #define SENSE_FLAGS_EOM                 BIT(6)
 #define SENSE_FLAGS_FILEMARK            BIT(7)
@@ -247,6 +299,15 @@ struct [[gnu::packed]] InquiryData
   uint8_t productRevisionLevel[4];
 };
 
+struct [[gnu::packed]] InquiryCommand
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint8_t pageCode;
+  uint16_t allocationLength;
+  uint8_t control;
+};
+
 struct [[gnu::packed]] ModeParameterHeader6
 {
   uint8_t modeDataLength;
@@ -324,6 +385,16 @@ struct [[gnu::packed]] Read12Command
   uint8_t control;
 };
 
+struct [[gnu::packed]] Read16Command
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint64_t logicalBlockAddress;
+  uint32_t transferLength;
+  uint8_t groupNumber;
+  uint8_t control;
+};
+
 struct [[gnu::packed]] ReadCapacity10Command
 {
   uint8_t operationCode;
@@ -334,6 +405,34 @@ struct [[gnu::packed]] ReadCapacity10Command
   uint8_t control;
 };
 
+struct [[gnu::packed]] ReadCapacity16Command
+{
+  uint8_t operationCode;
+  uint8_t serviceAction;
+  uint64_t lba;
+  uint32_t allocationLength;
+  uint8_t flags;
+  uint8_t control;
+};
+
+struct [[gnu::packed]] ReadFormatCapacitiesCommand
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint8_t reserved[5];
+  uint16_t allocationLength;
+  uint8_t control;
+};
+
+struct [[gnu::packed]] RequestSenseCommand
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint8_t reserved[2];
+  uint8_t allocationLength;
+  uint8_t control;
+};
+
 struct [[gnu::packed]] RequestSenseData
 {
   uint8_t responseCode;
@@ -355,6 +454,61 @@ struct [[gnu::packed]] ReadCapacityData
   uint32_t blockLength;
 };
 
+struct [[gnu::packed]] ReadCapacity16Data
+{
+  uint64_t lastLogicalBlockAddress;
+  uint32_t blockLength;
+  uint8_t flags0; /* P_TYPE, PROT_EN */
+  uint8_t flags1; /* P_I_EXPONENT, Logical Blocks per Physical Block */
+  uint8_t flags2; /* LBPME, LBPRZ, Lowest Aligned LBA */
+  uint8_t lowestAlignedLogicalBlockAddress;
+  uint8_t reserved[16];
+};
+
+struct [[gnu::packed]] SynchronizeCache10Command
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint32_t logicalBlockAddress;
+  uint8_t groupNumber;
+  uint16_t numberOfBlocks;
+  uint8_t control;
+};
+
+struct [[gnu::packed]] SynchronizeCache16Command
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint64_t logicalBlockAddress;
+  uint32_t numberOfBlocks;
+  uint8_t groupNumber;
+  uint8_t control;
+};
+
+struct [[gnu::packed]] UnmapCommand
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint8_t reserved[4];
+  uint8_t groupNumber;
+  uint16_t parameterListLength;
+  uint8_t control;
+};
+
+struct [[gnu::packed]] UnmapParameterListHeader
+{
+  uint16_t dataLength;
+  uint16_t blockDescriptorDataLength;
+  uint8_t reserved[4];
+};
+
+struct [[gnu::packed]] UnmapBlockDescriptor
+{
+  uint64_t logicalBlockAddress;
+  uint32_t numberOfBlocks;
+  uint8_t reserved[4];
+};
+
 struct [[gnu::packed]] Verify10Command
 {
   uint8_t operationCode;
@@ -392,6 +546,16 @@ struct [[gnu::packed]] Write12Command
   uint8_t groupNumber;
   uint8_t control;
 };
+
+struct [[gnu::packed]] Write16Command
+{
+  uint8_t operationCode;
+  uint8_t flags;
+  uint64_t logicalBlockAddress;
+  uint32_t transferLength;
+  uint8_t groupNumber;
+  uint8_t control;
+};
 /*----------------------------------------------------------------------------*/
 struct [[gnu::packed]] CapacityListHeader
 {
@@ -412,4 +576,46 @@ struct [[gnu::packed]] ReadFormatCapacitiesData
   struct CapacityDescriptor descriptors[];
 };
 /*----------------------------------------------------------------------------*/
+struct [[gnu::packed]] VpdPageHeader
+{
+  uint8_t peripheralDeviceType;
+  uint8_t pageCode;
+  uint16_t pageLength;
+};
+
+struct [[gnu::packed]] BlockLimitsVpdPage
+{
+  struct VpdPageHeader header;
+  uint8_t flags; /* WSNZ */
+  uint8_t maximumCompareAndWriteLength;
+  uint16_t optimalTransferLengthGranularity;
+  uint32_t maximumTransferLength;
+  uint32_t optimalTransferLength;
+  uint32_t maximumPrefetchLength;
+  uint32_t maximumUnmapLbaCount;
+  uint32_t maximumUnmapBlockDescriptorCount;
+  uint32_t optimalUnmapGranularity;
+  uint32_t unmapGranularityAlignment;
+  uint64_t maximumWriteSameLength;
+  uint8_t reserved[20];
+};
+
+struct [[gnu::packed]] BlockDeviceCharacteristicsVpdPage
+{
+  struct VpdPageHeader header;
+  uint16_t mediumRotationRate;
+  uint8_t productType;
+  uint8_t flags; /* WABEREQ, WACEREQ, Nominal Form Factor */
+  uint8_t reserved[56];
+};
+
+struct [[gnu::packed]] LogicalBlockProvisioningVpdPage
+{
+  struct VpdPageHeader header;
+  uint8_t thresholdExponent;
+  uint8_t flags; /* LBPU, LBPWS, LBPWS10, LBPRZ, ANC_SUP, DP */
+  uint8_t minimumPercentage;
+  uint8_t provisioningType;
+};
+/*----------------------------------------------------------------------------*/
 #endif /* HALM_USB_MSC_DEFS_H_ */
@@ -16,6 +16,40 @@
 struct Interface;
 struct MscQueryHandler;
 
+enum MscUnitFlags
+{
+  FLAG_LOCKED     = 0x01,
+  FLAG_READONLY   = 0x02,
+  FLAG_ATTENTION  = 0x04,
+  FLAG_FAILURE    = 0x08
+};
+
+struct MscUnit
+{
+  /* Memory interface */
+  struct Interface *interface;
+  /* Work queue for erase operations */
+  void *wq;
+  /* Address of the memory-mapped content, zero when unavailable */
+  uintptr_t address;
+  /* Number of blocks */
+  uint64_t blocks;
+  /* Size of the erase unit in bytes */
+  uint32_t granularity;
+  /* Additional Sense Code */
+  uint16_t asc;
+  /* Size of the logical block */
+  uint16_t blockSize;
+  /* Sense Key */
+  uint8_t sense;
+  /* Status flags */
+  uint8_t flags;
+  /* Method used to discard unmapped blocks */
+  uint8_t discard;
+  /* Logical blocks per physical block exponent */
+  uint8_t exponent;
+};
+
 struct Msc
 {
   struct UsbDriver base;
@@ -31,19 +65,10 @@ struct Msc
   /* Size of the buffer */
   size_t bufferSize;
 
-  struct
-  {
-    /* Memory interface */
-    struct Interface *interface;
-    /* Number of blocks */
-    uint32_t blocks;
-    /* Additional Sense Code */
-    uint16_t asc;
-    /* Sense Key */
-    uint8_t sense;
-    /* Status flags */
-    uint8_t flags;
-  } lun[1];
+  /* Logical units */
+  struct MscUnit *lun;
+  /* Number of logical units */
+  uint8_t lunCount;
 
   /* USB device handle */
   struct UsbDevice *device;
@@ -60,8 +85,6 @@ struct Msc
     uint8_t tx;
   } endpoints;
 
-  /* Size of the block in a Block Device */
-  uint16_t blockSize;
   /*
    * Size of the USB packet. Packet size is initialized during interface
    * configuration and depends on the speed of the interface.
@@ -80,20 +103,7 @@ struct Msc
       uint32_t length;
       uint32_t tag;
 
-      union
-      {
-        uint8_t raw[16];
-
-        struct PreventAllowMediumRemovalCommand mediumRemoval;
-        struct ReadCapacity10Command readCapacity10;
-        struct Read6Command read6;
-        struct Read10Command read10;
-        struct Read12Command read12;
-        struct Verify10Command verify10;
-        struct Write6Command write6;
-        struct Write10Command write10;
-        struct Write12Command write12;
-      } cb;
+      uint8_t cb[16];
 
       uint8_t flags;
       uint8_t lun;
@@ -122,8 +132,17 @@ struct MscQuery
 
 struct MscQueryHandler
 {
-  struct Msc *driver;
-  void (*trampoline)(struct Msc *);
+  /* Parent state machine and its argument */
+  void (*trampoline)(void *);
+  void *argument;
+
+  /* Endpoints for data transfers */
+  struct UsbEndpoint *rxEp;
+  struct UsbEndpoint *txEp;
+  /* Logical unit of the current storage transfer */
+  struct MscUnit *unit;
+  /* Size of the USB packet */
+  uint16_t packetSize;
 
   PointerArray usbPool;
   PointerQueue usbQueue;
@@ -131,14 +150,24 @@ struct MscQueryHandler
   size_t currentQueryLength;
   uint64_t currentQueryPosition;
   enum Result currentStatus;
+  /* Storage operation is in progress and can not be cancelled */
+  bool storageBusy;
 
   PointerArray queryPool;
   PointerQueue storageQueries;
   PointerQueue usbQueries;
 
+  /* Queries for pipelined data transfers */
+  struct MscQuery *queries;
+  size_t queryCount;
+
+  /* Copy of the Unmap parameter list used by the deferred erase */
+  uint8_t parameters[sizeof(struct UnmapParameterListHeader)
+      + MSC_UNMAP_DESCRIPTOR_COUNT * sizeof(struct UnmapBlockDescriptor)];
+  size_t parameterLength;
+
   /* Preallocated data */
   struct CSW csw;
-  struct MscQuery queries[2];
   struct UsbRequest headers[DATA_QUEUE_SIZE];
 };
 /*----------------------------------------------------------------------------*/
@@ -0,0 +1,65 @@
+/*
+ * halm/usb/msc_scsi.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_USB_MSC_SCSI_H_
+#define HALM_USB_MSC_SCSI_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/error.h>
+#include <stddef.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+struct MscUnit;
+struct MscUnitConfig;
+
+enum ScsiAction
+{
+  /** Command completed without a data stage. */
+  SCSI_ACTION_ACK,
+  /** Command failed, sense data are stored in the logical unit. */
+  SCSI_ACTION_FAILURE,
+  /** Response is stored in the buffer and should be sent to the host. */
+  SCSI_ACTION_RESPONSE,
+  /** Data should be read from the storage and sent to the host. */
+  SCSI_ACTION_READ,
+  /** Data should be received from the host and written to the storage. */
+  SCSI_ACTION_WRITE,
+  /**
+   * Parameter list should be received from the host into the buffer and
+   * passed to the \a scsiProcessParameters function.
+   */
+  SCSI_ACTION_PARAMETERS,
+  /**
+   * Parameter list is valid and blocks should be discarded with
+   * the \a scsiDiscardBlocks function outside of the interrupt context.
+   */
+  SCSI_ACTION_DISCARD
+};
+
+struct ScsiTransfer
+{
+  /** Position in the storage for read and write commands. */
+  uint64_t position;
+  /** Length of the response or length of the storage transfer. */
+  uint32_t length;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+enum ScsiAction scsiProcessCommand(struct MscUnit *, const uint8_t *, void *,
+    struct ScsiTransfer *);
+enum ScsiAction scsiProcessParameters(struct MscUnit *, const uint8_t *,
+    const void *, size_t);
+enum ScsiAction scsiDiscardBlocks(struct MscUnit *, const void *, size_t);
+size_t scsiGetSenseData(struct MscUnit *, void *);
+void scsiSetSense(struct MscUnit *, uint8_t, uint16_t);
+
+enum Result scsiAttachUnit(struct MscUnit *, const struct MscUnitConfig *);
+void scsiDetachUnit(struct MscUnit *);
+void scsiInitUnit(struct MscUnit *, uint16_t, uint16_t);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_USB_MSC_SCSI_H_ */
@@ -19,10 +19,24 @@ enum UacParameter
    */
   IF_UAC_STATUS = IF_PARAMETER_END,
   /**
-   * Update information about rate feedback. Integer format is Q16.16,
-   * parameter type is \a uint32_t.
+   * Update or retrieve information about rate feedback. Integer format is
+   * Q16.16, parameter type is \a uint32_t. Feedback can not be updated
+   * when the built-in feedback controller is enabled.
    */
-  IF_UAC_FEEDBACK
+  IF_UAC_FEEDBACK,
+  /**
+   * Retrieve an index of the receive stream format selected by the host.
+   * Index refers to the format list from the interface configuration.
+   * Parameter type is \a uint8_t. Returns @b E_IDLE when the receive
+   * stream is inactive.
+   */
+  IF_UAC_RX_FORMAT,
+  /**
+   * Retrieve an index of the transmit stream format selected by the host.
+   * Parameter type is \a uint8_t. Returns @b E_IDLE when the transmit
+   * stream is inactive.
+   */
+  IF_UAC_TX_FORMAT
 };
 
 enum UacFlags
@@ -33,13 +47,24 @@ enum UacFlags
   UAC_RX_READY  = 0x08,
   UAC_TX_ACTIVE = 0x10,
   UAC_TX_EMPTY  = 0x20,
-  UAC_RATE      = 0x40
+  UAC_RATE      = 0x40,
+  UAC_FORMAT    = 0x80
 };
 /*----------------------------------------------------------------------------*/
 extern const struct InterfaceClass * const Uac;
 
 struct Uac;
 
+struct UacFormat
+{
+  /** Mandatory: number of channels. */
+  uint8_t channels;
+  /** Mandatory: size of the sample container in bytes, from 1 to 4. */
+  uint8_t size;
+  /** Mandatory: number of significant bits in the sample. */
+  uint8_t resolution;
+};
+
 struct UacConfig
 {
   /** Mandatory: USB device. */
@@ -68,11 +93,31 @@ struct UacConfig
 
   /** Mandatory: sample rate list, last element should be 0. */
   const uint32_t *rates;
+  /**
+   * Optional: stream format list, last element should have zero channels.
+   * Each format is reported as a separate alternate setting, up to
+   * @b UAC_MAX_FORMATS formats are supported. Stereo format with 16-bit
+   * samples is used by default. Packets of each format at the highest
+   * sample rate should fit into a single isochronous transaction of
+   * @b UAC_DATA_EP_SIZE_HS bytes, formats larger than @b UAC_DATA_EP_SIZE
+   * bytes are available at High Speed only. Configuration descriptor grows
+   * with each format, control queue size should be increased accordingly.
+   */
+  const struct UacFormat *formats;
+
+  /**
+   * Optional: enable the built-in rate feedback controller. Feedback is
+   * calculated from the fill level of receive buffers on each read call,
+   * controller gains are tuned for one read call per 1 ms frame. Less
+   * frequent reads slow down the response of the controller.
+   */
+  bool feedback;
 };
 /*----------------------------------------------------------------------------*/
 BEGIN_DECLS
 
 void uacOnEvent(struct Uac *, unsigned int);
+void uacOnFormatSet(struct Uac *, bool);
 uint32_t uacOnSampleRateGet(const struct Uac *, size_t);
 uint32_t uacOnSampleRateGetCurrent(const struct Uac *);
 bool uacOnSampleRateSet(struct Uac *, uint32_t);
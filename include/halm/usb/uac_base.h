@@ -13,6 +13,7 @@ extern const struct UsbDriverClass * const UacBase;
 
 struct Uac;
 struct UacBase;
+struct UacFormat;
 
 struct UacBaseConfig
 {
@@ -31,14 +32,21 @@ struct UacBaseConfig
     uint8_t tx;
   } endpoints;
 
-  /** Mandatory: maximum packet size in bytes for 1 kHz frame rate. */
-  size_t packet;
+  /** Mandatory: stream formats, one alternate setting per format. */
+  const struct UacFormat *formats;
+  /** Mandatory: number of stream formats. */
+  size_t count;
+  /** Mandatory: maximum number of samples per channel in a packet. */
+  size_t samples;
 };
 /*----------------------------------------------------------------------------*/
 BEGIN_DECLS
 
 uint8_t uacBaseGetInterfaceIndex(const struct UacBase *);
-size_t uacBaseGetPacketSize(const struct UacBase *);
+const struct UacFormat *uacBaseGetRxFormat(const struct UacBase *);
+size_t uacBaseGetRxPacketSize(const struct UacBase *);
+const struct UacFormat *uacBaseGetTxFormat(const struct UacBase *);
+size_t uacBaseGetTxPacketSize(const struct UacBase *);
 enum UsbSpeed uacBaseGetUsbSpeed(const struct UacBase *);
 bool uacBaseIsRxActive(const struct UacBase *);
 bool uacBaseIsTxActive(const struct UacBase *);
@@ -9,12 +9,14 @@
 /*----------------------------------------------------------------------------*/
 #include <halm/usb/usb_defs.h>
 /*----------------------------------------------------------------------------*/
-#define RATE_FB_MUL           17
 #define RATE_FB_OFFSET        14
 #define RATE_FB_OFFSET_HS     16
 
 #define UAC_CONTROL_EP_SIZE   64
+#define UAC_DATA_EP_SIZE      1023
+#define UAC_DATA_EP_SIZE_HS   1024
 #define UAC_FEEDBACK_EP_SIZE  4
+#define UAC_MAX_FORMATS       4
 /*----------------------------------------------------------------------------*/
 /* Audio Interface Subclass Codes */
 enum
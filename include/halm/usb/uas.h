@@ -0,0 +1,163 @@
+/*
+ * halm/usb/uas.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_USB_UAS_H_
+#define HALM_USB_UAS_H_
+/*----------------------------------------------------------------------------*/
+#include <halm/generic/pointer_array.h>
+#include <halm/generic/pointer_queue.h>
+#include <halm/usb/usb.h>
+/*----------------------------------------------------------------------------*/
+extern const struct UsbDriverClass * const Uas;
+
+struct MscQueryHandler;
+struct MscUnit;
+struct MscUnitConfig;
+struct UasCommandSlot;
+struct UasStatusSlot;
+
+struct UasConfig
+{
+  /** Mandatory: USB device. */
+  void *device;
+
+  /**
+   * Optional: memory region for the temporary buffer. When the pointer is
+   * left uninitialized, a memory for the buffer will be allocated on the heap.
+   * Pointer address should be aligned.
+   */
+  void *arena;
+  /** Mandatory: buffer size. */
+  size_t size;
+  /**
+   * Optional: number of queries for pipelined data transfers.
+   * Two queries are used by default.
+   */
+  size_t depth;
+  /**
+   * Optional: number of logical units. Single logical unit will be
+   * configured when the value is left uninitialized.
+   */
+  uint8_t luns;
+
+  struct
+  {
+    /**
+     * Optional: size of the logical block in bytes. Power of two values
+     * from 512 to 4096 are allowed, 512-byte blocks are used by default.
+     */
+    uint16_t logical;
+    /**
+     * Optional: size of the physical block in bytes. The value should be
+     * a power of two multiple of the logical block size, for example
+     * 4096-byte physical blocks with 512-byte logical blocks. Physical
+     * block size is equal to the logical block size by default.
+     */
+    uint16_t physical;
+  } block;
+  /**
+   * Optional: maximum number of commands queued by the host. Commands are
+   * executed in order of arrival. Four commands are queued by default.
+   */
+  uint8_t commands;
+
+  struct
+  {
+    /** Mandatory: identifier of the command endpoint. */
+    uint8_t command;
+    /** Mandatory: identifier of the status endpoint. */
+    uint8_t status;
+    /** Mandatory: identifier of the Data-Out endpoint. */
+    uint8_t rx;
+    /** Mandatory: identifier of the Data-In endpoint. */
+    uint8_t tx;
+  } endpoints;
+};
+
+struct Uas
+{
+  struct UsbDriver base;
+
+  void (*callback)(void *);
+  void *callbackArgument;
+
+  /* Buffer for responses and storage data */
+  void *buffer;
+  /* Size of the buffer */
+  size_t bufferSize;
+
+  /* Logical units */
+  struct MscUnit *lun;
+  /* Number of logical units */
+  uint8_t lunCount;
+
+  /* USB device handle */
+  struct UsbDevice *device;
+
+  /* Command pipe handle */
+  struct UsbEndpoint *commandEp;
+  /* Status pipe handle */
+  struct UsbEndpoint *statusEp;
+  /* Data-Out pipe handle */
+  struct UsbEndpoint *rxEp;
+  /* Data-In pipe handle */
+  struct UsbEndpoint *txEp;
+
+  /* Data transfer handler shared with the Bulk-Only Transport */
+  struct MscQueryHandler *datapath;
+
+  /* Buffers for command and task management IUs */
+  struct UasCommandSlot *commands;
+  /* Commands waiting for execution */
+  PointerQueue pendingCommands;
+  /* Command being executed */
+  struct UasCommandSlot *current;
+
+  /* Buffers for status IUs */
+  struct UasStatusSlot *statuses;
+  /* Pool of free status buffers */
+  PointerArray statusPool;
+
+  /* Addresses of bulk endpoints */
+  struct
+  {
+    uint8_t command;
+    uint8_t status;
+    uint8_t rx;
+    uint8_t tx;
+  } endpoints;
+
+  /*
+   * Size of the USB packet. Packet size is initialized during interface
+   * configuration and depends on the speed of the interface.
+   */
+  uint16_t packetSize;
+  /* Length of the parameter list of the current command */
+  uint16_t parameterLength;
+  /* Number of command buffers */
+  uint8_t commandCount;
+  /* Data stage of the current command */
+  uint8_t action;
+  /* Interface index in configurations with multiple interface */
+  uint8_t interfaceIndex;
+  /* Buffer should be released during deinitialization */
+  bool preallocated;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+enum Result uasAttachUnit(struct Uas *, uint8_t, void *);
+enum Result uasAttachMappedUnit(struct Uas *, uint8_t, void *, const void *);
+enum Result uasAttachConfiguredUnit(struct Uas *, uint8_t,
+    const struct MscUnitConfig *);
+void uasDetachUnit(struct Uas *, uint8_t);
+bool uasIsUnitFailed(const struct Uas *, uint8_t);
+bool uasIsUnitLocked(const struct Uas *, uint8_t);
+void uasSetCallback(struct Uas *, void (*)(void *), void *);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_USB_UAS_H_ */
@@ -0,0 +1,130 @@
+/*
+ * halm/usb/uas_defs.h
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef HALM_USB_UAS_DEFS_H_
+#define HALM_USB_UAS_DEFS_H_
+/*----------------------------------------------------------------------------*/
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+#define UAS_DESCRIPTOR_TYPE_PIPE_USAGE  0x24
+#define UAS_COMMAND_IU_SIZE             32
+#define UAS_SENSE_DATA_SIZE             18
+/*----------------------------------------------------------------------------*/
+enum
+{
+  UAS_PIPE_COMMAND  = 0x01,
+  UAS_PIPE_STATUS   = 0x02,
+  UAS_PIPE_DATA_IN  = 0x03,
+  UAS_PIPE_DATA_OUT = 0x04
+};
+
+/* Information Unit identifiers */
+enum
+{
+  UAS_IU_COMMAND          = 0x01,
+  UAS_IU_SENSE            = 0x03,
+  UAS_IU_RESPONSE         = 0x04,
+  UAS_IU_TASK_MANAGEMENT  = 0x05,
+  UAS_IU_READ_READY       = 0x06,
+  UAS_IU_WRITE_READY      = 0x07
+};
+
+/* Task management functions */
+enum
+{
+  UAS_TMF_ABORT_TASK          = 0x01,
+  UAS_TMF_ABORT_TASK_SET      = 0x02,
+  UAS_TMF_CLEAR_TASK_SET      = 0x04,
+  UAS_TMF_LOGICAL_UNIT_RESET  = 0x08,
+  UAS_TMF_IT_NEXUS_RESET      = 0x10,
+  UAS_TMF_CLEAR_ACA           = 0x40,
+  UAS_TMF_QUERY_TASK          = 0x80,
+  UAS_TMF_QUERY_TASK_SET      = 0x81,
+  UAS_TMF_QUERY_ASYNC_EVENT   = 0x82
+};
+
+/* Response codes */
+enum
+{
+  UAS_RC_TMF_COMPLETE         = 0x00,
+  UAS_RC_INVALID_IU           = 0x02,
+  UAS_RC_TMF_NOT_SUPPORTED    = 0x04,
+  UAS_RC_TMF_FAILED           = 0x05,
+  UAS_RC_TMF_SUCCEEDED        = 0x08,
+  UAS_RC_INCORRECT_LUN        = 0x09,
+  UAS_RC_OVERLAPPED_TAG       = 0x0A
+};
+
+/* SCSI status codes */
+enum
+{
+  UAS_STATUS_GOOD             = 0x00,
+  UAS_STATUS_CHECK_CONDITION  = 0x02,
+  UAS_STATUS_BUSY             = 0x08,
+  UAS_STATUS_TASK_SET_FULL    = 0x28
+};
+/*----------------------------------------------------------------------------*/
+struct [[gnu::packed]] UasPipeUsageDescriptor
+{
+  uint8_t length;
+  uint8_t descriptorType;
+  uint8_t pipeId;
+  uint8_t reserved;
+};
+/*----------------------------------------------------------------------------*/
+struct [[gnu::packed]] UasIuHeader
+{
+  uint8_t id;
+  uint8_t reserved;
+  uint16_t tag;
+};
+
+struct [[gnu::packed]] UasCommandIu
+{
+  uint8_t id;
+  uint8_t reserved0;
+  uint16_t tag;
+  uint8_t attribute;
+  uint8_t reserved1;
+  uint8_t additionalLength;
+  uint8_t reserved2;
+  uint8_t lun[8];
+  uint8_t cb[16];
+};
+
+struct [[gnu::packed]] UasTaskManagementIu
+{
+  uint8_t id;
+  uint8_t reserved0;
+  uint16_t tag;
+  uint8_t function;
+  uint8_t reserved1;
+  uint16_t taskTag;
+  uint8_t lun[8];
+};
+
+struct [[gnu::packed]] UasSenseIu
+{
+  uint8_t id;
+  uint8_t reserved0;
+  uint16_t tag;
+  uint16_t statusQualifier;
+  uint8_t status;
+  uint8_t reserved1[7];
+  uint16_t length;
+  uint8_t data[UAS_SENSE_DATA_SIZE];
+};
+
+struct [[gnu::packed]] UasResponseIu
+{
+  uint8_t id;
+  uint8_t reserved;
+  uint16_t tag;
+  uint8_t additionalInfo[3];
+  uint8_t code;
+};
+/*----------------------------------------------------------------------------*/
+#endif /* HALM_USB_UAS_DEFS_H_ */
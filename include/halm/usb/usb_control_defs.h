@@ -20,6 +20,8 @@
 #endif
 
 #define REQUEST_POOL_SIZE             (EP0_REQUEST_COUNT + 1)
+/* Longest response to a control request, including descriptors */
+#define CONTROL_PAYLOAD_SIZE          (EP0_REQUEST_COUNT * EP0_PACKET_SIZE)
 
 #define STRING_BUFFER_SIZE            (EP0_REQUEST_COUNT * EP0_BUFFER_SIZE)
 #define STRING_DESCRIPTOR_TEXT_LIMIT  126
@@ -0,0 +1,661 @@
+/*
+ * block_device.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/flash.h>
+#include <halm/platform/generic/block_device.h>
+#include <uv.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+#  include <liburing.h>
+#  include <sys/eventfd.h>
+#endif
+
+#ifdef __linux__
+#  include <linux/fs.h>
+#endif
+/*----------------------------------------------------------------------------*/
+#define DEFAULT_ALIGNMENT 512
+#define DEFAULT_DEPTH     4
+/*----------------------------------------------------------------------------*/
+struct BlockDeviceRequest
+{
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+  /* Submission queue entry of the request */
+  struct io_uring_sqe *sqe;
+#else
+  /* Request for the thread pool of the event loop */
+  uv_work_t work;
+#endif
+
+  struct BlockDevice *device;
+  uint8_t *buffer;
+  uint64_t offset;
+  size_t length;
+  ssize_t result;
+  bool write;
+};
+
+struct BlockDevice
+{
+  struct Interface base;
+
+  void (*callback)(void *);
+  void *callbackArgument;
+
+  /* Requests of the current transfer */
+  struct BlockDeviceRequest *requests;
+
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+  /* Submission and completion queues */
+  struct io_uring ring;
+  /* Completion notifier for the event loop */
+  uv_poll_t *listener;
+  /* Event descriptor registered in the ring */
+  int event;
+#endif
+
+  /* Current position in bytes */
+  uint64_t position;
+  /* Size of the storage in bytes */
+  uint64_t size;
+  /* Alignment of positions and lengths */
+  size_t alignment;
+  /* Maximal number of requests */
+  size_t depth;
+  /* Number of requests in progress */
+  size_t pending;
+  /* File descriptor */
+  int file;
+
+  /* Status of the last transfer */
+  enum Result status;
+  /* Enable blocking mode */
+  bool blocking;
+  /* Direct access is enabled */
+  bool direct;
+  /* One of the requests failed */
+  bool failed;
+};
+/*----------------------------------------------------------------------------*/
+static void completeRequest(struct BlockDeviceRequest *, ssize_t);
+static enum Result getStorageSize(struct BlockDevice *);
+static size_t startTransfer(struct BlockDevice *, void *, size_t, bool);
+static enum Result submitRequests(struct BlockDevice *, size_t, bool);
+static enum Result transferBlocking(struct BlockDevice *, void *, size_t,
+    bool);
+
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+static void onCloseCallback(uv_handle_t *);
+static void onRingEvent(uv_poll_t *, int, int);
+#else
+static void onWorkCompleted(uv_work_t *, int);
+static void onWorkStarted(uv_work_t *);
+#endif
+/*----------------------------------------------------------------------------*/
+static enum Result bdInit(void *, const void *);
+static void bdDeinit(void *);
+static void bdSetCallback(void *, void (*)(void *), void *);
+static enum Result bdGetParam(void *, int, void *);
+static enum Result bdSetParam(void *, int, const void *);
+static size_t bdRead(void *, void *, size_t);
+static size_t bdWrite(void *, const void *, size_t);
+/*----------------------------------------------------------------------------*/
+const struct InterfaceClass * const BlockDevice =
+    &(const struct InterfaceClass){
+    .size = sizeof(struct BlockDevice),
+    .init = bdInit,
+    .deinit = bdDeinit,
+
+    .setCallback = bdSetCallback,
+    .getParam = bdGetParam,
+    .setParam = bdSetParam,
+    .read = bdRead,
+    .write = bdWrite
+};
+/*----------------------------------------------------------------------------*/
+static void completeRequest(struct BlockDeviceRequest *request, ssize_t result)
+{
+  struct BlockDevice * const dev = request->device;
+
+  if (result < 0 || (size_t)result != request->length)
+    dev->failed = true;
+
+  assert(dev->pending > 0);
+  if (--dev->pending)
+    return;
+
+  dev->status = dev->failed ? E_INTERFACE : E_OK;
+
+  if (dev->callback != NULL)
+    dev->callback(dev->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result getStorageSize(struct BlockDevice *dev)
+{
+  struct stat info;
+
+  if (fstat(dev->file, &info) == -1)
+    return E_INTERFACE;
+
+  if (S_ISBLK(info.st_mode))
+  {
+#ifdef BLKGETSIZE64
+    uint64_t size;
+
+    if (ioctl(dev->file, BLKGETSIZE64, &size) == -1)
+      return E_INTERFACE;
+
+    dev->size = size;
+#else
+    return E_INVALID;
+#endif
+  }
+  else if (S_ISREG(info.st_mode))
+  {
+    dev->size = (uint64_t)info.st_size;
+  }
+  else
+    return E_INVALID;
+
+  /* Incomplete block at the end of the storage is not used */
+  dev->size -= dev->size % dev->alignment;
+  return dev->size ? E_OK : E_VALUE;
+}
+/*----------------------------------------------------------------------------*/
+static size_t startTransfer(struct BlockDevice *dev, void *buffer,
+    size_t length, bool write)
+{
+  if (dev->status == E_BUSY)
+    return 0;
+
+  if (dev->position >= dev->size)
+    return 0;
+  if (length > dev->size - dev->position)
+    length = (size_t)(dev->size - dev->position);
+
+  if (dev->direct)
+  {
+    /* Unaligned direct transfers are rejected by the kernel */
+    if ((uintptr_t)buffer % dev->alignment || length % dev->alignment)
+    {
+      dev->status = E_VALUE;
+      return 0;
+    }
+  }
+
+  if (!length)
+    return 0;
+
+  if (dev->blocking)
+  {
+    dev->status = transferBlocking(dev, buffer, length, write);
+    if (dev->status != E_OK)
+      return 0;
+  }
+  else
+  {
+    /* Split the transfer into requests aligned to the storage blocks */
+    size_t chunk = (length + dev->depth - 1) / dev->depth;
+    chunk = (chunk + dev->alignment - 1) / dev->alignment * dev->alignment;
+
+    size_t count = 0;
+    uint8_t *position = buffer;
+
+    for (size_t left = length; left; ++count)
+    {
+      struct BlockDeviceRequest * const request = &dev->requests[count];
+      const size_t part = left < chunk ? left : chunk;
+
+      request->buffer = position;
+      request->offset = dev->position + (uint64_t)(length - left);
+      request->length = part;
+      request->result = 0;
+
+      position += part;
+      left -= part;
+    }
+
+    dev->failed = false;
+    dev->status = E_BUSY;
+
+    if (submitRequests(dev, count, write) != E_OK)
+    {
+      if (!dev->pending)
+      {
+        dev->status = E_ERROR;
+        return 0;
+      }
+
+      /* Submitted requests will complete the transfer with an error */
+      dev->failed = true;
+    }
+  }
+
+  dev->position += length;
+  return length;
+}
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+static enum Result submitRequests(struct BlockDevice *dev, size_t count,
+    bool write)
+{
+  dev->pending = 0;
+
+  /* Try to flush entries left after a failed submission */
+  if (io_uring_sq_space_left(&dev->ring) < count)
+  {
+    io_uring_submit(&dev->ring);
+
+    if (io_uring_sq_space_left(&dev->ring) < count)
+      return E_BUSY;
+  }
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    struct BlockDeviceRequest * const request = &dev->requests[index];
+    struct io_uring_sqe * const sqe = io_uring_get_sqe(&dev->ring);
+
+    assert(sqe != NULL);
+    request->sqe = sqe;
+
+    if (write)
+    {
+      io_uring_prep_write(sqe, dev->file, request->buffer,
+          (unsigned int)request->length, request->offset);
+    }
+    else
+    {
+      io_uring_prep_read(sqe, dev->file, request->buffer,
+          (unsigned int)request->length, request->offset);
+    }
+
+    io_uring_sqe_set_data(sqe, request);
+  }
+
+  const int submitted = io_uring_submit(&dev->ring);
+
+  dev->pending = submitted > 0 ? (size_t)submitted : 0;
+  if (dev->pending == count)
+    return E_OK;
+
+  /*
+   * Entries that were not consumed by the kernel stay in the submission
+   * queue and they are turned into no-op entries without requests.
+   * The kernel reads entries only during submission, therefore they
+   * are completed harmlessly with the next transfer.
+   */
+  for (size_t index = dev->pending; index < count; ++index)
+  {
+    struct io_uring_sqe * const sqe = dev->requests[index].sqe;
+
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+  }
+
+  return E_INTERFACE;
+}
+#else
+static enum Result submitRequests(struct BlockDevice *dev, size_t count,
+    bool write)
+{
+  dev->pending = 0;
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    struct BlockDeviceRequest * const request = &dev->requests[index];
+
+    request->write = write;
+
+    if (uv_queue_work(uv_default_loop(), &request->work, onWorkStarted,
+        onWorkCompleted) < 0)
+    {
+      return E_ERROR;
+    }
+
+    ++dev->pending;
+  }
+
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+static enum Result transferBlocking(struct BlockDevice *dev, void *buffer,
+    size_t length, bool write)
+{
+  uint8_t *data = buffer;
+  uint64_t offset = dev->position;
+
+  while (length)
+  {
+    const ssize_t result = write ?
+        pwrite(dev->file, data, length, (off_t)offset) :
+        pread(dev->file, data, length, (off_t)offset);
+
+    if (result <= 0)
+    {
+      if (result < 0 && errno == EINTR)
+        continue;
+      return E_INTERFACE;
+    }
+
+    data += result;
+    offset += (uint64_t)result;
+    length -= (size_t)result;
+  }
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+static void onCloseCallback(uv_handle_t *handle)
+{
+  free(handle);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+static void onRingEvent(uv_poll_t *handle, int, int)
+{
+  struct BlockDevice * const dev = uv_handle_get_data((uv_handle_t *)handle);
+  struct io_uring_cqe *cqe;
+  uint64_t counter;
+
+  if (read(dev->event, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+    return;
+
+  while (io_uring_peek_cqe(&dev->ring, &cqe) == 0)
+  {
+    struct BlockDeviceRequest * const request = io_uring_cqe_get_data(cqe);
+    const ssize_t result = cqe->res;
+
+    io_uring_cqe_seen(&dev->ring, cqe);
+
+    /* Entries of failed submissions are completed without requests */
+    if (request != NULL)
+      completeRequest(request, result);
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifndef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+static void onWorkCompleted(uv_work_t *work, int status)
+{
+  struct BlockDeviceRequest * const request =
+      uv_req_get_data((uv_req_t *)work);
+
+  completeRequest(request, status == 0 ? request->result : -1);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifndef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+static void onWorkStarted(uv_work_t *work)
+{
+  struct BlockDeviceRequest * const request =
+      uv_req_get_data((uv_req_t *)work);
+  const int file = request->device->file;
+  const bool write = request->write;
+  uint8_t *data = request->buffer;
+  uint64_t offset = request->offset;
+  size_t left = request->length;
+
+  while (left)
+  {
+    const ssize_t result = write ?
+        pwrite(file, data, left, (off_t)offset) :
+        pread(file, data, left, (off_t)offset);
+
+    if (result <= 0)
+    {
+      if (result < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+
+    data += result;
+    offset += (uint64_t)result;
+    left -= (size_t)result;
+  }
+
+  request->result = (ssize_t)(request->length - left);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+static enum Result bdInit(void *object, const void *configBase)
+{
+  const struct BlockDeviceConfig * const config = configBase;
+  assert(config != NULL);
+  assert(config->path != NULL);
+
+  struct BlockDevice * const dev = object;
+  enum Result res;
+  int flags = O_RDWR;
+
+  dev->alignment = config->alignment ? config->alignment : DEFAULT_ALIGNMENT;
+  dev->depth = config->depth ? config->depth : DEFAULT_DEPTH;
+  dev->callback = NULL;
+  dev->position = 0;
+  dev->pending = 0;
+  dev->status = E_OK;
+  dev->blocking = true;
+  dev->direct = config->direct;
+  dev->failed = false;
+
+  if (dev->direct)
+  {
+#ifdef O_DIRECT
+    flags |= O_DIRECT;
+#else
+    return E_INVALID;
+#endif
+  }
+
+  dev->requests = malloc(dev->depth * sizeof(struct BlockDeviceRequest));
+  if (dev->requests == NULL)
+    return E_MEMORY;
+
+  for (size_t index = 0; index < dev->depth; ++index)
+  {
+    dev->requests[index].device = dev;
+#ifndef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+    uv_req_set_data((uv_req_t *)&dev->requests[index].work,
+        &dev->requests[index]);
+#endif
+  }
+
+  dev->file = open(config->path, flags);
+  if (dev->file < 0)
+  {
+    res = E_ENTRY;
+    goto free_requests;
+  }
+
+  if ((res = getStorageSize(dev)) != E_OK)
+    goto free_file;
+
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+  /* Reserve space for entries left after a failed submission */
+  if (io_uring_queue_init((unsigned int)dev->depth * 2, &dev->ring, 0) < 0)
+  {
+    res = E_INTERFACE;
+    goto free_file;
+  }
+
+  dev->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (dev->event < 0)
+  {
+    res = E_INTERFACE;
+    goto free_ring;
+  }
+  if (io_uring_register_eventfd(&dev->ring, dev->event) < 0)
+  {
+    res = E_INTERFACE;
+    goto free_event;
+  }
+
+  dev->listener = malloc(sizeof(uv_poll_t));
+  if (dev->listener == NULL)
+  {
+    res = E_MEMORY;
+    goto free_event;
+  }
+
+  uv_poll_init(uv_default_loop(), dev->listener, dev->event);
+  uv_handle_set_data((uv_handle_t *)dev->listener, dev);
+  uv_poll_start(dev->listener, UV_READABLE, onRingEvent);
+#endif
+
+  return E_OK;
+
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+free_event:
+  close(dev->event);
+free_ring:
+  io_uring_queue_exit(&dev->ring);
+#endif
+free_file:
+  close(dev->file);
+free_requests:
+  free(dev->requests);
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static void bdDeinit(void *object)
+{
+  struct BlockDevice * const dev = object;
+
+  /* Pending transfer should be completed before deinitialization */
+  assert(dev->status != E_BUSY);
+
+#ifdef CONFIG_PLATFORM_LINUX_BLOCK_DEVICE_URING
+  uv_poll_stop(dev->listener);
+  uv_handle_set_data((uv_handle_t *)dev->listener, NULL);
+  uv_close((uv_handle_t *)dev->listener, onCloseCallback);
+  close(dev->event);
+  io_uring_queue_exit(&dev->ring);
+#endif
+
+  close(dev->file);
+  free(dev->requests);
+}
+/*----------------------------------------------------------------------------*/
+static void bdSetCallback(void *object, void (*callback)(void *),
+    void *argument)
+{
+  struct BlockDevice * const dev = object;
+
+  dev->callbackArgument = argument;
+  dev->callback = callback;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result bdGetParam(void *object, int parameter, void *data)
+{
+  struct BlockDevice * const dev = object;
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_POSITION:
+      if (dev->position > UINT32_MAX)
+        return E_VALUE;
+
+      *(uint32_t *)data = (uint32_t)dev->position;
+      return E_OK;
+
+    case IF_POSITION_64:
+      *(uint64_t *)data = dev->position;
+      return E_OK;
+
+    case IF_SIZE:
+      if (dev->size > UINT32_MAX)
+        return E_VALUE;
+
+      *(uint32_t *)data = (uint32_t)dev->size;
+      return E_OK;
+
+    case IF_SIZE_64:
+      *(uint64_t *)data = dev->size;
+      return E_OK;
+
+    case IF_STATUS:
+      return dev->status;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result bdSetParam(void *object, int parameter, const void *data)
+{
+  struct BlockDevice * const dev = object;
+
+  switch ((enum FlashParameter)parameter)
+  {
+    case IF_FLASH_SYNC:
+      /* Requests in progress are not covered by the synchronization */
+      if (dev->status == E_BUSY)
+        return E_BUSY;
+
+      return fdatasync(dev->file) == 0 ? E_OK : E_INTERFACE;
+
+    default:
+      break;
+  }
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_POSITION:
+    {
+      const uint64_t position = *(const uint32_t *)data;
+
+      if (position >= dev->size || (dev->direct && position % dev->alignment))
+        return E_ADDRESS;
+
+      dev->position = position;
+      return E_OK;
+    }
+
+    case IF_POSITION_64:
+    {
+      const uint64_t position = *(const uint64_t *)data;
+
+      if (position >= dev->size || (dev->direct && position % dev->alignment))
+        return E_ADDRESS;
+
+      dev->position = position;
+      return E_OK;
+    }
+
+    case IF_BLOCKING:
+      if (dev->status == E_BUSY)
+        return E_BUSY;
+
+      dev->blocking = true;
+      return E_OK;
+
+    case IF_ZEROCOPY:
+      dev->blocking = false;
+      return E_OK;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static size_t bdRead(void *object, void *buffer, size_t length)
+{
+  return startTransfer(object, buffer, length, false);
+}
+/*----------------------------------------------------------------------------*/
+static size_t bdWrite(void *object, const void *buffer, size_t length)
+{
+  return startTransfer(object, (void *)buffer, length, true);
+}
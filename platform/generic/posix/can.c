@@ -0,0 +1,1035 @@
+/*
+ * can.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/can.h>
+#include <halm/generic/can_filter.h>
+#include <halm/generic/pointer_array.h>
+#include <halm/generic/pointer_queue.h>
+#include <halm/platform/generic/can.h>
+#include <halm/timer.h>
+#include <uv.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+/*----------------------------------------------------------------------------*/
+#define BATCH_SIZE    16
+#define CONTROL_SIZE \
+    (CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(uint32_t)))
+/*----------------------------------------------------------------------------*/
+enum Cleanup
+{
+  CLEANUP_ALL,
+  CLEANUP_SOCKET,
+  CLEANUP_NOTIFIER,
+  CLEANUP_LISTENER,
+  CLEANUP_FILTERS,
+  CLEANUP_ARENA,
+  CLEANUP_TX_QUEUE,
+  CLEANUP_RX_QUEUE,
+  CLEANUP_POOL,
+  CLEANUP_MUTEX
+};
+
+enum Mode
+{
+  MODE_LISTENER,
+  MODE_ACTIVE,
+  MODE_LOOPBACK
+};
+/*----------------------------------------------------------------------------*/
+struct Can
+{
+  struct Interface base;
+
+  void (*callback)(void *);
+  void *callbackArgument;
+
+  /* Timer for the time stamp generation */
+  struct Timer *timer;
+  /* 64-bit timer for the time stamp generation */
+  struct Timer64 *timer64;
+
+  /* Message pool, frames of both formats are stored as flexible data-rate */
+  PointerArray pool;
+  /* Queue for received messages */
+  PointerQueue rxQueue;
+  /* Queue for transmitting messages */
+  PointerQueue txQueue;
+  /* Lock for the message pool and both queues */
+  pthread_mutex_t lock;
+  /* Pointer to a memory region used as a message pool */
+  void *arena;
+
+  /* Acceptance filters applied before enqueueing of received frames */
+  struct CanFilterSet filters;
+
+  /* Listener for socket events */
+  uv_poll_t *listener;
+  /* Notifier for messages queued from other threads */
+  uv_async_t *notifier;
+  /* Socket descriptor */
+  int descriptor;
+  /* Events monitored by the listener */
+  int events;
+
+  /* Desired baud rate */
+  uint32_t rate;
+  /* Number of frames dropped by the kernel */
+  uint32_t drops;
+  /* Current interface mode */
+  uint8_t mode;
+  /* Network interface supports flexible data-rate frames */
+  bool fd;
+
+  /* Maximum available frames in the receive queue */
+  size_t rxWatermark;
+  /* Maximum pending frames in the transmit queue */
+  size_t txWatermark;
+
+  /* Bus errors */
+  uint32_t errorCount;
+  /* Received frame overruns */
+  uint32_t overrunCount;
+  /* Received frames */
+  uint32_t rxCount;
+  /* Transmitted frames */
+  uint32_t txCount;
+};
+/*----------------------------------------------------------------------------*/
+static void cleanup(struct Can *, enum Cleanup);
+static size_t fetchMessage(const struct Can *, const void *, size_t,
+    struct CANFlexibleDataMessage *);
+static bool filterAdd(struct Can *, const struct CANFilter *, bool);
+static bool filterRemove(struct Can *, const struct CANFilter *, bool);
+static uint64_t getTimestamp(const struct Can *);
+static void onCloseCallback(uv_handle_t *);
+static void onInterfaceCallback(uv_poll_t *, int, int);
+static void onTransmitRequest(uv_async_t *);
+static size_t packFrame(const struct CANFlexibleDataMessage *,
+    struct canfd_frame *);
+static bool readFrames(struct Can *);
+static void resetQueues(struct Can *);
+static size_t sendFrames(struct Can *, const struct canfd_frame *,
+    const size_t *, size_t);
+static void setBusMode(struct Can *, enum Mode);
+static enum Result setupSocket(struct Can *, const struct CanConfig *);
+static void unpackFrame(const struct canfd_frame *, bool,
+    struct CANFlexibleDataMessage *);
+static bool writeFrames(struct Can *);
+/*----------------------------------------------------------------------------*/
+static enum Result canInit(void *, const void *);
+static void canDeinit(void *);
+static void canSetCallback(void *, void (*)(void *), void *);
+static enum Result canGetParam(void *, int, void *);
+static enum Result canSetParam(void *, int, const void *);
+static size_t canRead(void *, void *, size_t);
+static size_t canWrite(void *, const void *, size_t);
+/*----------------------------------------------------------------------------*/
+const struct InterfaceClass * const Can = &(const struct InterfaceClass){
+    .size = sizeof(struct Can),
+    .init = canInit,
+    .deinit = canDeinit,
+
+    .setCallback = canSetCallback,
+    .getParam = canGetParam,
+    .setParam = canSetParam,
+    .read = canRead,
+    .write = canWrite
+};
+/*----------------------------------------------------------------------------*/
+static void cleanup(struct Can *interface, enum Cleanup step)
+{
+  switch (step)
+  {
+    case CLEANUP_ALL:
+      uv_handle_set_data((uv_handle_t *)interface->notifier, NULL);
+      uv_close((uv_handle_t *)interface->notifier, onCloseCallback);
+      uv_handle_set_data((uv_handle_t *)interface->listener, NULL);
+      uv_close((uv_handle_t *)interface->listener, onCloseCallback);
+      [[fallthrough]];
+    case CLEANUP_SOCKET:
+      close(interface->descriptor);
+      [[fallthrough]];
+    case CLEANUP_NOTIFIER:
+      if (step != CLEANUP_ALL)
+        free(interface->notifier);
+      [[fallthrough]];
+    case CLEANUP_LISTENER:
+      if (step != CLEANUP_ALL)
+        free(interface->listener);
+      [[fallthrough]];
+    case CLEANUP_FILTERS:
+      canFilterSetDeinit(&interface->filters);
+      [[fallthrough]];
+    case CLEANUP_ARENA:
+      free(interface->arena);
+      [[fallthrough]];
+    case CLEANUP_TX_QUEUE:
+      pointerQueueDeinit(&interface->txQueue);
+      [[fallthrough]];
+    case CLEANUP_RX_QUEUE:
+      pointerQueueDeinit(&interface->rxQueue);
+      [[fallthrough]];
+    case CLEANUP_POOL:
+      pointerArrayDeinit(&interface->pool);
+      [[fallthrough]];
+    case CLEANUP_MUTEX:
+      pthread_mutex_destroy(&interface->lock);
+      break;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static size_t fetchMessage(const struct Can *interface, const void *buffer,
+    size_t length, struct CANFlexibleDataMessage *message)
+{
+  static_assert(offsetof(struct CANStandardMessage, flags) ==
+      offsetof(struct CANMessage, flags), "Incorrect message layout");
+  static_assert(offsetof(struct CANFlexibleDataMessage, flags) ==
+      offsetof(struct CANMessage, flags), "Incorrect message layout");
+  static_assert(offsetof(struct CANStandardMessage, data) ==
+      offsetof(struct CANFlexibleDataMessage, data),
+      "Incorrect message layout");
+
+  const uint8_t * const position = buffer;
+  const uint8_t flags = position[offsetof(struct CANMessage, flags)];
+  const uint8_t count = position[offsetof(struct CANMessage, length)];
+  size_t size;
+  size_t capacity;
+
+  if (flags & CAN_FD)
+  {
+    /* Network interface should support flexible data-rate frames */
+    if (!interface->fd || (flags & CAN_RTR))
+      return 0;
+
+    capacity = CANFD_MAX_DLEN;
+    size = sizeof(struct CANFlexibleDataMessage);
+  }
+  else
+  {
+    capacity = CAN_MAX_DLEN;
+    size = sizeof(struct CANStandardMessage);
+  }
+
+  /* Incomplete frames and frames with incorrect length are rejected */
+  if (length < size || count > capacity)
+    return 0;
+
+  /* Timestamp field is ignored */
+  message->timestamp = 0;
+
+  message->flags = flags;
+  message->length = count;
+
+  memcpy(&message->id, &position[offsetof(struct CANMessage, id)],
+      sizeof(message->id));
+  memcpy(message->data, &position[offsetof(struct CANMessage, data)],
+      capacity);
+
+  return size;
+}
+/*----------------------------------------------------------------------------*/
+static bool filterAdd(struct Can *interface, const struct CANFilter *filter,
+    bool ext)
+{
+  pthread_mutex_lock(&interface->lock);
+  const bool added = canFilterSetAdd(&interface->filters, filter, ext);
+  pthread_mutex_unlock(&interface->lock);
+
+  return added;
+}
+/*----------------------------------------------------------------------------*/
+static bool filterRemove(struct Can *interface, const struct CANFilter *filter,
+    bool ext)
+{
+  pthread_mutex_lock(&interface->lock);
+  const bool removed = canFilterSetRemove(&interface->filters, filter, ext);
+  pthread_mutex_unlock(&interface->lock);
+
+  return removed;
+}
+/*----------------------------------------------------------------------------*/
+static uint64_t getTimestamp(const struct Can *interface)
+{
+  if (interface->timer64 != NULL)
+    return timerGetValue64(interface->timer64);
+  else if (interface->timer != NULL)
+    return timerGetValue(interface->timer);
+  else
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+static void onCloseCallback(uv_handle_t *handle)
+{
+  free(handle);
+}
+/*----------------------------------------------------------------------------*/
+static void onInterfaceCallback(uv_poll_t *handle, int, int events)
+{
+  struct Can * const interface = uv_handle_get_data((uv_handle_t *)handle);
+  bool event = false;
+
+  if (events & UV_READABLE)
+    event = readFrames(interface);
+  if ((events & UV_WRITABLE) && writeFrames(interface))
+    event = true;
+
+  if (event && interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static void onTransmitRequest(uv_async_t *handle)
+{
+  struct Can * const interface = uv_handle_get_data((uv_handle_t *)handle);
+
+  if (writeFrames(interface) && interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static size_t packFrame(const struct CANFlexibleDataMessage *message,
+    struct canfd_frame *frame)
+{
+  memset(frame, 0, sizeof(*frame));
+
+  if (message->flags & CAN_EXT_ID)
+  {
+    assert(message->id < (1UL << 29));
+    frame->can_id = message->id | CAN_EFF_FLAG;
+  }
+  else
+  {
+    assert(message->id < (1UL << 11));
+    frame->can_id = message->id;
+  }
+
+  if (message->flags & CAN_FD)
+  {
+    assert(message->length <= CANFD_MAX_DLEN);
+
+    if (message->flags & CAN_BRS)
+      frame->flags |= CANFD_BRS;
+
+    /* Payload is padded with zeros up to the next valid length */
+    memcpy(frame->data, message->data, message->length);
+    frame->len = canDlcToLength(canLengthToDlc(message->length));
+
+    return CANFD_MTU;
+  }
+  else
+  {
+    assert(message->length <= CAN_MAX_DLEN);
+
+    if (message->flags & CAN_RTR)
+      frame->can_id |= CAN_RTR_FLAG;
+    else
+      memcpy(frame->data, message->data, message->length);
+
+    frame->len = message->length;
+    return CAN_MTU;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static bool readFrames(struct Can *interface)
+{
+  struct canfd_frame frames[BATCH_SIZE];
+  struct mmsghdr messages[BATCH_SIZE];
+  struct iovec vectors[BATCH_SIZE];
+  uint8_t controls[BATCH_SIZE][CONTROL_SIZE];
+  bool event = false;
+  int count;
+
+  pthread_mutex_lock(&interface->lock);
+
+  do
+  {
+    memset(messages, 0, sizeof(messages));
+
+    for (size_t index = 0; index < BATCH_SIZE; ++index)
+    {
+      vectors[index].iov_base = &frames[index];
+      vectors[index].iov_len = sizeof(frames[index]);
+      messages[index].msg_hdr.msg_iov = &vectors[index];
+      messages[index].msg_hdr.msg_iovlen = 1;
+      messages[index].msg_hdr.msg_control = controls[index];
+      messages[index].msg_hdr.msg_controllen = sizeof(controls[index]);
+    }
+
+    /* Receive multiple frames with a single system call */
+    count = recvmmsg(interface->descriptor, messages, BATCH_SIZE,
+        MSG_DONTWAIT, NULL);
+
+    for (int index = 0; index < count; ++index)
+    {
+      struct msghdr * const header = &messages[index].msg_hdr;
+      const struct canfd_frame * const frame = &frames[index];
+      const bool fd = messages[index].msg_len == CANFD_MTU;
+      uint64_t timestamp = getTimestamp(interface);
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg != NULL;
+          cmsg = CMSG_NXTHDR(header, cmsg))
+      {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+          continue;
+
+        if (cmsg->cmsg_type == SO_TIMESTAMP && interface->timer == NULL
+            && interface->timer64 == NULL)
+        {
+          struct timeval time;
+
+          memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+          timestamp = (uint64_t)time.tv_sec * 1000000 + time.tv_usec;
+        }
+        else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+          uint32_t drops;
+
+          /* Kernel reports a total number of dropped frames */
+          memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+          interface->overrunCount += drops - interface->drops;
+          interface->drops = drops;
+        }
+      }
+
+      if (!fd && messages[index].msg_len != CAN_MTU)
+        continue;
+
+      if (frame->can_id & CAN_ERR_FLAG)
+      {
+        ++interface->errorCount;
+        continue;
+      }
+
+      if (!canFilterSetMatch(&interface->filters,
+          frame->can_id & CAN_EFF_MASK, (frame->can_id & CAN_EFF_FLAG) != 0))
+      {
+        continue;
+      }
+
+      if (!pointerQueueFull(&interface->rxQueue))
+      {
+        struct CANFlexibleDataMessage * const message =
+            pointerArrayBack(&interface->pool);
+        pointerArrayPopBack(&interface->pool);
+
+        unpackFrame(frame, fd, message);
+        message->timestamp = timestamp;
+
+        /* Frames sent by this socket are received back in loopback mode */
+        if (header->msg_flags & MSG_CONFIRM)
+          message->flags |= CAN_SELF_RX;
+
+        pointerQueuePushBack(&interface->rxQueue, message);
+        ++interface->rxCount;
+        event = true;
+      }
+      else
+        ++interface->overrunCount;
+    }
+  }
+  while (count == BATCH_SIZE);
+
+  if (pointerQueueSize(&interface->rxQueue) > interface->rxWatermark)
+    interface->rxWatermark = pointerQueueSize(&interface->rxQueue);
+
+  pthread_mutex_unlock(&interface->lock);
+  return event;
+}
+/*----------------------------------------------------------------------------*/
+static void resetQueues(struct Can *interface)
+{
+  pthread_mutex_lock(&interface->lock);
+
+  while (!pointerQueueEmpty(&interface->txQueue))
+  {
+    struct CANFlexibleDataMessage * const message =
+        pointerQueueFront(&interface->txQueue);
+
+    pointerQueuePopFront(&interface->txQueue);
+    pointerArrayPushBack(&interface->pool, message);
+  }
+
+  while (!pointerQueueEmpty(&interface->rxQueue))
+  {
+    struct CANFlexibleDataMessage * const message =
+        pointerQueueFront(&interface->rxQueue);
+
+    pointerQueuePopFront(&interface->rxQueue);
+    pointerArrayPushBack(&interface->pool, message);
+  }
+
+  pthread_mutex_unlock(&interface->lock);
+}
+/*----------------------------------------------------------------------------*/
+static size_t sendFrames(struct Can *interface,
+    const struct canfd_frame *frames, const size_t *sizes, size_t count)
+{
+  struct mmsghdr messages[BATCH_SIZE];
+  struct iovec vectors[BATCH_SIZE];
+
+  assert(count <= BATCH_SIZE);
+  memset(messages, 0, sizeof(messages));
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    vectors[index].iov_base = (void *)&frames[index];
+    vectors[index].iov_len = sizes[index];
+    messages[index].msg_hdr.msg_iov = &vectors[index];
+    messages[index].msg_hdr.msg_iovlen = 1;
+  }
+
+  /* Socket is full when the call fails with EAGAIN or ENOBUFS */
+  const int sent = sendmmsg(interface->descriptor, messages,
+      (unsigned int)count, MSG_DONTWAIT);
+
+  if (sent <= 0)
+    return 0;
+
+  interface->txCount += (uint32_t)sent;
+  return (size_t)sent;
+}
+/*----------------------------------------------------------------------------*/
+static void setBusMode(struct Can *interface, enum Mode mode)
+{
+  if (interface->mode != mode)
+  {
+    const int own = mode == MODE_LOOPBACK;
+
+    /*
+     * Frames transmitted by the socket are received back in loopback mode.
+     * Notice: unlike hardware controllers, frames are still delivered
+     * to other sockets bound to the same network interface.
+     */
+    setsockopt(interface->descriptor, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS,
+        &own, sizeof(own));
+
+    interface->mode = mode;
+
+    /* Return pending message descriptors to the pool */
+    resetQueues(interface);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result setupSocket(struct Can *interface,
+    const struct CanConfig *config)
+{
+  static const can_err_mask_t errors = CAN_ERR_MASK;
+  static const int enabled = 1;
+  static const int disabled = 0;
+
+  const unsigned int index = if_nametoindex(config->device);
+
+  if (!index)
+    return E_VALUE;
+
+  interface->descriptor = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (interface->descriptor == -1)
+    return E_INTERFACE;
+
+  const struct sockaddr_can address = {
+      .can_family = AF_CAN,
+      .can_ifindex = (int)index
+  };
+
+  if (bind(interface->descriptor, (const struct sockaddr *)&address,
+      sizeof(address)) == -1)
+  {
+    close(interface->descriptor);
+    return E_BUSY;
+  }
+
+  /* Receive error frames, time stamps and counters of dropped frames */
+  if (setsockopt(interface->descriptor, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+          &errors, sizeof(errors)) == -1
+      || setsockopt(interface->descriptor, SOL_CAN_RAW,
+          CAN_RAW_RECV_OWN_MSGS, &disabled, sizeof(disabled)) == -1
+      || setsockopt(interface->descriptor, SOL_SOCKET, SO_TIMESTAMP,
+          &enabled, sizeof(enabled)) == -1
+      || setsockopt(interface->descriptor, SOL_SOCKET, SO_RXQ_OVFL,
+          &enabled, sizeof(enabled)) == -1)
+  {
+    close(interface->descriptor);
+    return E_INTERFACE;
+  }
+
+  struct ifreq request;
+
+  /* Flexible data-rate frames are enabled on request when supported */
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, config->device, IFNAMSIZ - 1);
+
+  interface->fd = config->fd
+      && ioctl(interface->descriptor, SIOCGIFMTU, &request) == 0
+      && request.ifr_mtu == CANFD_MTU
+      && setsockopt(interface->descriptor, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+          &enabled, sizeof(enabled)) == 0;
+
+  fcntl(interface->descriptor, F_SETFL, O_NONBLOCK);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void unpackFrame(const struct canfd_frame *frame, bool fd,
+    struct CANFlexibleDataMessage *message)
+{
+  const uint8_t capacity = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+  const uint8_t length = MIN(frame->len, capacity);
+
+  message->flags = 0;
+  message->length = length;
+
+  if (frame->can_id & CAN_EFF_FLAG)
+  {
+    message->id = frame->can_id & CAN_EFF_MASK;
+    message->flags |= CAN_EXT_ID;
+  }
+  else
+    message->id = frame->can_id & CAN_SFF_MASK;
+
+  if (fd)
+  {
+    message->flags |= CAN_FD;
+
+    if (frame->flags & CANFD_BRS)
+      message->flags |= CAN_BRS;
+    if (frame->flags & CANFD_ESI)
+      message->flags |= CAN_ESI;
+
+    memcpy(message->data, frame->data, length);
+  }
+  else if (frame->can_id & CAN_RTR_FLAG)
+    message->flags |= CAN_RTR;
+  else
+    memcpy(message->data, frame->data, length);
+}
+/*----------------------------------------------------------------------------*/
+static bool writeFrames(struct Can *interface)
+{
+  bool sent = false;
+  int events = UV_READABLE;
+
+  pthread_mutex_lock(&interface->lock);
+
+  if (pointerQueueSize(&interface->txQueue) > interface->txWatermark)
+    interface->txWatermark = pointerQueueSize(&interface->txQueue);
+
+  while (!pointerQueueEmpty(&interface->txQueue))
+  {
+    struct canfd_frame frames[BATCH_SIZE];
+    size_t sizes[BATCH_SIZE];
+    const size_t count = MIN(pointerQueueSize(&interface->txQueue),
+        BATCH_SIZE);
+
+    for (size_t index = 0; index < count; ++index)
+    {
+      sizes[index] = packFrame(*pointerQueueAt(&interface->txQueue, index),
+          &frames[index]);
+    }
+
+    const size_t number = sendFrames(interface, frames, sizes, count);
+
+    for (size_t index = 0; index < number; ++index)
+    {
+      struct CANFlexibleDataMessage * const message =
+          pointerQueueFront(&interface->txQueue);
+
+      pointerQueuePopFront(&interface->txQueue);
+      pointerArrayPushBack(&interface->pool, message);
+    }
+
+    if (number < count)
+    {
+      /* Wait until the socket is ready to accept more frames */
+      events |= UV_WRITABLE;
+      break;
+    }
+
+    sent = true;
+  }
+
+  pthread_mutex_unlock(&interface->lock);
+
+  if (events != interface->events)
+  {
+    interface->events = events;
+    uv_poll_start(interface->listener, events, onInterfaceCallback);
+  }
+
+  /* Notify the user when the queue was drained */
+  return sent && !(events & UV_WRITABLE);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result canInit(void *object, const void *configBase)
+{
+  const struct CanConfig * const config = configBase;
+  assert(config != NULL);
+  assert(config->device != NULL);
+  assert(config->rxBuffers && config->txBuffers);
+
+  struct Can * const interface = object;
+  const size_t poolSize = config->rxBuffers + config->txBuffers;
+  enum Result res;
+
+  interface->callback = NULL;
+  interface->timer = config->timer;
+  interface->timer64 = config->timer64;
+  interface->events = UV_READABLE;
+  interface->rate = config->rate;
+  interface->drops = 0;
+  interface->mode = MODE_LISTENER;
+  interface->fd = false;
+  interface->rxWatermark = 0;
+  interface->txWatermark = 0;
+
+  interface->errorCount = 0;
+  interface->overrunCount = 0;
+  interface->rxCount = 0;
+  interface->txCount = 0;
+
+  if (pthread_mutex_init(&interface->lock, 0))
+    return E_ERROR;
+
+  if (!pointerArrayInit(&interface->pool, poolSize))
+  {
+    cleanup(interface, CLEANUP_MUTEX);
+    return E_MEMORY;
+  }
+  if (!pointerQueueInit(&interface->rxQueue, config->rxBuffers))
+  {
+    cleanup(interface, CLEANUP_POOL);
+    return E_MEMORY;
+  }
+  if (!pointerQueueInit(&interface->txQueue, config->txBuffers))
+  {
+    cleanup(interface, CLEANUP_RX_QUEUE);
+    return E_MEMORY;
+  }
+
+  interface->arena = malloc(sizeof(struct CANFlexibleDataMessage) * poolSize);
+  if (interface->arena == NULL)
+  {
+    cleanup(interface, CLEANUP_TX_QUEUE);
+    return E_MEMORY;
+  }
+
+  if (!canFilterSetInit(&interface->filters, config->filters))
+  {
+    cleanup(interface, CLEANUP_ARENA);
+    return E_MEMORY;
+  }
+
+  interface->listener = malloc(sizeof(uv_poll_t));
+  if (interface->listener == NULL)
+  {
+    cleanup(interface, CLEANUP_FILTERS);
+    return E_MEMORY;
+  }
+
+  interface->notifier = malloc(sizeof(uv_async_t));
+  if (interface->notifier == NULL)
+  {
+    cleanup(interface, CLEANUP_LISTENER);
+    return E_MEMORY;
+  }
+
+  if ((res = setupSocket(interface, config)) != E_OK)
+  {
+    cleanup(interface, CLEANUP_NOTIFIER);
+    return res;
+  }
+
+  struct CANFlexibleDataMessage *message = interface->arena;
+
+  for (size_t index = 0; index < poolSize; ++index)
+  {
+    pointerArrayPushBack(&interface->pool, message);
+    ++message;
+  }
+
+  uv_poll_init_socket(uv_default_loop(), interface->listener,
+      interface->descriptor);
+  uv_handle_set_data((uv_handle_t *)interface->listener, interface);
+  uv_poll_start(interface->listener, UV_READABLE, onInterfaceCallback);
+
+  uv_async_init(uv_default_loop(), interface->notifier, onTransmitRequest);
+  uv_handle_set_data((uv_handle_t *)interface->notifier, interface);
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void canDeinit(void *object)
+{
+  cleanup(object, CLEANUP_ALL);
+}
+/*----------------------------------------------------------------------------*/
+static void canSetCallback(void *object, void (*callback)(void *),
+    void *argument)
+{
+  struct Can * const interface = object;
+
+  interface->callbackArgument = argument;
+  interface->callback = callback;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result canGetParam(void *object, int parameter, void *data)
+{
+  struct Can * const interface = object;
+
+  switch ((enum CANParameter)parameter)
+  {
+    case IF_CAN_ERRORS:
+      *(uint32_t *)data = interface->errorCount;
+      return E_OK;
+
+    case IF_CAN_OVERRUNS:
+      *(uint32_t *)data = interface->overrunCount;
+      return E_OK;
+
+    case IF_CAN_RX_COUNT:
+      *(uint32_t *)data = interface->rxCount;
+      return E_OK;
+
+    case IF_CAN_TX_COUNT:
+      *(uint32_t *)data = interface->txCount;
+      return E_OK;
+
+    default:
+      break;
+  }
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_RX_AVAILABLE:
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = pointerQueueSize(&interface->rxQueue);
+      pthread_mutex_unlock(&interface->lock);
+      return E_OK;
+
+    case IF_RX_PENDING:
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = pointerQueueCapacity(&interface->rxQueue)
+          - pointerQueueSize(&interface->rxQueue);
+      pthread_mutex_unlock(&interface->lock);
+      return E_OK;
+
+    case IF_TX_AVAILABLE:
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = pointerQueueCapacity(&interface->txQueue)
+          - pointerQueueSize(&interface->txQueue);
+      pthread_mutex_unlock(&interface->lock);
+      return E_OK;
+
+    case IF_TX_PENDING:
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = pointerQueueSize(&interface->txQueue);
+      pthread_mutex_unlock(&interface->lock);
+      return E_OK;
+
+    case IF_RX_WATERMARK:
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = interface->rxWatermark;
+      pthread_mutex_unlock(&interface->lock);
+      return E_OK;
+
+    case IF_TX_WATERMARK:
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = interface->txWatermark;
+      pthread_mutex_unlock(&interface->lock);
+      return E_OK;
+
+    case IF_RATE:
+      *(uint32_t *)data = interface->rate;
+      return E_OK;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result canSetParam(void *object, int parameter, const void *data)
+{
+  struct Can * const interface = object;
+
+  switch ((enum CANParameter)parameter)
+  {
+    case IF_CAN_ACTIVE:
+      setBusMode(interface, MODE_ACTIVE);
+      return E_OK;
+
+    case IF_CAN_LISTENER:
+      setBusMode(interface, MODE_LISTENER);
+      return E_OK;
+
+    case IF_CAN_LOOPBACK:
+      setBusMode(interface, MODE_LOOPBACK);
+      return E_OK;
+
+    case IF_CAN_FILTER_ADD_STD:
+      return filterAdd(interface, data, false) ? E_OK : E_FULL;
+
+    case IF_CAN_FILTER_REMOVE_STD:
+      return filterRemove(interface, data, false) ? E_OK : E_VALUE;
+
+    case IF_CAN_FILTER_ADD_EXT:
+      return filterAdd(interface, data, true) ? E_OK : E_FULL;
+
+    case IF_CAN_FILTER_REMOVE_EXT:
+      return filterRemove(interface, data, true) ? E_OK : E_VALUE;
+
+    default:
+      break;
+  }
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_RATE:
+    {
+      const uint32_t rate = *(const uint32_t *)data;
+
+      if (rate)
+      {
+        interface->rate = rate;
+        return E_OK;
+      }
+      else
+        return E_VALUE;
+    }
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static size_t canRead(void *object, void *buffer, size_t length)
+{
+  struct Can * const interface = object;
+  size_t position = 0;
+
+  pthread_mutex_lock(&interface->lock);
+
+  while (!pointerQueueEmpty(&interface->rxQueue) && position < length)
+  {
+    struct CANFlexibleDataMessage * const message =
+        pointerQueueFront(&interface->rxQueue);
+    const size_t size = (message->flags & CAN_FD) ?
+        sizeof(struct CANFlexibleDataMessage) :
+        sizeof(struct CANStandardMessage);
+
+    if (length - position < size)
+    {
+      /* Stop when the next frame does not fit into the remaining space */
+      if (position)
+        break;
+
+      /* Drop the frame that does not fit into the whole buffer */
+      pointerQueuePopFront(&interface->rxQueue);
+      pointerArrayPushBack(&interface->pool, message);
+      continue;
+    }
+
+    memcpy((uint8_t *)buffer + position, message, size);
+
+    pointerQueuePopFront(&interface->rxQueue);
+    pointerArrayPushBack(&interface->pool, message);
+
+    position += size;
+  }
+
+  pthread_mutex_unlock(&interface->lock);
+  return position;
+}
+/*----------------------------------------------------------------------------*/
+static size_t canWrite(void *object, const void *buffer, size_t length)
+{
+  struct Can * const interface = object;
+  size_t position = 0;
+  bool error = false;
+
+  /* Transmission is disabled in listener mode */
+  if (interface->mode == MODE_LISTENER)
+    return 0;
+
+  pthread_mutex_lock(&interface->lock);
+
+  if (pointerQueueEmpty(&interface->txQueue))
+  {
+    /* Send frames directly while the socket accepts them */
+    while (!error && position < length)
+    {
+      struct canfd_frame frames[BATCH_SIZE];
+      size_t records[BATCH_SIZE];
+      size_t sizes[BATCH_SIZE];
+      size_t count = 0;
+
+      for (size_t offset = position; offset < length && count < BATCH_SIZE;)
+      {
+        struct CANFlexibleDataMessage message;
+        const size_t record = fetchMessage(interface,
+            (const uint8_t *)buffer + offset, length - offset, &message);
+
+        if (!record)
+        {
+          /* Stop on an incorrect frame */
+          error = true;
+          break;
+        }
+
+        sizes[count] = packFrame(&message, &frames[count]);
+        records[count] = record;
+        offset += record;
+        ++count;
+      }
+
+      if (!count)
+        break;
+
+      const size_t sent = sendFrames(interface, frames, sizes, count);
+
+      for (size_t index = 0; index < sent; ++index)
+        position += records[index];
+
+      if (sent < count)
+        break;
+    }
+  }
+
+  while (!error && position < length && !pointerQueueFull(&interface->txQueue))
+  {
+    struct CANFlexibleDataMessage * const message =
+        pointerArrayBack(&interface->pool);
+    const size_t record = fetchMessage(interface,
+        (const uint8_t *)buffer + position, length - position, message);
+
+    if (record)
+    {
+      pointerArrayPopBack(&interface->pool);
+      pointerQueuePushBack(&interface->txQueue, message);
+
+      position += record;
+    }
+    else
+    {
+      /* Stop on an incorrect frame */
+      error = true;
+    }
+  }
+
+  const bool pending = !pointerQueueEmpty(&interface->txQueue);
+
+  pthread_mutex_unlock(&interface->lock);
+
+  /* Queued frames are sent from the event loop */
+  if (pending)
+    uv_async_send(interface->notifier);
+
+  return position;
+}
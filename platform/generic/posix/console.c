@@ -5,25 +5,14 @@
  */
 
 #include <halm/platform/generic/console.h>
-#include <xcore/containers/byte_queue.h>
+#include <halm/platform/generic/posix/stream_ring.h>
 #include <uv.h>
-#include <pthread.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
 /*----------------------------------------------------------------------------*/
-#define BUFFER_SIZE 64
-#define QUEUE_SIZE  2048
+#define QUEUE_SIZE 2048
 /*----------------------------------------------------------------------------*/
-enum Cleanup
-{
-  CLEANUP_ALL,
-  CLEANUP_THREAD,
-  CLEANUP_MUTEX,
-  CLEANUP_SEMAPHORE,
-  CLEANUP_QUEUE
-};
-
 struct Console
 {
   struct Interface base;
@@ -31,8 +20,13 @@ struct Console
   void (*callback)(void *);
   void *callbackArgument;
 
-  struct ByteQueue rxQueue;
-  pthread_mutex_t rxQueueLock;
+  /* Input queue filled from the event loop */
+  struct StreamRing rxQueue;
+
+  /* Transfer counters */
+  _Atomic uint64_t rxBytes;
+  _Atomic uint64_t rxOverruns;
+  _Atomic uint64_t txBytes;
 
   struct termios initialSettings;
   uv_poll_t *listener;
@@ -84,13 +78,14 @@ static void onCloseCallback(uv_handle_t *handle)
 static void onInterfaceCallback(uv_poll_t *handle, int, int)
 {
   struct Console * const interface = handle->data;
-  uint8_t buffer[BUFFER_SIZE];
-  ssize_t length;
+  size_t dropped;
+  const size_t received =
+      streamRingPushFrom(&interface->rxQueue, STDIN_FILENO, &dropped);
 
-  pthread_mutex_lock(&interface->rxQueueLock);
-  while ((length = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
-    byteQueuePushArray(&interface->rxQueue, buffer, (size_t)length);
-  pthread_mutex_unlock(&interface->rxQueueLock);
+  atomic_fetch_add_explicit(&interface->rxBytes, (uint64_t)received,
+      memory_order_relaxed);
+  atomic_fetch_add_explicit(&interface->rxOverruns, (uint64_t)dropped,
+      memory_order_relaxed);
 
   if (interface->callback != NULL)
     interface->callback(interface->callbackArgument);
@@ -102,18 +97,15 @@ static enum Result streamInit(void *object, const void *)
   enum Result res;
 
   interface->callback = NULL;
-
-  if (pthread_mutex_init(&interface->rxQueueLock, 0))
-    return E_ERROR;
+  atomic_init(&interface->rxBytes, 0);
+  atomic_init(&interface->rxOverruns, 0);
+  atomic_init(&interface->txBytes, 0);
 
   interface->listener = malloc(sizeof(uv_poll_t));
   if (interface->listener == NULL)
-  {
-    res = E_MEMORY;
-    goto free_mutex;
-  }
+    return E_MEMORY;
 
-  if (!byteQueueInit(&interface->rxQueue, QUEUE_SIZE))
+  if (!streamRingInit(&interface->rxQueue, QUEUE_SIZE))
   {
     res = E_MEMORY;
     goto free_listener;
@@ -129,8 +121,6 @@ static enum Result streamInit(void *object, const void *)
 
 free_listener:
   free(interface->listener);
-free_mutex:
-  pthread_mutex_destroy(&interface->rxQueueLock);
   return res;
 }
 /*----------------------------------------------------------------------------*/
@@ -144,8 +134,7 @@ static void streamDeinit(void *object)
   /* Restore terminal settings */
   tcsetattr(STDIN_FILENO, TCSANOW, &interface->initialSettings);
 
-  byteQueueDeinit(&interface->rxQueue);
-  pthread_mutex_destroy(&interface->rxQueueLock);
+  streamRingDeinit(&interface->rxQueue);
 }
 /*----------------------------------------------------------------------------*/
 static void streamSetCallback(void *object, void (*callback)(void *),
@@ -161,19 +150,33 @@ static enum Result streamGetParam(void *object, int parameter, void *data)
 {
   struct Console *interface = object;
 
+  switch ((enum StreamStatisticsParameter)parameter)
+  {
+    case IF_STREAM_STATISTICS:
+    {
+      struct StreamStatistics * const statistics = data;
+
+      statistics->rxBytes = atomic_load_explicit(&interface->rxBytes,
+          memory_order_relaxed);
+      statistics->rxOverruns = atomic_load_explicit(&interface->rxOverruns,
+          memory_order_relaxed);
+      statistics->txBytes = atomic_load_explicit(&interface->txBytes,
+          memory_order_relaxed);
+      return E_OK;
+    }
+
+    default:
+      break;
+  }
+
   switch ((enum IfParameter)parameter)
   {
     case IF_RX_AVAILABLE:
-      pthread_mutex_lock(&interface->rxQueueLock);
-      *(size_t *)data = byteQueueSize(&interface->rxQueue);
-      pthread_mutex_unlock(&interface->rxQueueLock);
+      *(size_t *)data = streamRingSize(&interface->rxQueue);
       return E_OK;
 
     case IF_RX_PENDING:
-      pthread_mutex_lock(&interface->rxQueueLock);
-      *(size_t *)data = byteQueueCapacity(&interface->rxQueue)
-          - byteQueueSize(&interface->rxQueue);
-      pthread_mutex_unlock(&interface->rxQueueLock);
+      *(size_t *)data = streamRingSpace(&interface->rxQueue);
       return E_OK;
 
     case IF_TX_AVAILABLE:
@@ -197,23 +200,22 @@ static enum Result streamSetParam(void *, int, const void *)
 static size_t streamRead(void *object, void *buffer, size_t length)
 {
   struct Console * const interface = object;
-
-  pthread_mutex_lock(&interface->rxQueueLock);
-  const size_t read = byteQueuePopArray(&interface->rxQueue, buffer, length);
-  pthread_mutex_unlock(&interface->rxQueueLock);
-
-  return read;
+  return streamRingPop(&interface->rxQueue, buffer, length);
 }
 /*----------------------------------------------------------------------------*/
-static size_t streamWrite(void *, const void *buffer, size_t length)
+static size_t streamWrite(void *object, const void *buffer, size_t length)
 {
+  struct Console * const interface = object;
+
   if (!length)
     return 0;
 
   const ssize_t written = write(STDOUT_FILENO, buffer, length);
 
-  if (written)
+  if (written > 0)
   {
+    atomic_fetch_add_explicit(&interface->txBytes, (uint64_t)written,
+        memory_order_relaxed);
     fsync(STDOUT_FILENO);
     return (size_t)written;
   }
@@ -6,48 +6,157 @@
 
 #include <halm/platform/generic/mmf.h>
 #include <xcore/memory.h>
+#include <uv.h>
+#include <assert.h>
 #include <fcntl.h>
 #include <semaphore.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 /*----------------------------------------------------------------------------*/
-static enum Result mmfInit(void *, const void *);
-static void mmfDeinit(void *);
-static enum Result mmfGetParam(void *, int, void *);
-static enum Result mmfSetParam(void *, int, const void *);
-static size_t mmfRead(void *, void *, size_t);
-static size_t mmfWrite(void *, const void *, size_t);
-/*----------------------------------------------------------------------------*/
 struct MemoryMappedFile
 {
   struct Interface base;
 
-  off_t position;
-  off_t offset;
-  off_t size;
+  void (*callback)(void *);
+  void *callbackArgument;
+
+  uint64_t position;
+  uint64_t offset;
+  uint64_t size;
 
   sem_t semaphore;
 
+  /* Periodic writeback timer */
+  uv_timer_t *timer;
+  /* Request for the thread pool of the event loop */
+  uv_work_t work;
+
+  /* Pending zero-copy transfer */
+  struct
+  {
+    uint8_t *buffer;
+    uint8_t *data;
+    size_t length;
+    bool write;
+  } transfer;
+
   struct stat info;
   uint8_t *data;
+  size_t length;
   int file;
+
+  /* Status of the last transfer */
+  enum Result status;
+  /* Enable blocking mode */
+  bool blocking;
 };
 /*----------------------------------------------------------------------------*/
+static void onCloseCallback(uv_handle_t *);
+static void onFlushCallback(uv_timer_t *);
+static void onTransferCompleted(uv_work_t *, int);
+static void onTransferWork(uv_work_t *);
+static size_t transferData(struct MemoryMappedFile *, void *, size_t, bool);
+/*----------------------------------------------------------------------------*/
+static enum Result mmfInit(void *, const void *);
+static void mmfDeinit(void *);
+static void mmfSetCallback(void *, void (*)(void *), void *);
+static enum Result mmfGetParam(void *, int, void *);
+static enum Result mmfSetParam(void *, int, const void *);
+static size_t mmfRead(void *, void *, size_t);
+static size_t mmfWrite(void *, const void *, size_t);
+/*----------------------------------------------------------------------------*/
 const struct InterfaceClass * const MemoryMappedFile =
     &(const struct InterfaceClass){
     .size = sizeof(struct MemoryMappedFile),
     .init = mmfInit,
     .deinit = mmfDeinit,
 
-    .setCallback = NULL,
+    .setCallback = mmfSetCallback,
     .getParam = mmfGetParam,
     .setParam = mmfSetParam,
     .read = mmfRead,
     .write = mmfWrite
 };
 /*----------------------------------------------------------------------------*/
+static void onCloseCallback(uv_handle_t *handle)
+{
+  free(handle);
+}
+/*----------------------------------------------------------------------------*/
+static void onFlushCallback(uv_timer_t *handle)
+{
+  struct MemoryMappedFile * const dev =
+      uv_handle_get_data((uv_handle_t *)handle);
+
+  msync(dev->data, dev->length, MS_ASYNC);
+}
+/*----------------------------------------------------------------------------*/
+static void onTransferCompleted(uv_work_t *request, int status)
+{
+  struct MemoryMappedFile * const dev = uv_req_get_data((uv_req_t *)request);
+
+  dev->status = status == 0 ? E_OK : E_ERROR;
+
+  if (dev->callback != NULL)
+    dev->callback(dev->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static void onTransferWork(uv_work_t *request)
+{
+  struct MemoryMappedFile * const dev = uv_req_get_data((uv_req_t *)request);
+
+  /* Page faults are handled in the thread pool instead of the event loop */
+  if (dev->transfer.write)
+    memcpy(dev->transfer.data, dev->transfer.buffer, dev->transfer.length);
+  else
+    memcpy(dev->transfer.buffer, dev->transfer.data, dev->transfer.length);
+}
+/*----------------------------------------------------------------------------*/
+static size_t transferData(struct MemoryMappedFile *dev, void *buffer,
+    size_t length, bool write)
+{
+  if (dev->status == E_BUSY)
+    return 0;
+
+  if (dev->position >= dev->size)
+    return 0;
+  if (length > dev->size - dev->position)
+    length = (size_t)(dev->size - dev->position);
+
+  uint8_t * const data = dev->data + dev->offset + dev->position;
+
+  if (dev->blocking)
+  {
+    if (write)
+      memcpy(data, buffer, length);
+    else
+      memcpy(buffer, data, length);
+
+    dev->status = E_OK;
+  }
+  else
+  {
+    dev->transfer.buffer = buffer;
+    dev->transfer.data = data;
+    dev->transfer.length = length;
+    dev->transfer.write = write;
+    dev->status = E_BUSY;
+
+    if (uv_queue_work(uv_default_loop(), &dev->work, onTransferWork,
+        onTransferCompleted) < 0)
+    {
+      dev->status = E_ERROR;
+      return 0;
+    }
+  }
+
+  dev->position += length;
+  return length;
+}
+/*----------------------------------------------------------------------------*/
 static enum Result mmfInit(void *object, const void *configBase)
 {
   const char * const path = configBase;
@@ -57,9 +166,12 @@ static enum Result mmfInit(void *object, const void *configBase)
   if (path == NULL)
     return E_ERROR;
 
+  dev->callback = NULL;
   dev->position = 0;
   dev->offset = 0;
   dev->size = 0;
+  dev->status = E_OK;
+  dev->blocking = true;
 
   if (sem_init(&dev->semaphore, 0, 1))
     return E_ERROR;
@@ -75,8 +187,14 @@ static enum Result mmfInit(void *object, const void *configBase)
     res = E_INTERFACE;
     goto free_file;
   }
+  if ((uint64_t)dev->info.st_size > SIZE_MAX)
+  {
+    res = E_VALUE;
+    goto free_file;
+  }
 
-  dev->data = mmap(NULL, dev->info.st_size, PROT_WRITE, MAP_SHARED,
+  dev->length = (size_t)dev->info.st_size;
+  dev->data = mmap(NULL, dev->length, PROT_READ | PROT_WRITE, MAP_SHARED,
       dev->file, 0);
   if (dev->data == MAP_FAILED)
   {
@@ -84,9 +202,27 @@ static enum Result mmfInit(void *object, const void *configBase)
     goto free_file;
   }
 
-  dev->size = dev->info.st_size;
+  dev->timer = malloc(sizeof(uv_timer_t));
+  if (dev->timer == NULL)
+  {
+    res = E_MEMORY;
+    goto free_mapping;
+  }
+  if (uv_timer_init(uv_default_loop(), dev->timer) < 0)
+  {
+    free(dev->timer);
+    res = E_ERROR;
+    goto free_mapping;
+  }
+
+  uv_handle_set_data((uv_handle_t *)dev->timer, dev);
+  uv_req_set_data((uv_req_t *)&dev->work, dev);
+
+  dev->size = (uint64_t)dev->info.st_size;
   return E_OK;
 
+free_mapping:
+  munmap(dev->data, dev->length);
 free_file:
   close(dev->file);
 free_semaphore:
@@ -98,25 +234,68 @@ static void mmfDeinit(void *object)
 {
   struct MemoryMappedFile * const dev = object;
 
-  munmap(dev->data, dev->info.st_size);
+  /* Pending transfer should be completed before deinitialization */
+  assert(dev->status != E_BUSY);
+
+  uv_timer_stop(dev->timer);
+  uv_close((uv_handle_t *)dev->timer, onCloseCallback);
+
+  msync(dev->data, dev->length, MS_SYNC);
+  munmap(dev->data, dev->length);
   close(dev->file);
   sem_destroy(&dev->semaphore);
 }
 /*----------------------------------------------------------------------------*/
+static void mmfSetCallback(void *object, void (*callback)(void *),
+    void *argument)
+{
+  struct MemoryMappedFile * const dev = object;
+
+  dev->callbackArgument = argument;
+  dev->callback = callback;
+}
+/*----------------------------------------------------------------------------*/
 static enum Result mmfGetParam(void *object, int parameter, void *data)
 {
   struct MemoryMappedFile * const dev = object;
 
+  switch ((enum FlashParameter)parameter)
+  {
+    case IF_FLASH_MEMORY_MAPPED_ADDRESS:
+      *(uintptr_t *)data = (uintptr_t)(dev->data + dev->offset);
+      return E_OK;
+
+    default:
+      break;
+  }
+
   switch ((enum IfParameter)parameter)
   {
+    case IF_POSITION:
+      if (dev->position > UINT32_MAX)
+        return E_VALUE;
+
+      *(uint32_t *)data = (uint32_t)dev->position;
+      return E_OK;
+
     case IF_POSITION_64:
-      *(uint64_t *)data = (uint64_t)dev->position;
+      *(uint64_t *)data = dev->position;
+      return E_OK;
+
+    case IF_SIZE:
+      if (dev->size > UINT32_MAX)
+        return E_VALUE;
+
+      *(uint32_t *)data = (uint32_t)dev->size;
       return E_OK;
 
     case IF_SIZE_64:
-      *(uint64_t *)data = (uint64_t)dev->size;
+      *(uint64_t *)data = dev->size;
       return E_OK;
 
+    case IF_STATUS:
+      return dev->status;
+
     default:
       return E_INVALID;
   }
@@ -126,13 +305,88 @@ static enum Result mmfSetParam(void *object, int parameter, const void *data)
 {
   struct MemoryMappedFile * const dev = object;
 
+  switch ((enum MemoryMappedFileParameter)parameter)
+  {
+    case IF_MMF_FLUSH:
+      return msync(dev->data, dev->length, MS_ASYNC) == 0 ? E_OK : E_INTERFACE;
+
+    case IF_MMF_FLUSH_PERIOD:
+    {
+      const uint32_t period = *(const uint32_t *)data;
+
+      if (period)
+        uv_timer_start(dev->timer, onFlushCallback, period, period);
+      else
+        uv_timer_stop(dev->timer);
+
+      return E_OK;
+    }
+
+    case IF_MMF_ADVICE:
+    {
+      int advice;
+
+      switch (*(const enum MmfAdvice *)data)
+      {
+        case MMF_ADVICE_NORMAL:
+          advice = MADV_NORMAL;
+          break;
+
+        case MMF_ADVICE_SEQUENTIAL:
+          advice = MADV_SEQUENTIAL;
+          break;
+
+        case MMF_ADVICE_RANDOM:
+          advice = MADV_RANDOM;
+          break;
+
+#ifdef MADV_HUGEPAGE
+        case MMF_ADVICE_HUGEPAGE:
+          advice = MADV_HUGEPAGE;
+          break;
+#endif
+
+        default:
+          return E_VALUE;
+      }
+
+      return madvise(dev->data, dev->length, advice) == 0 ?
+          E_OK : E_INTERFACE;
+    }
+
+    default:
+      break;
+  }
+
+  switch ((enum FlashParameter)parameter)
+  {
+    case IF_FLASH_SYNC:
+      return msync(dev->data, dev->length, MS_SYNC) == 0 ? E_OK : E_INTERFACE;
+
+    default:
+      break;
+  }
+
   switch ((enum IfParameter)parameter)
   {
+    case IF_POSITION:
+    {
+      const uint64_t position = *(const uint32_t *)data;
+
+      if (position < dev->size)
+      {
+        dev->position = position;
+        return E_OK;
+      }
+      else
+        return E_ADDRESS;
+    }
+
     case IF_POSITION_64:
     {
-      const off_t position = (off_t)(*(const uint64_t *)data);
+      const uint64_t position = *(const uint64_t *)data;
 
-      if (position + dev->offset < dev->info.st_size)
+      if (position < dev->size)
       {
         dev->position = position;
         return E_OK;
@@ -149,6 +403,14 @@ static enum Result mmfSetParam(void *object, int parameter, const void *data)
       sem_post(&dev->semaphore);
       return E_OK;
 
+    case IF_BLOCKING:
+      dev->blocking = true;
+      return E_OK;
+
+    case IF_ZEROCOPY:
+      dev->blocking = false;
+      return E_OK;
+
     default:
       return E_INVALID;
   }
@@ -156,20 +418,10 @@ static enum Result mmfSetParam(void *object, int parameter, const void *data)
 /*----------------------------------------------------------------------------*/
 static size_t mmfRead(void *object, void *buffer, size_t length)
 {
-  struct MemoryMappedFile * const dev = object;
-
-  memcpy(buffer, dev->data + dev->offset + dev->position, length);
-  dev->position += length;
-
-  return length;
+  return transferData(object, buffer, length, false);
 }
 /*----------------------------------------------------------------------------*/
 static size_t mmfWrite(void *object, const void *buffer, size_t length)
 {
-  struct MemoryMappedFile * const dev = object;
-
-  memcpy(dev->data + dev->offset + dev->position, buffer, length);
-  dev->position += length;
-
-  return length;
+  return transferData(object, (void *)buffer, length, true);
 }
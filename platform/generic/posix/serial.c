@@ -4,19 +4,18 @@
  * Project is distributed under the terms of the MIT License
  */
 
+#include <halm/platform/generic/posix/stream_ring.h>
 #include <halm/platform/generic/serial.h>
 #include <xcore/bits.h>
-#include <xcore/containers/byte_queue.h>
 #include <uv.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 /*----------------------------------------------------------------------------*/
-#define BUFFER_SIZE 64
-#define QUEUE_SIZE  2048
+#define QUEUE_SIZE 2048
 /*----------------------------------------------------------------------------*/
 struct StreamRateEntry
 {
@@ -31,12 +30,23 @@ struct Serial
   void (*callback)(void *);
   void *callbackArgument;
 
-  struct ByteQueue rxQueue;
-  pthread_mutex_t rxQueueLock;
+  /* Input queue filled from the event loop */
+  struct StreamRing rxQueue;
+  /* Optional output queue drained from the event loop */
+  struct StreamRing txQueue;
+
+  /* Transfer counters */
+  _Atomic uint64_t rxBytes;
+  _Atomic uint64_t rxOverruns;
+  _Atomic uint64_t txBytes;
 
   struct termios initialSettings;
   uv_poll_t *listener;
+  /* Notifier for queued output data, output queue is disabled when empty */
+  uv_async_t *notifier;
   int descriptor;
+  /* Events monitored by the listener */
+  int events;
 };
 /*----------------------------------------------------------------------------*/
 static const struct StreamRateEntry rateList[] = {
@@ -62,8 +72,11 @@ static bool getPortParity(struct Serial *, uint8_t *);
 static bool getPortRate(struct Serial *, uint32_t *);
 static void onCloseCallback(uv_handle_t *);
 static void onInterfaceCallback(uv_poll_t *, int, int);
+static void onOutputRequest(uv_async_t *);
+static bool readInput(struct Serial *);
 static void setPortParameters(struct Serial *, const struct SerialConfig *);
 static bool setPortRate(struct Serial *, uint32_t);
+static bool writeOutput(struct Serial *);
 /*----------------------------------------------------------------------------*/
 static enum Result streamInit(void *, const void *);
 static void streamDeinit(void *);
@@ -149,22 +162,44 @@ static void onCloseCallback(uv_handle_t *handle)
   free(handle);
 }
 /*----------------------------------------------------------------------------*/
-static void onInterfaceCallback(uv_poll_t *handle, int, int)
+static void onInterfaceCallback(uv_poll_t *handle, int, int events)
 {
   struct Serial * const interface = uv_handle_get_data((uv_handle_t *)handle);
-  uint8_t buffer[BUFFER_SIZE];
-  ssize_t length;
 
   /* TODO Disconnect handling */
-  pthread_mutex_lock(&interface->rxQueueLock);
-  while ((length = read(interface->descriptor, buffer, sizeof(buffer))) > 0)
-    byteQueuePushArray(&interface->rxQueue, buffer, (size_t)length);
-  pthread_mutex_unlock(&interface->rxQueueLock);
+  if (events & UV_READABLE)
+    readInput(interface);
+  if (events & UV_WRITABLE)
+    writeOutput(interface);
 
   if (interface->callback != NULL)
     interface->callback(interface->callbackArgument);
 }
 /*----------------------------------------------------------------------------*/
+static void onOutputRequest(uv_async_t *handle)
+{
+  struct Serial * const interface = uv_handle_get_data((uv_handle_t *)handle);
+
+  if (writeOutput(interface) && interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+static bool readInput(struct Serial *interface)
+{
+  size_t dropped;
+  const size_t received = streamRingPushFrom(&interface->rxQueue,
+      interface->descriptor, &dropped);
+
+  if (!received)
+    return false;
+
+  atomic_fetch_add_explicit(&interface->rxBytes, (uint64_t)received,
+      memory_order_relaxed);
+  atomic_fetch_add_explicit(&interface->rxOverruns, (uint64_t)dropped,
+      memory_order_relaxed);
+  return true;
+}
+/*----------------------------------------------------------------------------*/
 static void setPortParameters(struct Serial *interface,
     const struct SerialConfig *config)
 {
@@ -237,52 +272,119 @@ static bool setPortRate(struct Serial *interface, uint32_t desiredRate)
     return false;
 }
 /*----------------------------------------------------------------------------*/
+static bool writeOutput(struct Serial *interface)
+{
+  int events = UV_READABLE;
+  bool sent = false;
+
+  while (1)
+  {
+    struct iovec vectors[2];
+    const unsigned int count =
+        streamRingPopVectors(&interface->txQueue, vectors);
+
+    if (!count)
+      break;
+
+    const ssize_t length = writev(interface->descriptor, vectors, (int)count);
+
+    if (length <= 0)
+    {
+      /* Wait until the device is ready to accept more data */
+      if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        events |= UV_WRITABLE;
+      break;
+    }
+
+    streamRingPopCommit(&interface->txQueue, (size_t)length);
+    atomic_fetch_add_explicit(&interface->txBytes, (uint64_t)length,
+        memory_order_relaxed);
+    sent = true;
+  }
+
+  if (events != interface->events)
+  {
+    interface->events = events;
+    uv_poll_start(interface->listener, events, onInterfaceCallback);
+  }
+
+  return sent;
+}
+/*----------------------------------------------------------------------------*/
 static enum Result streamInit(void *object, const void *configBase)
 {
   const struct SerialConfig * const config = configBase;
+  assert(!config->txLength || !(config->txLength & (config->txLength - 1)));
+
   struct Serial * const interface = object;
   enum Result res;
 
   interface->callback = NULL;
-
-  if (pthread_mutex_init(&interface->rxQueueLock, 0))
-    return E_ERROR;
+  interface->notifier = NULL;
+  interface->events = UV_READABLE;
+  atomic_init(&interface->rxBytes, 0);
+  atomic_init(&interface->rxOverruns, 0);
+  atomic_init(&interface->txBytes, 0);
 
   interface->listener = malloc(sizeof(uv_poll_t));
   if (interface->listener == NULL)
+    return E_MEMORY;
+
+  if (!streamRingInit(&interface->rxQueue, QUEUE_SIZE))
   {
     res = E_MEMORY;
-    goto free_mutex;
+    goto free_listener;
   }
 
-  if (!byteQueueInit(&interface->rxQueue, QUEUE_SIZE))
+  if (config->txLength)
   {
-    res = E_MEMORY;
-    goto free_listener;
+    if (!streamRingInit(&interface->txQueue, config->txLength))
+    {
+      res = E_MEMORY;
+      goto free_rx_queue;
+    }
+
+    interface->notifier = malloc(sizeof(uv_async_t));
+    if (interface->notifier == NULL)
+    {
+      res = E_MEMORY;
+      goto free_tx_queue;
+    }
   }
 
   interface->descriptor = open(config->device, O_RDWR | O_NOCTTY | O_NDELAY);
   if (interface->descriptor == -1)
   {
     res = E_INTERFACE;
-    goto free_queue;
+    goto free_notifier;
   }
 
-  fcntl(interface->descriptor, F_SETFL, 0);
+  /* Queued output requires non-blocking writes */
+  fcntl(interface->descriptor, F_SETFL,
+      interface->notifier != NULL ? O_NONBLOCK : 0);
   setPortParameters(interface, config);
 
   uv_poll_init(uv_default_loop(), interface->listener, interface->descriptor);
   uv_handle_set_data((uv_handle_t *)interface->listener, interface);
   uv_poll_start(interface->listener, UV_READABLE, onInterfaceCallback);
 
+  if (interface->notifier != NULL)
+  {
+    uv_async_init(uv_default_loop(), interface->notifier, onOutputRequest);
+    uv_handle_set_data((uv_handle_t *)interface->notifier, interface);
+  }
+
   return E_OK;
 
-free_queue:
-  byteQueueDeinit(&interface->rxQueue);
+free_notifier:
+  free(interface->notifier);
+free_tx_queue:
+  if (config->txLength)
+    streamRingDeinit(&interface->txQueue);
+free_rx_queue:
+  streamRingDeinit(&interface->rxQueue);
 free_listener:
   free(interface->listener);
-free_mutex:
-  pthread_mutex_destroy(&interface->rxQueueLock);
   return res;
 }
 /*----------------------------------------------------------------------------*/
@@ -293,12 +395,18 @@ static void streamDeinit(void *object)
   uv_handle_set_data((uv_handle_t *)interface->listener, NULL);
   uv_close((uv_handle_t *)interface->listener, onCloseCallback);
 
+  if (interface->notifier != NULL)
+  {
+    uv_handle_set_data((uv_handle_t *)interface->notifier, NULL);
+    uv_close((uv_handle_t *)interface->notifier, onCloseCallback);
+    streamRingDeinit(&interface->txQueue);
+  }
+
   /* Restore terminal settings and close device */
   tcsetattr(interface->descriptor, TCSANOW, &interface->initialSettings);
   close(interface->descriptor);
 
-  byteQueueDeinit(&interface->rxQueue);
-  pthread_mutex_destroy(&interface->rxQueueLock);
+  streamRingDeinit(&interface->rxQueue);
 }
 /*----------------------------------------------------------------------------*/
 static void streamSetCallback(void *object, void (*callback)(void *),
@@ -335,27 +443,43 @@ static enum Result streamGetParam(void *object, int parameter, void *data)
       break;
   }
 
+  switch ((enum StreamStatisticsParameter)parameter)
+  {
+    case IF_STREAM_STATISTICS:
+    {
+      struct StreamStatistics * const statistics = data;
+
+      statistics->rxBytes = atomic_load_explicit(&interface->rxBytes,
+          memory_order_relaxed);
+      statistics->rxOverruns = atomic_load_explicit(&interface->rxOverruns,
+          memory_order_relaxed);
+      statistics->txBytes = atomic_load_explicit(&interface->txBytes,
+          memory_order_relaxed);
+      return E_OK;
+    }
+
+    default:
+      break;
+  }
+
   switch ((enum IfParameter)parameter)
   {
     case IF_RX_AVAILABLE:
-      pthread_mutex_lock(&interface->rxQueueLock);
-      *(size_t *)data = byteQueueSize(&interface->rxQueue);
-      pthread_mutex_unlock(&interface->rxQueueLock);
+      *(size_t *)data = streamRingSize(&interface->rxQueue);
       return E_OK;
 
     case IF_RX_PENDING:
-      pthread_mutex_lock(&interface->rxQueueLock);
-      *(size_t *)data = byteQueueCapacity(&interface->rxQueue)
-          - byteQueueSize(&interface->rxQueue);
-      pthread_mutex_unlock(&interface->rxQueueLock);
+      *(size_t *)data = streamRingSpace(&interface->rxQueue);
       return E_OK;
 
     case IF_TX_AVAILABLE:
-      *(size_t *)data = 0;
+      *(size_t *)data = interface->notifier != NULL ?
+          streamRingSpace(&interface->txQueue) : 0;
       return E_OK;
 
     case IF_TX_PENDING:
-      *(size_t *)data = 0;
+      *(size_t *)data = interface->notifier != NULL ?
+          streamRingSize(&interface->txQueue) : 0;
       return E_OK;
 
     case IF_RATE:
@@ -398,21 +522,32 @@ static enum Result streamSetParam(void *object, int parameter, const void *data)
 static size_t streamRead(void *object, void *buffer, size_t length)
 {
   struct Serial * const interface = object;
-
-  pthread_mutex_lock(&interface->rxQueueLock);
-  const size_t read = byteQueuePopArray(&interface->rxQueue, buffer, length);
-  pthread_mutex_unlock(&interface->rxQueueLock);
-
-  return read;
+  return streamRingPop(&interface->rxQueue, buffer, length);
 }
 /*----------------------------------------------------------------------------*/
 static size_t streamWrite(void *object, const void *buffer, size_t length)
 {
   struct Serial * const interface = object;
+
+  if (interface->notifier != NULL)
+  {
+    const size_t pushed = streamRingPush(&interface->txQueue, buffer, length);
+
+    /* Output queue is drained from the event loop thread */
+    if (pushed)
+      uv_async_send(interface->notifier);
+
+    return pushed;
+  }
+
   const ssize_t result = write(interface->descriptor, buffer, length);
 
   if (result != -1)
+  {
+    atomic_fetch_add_explicit(&interface->txBytes, (uint64_t)result,
+        memory_order_relaxed);
     return result;
+  }
   else
     return 0;
 }
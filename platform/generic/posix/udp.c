@@ -6,6 +6,7 @@
 
 #include <halm/platform/generic/udp.h>
 #include <xcore/containers/byte_queue.h>
+#include <xcore/helpers.h>
 #include <uv.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -14,6 +15,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 /*----------------------------------------------------------------------------*/
+#define BATCH_SIZE  16
 #define BUFFER_SIZE 1536
 #define QUEUE_SIZE  2048
 /*----------------------------------------------------------------------------*/
@@ -21,9 +23,12 @@ enum Cleanup
 {
   CLEANUP_ALL,
   CLEANUP_NETWORK,
+  CLEANUP_ARENA,
   CLEANUP_LISTENER,
   CLEANUP_MUTEX,
-  CLEANUP_QUEUE
+  CLEANUP_NOTIFIER,
+  CLEANUP_QUEUE,
+  CLEANUP_TX_QUEUE
 };
 
 struct Udp
@@ -34,18 +39,38 @@ struct Udp
   void *callbackArgument;
 
   struct ByteQueue rxQueue;
-  pthread_mutex_t rxQueueLock;
+  struct ByteQueue txQueue;
+  pthread_mutex_t lock;
+
+  /* Buffers for batched reception and transmission */
+  uint8_t *arena;
 
   uv_poll_t *listener;
+  uv_async_t *notifier;
   int client;
   int server;
+
+  /* Length of the datagram at the head of the queue in packet mode */
+  uint16_t rxPacketLength;
+  /* Preserve datagram boundaries */
+  bool packets;
+  /* Reception is suspended until the input queue is drained */
+  bool paused;
+  /* Output is queued and transmitted from the event loop */
+  bool queued;
 };
 /*----------------------------------------------------------------------------*/
 static void cleanup(struct Udp *, enum Cleanup);
+static size_t getRxSlots(const struct Udp *);
 static void onCloseCallback(uv_handle_t *);
 static void onInterfaceCallback(uv_poll_t *, int, int);
+static void onLoopRequest(uv_async_t *);
+static void pushDatagram(struct Udp *, const uint8_t *, size_t);
+static size_t queueOutput(struct Udp *, const uint8_t *, size_t);
+static size_t sendBatched(struct Udp *, const uint8_t *, size_t);
 static enum Result setupSockets(struct Udp *,
     const struct UdpConfig *);
+static void writeOutput(struct Udp *);
 /*----------------------------------------------------------------------------*/
 static enum Result streamInit(void *, const void *);
 static void streamDeinit(void *);
@@ -72,6 +97,8 @@ static void cleanup(struct Udp *interface, enum Cleanup step)
   switch (step)
   {
     case CLEANUP_ALL:
+      uv_handle_set_data((uv_handle_t *)interface->notifier, NULL);
+      uv_close((uv_handle_t *)interface->notifier, onCloseCallback);
       uv_handle_set_data((uv_handle_t *)interface->listener, NULL);
       uv_close((uv_handle_t *)interface->listener, onCloseCallback);
       [[fallthrough]];
@@ -79,19 +106,41 @@ static void cleanup(struct Udp *interface, enum Cleanup step)
       close(interface->server);
       close(interface->client);
       [[fallthrough]];
+    case CLEANUP_TX_QUEUE:
+      if (interface->queued)
+        byteQueueDeinit(&interface->txQueue);
+      [[fallthrough]];
     case CLEANUP_QUEUE:
       byteQueueDeinit(&interface->rxQueue);
       [[fallthrough]];
+    case CLEANUP_ARENA:
+      free(interface->arena);
+      [[fallthrough]];
+    case CLEANUP_NOTIFIER:
+      if (step != CLEANUP_ALL)
+        free(interface->notifier);
+      [[fallthrough]];
     case CLEANUP_LISTENER:
       if (step != CLEANUP_ALL)
         free(interface->listener);
       [[fallthrough]];
     case CLEANUP_MUTEX:
-      pthread_mutex_destroy(&interface->rxQueueLock);
+      pthread_mutex_destroy(&interface->lock);
       break;
   }
 }
 /*----------------------------------------------------------------------------*/
+static size_t getRxSlots(const struct Udp *interface)
+{
+  const size_t space = byteQueueCapacity(&interface->rxQueue)
+      - byteQueueSize(&interface->rxQueue);
+  const size_t required = interface->packets ?
+      BUFFER_SIZE + sizeof(uint16_t) : BUFFER_SIZE;
+
+  /* Number of datagrams of the maximum size that fit into the queue */
+  return space / required;
+}
+/*----------------------------------------------------------------------------*/
 static void onCloseCallback(uv_handle_t *handle)
 {
   free(handle);
@@ -100,18 +149,173 @@ static void onCloseCallback(uv_handle_t *handle)
 static void onInterfaceCallback(uv_poll_t *handle, int, int)
 {
   struct Udp * const interface = uv_handle_get_data((uv_handle_t *)handle);
-  uint8_t buffer[BUFFER_SIZE];
-  ssize_t length;
+  struct mmsghdr messages[BATCH_SIZE];
+  struct iovec vectors[BATCH_SIZE];
+  int count;
 
-  pthread_mutex_lock(&interface->rxQueueLock);
-  while ((length = recv(interface->server, buffer, sizeof(buffer), 0)) > 0)
-    byteQueuePushArray(&interface->rxQueue, buffer, (size_t)length);
-  pthread_mutex_unlock(&interface->rxQueueLock);
+  memset(messages, 0, sizeof(messages));
+
+  for (size_t index = 0; index < BATCH_SIZE; ++index)
+  {
+    vectors[index].iov_base = interface->arena + index * BUFFER_SIZE;
+    vectors[index].iov_len = BUFFER_SIZE;
+    messages[index].msg_hdr.msg_iov = &vectors[index];
+    messages[index].msg_hdr.msg_iovlen = 1;
+  }
+
+  pthread_mutex_lock(&interface->lock);
+
+  while (1)
+  {
+    const unsigned int limit = (unsigned int)MIN(getRxSlots(interface),
+        BATCH_SIZE);
+
+    if (!limit)
+    {
+      /* Leave datagrams in the socket buffer until the queue is drained */
+      interface->paused = true;
+      uv_poll_stop(interface->listener);
+      break;
+    }
+
+    /* Receive multiple datagrams with a single system call */
+    count = recvmmsg(interface->server, messages, limit, MSG_DONTWAIT, NULL);
+    if (count <= 0)
+      break;
+
+    for (int index = 0; index < count; ++index)
+    {
+      const struct mmsghdr * const message = &messages[index];
+
+      if (!interface->packets || !(message->msg_hdr.msg_flags & MSG_TRUNC))
+      {
+        pushDatagram(interface, vectors[index].iov_base,
+            (size_t)message->msg_len);
+      }
+    }
+
+    if ((unsigned int)count < limit)
+      break;
+  }
+
+  pthread_mutex_unlock(&interface->lock);
 
   if (interface->callback != NULL)
     interface->callback(interface->callbackArgument);
 }
 /*----------------------------------------------------------------------------*/
+static void onLoopRequest(uv_async_t *handle)
+{
+  struct Udp * const interface = uv_handle_get_data((uv_handle_t *)handle);
+  bool resume = false;
+
+  if (interface == NULL)
+    return;
+
+  pthread_mutex_lock(&interface->lock);
+  if (interface->paused && getRxSlots(interface))
+  {
+    interface->paused = false;
+    resume = true;
+  }
+  pthread_mutex_unlock(&interface->lock);
+
+  if (resume)
+    uv_poll_start(interface->listener, UV_READABLE, onInterfaceCallback);
+  if (interface->queued)
+    writeOutput(interface);
+}
+/*----------------------------------------------------------------------------*/
+static void pushDatagram(struct Udp *interface, const uint8_t *buffer,
+    size_t length)
+{
+  if (interface->packets)
+  {
+    const size_t space = byteQueueCapacity(&interface->rxQueue)
+        - byteQueueSize(&interface->rxQueue);
+    const uint16_t header = (uint16_t)length;
+
+    /* Empty datagrams and datagrams that do not fit are dropped */
+    if (!length || space < sizeof(header) + length)
+      return;
+
+    byteQueuePushArray(&interface->rxQueue, &header, sizeof(header));
+  }
+
+  byteQueuePushArray(&interface->rxQueue, buffer, length);
+}
+/*----------------------------------------------------------------------------*/
+static size_t queueOutput(struct Udp *interface, const uint8_t *buffer,
+    size_t length)
+{
+  size_t written = 0;
+
+  pthread_mutex_lock(&interface->lock);
+
+  if (interface->packets)
+  {
+    const size_t space = byteQueueCapacity(&interface->txQueue)
+        - byteQueueSize(&interface->txQueue);
+    const uint16_t header = (uint16_t)length;
+
+    if (length && length <= BUFFER_SIZE && space >= sizeof(header) + length)
+    {
+      byteQueuePushArray(&interface->txQueue, &header, sizeof(header));
+      written = byteQueuePushArray(&interface->txQueue, buffer, length);
+    }
+  }
+  else
+    written = byteQueuePushArray(&interface->txQueue, buffer, length);
+
+  pthread_mutex_unlock(&interface->lock);
+
+  if (written)
+    uv_async_send(interface->notifier);
+  return written;
+}
+/*----------------------------------------------------------------------------*/
+static size_t sendBatched(struct Udp *interface, const uint8_t *buffer,
+    size_t length)
+{
+  struct mmsghdr messages[BATCH_SIZE];
+  struct iovec vectors[BATCH_SIZE];
+  size_t written = 0;
+
+  while (written < length)
+  {
+    unsigned int count = 0;
+
+    memset(messages, 0, sizeof(messages));
+
+    /* Split the stream into datagrams and send them with a single call */
+    for (size_t offset = written; offset < length && count < BATCH_SIZE;
+        ++count)
+    {
+      const size_t left = length - offset;
+      const size_t chunk = left < BUFFER_SIZE ? left : BUFFER_SIZE;
+
+      vectors[count].iov_base = (void *)(buffer + offset);
+      vectors[count].iov_len = chunk;
+      messages[count].msg_hdr.msg_iov = &vectors[count];
+      messages[count].msg_hdr.msg_iovlen = 1;
+      offset += chunk;
+    }
+
+    const int sent = sendmmsg(interface->client, messages, count, 0);
+
+    if (sent <= 0)
+      break;
+
+    for (int index = 0; index < sent; ++index)
+      written += messages[index].msg_len;
+
+    if ((unsigned int)sent < count)
+      break;
+  }
+
+  return written;
+}
+/*----------------------------------------------------------------------------*/
 static enum Result setupSockets(struct Udp *interface,
     const struct UdpConfig *config)
 {
@@ -177,15 +381,75 @@ close_client:
   return res;
 }
 /*----------------------------------------------------------------------------*/
+static void writeOutput(struct Udp *interface)
+{
+  struct mmsghdr messages[BATCH_SIZE];
+  struct iovec vectors[BATCH_SIZE];
+
+  while (1)
+  {
+    unsigned int count = 0;
+
+    memset(messages, 0, sizeof(messages));
+
+    /* Arena is shared with the reception, both run in the event loop */
+    pthread_mutex_lock(&interface->lock);
+    while (count < BATCH_SIZE && !byteQueueEmpty(&interface->txQueue))
+    {
+      uint8_t * const buffer = interface->arena + count * BUFFER_SIZE;
+      size_t length;
+
+      if (interface->packets)
+      {
+        uint16_t header;
+
+        byteQueuePopArray(&interface->txQueue, &header, sizeof(header));
+        length = header;
+      }
+      else
+        length = MIN(byteQueueSize(&interface->txQueue), BUFFER_SIZE);
+
+      vectors[count].iov_base = buffer;
+      vectors[count].iov_len =
+          byteQueuePopArray(&interface->txQueue, buffer, length);
+      messages[count].msg_hdr.msg_iov = &vectors[count];
+      messages[count].msg_hdr.msg_iovlen = 1;
+      ++count;
+    }
+    pthread_mutex_unlock(&interface->lock);
+
+    if (!count)
+      break;
+
+    /* Datagrams rejected by the socket are dropped */
+    sendmmsg(interface->client, messages, count, 0);
+  }
+}
+/*----------------------------------------------------------------------------*/
 static enum Result streamInit(void *object, const void *configBase)
 {
   const struct UdpConfig * const config = configBase;
   struct Udp * const interface = object;
   enum Result res;
 
+  const size_t rxLength = config->rxLength ? config->rxLength : QUEUE_SIZE;
+
+  /* Input queue should fit at least one datagram of the maximum size */
+  if (rxLength < BUFFER_SIZE + sizeof(uint16_t))
+    return E_VALUE;
+  if (config->packets && config->txLength
+      && config->txLength < BUFFER_SIZE + sizeof(uint16_t))
+  {
+    return E_VALUE;
+  }
+
   interface->callback = NULL;
+  interface->rxPacketLength = 0;
+  interface->packets = config->packets;
+  interface->paused = false;
+  interface->queued = config->txLength > 0;
 
-  if (pthread_mutex_init(&interface->rxQueueLock, 0))
+  if (pthread_mutex_init(&interface->lock, 0))
     return E_ERROR;
 
   interface->listener = malloc(sizeof(uv_poll_t));
@@ -195,15 +459,36 @@ static enum Result streamInit(void *object, const void *configBase)
     return E_MEMORY;
   }
 
-  if (!byteQueueInit(&interface->rxQueue, QUEUE_SIZE))
+  interface->notifier = malloc(sizeof(uv_async_t));
+  if (interface->notifier == NULL)
   {
     cleanup(interface, CLEANUP_LISTENER);
     return E_MEMORY;
   }
 
-  if ((res = setupSockets(interface, config)) != E_OK)
+  interface->arena = malloc(BATCH_SIZE * BUFFER_SIZE);
+  if (interface->arena == NULL)
+  {
+    cleanup(interface, CLEANUP_NOTIFIER);
+    return E_MEMORY;
+  }
+
+  if (!byteQueueInit(&interface->rxQueue, rxLength))
+  {
+    cleanup(interface, CLEANUP_ARENA);
+    return E_MEMORY;
+  }
+
+  if (interface->queued
+      && !byteQueueInit(&interface->txQueue, config->txLength))
   {
     cleanup(interface, CLEANUP_QUEUE);
+    return E_MEMORY;
+  }
+
+  if ((res = setupSockets(interface, config)) != E_OK)
+  {
+    cleanup(interface, CLEANUP_TX_QUEUE);
     return res;
   }
 
@@ -213,6 +498,9 @@ static enum Result streamInit(void *object, const void *configBase)
   uv_handle_set_data((uv_handle_t *)interface->listener, interface);
   uv_poll_start(interface->listener, UV_READABLE, onInterfaceCallback);
 
+  uv_async_init(uv_default_loop(), interface->notifier, onLoopRequest);
+  uv_handle_set_data((uv_handle_t *)interface->notifier, interface);
+
   return E_OK;
 }
 /*----------------------------------------------------------------------------*/
@@ -237,24 +525,44 @@ static enum Result streamGetParam(void *object, int parameter, void *data)
   switch ((enum IfParameter)parameter)
   {
     case IF_RX_AVAILABLE:
-      pthread_mutex_lock(&interface->rxQueueLock);
-      *(size_t *)data = byteQueueSize(&interface->rxQueue);
-      pthread_mutex_unlock(&interface->rxQueueLock);
+      pthread_mutex_lock(&interface->lock);
+      if (interface->packets)
+      {
+        /* Length of the next datagram is returned in packet mode */
+        if (!interface->rxPacketLength
+            && !byteQueueEmpty(&interface->rxQueue))
+        {
+          byteQueuePopArray(&interface->rxQueue, &interface->rxPacketLength,
+              sizeof(interface->rxPacketLength));
+        }
+
+        *(size_t *)data = interface->rxPacketLength;
+      }
+      else
+        *(size_t *)data = byteQueueSize(&interface->rxQueue);
+      pthread_mutex_unlock(&interface->lock);
       return E_OK;
 
     case IF_RX_PENDING:
-      pthread_mutex_lock(&interface->rxQueueLock);
+      pthread_mutex_lock(&interface->lock);
       *(size_t *)data = byteQueueCapacity(&interface->rxQueue)
           - byteQueueSize(&interface->rxQueue);
-      pthread_mutex_unlock(&interface->rxQueueLock);
+      pthread_mutex_unlock(&interface->lock);
       return E_OK;
 
     case IF_TX_AVAILABLE:
-      *(size_t *)data = 0;
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = interface->queued ?
+          byteQueueCapacity(&interface->txQueue)
+              - byteQueueSize(&interface->txQueue) : 0;
+      pthread_mutex_unlock(&interface->lock);
       return E_OK;
 
     case IF_TX_PENDING:
-      *(size_t *)data = 0;
+      pthread_mutex_lock(&interface->lock);
+      *(size_t *)data = interface->queued ?
+          byteQueueSize(&interface->txQueue) : 0;
+      pthread_mutex_unlock(&interface->lock);
       return E_OK;
 
     default:
@@ -270,18 +578,60 @@ static enum Result streamSetParam(void *, int, const void *)
 static size_t streamRead(void *object, void *buffer, size_t length)
 {
   struct Udp * const interface = object;
+  size_t read;
+
+  pthread_mutex_lock(&interface->lock);
+
+  if (interface->packets)
+  {
+    if (!interface->rxPacketLength && !byteQueueEmpty(&interface->rxQueue))
+    {
+      byteQueuePopArray(&interface->rxQueue, &interface->rxPacketLength,
+          sizeof(interface->rxPacketLength));
+    }
+
+    size_t left = interface->rxPacketLength;
+
+    read = byteQueuePopArray(&interface->rxQueue, buffer,
+        length < left ? length : left);
+    left -= read;
+
+    /* Tail of the datagram that does not fit into the buffer is dropped */
+    while (left)
+    {
+      uint8_t tail[64];
+      const size_t chunk = left < sizeof(tail) ? left : sizeof(tail);
 
-  pthread_mutex_lock(&interface->rxQueueLock);
-  const size_t read = byteQueuePopArray(&interface->rxQueue, buffer, length);
-  pthread_mutex_unlock(&interface->rxQueueLock);
+      left -= byteQueuePopArray(&interface->rxQueue, tail, chunk);
+    }
 
+    interface->rxPacketLength = 0;
+  }
+  else
+    read = byteQueuePopArray(&interface->rxQueue, buffer, length);
+
+  /* Reception is resumed from the event loop */
+  const bool resume = interface->paused && getRxSlots(interface);
+
+  pthread_mutex_unlock(&interface->lock);
+
+  if (resume)
+    uv_async_send(interface->notifier);
   return read;
 }
 /*----------------------------------------------------------------------------*/
 static size_t streamWrite(void *object, const void *buffer, size_t length)
 {
   struct Udp * const interface = object;
-  const int written = send(interface->client, buffer, length, 0);
 
-  return written > 0 ? (size_t)written : 0;
+  if (interface->queued)
+    return queueOutput(interface, buffer, length);
+
+  if (interface->packets)
+  {
+    const ssize_t written = send(interface->client, buffer, length, 0);
+    return written > 0 ? (size_t)written : 0;
+  }
+  else
+    return sendBatched(interface, buffer, length);
 }
@@ -0,0 +1,703 @@
+/*
+ * usb_device.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/platform/generic/usb_device.h>
+#include <halm/usb/usb_control.h>
+#include <halm/usb/usb_defs.h>
+#include <halm/usb/usb_request.h>
+#include <xcore/containers/tg_queue.h>
+#include <xcore/memory.h>
+#include <uv.h>
+#include <assert.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+#define EP_TO_INDEX(ep)     ((((ep) & 0x0F) << 1) | (((ep) & 0x80) >> 7))
+#define ENDPOINT_COUNT      32
+#define EP0_PACKET_SIZE     64
+/*----------------------------------------------------------------------------*/
+struct TransferEntry
+{
+  struct UsbRequest *request;
+  /* Submission time in nanoseconds */
+  uint64_t time;
+};
+
+DEFINE_QUEUE(struct TransferEntry, Transfer, transfer)
+
+struct UsbEndpoint
+{
+  struct UsbEndpointBase base;
+
+  /* Parent device */
+  struct UsbDevice *device;
+  /* Queued requests */
+  TransferQueue requests;
+  /* Number of bytes already transferred for the first request */
+  size_t offset;
+  /* Maximum packet size */
+  uint16_t size;
+  /* Logical address */
+  uint8_t address;
+  /* Endpoint type */
+  uint8_t type;
+};
+
+struct UsbDevice
+{
+  struct UsbDeviceBase base;
+
+  /* Array of registered endpoints */
+  struct UsbEndpoint *endpoints[ENDPOINT_COUNT];
+  /* Control message handler */
+  struct UsbControl *control;
+
+  /* Transfer statistics */
+  struct UsbEndpointStatistics statistics[ENDPOINT_COUNT];
+  /* Time of the first submission for each endpoint */
+  uint64_t start[ENDPOINT_COUNT];
+  /* Halt states of endpoints */
+  uint32_t stalled;
+
+  /* Device address */
+  uint8_t address;
+  /* Device is connected to the bus */
+  bool connected;
+  /* High Speed mode is enabled */
+  bool hs;
+  /* Bus is suspended */
+  bool suspended;
+};
+/*----------------------------------------------------------------------------*/
+static void completeRequest(struct UsbEndpoint *, enum UsbRequestStatus);
+static struct UsbEndpoint *findEndpoint(struct UsbDevice *, uint8_t);
+static void flushEndpoint(struct UsbEndpoint *);
+static bool isMultiPacket(const struct UsbEndpoint *);
+static void resetDevice(struct UsbDevice *);
+static enum Result transferIn(struct UsbEndpoint *, uint8_t *, size_t,
+    size_t *);
+static enum Result transferOut(struct UsbEndpoint *, const uint8_t *, size_t,
+    size_t *);
+/*----------------------------------------------------------------------------*/
+static enum Result devInit(void *, const void *);
+static void devDeinit(void *);
+static void *devCreateEndpoint(void *, uint8_t);
+static uint8_t devGetInterface(const void *);
+static void devSetAddress(void *, uint8_t);
+static void devSetConnected(void *, bool);
+static enum Result devBind(void *, void *);
+static void devUnbind(void *, const void *);
+static enum UsbSpeed devGetSpeed(const void *);
+static void devSetPower(void *, uint16_t);
+static UsbStringIndex devStringAppend(void *, struct UsbString);
+static void devStringErase(void *, struct UsbString);
+/*----------------------------------------------------------------------------*/
+const struct UsbDeviceClass * const UsbDevice =
+    &(const struct UsbDeviceClass){
+    .size = sizeof(struct UsbDevice),
+    .init = devInit,
+    .deinit = devDeinit,
+
+    .createEndpoint = devCreateEndpoint,
+    .getInterface = devGetInterface,
+    .setAddress = devSetAddress,
+    .setConnected = devSetConnected,
+
+    .bind = devBind,
+    .unbind = devUnbind,
+
+    .getSpeed = devGetSpeed,
+    .setPower = devSetPower,
+
+    .stringAppend = devStringAppend,
+    .stringErase = devStringErase
+};
+/*----------------------------------------------------------------------------*/
+static enum Result epInit(void *, const void *);
+static void epDeinit(void *);
+static void epClear(void *);
+static void epDisable(void *);
+static void epEnable(void *, uint8_t, uint16_t);
+static enum Result epEnqueue(void *, struct UsbRequest *);
+static bool epIsStalled(void *);
+static void epSetStalled(void *, bool);
+/*----------------------------------------------------------------------------*/
+static const struct UsbEndpointClass * const UsbEndpoint =
+    &(const struct UsbEndpointClass){
+    .size = sizeof(struct UsbEndpoint),
+    .init = epInit,
+    .deinit = epDeinit,
+
+    .clear = epClear,
+    .disable = epDisable,
+    .enable = epEnable,
+    .enqueue = epEnqueue,
+    .isStalled = epIsStalled,
+    .setStalled = epSetStalled
+};
+/*----------------------------------------------------------------------------*/
+static void completeRequest(struct UsbEndpoint *ep,
+    enum UsbRequestStatus status)
+{
+  const struct TransferEntry entry = transferQueueFront(&ep->requests);
+  transferQueuePopFront(&ep->requests);
+  ep->offset = 0;
+
+  if (status == USB_REQUEST_COMPLETED || status == USB_REQUEST_SETUP)
+  {
+    const unsigned int index = EP_TO_INDEX(ep->address);
+    struct UsbEndpointStatistics * const statistics =
+        &ep->device->statistics[index];
+    const uint64_t time = uv_hrtime();
+    const uint64_t latency = time - entry.time;
+
+    ++statistics->requests;
+    statistics->latency += latency;
+    if (latency > statistics->maxLatency)
+      statistics->maxLatency = latency;
+    statistics->elapsed = time - ep->device->start[index];
+  }
+
+  entry.request->callback(entry.request->argument, entry.request, status);
+}
+/*----------------------------------------------------------------------------*/
+static struct UsbEndpoint *findEndpoint(struct UsbDevice *device,
+    uint8_t address)
+{
+  if (!device->connected || device->suspended)
+    return NULL;
+
+  return device->endpoints[EP_TO_INDEX(address)];
+}
+/*----------------------------------------------------------------------------*/
+static void flushEndpoint(struct UsbEndpoint *ep)
+{
+  while (!transferQueueEmpty(&ep->requests))
+    completeRequest(ep, USB_REQUEST_CANCELLED);
+}
+/*----------------------------------------------------------------------------*/
+static bool isMultiPacket(const struct UsbEndpoint *ep)
+{
+#ifdef CONFIG_PLATFORM_USB_DEVICE_MULTI_PACKET
+  return ep->type != ENDPOINT_TYPE_ISOCHRONOUS;
+#else
+  /* Control transfers are always assembled by the controller model */
+  return ep->type == ENDPOINT_TYPE_CONTROL;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static void resetDevice(struct UsbDevice *device)
+{
+  device->address = 0;
+  device->stalled = 0;
+  device->suspended = false;
+
+  /* Reset all enabled endpoints except for Control Endpoints */
+  for (size_t index = 2; index < ARRAY_SIZE(device->endpoints); ++index)
+    device->endpoints[index] = NULL;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result transferIn(struct UsbEndpoint *ep, uint8_t *buffer,
+    size_t capacity, size_t *length)
+{
+  const unsigned int index = EP_TO_INDEX(ep->address);
+  struct UsbEndpointStatistics * const statistics =
+      &ep->device->statistics[index];
+  size_t position = 0;
+  bool transferred = false;
+
+  *length = 0;
+
+  if (ep->device->stalled & (1UL << index))
+    return E_INVALID;
+
+  while (!transferQueueEmpty(&ep->requests))
+  {
+    struct UsbRequest * const request =
+        transferQueueFront(&ep->requests).request;
+    const size_t chunk = MIN(request->length - ep->offset, ep->size);
+
+    /* Packet does not fit into the buffer, leave it for the next transfer */
+    if (position + chunk > capacity)
+      break;
+
+    if (chunk)
+    {
+      memcpy(buffer + position, (const uint8_t *)request->buffer + ep->offset,
+          chunk);
+    }
+
+    ep->offset += chunk;
+    position += chunk;
+    statistics->bytes += chunk;
+    ++statistics->packets;
+    transferred = true;
+
+    if (ep->offset == request->length)
+      completeRequest(ep, USB_REQUEST_COMPLETED);
+
+    /* Short packet finishes the transfer, one packet per frame otherwise */
+    if (chunk < ep->size || ep->type == ENDPOINT_TYPE_ISOCHRONOUS)
+      break;
+  }
+
+  *length = position;
+  return transferred ? E_OK : E_EMPTY;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result transferOut(struct UsbEndpoint *ep, const uint8_t *buffer,
+    size_t length, size_t *written)
+{
+  const unsigned int index = EP_TO_INDEX(ep->address);
+  struct UsbEndpointStatistics * const statistics =
+      &ep->device->statistics[index];
+  const bool multi = isMultiPacket(ep);
+  size_t position = 0;
+  enum Result res = E_OK;
+
+  if (ep->device->stalled & (1UL << index))
+  {
+    *written = 0;
+    return E_INVALID;
+  }
+
+  do
+  {
+    if (transferQueueEmpty(&ep->requests))
+    {
+      /* The endpoint responds with NAK */
+      res = E_EMPTY;
+      break;
+    }
+
+    struct UsbRequest * const request =
+        transferQueueFront(&ep->requests).request;
+    const size_t chunk = MIN(length - position, ep->size);
+
+    if (ep->offset + chunk > request->capacity)
+    {
+      /* Data overrun */
+      completeRequest(ep, USB_REQUEST_ERROR);
+      res = E_VALUE;
+      break;
+    }
+
+    if (chunk)
+    {
+      memcpy((uint8_t *)request->buffer + ep->offset, buffer + position,
+          chunk);
+    }
+
+    ep->offset += chunk;
+    position += chunk;
+    statistics->bytes += chunk;
+    ++statistics->packets;
+
+    if (chunk < ep->size || ep->offset == request->capacity || !multi)
+    {
+      request->length = (uint16_t)ep->offset;
+      completeRequest(ep, USB_REQUEST_COMPLETED);
+    }
+  }
+  while (position < length);
+
+  *written = position;
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result devInit(void *object, const void *configBase)
+{
+  const struct UsbDeviceConfig * const config = configBase;
+  assert(config != NULL);
+
+  const struct UsbControlConfig controlConfig = {
+      .parent = object,
+      .vid = config->vid,
+      .pid = config->pid
+  };
+  struct UsbDevice * const device = object;
+
+#ifdef CONFIG_PLATFORM_USB_HS
+  device->hs = config->hs;
+#else
+  device->hs = false;
+#endif
+
+  device->connected = false;
+  device->suspended = false;
+  device->address = 0;
+  device->stalled = 0;
+
+  for (size_t index = 0; index < ARRAY_SIZE(device->endpoints); ++index)
+    device->endpoints[index] = NULL;
+  usbDevHostResetStatistics(device);
+
+  /* Initialize control message handler after endpoint initialization */
+  device->control = init(UsbControl, &controlConfig);
+  if (device->control == NULL)
+    return E_ERROR;
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void devDeinit(void *object)
+{
+  struct UsbDevice * const device = object;
+  deinit(device->control);
+}
+/*----------------------------------------------------------------------------*/
+static void *devCreateEndpoint(void *object, uint8_t address)
+{
+  const unsigned int index = EP_TO_INDEX(address);
+  struct UsbDevice * const device = object;
+
+  assert(index < ARRAY_SIZE(device->endpoints));
+
+  const struct UsbEndpointConfig config = {
+      .parent = device,
+      .address = address
+  };
+  struct UsbEndpoint * const ep = init(UsbEndpoint, &config);
+
+  if (ep != NULL && index < 2)
+  {
+    /* Set Control Endpoints immediately after creation */
+    assert(device->endpoints[index] == NULL);
+    device->endpoints[index] = ep;
+  }
+
+  return ep;
+}
+/*----------------------------------------------------------------------------*/
+static uint8_t devGetInterface(const void *)
+{
+  return 0;
+}
+/*----------------------------------------------------------------------------*/
+static void devSetAddress(void *object, uint8_t address)
+{
+  struct UsbDevice * const device = object;
+  device->address = address;
+}
+/*----------------------------------------------------------------------------*/
+static void devSetConnected(void *object, bool state)
+{
+  struct UsbDevice * const device = object;
+  device->connected = state;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result devBind(void *object, void *driver)
+{
+  struct UsbDevice * const device = object;
+  return usbControlBindDriver(device->control, driver);
+}
+/*----------------------------------------------------------------------------*/
+static void devUnbind(void *object, const void *)
+{
+  struct UsbDevice * const device = object;
+  usbControlUnbindDriver(device->control);
+}
+/*----------------------------------------------------------------------------*/
+static enum UsbSpeed devGetSpeed(const void *object)
+{
+  const struct UsbDevice * const device = object;
+  return device->hs ? USB_HS : USB_FS;
+}
+/*----------------------------------------------------------------------------*/
+static void devSetPower(void *object, uint16_t current)
+{
+  struct UsbDevice * const device = object;
+  usbControlSetPower(device->control, current);
+}
+/*----------------------------------------------------------------------------*/
+static UsbStringIndex devStringAppend(void *object, struct UsbString string)
+{
+  struct UsbDevice * const device = object;
+  return usbControlStringAppend(device->control, string);
+}
+/*----------------------------------------------------------------------------*/
+static void devStringErase(void *object, struct UsbString string)
+{
+  struct UsbDevice * const device = object;
+  usbControlStringErase(device->control, string);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result epInit(void *object, const void *configBase)
+{
+  const struct UsbEndpointConfig * const config = configBase;
+  struct UsbEndpoint * const ep = object;
+  size_t size;
+
+  if (USB_EP_LOGICAL_ADDRESS(config->address) == 0)
+    size = CONFIG_USB_DEVICE_CONTROL_REQUESTS;
+  else
+    size = CONFIG_PLATFORM_USB_DEVICE_EP_REQUESTS;
+
+  if (transferQueueInit(&ep->requests, size))
+  {
+    ep->device = config->parent;
+    ep->offset = 0;
+    ep->size = EP0_PACKET_SIZE;
+    ep->address = config->address;
+    ep->type = ENDPOINT_TYPE_CONTROL;
+
+    return E_OK;
+  }
+  else
+    return E_MEMORY;
+}
+/*----------------------------------------------------------------------------*/
+static void epDeinit(void *object)
+{
+  struct UsbEndpoint * const ep = object;
+  struct UsbDevice * const device = ep->device;
+  const unsigned int index = EP_TO_INDEX(ep->address);
+
+  /* Remove pending requests */
+  epDisable(ep);
+  epClear(ep);
+
+  if (index < 2)
+  {
+    assert(device->endpoints[index] == ep);
+    device->endpoints[index] = NULL;
+  }
+
+  transferQueueDeinit(&ep->requests);
+}
+/*----------------------------------------------------------------------------*/
+static void epClear(void *object)
+{
+  flushEndpoint(object);
+}
+/*----------------------------------------------------------------------------*/
+static void epDisable(void *object)
+{
+  struct UsbEndpoint * const ep = object;
+  struct UsbDevice * const device = ep->device;
+  const unsigned int index = EP_TO_INDEX(ep->address);
+
+  if (index >= 2 && device->endpoints[index] == ep)
+    device->endpoints[index] = NULL;
+}
+/*----------------------------------------------------------------------------*/
+static void epEnable(void *object, uint8_t type, uint16_t size)
+{
+  struct UsbEndpoint * const ep = object;
+  struct UsbDevice * const device = ep->device;
+  const unsigned int index = EP_TO_INDEX(ep->address);
+
+  assert(size);
+
+  ep->offset = 0;
+  ep->size = size;
+  ep->type = type;
+  device->stalled &= ~(1UL << index);
+
+  if (index >= 2)
+  {
+    assert(device->endpoints[index] == NULL
+        || device->endpoints[index] == ep);
+    device->endpoints[index] = ep;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result epEnqueue(void *object, struct UsbRequest *request)
+{
+  assert(request != NULL);
+  assert(request->callback != NULL);
+
+  struct UsbEndpoint * const ep = object;
+
+  /* Controllers without transfer descriptors send one packet per request */
+  if ((ep->address & USB_EP_DIRECTION_IN) && !isMultiPacket(ep)
+      && request->length > ep->size)
+  {
+    return E_VALUE;
+  }
+
+  if (transferQueueFull(&ep->requests))
+    return E_FULL;
+
+  const struct TransferEntry entry = {
+      .request = request,
+      .time = uv_hrtime()
+  };
+  const unsigned int index = EP_TO_INDEX(ep->address);
+
+  if (!ep->device->start[index])
+    ep->device->start[index] = entry.time;
+
+  transferQueuePushBack(&ep->requests, entry);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static bool epIsStalled(void *object)
+{
+  struct UsbEndpoint * const ep = object;
+  const unsigned int index = EP_TO_INDEX(ep->address);
+
+  return (ep->device->stalled & (1UL << index)) != 0;
+}
+/*----------------------------------------------------------------------------*/
+static void epSetStalled(void *object, bool stalled)
+{
+  struct UsbEndpoint * const ep = object;
+  const unsigned int index = EP_TO_INDEX(ep->address);
+
+  if (stalled)
+    ep->device->stalled |= 1UL << index;
+  else
+    ep->device->stalled &= ~(1UL << index);
+}
+/*----------------------------------------------------------------------------*/
+enum Result usbDevHostControl(struct UsbDevice *device,
+    const struct UsbSetupPacket *packet, void *data, uint16_t *length)
+{
+  struct UsbEndpoint * const ep0out = findEndpoint(device, 0x00);
+  struct UsbEndpoint * const ep0in = findEndpoint(device, 0x80);
+  const bool in = REQUEST_DIRECTION_VALUE(packet->requestType)
+      == REQUEST_DIRECTION_TO_HOST;
+  size_t count;
+  enum Result res;
+
+  if (ep0out == NULL || ep0in == NULL)
+    return E_IDLE;
+
+  /* Setup packet flushes buffers and clears halt state of control pipes */
+  flushEndpoint(ep0in);
+  device->stalled &= ~(BIT(0) | BIT(1));
+
+  if (transferQueueEmpty(&ep0out->requests))
+    return E_BUSY;
+
+  /* Setup stage */
+  struct UsbRequest * const request =
+      transferQueueFront(&ep0out->requests).request;
+  const struct UsbSetupPacket setup = {
+      .requestType = packet->requestType,
+      .request = packet->request,
+      .value = toLittleEndian16(packet->value),
+      .index = toLittleEndian16(packet->index),
+      .length = toLittleEndian16(packet->length)
+  };
+
+  assert(request->capacity >= sizeof(setup));
+  memcpy(request->buffer, &setup, sizeof(setup));
+  request->length = sizeof(setup);
+  device->statistics[0].bytes += sizeof(setup);
+  ++device->statistics[0].packets;
+  completeRequest(ep0out, USB_REQUEST_SETUP);
+
+  if (in)
+  {
+    /* Data stage */
+    res = transferIn(ep0in, data, packet->length, &count);
+    if (res != E_OK)
+      return res == E_EMPTY ? E_BUSY : res;
+
+    if (length != NULL)
+      *length = (uint16_t)count;
+
+    /* Status stage */
+    res = transferOut(ep0out, NULL, 0, &count);
+  }
+  else
+  {
+    /* Data stage */
+    if (packet->length)
+    {
+      res = transferOut(ep0out, data, packet->length, &count);
+      if (res != E_OK)
+        return res == E_EMPTY ? E_BUSY : res;
+    }
+
+    /* Status stage */
+    res = transferIn(ep0in, NULL, 0, &count);
+    if (res == E_EMPTY)
+      res = E_BUSY;
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+enum Result usbDevHostRead(struct UsbDevice *device, uint8_t address,
+    void *buffer, size_t capacity, size_t *length)
+{
+  struct UsbEndpoint * const ep = findEndpoint(device,
+      address | USB_EP_DIRECTION_IN);
+
+  if (ep == NULL)
+  {
+    *length = 0;
+    return E_IDLE;
+  }
+
+  return transferIn(ep, buffer, capacity, length);
+}
+/*----------------------------------------------------------------------------*/
+enum Result usbDevHostWrite(struct UsbDevice *device, uint8_t address,
+    const void *buffer, size_t length, size_t *written)
+{
+  struct UsbEndpoint * const ep = findEndpoint(device,
+      address & ~USB_EP_DIRECTION_IN);
+
+  if (ep == NULL)
+  {
+    *written = 0;
+    return E_IDLE;
+  }
+
+  return transferOut(ep, buffer, length, written);
+}
+/*----------------------------------------------------------------------------*/
+void usbDevHostFrame(struct UsbDevice *device)
+{
+  if (device->connected && !device->suspended)
+    usbControlNotify(device->control, USB_DEVICE_EVENT_FRAME);
+}
+/*----------------------------------------------------------------------------*/
+enum Result usbDevHostReset(struct UsbDevice *device)
+{
+  if (!device->connected)
+    return E_IDLE;
+
+  resetDevice(device);
+  usbControlNotify(device->control, USB_DEVICE_EVENT_RESET);
+
+  /* Speed is negotiated during the reset */
+  usbControlNotify(device->control, USB_DEVICE_EVENT_PORT_CHANGE);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+void usbDevHostResume(struct UsbDevice *device)
+{
+  if (device->connected && device->suspended)
+  {
+    device->suspended = false;
+    usbControlNotify(device->control, USB_DEVICE_EVENT_RESUME);
+  }
+}
+/*----------------------------------------------------------------------------*/
+void usbDevHostSuspend(struct UsbDevice *device)
+{
+  if (device->connected && !device->suspended)
+  {
+    device->suspended = true;
+    usbControlNotify(device->control, USB_DEVICE_EVENT_SUSPEND);
+  }
+}
+/*----------------------------------------------------------------------------*/
+void usbDevHostGetStatistics(const struct UsbDevice *device, uint8_t address,
+    struct UsbEndpointStatistics *statistics)
+{
+  *statistics = device->statistics[EP_TO_INDEX(address)];
+}
+/*----------------------------------------------------------------------------*/
+void usbDevHostResetStatistics(struct UsbDevice *device)
+{
+  memset(device->statistics, 0, sizeof(device->statistics));
+  memset(device->start, 0, sizeof(device->start));
+}
@@ -5,6 +5,9 @@
  */
 
 #include <halm/generic/can.h>
+#include <halm/generic/can_batch.h>
+#include <halm/generic/can_timing.h>
+#include <halm/generic/can_filter.h>
 #include <halm/generic/pointer_array.h>
 #include <halm/generic/pointer_queue.h>
 #include <halm/platform/lpc/can.h>
@@ -36,6 +39,8 @@ struct Can
 
   /* Timer for the time stamp generation */
   struct Timer *timer;
+  /* 64-bit timer for the time stamp generation */
+  struct Timer64 *timer64;
 
   /* Message pool */
   PointerArray pool;
@@ -52,6 +57,11 @@ struct Can
   /* Message sequence number */
   uint8_t sequence;
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_FILTERS
+  /* Software acceptance filters */
+  struct CanFilterSet filters;
+#endif
+
 #ifdef CONFIG_PLATFORM_LPC_CAN_WATERMARK
   /* Maximum available frames in the receive queue */
   size_t rxWatermark;
@@ -59,6 +69,11 @@ struct Can
   size_t txWatermark;
 #endif
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+  /* Frames lent to the user of the zero-copy interface */
+  struct CanBatchPool batch;
+#endif
+
 #ifdef CONFIG_PLATFORM_LPC_CAN_COUNTERS
   /* Bus errors */
   uint32_t errorCount;
@@ -71,11 +86,14 @@ struct Can
 #endif
 };
 /*----------------------------------------------------------------------------*/
-static bool calcSegments(uint8_t, uint8_t *, uint8_t *);
 static bool calcTimings(const struct Can *, uint32_t, uint32_t *);
 static bool fetchStandardMessage(const void *, struct CANStandardMessage *);
 static uint32_t getBusRate(const struct Can *);
+static size_t getRxQueueSpace(const struct Can *);
+static uint64_t getTimestamp(const struct Can *);
+static size_t getTxQueueSpace(const struct Can *);
 static void interruptHandler(void *);
+static bool isMessageAccepted(const struct Can *);
 static void readMessage(struct Can *, struct CANStandardMessage *);
 static void resetQueues(struct Can *);
 static void sendMessage(struct Can *, const struct CANStandardMessage *,
@@ -88,6 +106,11 @@ static void updateTxWatermark(struct Can *, size_t);
 #ifdef CONFIG_PLATFORM_LPC_CAN_PM
 static void powerStateHandler(void *, enum PmState);
 #endif
+
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+static size_t sendFrames(void *, struct CANStandardMessage * const *,
+    size_t);
+#endif
 /*----------------------------------------------------------------------------*/
 static enum Result canInit(void *, const void *);
 static void canSetCallback(void *, void (*)(void *), void *);
@@ -114,90 +137,35 @@ const struct InterfaceClass * const Can = &(const struct InterfaceClass){
     .write = canWrite
 };
 /*----------------------------------------------------------------------------*/
-static bool calcSegments(uint8_t width, uint8_t *tseg1, uint8_t *tseg2)
-{
-  /* Width of the bit segment 1, the synchronization time segment excluded */
-  const uint8_t seg1 = width * CONFIG_PLATFORM_LPC_CAN_SP / 100 - 1;
-
-  if (seg1 > BTR_TSEG1_MAX + 1)
-    return false;
-
-  const uint8_t seg2 = width - seg1 - 1;
-
-  if (seg2 > BTR_TSEG2_MAX + 1)
-    return false;
-  if (seg2 <= CONFIG_PLATFORM_LPC_CAN_SJW)
-    return false;
-  if (seg2 > seg1 + 1)
-    return false;
-
-  *tseg1 = seg1;
-  *tseg2 = seg2;
-
-  return true;
-}
-/*----------------------------------------------------------------------------*/
 static bool calcTimings(const struct Can *interface, uint32_t rate,
     uint32_t *result)
 {
-  static const uint8_t maxWidth = BTR_TSEG1_MAX + BTR_TSEG2_MAX + 3;
-  static const uint8_t minWidth = 3;
-
-  if (!rate)
-    return false;
-
-  const uint32_t apbClock = canGetClock(&interface->base);
-  uint32_t currentError = MAX_CLOCK_ERROR;
-  uint32_t currentPrescaler;
-  uint8_t currentDelta = UINT8_MAX;
-  uint8_t currentSeg1;
-  uint8_t currentSeg2;
-
-  for (uint8_t width = maxWidth; width >= minWidth; --width)
-  {
-    const uint32_t clock = rate * width;
-    const uint32_t error = apbClock % clock;
-
-    if (error > currentError)
-      continue;
-    if (clock > apbClock)
-      continue;
-    if (apbClock / clock > BTR_BRP_MAX + 1)
-      continue;
-
-    uint8_t seg1;
-    uint8_t seg2;
-
-    if (calcSegments(width, &seg1, &seg2))
-    {
-      const uint8_t sp = ((uint16_t)seg1 + 1) * 100 / width;
-      const uint8_t delta = abs(CONFIG_PLATFORM_LPC_CAN_SP - (int)sp);
-
-      if (error < currentError || delta < currentDelta)
-      {
-        currentError = error;
-        currentPrescaler = apbClock / clock;
-        currentDelta = delta;
-        currentSeg1 = seg1;
-        currentSeg2 = seg2;
+  static const struct CanTimingLimits limits = {
+      .prescaler = BTR_BRP_MAX,
+      .minSeg1 = 1,
+      .maxSeg1 = BTR_TSEG1_MAX + 1,
+      .minSeg2 = 1,
+      .maxSeg2 = BTR_TSEG2_MAX + 1,
+      .maxSjw = 4
+  };
 
-        if (error == 0 && delta == 0)
-          break;
-      }
-    }
-  }
+  const struct CanTimingRequest request = {
+      .rate = rate,
+      .tolerance = MAX_CLOCK_ERROR,
+      .samplePoint = CONFIG_PLATFORM_LPC_CAN_SP,
+      .sjw = CONFIG_PLATFORM_LPC_CAN_SJW
+  };
+  struct CanTiming timing;
 
-  if (currentDelta != UINT8_MAX)
-  {
-    *result = BTR_BRP(currentPrescaler - 1)
-        | BTR_SJW(CONFIG_PLATFORM_LPC_CAN_SJW - 1)
-        | BTR_TSEG1(currentSeg1 - 1)
-        | BTR_TSEG2(currentSeg2 - 1);
+  if (!canTimingCalc(canGetClock(&interface->base), &limits, &request, &timing))
+    return false;
 
-    return true;
-  }
+  *result = BTR_BRP(timing.prescaler - 1)
+      | BTR_SJW(timing.sjw - 1)
+      | BTR_TSEG1(timing.seg1 - 1)
+      | BTR_TSEG2(timing.seg2 - 1);
 
-  return false;
+  return true;
 }
 /*----------------------------------------------------------------------------*/
 static bool fetchStandardMessage(const void *buffer,
@@ -242,6 +210,38 @@ static uint32_t getBusRate(const struct Can *interface)
   return apbClock / prescaler / width;
 }
 /*----------------------------------------------------------------------------*/
+static size_t getRxQueueSpace(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+  /* Borrowed frames occupy slots of the receive queue */
+  return canBatchPoolRxSpace(&interface->batch);
+#else
+  return pointerQueueCapacity(&interface->rxQueue)
+      - pointerQueueSize(&interface->rxQueue);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static uint64_t getTimestamp(const struct Can *interface)
+{
+  if (interface->timer64 != NULL)
+    return timerGetValue64(interface->timer64);
+  else if (interface->timer != NULL)
+    return timerGetValue(interface->timer);
+  else
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+static size_t getTxQueueSpace(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+  /* Acquired frames have reserved slots in the transmit queue */
+  return canBatchPoolTxSpace(&interface->batch);
+#else
+  return pointerQueueCapacity(&interface->txQueue)
+      - pointerQueueSize(&interface->txQueue);
+#endif
+}
+/*----------------------------------------------------------------------------*/
 static void interruptHandler(void *object)
 {
   struct Can * const interface = object;
@@ -253,10 +253,11 @@ static void interruptHandler(void *object)
   {
     while (reg->SR & SR_RBS)
     {
-      const uint32_t timestamp = interface->timer ?
-          timerGetValue(interface->timer) : 0;
+      const uint64_t timestamp = getTimestamp(interface);
 
-      if (!pointerQueueFull(&interface->rxQueue))
+      const bool accepted = isMessageAccepted(interface);
+
+      if (accepted && getRxQueueSpace(interface) > 0)
       {
         struct CANStandardMessage * const message =
             pointerArrayBack(&interface->pool);
@@ -270,7 +271,9 @@ static void interruptHandler(void *object)
       else
       {
 #ifdef CONFIG_PLATFORM_LPC_CAN_COUNTERS
-        ++interface->overrunCount;
+        /* Frames rejected by acceptance filters aren't counted */
+        if (accepted)
+          ++interface->overrunCount;
 #endif
       }
 
@@ -342,6 +345,20 @@ static void interruptHandler(void *object)
     interface->callback(interface->callbackArgument);
 }
 /*----------------------------------------------------------------------------*/
+static bool isMessageAccepted(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_LPC_CAN_FILTERS
+  const LPC_CAN_Type * const reg = interface->base.reg;
+
+  /* Hardware filter is bypassed, filtering is performed in software */
+  return canFilterSetMatch(&interface->filters, reg->RID,
+      (reg->RFS & RFS_FF) != 0);
+#else
+  (void)interface;
+  return true;
+#endif
+}
+/*----------------------------------------------------------------------------*/
 static void readMessage(struct Can *interface,
     struct CANStandardMessage *message)
 {
@@ -534,6 +551,32 @@ static void powerStateHandler(void *object, enum PmState state)
 }
 #endif
 /*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+static size_t sendFrames(void *object,
+    struct CANStandardMessage * const *frames, size_t count)
+{
+  struct Can * const interface = object;
+  LPC_CAN_Type * const reg = interface->base.reg;
+  uint32_t status = reg->SR & SR_TBS_MASK;
+  size_t index = 0;
+
+  if (interface->sequence || status == SR_TBS_MASK)
+  {
+    while (index < count && status != 0)
+    {
+      /* One of the transmit buffers is empty, write new frame into it */
+      sendMessage(interface, frames[index++], &status);
+
+      /* Stop after sequence restart */
+      if (!interface->sequence)
+        break;
+    }
+  }
+
+  return index;
+}
+#endif
+/*----------------------------------------------------------------------------*/
 static enum Result canInit(void *object, const void *configBase)
 {
   const struct CanConfig * const config = configBase;
@@ -564,13 +607,24 @@ static enum Result canInit(void *object, const void *configBase)
   if (interface->arena == NULL)
     return E_MEMORY;
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_FILTERS
+  if (!canFilterSetInit(&interface->filters, config->filters))
+    return E_MEMORY;
+#endif
+
   interface->base.handler = interruptHandler;
   interface->callback = NULL;
   interface->timer = config->timer;
+  interface->timer64 = config->timer64;
   interface->mode = MODE_LISTENER;
   interface->rate = config->rate;
   interface->sequence = 0;
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+  canBatchPoolInit(&interface->batch, &interface->pool,
+      &interface->rxQueue, &interface->txQueue);
+#endif
+
 #ifdef CONFIG_PLATFORM_LPC_CAN_COUNTERS
   interface->errorCount = 0;
   interface->overrunCount = 0;
@@ -636,6 +690,10 @@ static void canDeinit(void *object)
   pmUnregister(interface);
 #endif
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_FILTERS
+  canFilterSetDeinit(&interface->filters);
+#endif
+
   free(interface->arena);
   pointerQueueDeinit(&interface->txQueue);
   pointerQueueDeinit(&interface->rxQueue);
@@ -678,6 +736,20 @@ static enum Result canGetParam(void *object, int parameter, void *data)
       break;
 #endif
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+    case IF_CAN_RX_ACQUIRE:
+      irqDisable(interface->base.irq);
+      canBatchPoolAcquireRx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+
+    case IF_CAN_TX_ACQUIRE:
+      irqDisable(interface->base.irq);
+      canBatchPoolAcquireTx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+#endif
+
     default:
       break;
   }
@@ -689,13 +761,11 @@ static enum Result canGetParam(void *object, int parameter, void *data)
       return E_OK;
 
     case IF_RX_PENDING:
-      *(size_t *)data = pointerQueueCapacity(&interface->rxQueue)
-          - pointerQueueSize(&interface->rxQueue);
+      *(size_t *)data = getRxQueueSpace(interface);
       return E_OK;
 
     case IF_TX_AVAILABLE:
-      *(size_t *)data = pointerQueueCapacity(&interface->txQueue)
-          - pointerQueueSize(&interface->txQueue);
+      *(size_t *)data = getTxQueueSpace(interface);
       return E_OK;
 
     case IF_TX_PENDING:
@@ -739,6 +809,57 @@ static enum Result canSetParam(void *object, int parameter, const void *data)
       setBusMode(interface, MODE_LOOPBACK);
       return E_OK;
 
+#ifdef CONFIG_PLATFORM_LPC_CAN_ZERO_COPY
+    case IF_CAN_RX_RELEASE:
+      irqDisable(interface->base.irq);
+      canBatchPoolReleaseRx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+
+    case IF_CAN_TX_RELEASE:
+      irqDisable(interface->base.irq);
+      canBatchPoolReleaseTx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+
+    case IF_CAN_TX_SUBMIT:
+    {
+      bool submitted;
+
+      irqDisable(interface->base.irq);
+      submitted = canBatchPoolSubmit(&interface->batch, data,
+          sendFrames, interface);
+      irqEnable(interface->base.irq);
+      return submitted ? E_OK : E_VALUE;
+    }
+#endif
+
+#ifdef CONFIG_PLATFORM_LPC_CAN_FILTERS
+    case IF_CAN_FILTER_ADD_STD:
+    case IF_CAN_FILTER_ADD_EXT:
+    {
+      const bool ext = parameter == IF_CAN_FILTER_ADD_EXT;
+
+      irqDisable(interface->base.irq);
+      const bool added = canFilterSetAdd(&interface->filters, data, ext);
+      irqEnable(interface->base.irq);
+
+      return added ? E_OK : E_FULL;
+    }
+
+    case IF_CAN_FILTER_REMOVE_STD:
+    case IF_CAN_FILTER_REMOVE_EXT:
+    {
+      const bool ext = parameter == IF_CAN_FILTER_REMOVE_EXT;
+
+      irqDisable(interface->base.irq);
+      const bool removed = canFilterSetRemove(&interface->filters, data, ext);
+      irqEnable(interface->base.irq);
+
+      return removed ? E_OK : E_VALUE;
+    }
+#endif
+
     default:
       break;
   }
@@ -829,7 +950,7 @@ static size_t canWrite(void *object, const void *buffer, size_t length)
     }
   }
 
-  while (!error && position < length && !pointerQueueFull(&interface->txQueue))
+  while (!error && position < length && getTxQueueSpace(interface) > 0)
   {
     struct CANStandardMessage * const message =
         pointerArrayBack(&interface->pool);
@@ -5,6 +5,8 @@
  */
 
 #include <halm/generic/can.h>
+#include <halm/generic/can_batch.h>
+#include <halm/generic/can_timing.h>
 #include <halm/generic/pointer_array.h>
 #include <halm/generic/pointer_queue.h>
 #include <halm/platform/numicro/can.h>
@@ -57,6 +59,8 @@ struct Can
 
   /* Timer for the time stamp generation */
   struct Timer *timer;
+  /* 64-bit timer for the time stamp generation */
+  struct Timer64 *timer64;
 
   /* Message pool */
   PointerArray pool;
@@ -81,6 +85,11 @@ struct Can
   size_t txWatermark;
 #endif
 
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+  /* Frames lent to the user of the zero-copy interface */
+  struct CanBatchPool batch;
+#endif
+
 #ifdef CONFIG_PLATFORM_NUMICRO_CAN_COUNTERS
   /* Bus errors */
   uint32_t errorCount;
@@ -94,11 +103,13 @@ struct Can
 };
 /*----------------------------------------------------------------------------*/
 static void buildAcceptanceFilters(struct Can *);
-static bool calcSegments(uint8_t, uint8_t *, uint8_t *);
 static bool calcTimings(const struct Can *, uint32_t, uint32_t *, uint32_t *);
 static void dropMessage(struct Can *, size_t);
 static bool fetchStandardMessage(const void *, struct CANStandardMessage *);
 static uint32_t getBusRate(const struct Can *);
+static size_t getRxQueueSpace(const struct Can *);
+static uint64_t getTimestamp(const struct Can *);
+static size_t getTxQueueSpace(const struct Can *);
 static void interruptHandler(void *);
 static void invalidateMessageObject(struct Can *, size_t);
 static bool isNextMessageValid(const void *);
@@ -119,6 +130,11 @@ static bool filterRemove(struct Can *, const struct CANFilter *, bool);
 #ifdef CONFIG_PLATFORM_NUMICRO_CAN_PM
 static void powerStateHandler(void *, enum PmState);
 #endif
+
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+static size_t sendFrames(void *, struct CANStandardMessage * const *,
+    size_t);
+#endif
 /*----------------------------------------------------------------------------*/
 static enum Result canInit(void *, const void *);
 static void canDeinit(void *);
@@ -176,92 +192,36 @@ static void buildAcceptanceFilters(struct Can *interface)
   }
 }
 /*----------------------------------------------------------------------------*/
-static bool calcSegments(uint8_t width, uint8_t *tseg1, uint8_t *tseg2)
-{
-  /* Width of the bit segment 1, the synchronization time segment excluded */
-  const uint8_t seg1 = width * CONFIG_PLATFORM_NUMICRO_CAN_SP / 100 - 1;
-
-  if (seg1 < BTIME_TSEG1_MIN + 1 || seg1 > BTIME_TSEG1_MAX + 1)
-    return false;
-
-  const uint8_t seg2 = width - seg1 - 1;
-
-  if (seg2 > BTIME_TSEG2_MAX + 1)
-    return false;
-  if (seg2 <= CONFIG_PLATFORM_NUMICRO_CAN_SJW)
-    return false;
-  if (seg2 > seg1 + 1)
-    return false;
-
-  *tseg1 = seg1;
-  *tseg2 = seg2;
-
-  return true;
-}
-/*----------------------------------------------------------------------------*/
 static bool calcTimings(const struct Can *interface, uint32_t rate,
     uint32_t *result, uint32_t *extension)
 {
-  static const uint8_t maxWidth = BTIME_TSEG1_MAX + BTIME_TSEG2_MAX + 3;
-  static const uint8_t minWidth = BTIME_TSEG1_MIN + 3;
-
-  if (!rate)
-    return false;
-
-  const uint32_t apbClock = canGetClock(&interface->base);
-
-  uint32_t currentError = MAX_CLOCK_ERROR;
-  uint32_t currentPrescaler;
-  uint8_t currentDelta = UINT8_MAX;
-  uint8_t currentSeg1;
-  uint8_t currentSeg2;
-
-  for (uint8_t width = maxWidth; width >= minWidth; --width)
-  {
-    const uint32_t clock = rate * width;
-    const uint32_t error = apbClock % clock;
-
-    if (error > currentError)
-      continue;
-    if (clock > apbClock)
-      continue;
-    if (apbClock / clock > BRP_BRPE_MAX + 1)
-      continue;
-
-    uint8_t seg1;
-    uint8_t seg2;
-
-    if (calcSegments(width, &seg1, &seg2))
-    {
-      const uint8_t sp = ((uint16_t)seg1 + 1) * 100 / width;
-      const uint8_t delta = abs(CONFIG_PLATFORM_NUMICRO_CAN_SP - (int)sp);
+  static const struct CanTimingLimits limits = {
+      .prescaler = BRP_BRPE_MAX,
+      .minSeg1 = BTIME_TSEG1_MIN + 1,
+      .maxSeg1 = BTIME_TSEG1_MAX + 1,
+      .minSeg2 = 1,
+      .maxSeg2 = BTIME_TSEG2_MAX + 1,
+      .maxSjw = 4
+  };
 
-      if (error < currentError || delta < currentDelta)
-      {
-        currentError = error;
-        currentPrescaler = apbClock / clock;
-        currentDelta = delta;
-        currentSeg1 = seg1;
-        currentSeg2 = seg2;
-
-        if (error == 0 && delta == 0)
-          break;
-      }
-    }
-  }
+  const struct CanTimingRequest request = {
+      .rate = rate,
+      .tolerance = MAX_CLOCK_ERROR,
+      .samplePoint = CONFIG_PLATFORM_NUMICRO_CAN_SP,
+      .sjw = CONFIG_PLATFORM_NUMICRO_CAN_SJW
+  };
+  struct CanTiming timing;
 
-  if (currentDelta != UINT8_MAX)
-  {
-    *result = (BTIME_BRP(currentPrescaler - 1) & BTIME_BRP_MASK)
-        | BTIME_SJW(CONFIG_PLATFORM_NUMICRO_CAN_SJW - 1)
-        | BTIME_TSEG1(currentSeg1 - 1)
-        | BTIME_TSEG2(currentSeg2 - 1);
-    *extension = (currentPrescaler - 1) >> BTIME_BRP_WIDTH;
+  if (!canTimingCalc(canGetClock(&interface->base), &limits, &request, &timing))
+    return false;
 
-    return true;
-  }
+  *result = (BTIME_BRP(timing.prescaler - 1) & BTIME_BRP_MASK)
+      | BTIME_SJW(timing.sjw - 1)
+      | BTIME_TSEG1(timing.seg1 - 1)
+      | BTIME_TSEG2(timing.seg2 - 1);
+  *extension = (timing.prescaler - 1) >> BTIME_BRP_WIDTH;
 
-  return false;
+  return true;
 }
 /*----------------------------------------------------------------------------*/
 static void dropMessage(struct Can *interface, size_t index)
@@ -321,6 +281,38 @@ static uint32_t getBusRate(const struct Can *interface)
   return apbClock / prescaler / width;
 }
 /*----------------------------------------------------------------------------*/
+static size_t getRxQueueSpace(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+  /* Borrowed frames occupy slots of the receive queue */
+  return canBatchPoolRxSpace(&interface->batch);
+#else
+  return pointerQueueCapacity(&interface->rxQueue)
+      - pointerQueueSize(&interface->rxQueue);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static uint64_t getTimestamp(const struct Can *interface)
+{
+  if (interface->timer64 != NULL)
+    return timerGetValue64(interface->timer64);
+  else if (interface->timer != NULL)
+    return timerGetValue(interface->timer);
+  else
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+static size_t getTxQueueSpace(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+  /* Acquired frames have reserved slots in the transmit queue */
+  return canBatchPoolTxSpace(&interface->batch);
+#else
+  return pointerQueueCapacity(&interface->txQueue)
+      - pointerQueueSize(&interface->txQueue);
+#endif
+}
+/*----------------------------------------------------------------------------*/
 static void interruptHandler(void *object)
 {
   struct Can * const interface = object;
@@ -357,10 +349,9 @@ static void interruptHandler(void *object)
       /* Receive messages */
       while (reg->NDAT[RX_REG_INDEX] & (1UL << (id - 1)))
       {
-        const uint32_t timestamp = interface->timer ?
-            timerGetValue(interface->timer) : 0;
+        const uint64_t timestamp = getTimestamp(interface);
 
-        if (!pointerQueueFull(&interface->rxQueue))
+        if (getRxQueueSpace(interface) > 0)
         {
           struct CANStandardMessage * const message =
               pointerArrayBack(&interface->pool);
@@ -752,6 +743,28 @@ static void powerStateHandler(void *object, enum PmState state)
 }
 #endif
 /*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+static size_t sendFrames(void *object,
+    struct CANStandardMessage * const *frames, size_t count)
+{
+  struct Can * const interface = object;
+  NM_CAN_Type * const reg = interface->base.reg;
+
+  if (reg->TXREQ[TX_REG_INDEX])
+    return 0;
+
+  const size_t lastMessageIndex = MIN(count, TX_COUNT);
+
+  for (size_t index = 0; index < lastMessageIndex; ++index)
+  {
+    writeMessage(interface, frames[index], TX_OBJECT + index,
+        index == lastMessageIndex - 1);
+  }
+
+  return lastMessageIndex;
+}
+#endif
+/*----------------------------------------------------------------------------*/
 static enum Result canInit(void *object, const void *configBase)
 {
   const struct CanConfig * const config = configBase;
@@ -792,6 +805,12 @@ static enum Result canInit(void *object, const void *configBase)
   interface->callback = NULL;
   interface->rate = config->rate;
   interface->timer = config->timer;
+  interface->timer64 = config->timer64;
+
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+  canBatchPoolInit(&interface->batch, &interface->pool,
+      &interface->rxQueue, &interface->txQueue);
+#endif
 
 #ifdef CONFIG_PLATFORM_NUMICRO_CAN_COUNTERS
   interface->errorCount = 0;
@@ -902,6 +921,20 @@ static enum Result canGetParam(void *object, int parameter, void *data)
       break;
 #endif
 
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+    case IF_CAN_RX_ACQUIRE:
+      irqDisable(interface->base.irq);
+      canBatchPoolAcquireRx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+
+    case IF_CAN_TX_ACQUIRE:
+      irqDisable(interface->base.irq);
+      canBatchPoolAcquireTx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+#endif
+
     default:
       break;
   }
@@ -913,13 +946,11 @@ static enum Result canGetParam(void *object, int parameter, void *data)
       return E_OK;
 
     case IF_RX_PENDING:
-      *(size_t *)data = pointerQueueCapacity(&interface->rxQueue)
-          - pointerQueueSize(&interface->rxQueue);
+      *(size_t *)data = getRxQueueSpace(interface);
       return E_OK;
 
     case IF_TX_AVAILABLE:
-      *(size_t *)data = pointerQueueCapacity(&interface->txQueue)
-          - pointerQueueSize(&interface->txQueue);
+      *(size_t *)data = getTxQueueSpace(interface);
       return E_OK;
 
     case IF_TX_PENDING:
@@ -963,6 +994,31 @@ static enum Result canSetParam(void *object, int parameter, const void *data)
       setBusMode(interface, MODE_LOOPBACK);
       return E_OK;
 
+#ifdef CONFIG_PLATFORM_NUMICRO_CAN_ZERO_COPY
+    case IF_CAN_RX_RELEASE:
+      irqDisable(interface->base.irq);
+      canBatchPoolReleaseRx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+
+    case IF_CAN_TX_RELEASE:
+      irqDisable(interface->base.irq);
+      canBatchPoolReleaseTx(&interface->batch, data);
+      irqEnable(interface->base.irq);
+      return E_OK;
+
+    case IF_CAN_TX_SUBMIT:
+    {
+      bool submitted;
+
+      irqDisable(interface->base.irq);
+      submitted = canBatchPoolSubmit(&interface->batch, data,
+          sendFrames, interface);
+      irqEnable(interface->base.irq);
+      return submitted ? E_OK : E_VALUE;
+    }
+#endif
+
 #ifdef CONFIG_PLATFORM_NUMICRO_CAN_FILTERS
     case IF_CAN_FILTER_ADD_STD:
       if (filterAdd(interface, data, false))
@@ -1082,7 +1138,7 @@ static size_t canWrite(void *object, const void *buffer, size_t length)
     }
   }
 
-  while (!error && position < length && !pointerQueueFull(&interface->txQueue))
+  while (!error && position < length && getTxQueueSpace(interface) > 0)
   {
     struct CANStandardMessage * const message =
         pointerArrayBack(&interface->pool);
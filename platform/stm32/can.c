@@ -5,6 +5,8 @@
  */
 
 #include <halm/generic/can.h>
+#include <halm/generic/can_batch.h>
+#include <halm/generic/can_timing.h>
 #include <halm/generic/pointer_array.h>
 #include <halm/generic/pointer_queue.h>
 #include <halm/platform/stm32/bxcan_base.h>
@@ -35,6 +37,8 @@ struct Can
 
   /* Timer for the time stamp generation */
   struct Timer *timer;
+  /* 64-bit timer for the time stamp generation */
+  struct Timer64 *timer64;
 
   /* Message pool */
   PointerArray pool;
@@ -54,6 +58,11 @@ struct Can
   size_t txWatermark;
 #endif
 
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+  /* Frames lent to the user of the zero-copy interface */
+  struct CanBatchPool batch;
+#endif
+
 #ifdef CONFIG_PLATFORM_STM32_CAN_COUNTERS
   /* Bus errors */
   uint32_t errorCount;
@@ -66,10 +75,12 @@ struct Can
 #endif
 };
 /*----------------------------------------------------------------------------*/
-static bool calcSegments(uint8_t, uint8_t *, uint8_t *);
 static bool calcTimings(const struct Can *, uint32_t, uint32_t *);
 static bool fetchStandardMessage(const void *, struct CANStandardMessage *);
 static uint32_t getBusRate(const struct Can *);
+static size_t getRxQueueSpace(const struct Can *);
+static uint64_t getTimestamp(const struct Can *);
+static size_t getTxQueueSpace(const struct Can *);
 static void interruptHandler(void *);
 static void readMessage(struct Can *, struct CANStandardMessage *,
     unsigned int);
@@ -84,6 +95,11 @@ static void updateTxWatermark(struct Can *, size_t);
 #ifdef CONFIG_PLATFORM_STM32_CAN_PM
 static void powerStateHandler(void *, enum PmState);
 #endif
+
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+static size_t sendFrames(void *, struct CANStandardMessage * const *,
+    size_t);
+#endif
 /*----------------------------------------------------------------------------*/
 static enum Result canInit(void *, const void *);
 static void canSetCallback(void *, void (*)(void *), void *);
@@ -110,90 +126,35 @@ const struct InterfaceClass * const Can = &(const struct InterfaceClass){
     .write = canWrite
 };
 /*----------------------------------------------------------------------------*/
-static bool calcSegments(uint8_t width, uint8_t *tseg1, uint8_t *tseg2)
-{
-  /* Width of the bit segment 1, the synchronization time segment excluded */
-  const uint8_t seg1 = width * CONFIG_PLATFORM_STM32_CAN_SP / 100 - 1;
-
-  if (seg1 > BTR_TS1_MAX + 1)
-    return false;
-
-  const uint8_t seg2 = width - seg1 - 1;
-
-  if (seg2 > BTR_TS2_MAX + 1)
-    return false;
-  if (seg2 <= CONFIG_PLATFORM_STM32_CAN_SJW)
-    return false;
-  if (seg2 > seg1 + 1)
-    return false;
-
-  *tseg1 = seg1;
-  *tseg2 = seg2;
-
-  return true;
-}
-/*----------------------------------------------------------------------------*/
 static bool calcTimings(const struct Can *interface, uint32_t rate,
     uint32_t *result)
 {
-  static const uint8_t maxWidth = BTR_TS1_MAX + BTR_TS2_MAX + 3;
-  static const uint8_t minWidth = 3;
-
-  if (!rate)
-    return false;
-
-  const uint32_t apbClock = canGetClock(&interface->base);
-  uint32_t currentError = MAX_CLOCK_ERROR;
-  uint32_t currentPrescaler;
-  uint8_t currentDelta = UINT8_MAX;
-  uint8_t currentSeg1;
-  uint8_t currentSeg2;
-
-  for (uint8_t width = maxWidth; width >= minWidth; --width)
-  {
-    const uint32_t clock = rate * width;
-    const uint32_t error = apbClock % clock;
-
-    if (error > currentError)
-      continue;
-    if (clock > apbClock)
-      continue;
-    if (apbClock / clock > BTR_BRP_MAX + 1)
-      continue;
-
-    uint8_t seg1;
-    uint8_t seg2;
-
-    if (calcSegments(width, &seg1, &seg2))
-    {
-      const uint8_t sp = ((uint16_t)seg1 + 1) * 100 / width;
-      const uint8_t delta = abs(CONFIG_PLATFORM_STM32_CAN_SP - (int)sp);
+  static const struct CanTimingLimits limits = {
+      .prescaler = BTR_BRP_MAX,
+      .minSeg1 = 1,
+      .maxSeg1 = BTR_TS1_MAX + 1,
+      .minSeg2 = 1,
+      .maxSeg2 = BTR_TS2_MAX + 1,
+      .maxSjw = 4
+  };
 
-      if (error < currentError || delta < currentDelta)
-      {
-        currentError = error;
-        currentPrescaler = apbClock / clock;
-        currentDelta = delta;
-        currentSeg1 = seg1;
-        currentSeg2 = seg2;
-
-        if (error == 0 && delta == 0)
-          break;
-      }
-    }
-  }
+  const struct CanTimingRequest request = {
+      .rate = rate,
+      .tolerance = MAX_CLOCK_ERROR,
+      .samplePoint = CONFIG_PLATFORM_STM32_CAN_SP,
+      .sjw = CONFIG_PLATFORM_STM32_CAN_SJW
+  };
+  struct CanTiming timing;
 
-  if (currentDelta != UINT8_MAX)
-  {
-    *result = BTR_BRP(currentPrescaler - 1)
-        | BTR_SJW(CONFIG_PLATFORM_STM32_CAN_SJW - 1)
-        | BTR_TS1(currentSeg1 - 1)
-        | BTR_TS2(currentSeg2 - 1);
+  if (!canTimingCalc(canGetClock(&interface->base), &limits, &request, &timing))
+    return false;
 
-    return true;
-  }
+  *result = BTR_BRP(timing.prescaler - 1)
+      | BTR_SJW(timing.sjw - 1)
+      | BTR_TS1(timing.seg1 - 1)
+      | BTR_TS2(timing.seg2 - 1);
 
-  return false;
+  return true;
 }
 /*----------------------------------------------------------------------------*/
 static bool fetchStandardMessage(const void *buffer,
@@ -238,6 +199,38 @@ static uint32_t getBusRate(const struct Can *interface)
   return apbClock / prescaler / width;
 }
 /*----------------------------------------------------------------------------*/
+static size_t getRxQueueSpace(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+  /* Borrowed frames occupy slots of the receive queue */
+  return canBatchPoolRxSpace(&interface->batch);
+#else
+  return pointerQueueCapacity(&interface->rxQueue)
+      - pointerQueueSize(&interface->rxQueue);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static uint64_t getTimestamp(const struct Can *interface)
+{
+  if (interface->timer64 != NULL)
+    return timerGetValue64(interface->timer64);
+  else if (interface->timer != NULL)
+    return timerGetValue(interface->timer);
+  else
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+static size_t getTxQueueSpace(const struct Can *interface)
+{
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+  /* Acquired frames have reserved slots in the transmit queue */
+  return canBatchPoolTxSpace(&interface->batch);
+#else
+  return pointerQueueCapacity(&interface->txQueue)
+      - pointerQueueSize(&interface->txQueue);
+#endif
+}
+/*----------------------------------------------------------------------------*/
 static void interruptHandler(void *object)
 {
   struct Can * const interface = object;
@@ -258,10 +251,9 @@ static void interruptHandler(void *object)
   /* Read received messages, use FIFO0 only */
   while (RF_FMP_VALUE(reg->RFR[0]) > 0)
   {
-    const uint32_t timestamp = interface->timer ?
-        timerGetValue(interface->timer) : 0;
+    const uint64_t timestamp = getTimestamp(interface);
 
-    if (!pointerQueueFull(&interface->rxQueue))
+    if (getRxQueueSpace(interface) > 0)
     {
       struct CANStandardMessage * const message =
           pointerArrayBack(&interface->pool);
@@ -528,6 +520,27 @@ static void powerStateHandler(void *object, enum PmState state)
 }
 #endif
 /*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+static size_t sendFrames(void *object,
+    struct CANStandardMessage * const *frames, size_t count)
+{
+  struct Can * const interface = object;
+  STM_CAN_Type * const reg = interface->base.reg;
+  size_t index = 0;
+
+  if ((reg->TSR & TSR_TME_MASK) == TSR_TME_MASK)
+  {
+    reg->IER |= IER_TMEIE;
+
+    /* Write frames while one of the transmit buffers is empty */
+    while (index < count && (reg->TSR & TSR_TME_MASK) != 0)
+      sendMessage(interface, frames[index++]);
+  }
+
+  return index;
+}
+#endif
+/*----------------------------------------------------------------------------*/
 static enum Result canInit(void *object, const void *configBase)
 {
   const struct CanConfig * const config = configBase;
@@ -561,6 +574,12 @@ static enum Result canInit(void *object, const void *configBase)
   interface->base.handler = interruptHandler;
   interface->callback = NULL;
   interface->timer = config->timer;
+  interface->timer64 = config->timer64;
+
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+  canBatchPoolInit(&interface->batch, &interface->pool,
+      &interface->rxQueue, &interface->txQueue);
+#endif
 
 #ifdef CONFIG_PLATFORM_STM32_CAN_COUNTERS
   interface->errorCount = 0;
@@ -683,6 +702,20 @@ static enum Result canGetParam(void *object, int parameter, void *data)
       break;
 #endif
 
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+    case IF_CAN_RX_ACQUIRE:
+      irqDisable(interface->base.irq.rx0);
+      canBatchPoolAcquireRx(&interface->batch, data);
+      irqEnable(interface->base.irq.rx0);
+      return E_OK;
+
+    case IF_CAN_TX_ACQUIRE:
+      irqDisable(interface->base.irq.tx);
+      canBatchPoolAcquireTx(&interface->batch, data);
+      irqEnable(interface->base.irq.tx);
+      return E_OK;
+#endif
+
     default:
       break;
   }
@@ -694,13 +727,11 @@ static enum Result canGetParam(void *object, int parameter, void *data)
       return E_OK;
 
     case IF_RX_PENDING:
-      *(size_t *)data = pointerQueueCapacity(&interface->rxQueue)
-          - pointerQueueSize(&interface->rxQueue);
+      *(size_t *)data = getRxQueueSpace(interface);
       return E_OK;
 
     case IF_TX_AVAILABLE:
-      *(size_t *)data = pointerQueueCapacity(&interface->txQueue)
-          - pointerQueueSize(&interface->txQueue);
+      *(size_t *)data = getTxQueueSpace(interface);
       return E_OK;
 
     case IF_TX_PENDING:
@@ -744,6 +775,35 @@ static enum Result canSetParam(void *object, int parameter, const void *data)
       setBusMode(interface, MODE_LOOPBACK);
       return E_OK;
 
+#ifdef CONFIG_PLATFORM_STM32_CAN_ZERO_COPY
+    case IF_CAN_RX_RELEASE:
+      irqDisable(interface->base.irq.rx0);
+      irqDisable(interface->base.irq.tx);
+      canBatchPoolReleaseRx(&interface->batch, data);
+      irqEnable(interface->base.irq.tx);
+      irqEnable(interface->base.irq.rx0);
+      return E_OK;
+
+    case IF_CAN_TX_RELEASE:
+      irqDisable(interface->base.irq.rx0);
+      irqDisable(interface->base.irq.tx);
+      canBatchPoolReleaseTx(&interface->batch, data);
+      irqEnable(interface->base.irq.tx);
+      irqEnable(interface->base.irq.rx0);
+      return E_OK;
+
+    case IF_CAN_TX_SUBMIT:
+    {
+      bool submitted;
+
+      irqDisable(interface->base.irq.tx);
+      submitted = canBatchPoolSubmit(&interface->batch, data,
+          sendFrames, interface);
+      irqEnable(interface->base.irq.tx);
+      return submitted ? E_OK : E_VALUE;
+    }
+#endif
+
     default:
       break;
   }
@@ -828,7 +888,7 @@ static size_t canWrite(void *object, const void *buffer, size_t length)
     }
   }
 
-  while (!error && position < length && !pointerQueueFull(&interface->txQueue))
+  while (!error && position < length && getTxQueueSpace(interface) > 0)
   {
     struct CANStandardMessage * const message =
         pointerArrayBack(&interface->pool);
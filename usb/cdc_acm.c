@@ -22,6 +22,9 @@
 #ifdef CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
 #  define MEM_ALIGNMENT CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
 #endif
+
+/* Transfer descriptors of multi-packet controllers cover at least 16 kB */
+#define MAX_TRANSFER_SIZE 16384
 /*----------------------------------------------------------------------------*/
 struct CdcAcm
 {
@@ -43,6 +46,10 @@ struct CdcAcm
   size_t queuedRxBytes;
   /* Number of pending bytes */
   size_t queuedTxBytes;
+  /* Size of request buffers */
+  size_t bufferSize;
+  /* Number of bytes already read from the first request in the queue */
+  size_t rxOffset;
 
   struct UsbEndpoint *notificationEp;
   struct UsbEndpoint *rxDataEp;
@@ -61,12 +68,13 @@ struct CdcAcm
 #endif
 };
 /*----------------------------------------------------------------------------*/
-static void *allocBufferMemory(size_t, size_t, size_t *);
+static inline size_t alignBufferSize(size_t);
+static void *allocBufferMemory(size_t, size_t, size_t, size_t *);
 static void cdcDataReceived(void *, struct UsbRequest *, enum UsbRequestStatus);
 static void cdcDataSent(void *, struct UsbRequest *, enum UsbRequestStatus);
-static inline size_t getMaxBufferSize(void);
 static inline size_t getMaxPacketSize(void);
 static inline size_t getPacketSize(const struct CdcAcm *);
+static inline size_t getTransferSize(const struct CdcAcm *);
 static inline bool isTxPoolEmpty(const struct CdcAcm *);
 static bool resetEndpoints(struct CdcAcm *);
 static void updateRxWatermark(struct CdcAcm *, size_t);
@@ -98,10 +106,19 @@ const struct InterfaceClass * const CdcAcm = &(const struct InterfaceClass){
     .write = interfaceWrite
 };
 /*----------------------------------------------------------------------------*/
+static inline size_t alignBufferSize(size_t size)
+{
+#ifdef MEM_ALIGNMENT
+  size += MEM_ALIGNMENT - 1;
+  size -= size % MEM_ALIGNMENT;
+#endif
+
+  return size;
+}
+/*----------------------------------------------------------------------------*/
 static void *allocBufferMemory(size_t requestCount, size_t bufferCount,
-    size_t *padding)
+    size_t bufferSize, size_t *padding)
 {
-  const size_t bufferSize = getMaxBufferSize();
   const size_t dataMemorySize = bufferCount * bufferSize;
   size_t headerMemorySize = requestCount * sizeof(struct UsbRequest);
 
@@ -171,7 +188,9 @@ static void cdcDataSent(void *argument, struct UsbRequest *request,
   {
     interface->queuedTxBytes -= request->length;
 
-    if (!interface->queuedTxBytes && request->length == maxPacketSize)
+    /* Transfer ends with a short packet, multi-packet requests included */
+    if (!interface->queuedTxBytes && request->length
+        && !(request->length % maxPacketSize))
     {
       /* Send empty packet to finalize data transfer */
       request->length = 0;
@@ -220,18 +239,6 @@ static void cdcNotificationSent(void *argument, struct UsbRequest *request,
 }
 #endif
 /*----------------------------------------------------------------------------*/
-static inline size_t getMaxBufferSize(void)
-{
-  size_t size = getMaxPacketSize();
-
-#ifdef MEM_ALIGNMENT
-  size += MEM_ALIGNMENT - 1;
-  size -= size % MEM_ALIGNMENT;
-#endif
-
-  return size;
-}
-/*----------------------------------------------------------------------------*/
 static inline size_t getMaxPacketSize(void)
 {
 #ifdef CONFIG_USB_DEVICE_HS
@@ -247,6 +254,16 @@ static inline size_t getPacketSize(const struct CdcAcm *interface)
       CDC_DATA_EP_SIZE_HS : CDC_DATA_EP_SIZE;
 }
 /*----------------------------------------------------------------------------*/
+static inline size_t getTransferSize(const struct CdcAcm *interface)
+{
+#ifdef CONFIG_PLATFORM_USB_DEVICE_MULTI_PACKET
+  /* Each request may contain several packets of the current speed */
+  return interface->bufferSize;
+#else
+  return getPacketSize(interface);
+#endif
+}
+/*----------------------------------------------------------------------------*/
 static inline bool isTxPoolEmpty(const struct CdcAcm *interface)
 {
 #ifdef CONFIG_USB_DEVICE_CDC_ACM_INTERRUPTS
@@ -267,6 +284,7 @@ static bool resetEndpoints(struct CdcAcm *interface)
   interface->suspended = true;
   interface->queuedRxBytes = 0;
   interface->queuedTxBytes = 0;
+  interface->rxOffset = 0;
 
   /* Enable endpoints */
   const size_t maxPacketSize = getPacketSize(interface);
@@ -376,6 +394,18 @@ static enum Result interfaceInit(void *object, const void *configBase)
       }
   };
 
+  const size_t packetSize = getMaxPacketSize();
+  const size_t requestSize = config->bufferSize ?
+      config->bufferSize : packetSize;
+
+  /* Buffer should contain an integer number of packets */
+  if (requestSize % packetSize || requestSize > MAX_TRANSFER_SIZE)
+    return E_VALUE;
+#ifndef CONFIG_PLATFORM_USB_DEVICE_MULTI_PACKET
+  if (requestSize != packetSize)
+    return E_VALUE;
+#endif
+
   if (!pointerQueueInit(&interface->rxRequestQueue, config->rxBuffers))
     return E_MEMORY;
   if (!pointerArrayInit(&interface->txRequestPool, config->txBuffers))
@@ -385,6 +415,8 @@ static enum Result interfaceInit(void *object, const void *configBase)
   interface->callbackArgument = NULL;
   interface->queuedRxBytes = 0;
   interface->queuedTxBytes = 0;
+  interface->bufferSize = requestSize;
+  interface->rxOffset = 0;
   interface->suspended = true;
   interface->updated = false;
 
@@ -407,14 +439,13 @@ static enum Result interfaceInit(void *object, const void *configBase)
     return E_ERROR;
 
   const size_t count = config->rxBuffers + config->txBuffers;
-  const size_t bufferSize = getMaxBufferSize();
-  const size_t packetSize = getMaxPacketSize();
+  const size_t bufferSize = alignBufferSize(requestSize);
   uint8_t *arena;
 
   /* Allocate requests */
   if (config->arena != NULL)
   {
-    interface->requests = allocBufferMemory(count, 0, NULL);
+    interface->requests = allocBufferMemory(count, 0, 0, NULL);
     if (interface->requests == NULL)
       return E_MEMORY;
 
@@ -424,7 +455,8 @@ static enum Result interfaceInit(void *object, const void *configBase)
   {
     size_t padding;
 
-    interface->requests = allocBufferMemory(count, count, &padding);
+    interface->requests = allocBufferMemory(count, count, bufferSize,
+        &padding);
     if (interface->requests == NULL)
       return E_MEMORY;
 
@@ -437,7 +469,8 @@ static enum Result interfaceInit(void *object, const void *configBase)
 
   for (size_t index = 0; index < config->rxBuffers; ++index)
   {
-    usbRequestInit(request, payload, packetSize, cdcDataReceived, interface);
+    usbRequestInit(request, payload, requestSize, cdcDataReceived,
+        interface);
     pointerQueuePushBack(&interface->rxRequestQueue, request);
 
     ++request;
@@ -446,7 +479,7 @@ static enum Result interfaceInit(void *object, const void *configBase)
 
   for (size_t index = 0; index < config->txBuffers; ++index)
   {
-    usbRequestInit(request, payload, packetSize, cdcDataSent, interface);
+    usbRequestInit(request, payload, requestSize, cdcDataSent, interface);
     pointerArrayPushBack(&interface->txRequestPool, request);
 
     ++request;
@@ -511,7 +544,7 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
       {
         const size_t buffers = pointerQueueCapacity(&interface->rxRequestQueue)
             - pointerQueueSize(&interface->rxRequestQueue);
-        *(size_t *)data = buffers * getPacketSize(interface);
+        *(size_t *)data = buffers * getTransferSize(interface);
       }
       else
         *(size_t *)data = 0;
@@ -521,7 +554,7 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
       if (!interface->suspended)
       {
         const size_t buffers = pointerArraySize(&interface->txRequestPool);
-        *(size_t *)data = buffers * getPacketSize(interface);
+        *(size_t *)data = buffers * getTransferSize(interface);
       }
       else
         *(size_t *)data = 0;
@@ -641,8 +674,6 @@ static size_t interfaceRead(void *object, void *buffer, size_t length)
   struct CdcAcm * const interface = object;
   uint8_t *bufferPosition = buffer;
 
-  assert(length >= getPacketSize(interface));
-
   if (interface->suspended)
     return 0;
 
@@ -650,24 +681,38 @@ static size_t interfaceRead(void *object, void *buffer, size_t length)
   {
     struct UsbRequest * const request =
         pointerQueueFront(&interface->rxRequestQueue);
+    const size_t bytesToRead =
+        MIN(length, request->length - interface->rxOffset);
+    IrqState state;
+
+    if (bytesToRead)
+    {
+      memcpy(bufferPosition, (const uint8_t *)request->buffer
+          + interface->rxOffset, bytesToRead);
 
-    if (length < request->length)
+      state = irqSave();
+      interface->queuedRxBytes -= bytesToRead;
+      irqRestore(state);
+
+      bufferPosition += bytesToRead;
+      length -= bytesToRead;
+    }
+
+    /* Large requests may be read in several steps */
+    if (interface->rxOffset + bytesToRead < request->length)
+    {
+      interface->rxOffset += bytesToRead;
       break;
+    }
 
-    const size_t bytesToRead = request->length;
-    IrqState state;
+    interface->rxOffset = 0;
 
     state = irqSave();
     pointerQueuePopFront(&interface->rxRequestQueue);
-    interface->queuedRxBytes -= bytesToRead;
     irqRestore(state);
 
-    memcpy(bufferPosition, request->buffer, bytesToRead);
     request->length = 0;
 
-    bufferPosition += bytesToRead;
-    length -= bytesToRead;
-
     if (usbEpEnqueue(interface->rxDataEp, request) != E_OK)
     {
       /* Hardware error occurred, suspend the interface and wait for reset */
@@ -689,14 +734,14 @@ static size_t interfaceWrite(void *object, const void *buffer, size_t length)
 {
   struct CdcAcm * const interface = object;
   const uint8_t *bufferPosition = buffer;
-  const size_t maxPacketSize = getPacketSize(interface);
+  const size_t transferSize = getTransferSize(interface);
 
   if (interface->suspended)
     return 0;
 
   while (length && !isTxPoolEmpty(interface))
   {
-    const size_t bytesToWrite = MIN(length, maxPacketSize);
+    const size_t bytesToWrite = MIN(length, transferSize);
     struct UsbRequest *request;
     IrqState state;
 
@@ -0,0 +1,1205 @@
+/*
+ * cdc_ncm.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/pointer_array.h>
+#include <halm/generic/pointer_queue.h>
+#include <halm/irq.h>
+#include <halm/usb/cdc_ncm.h>
+#include <halm/usb/cdc_ncm_base.h>
+#include <halm/usb/cdc_ncm_defs.h>
+#include <halm/usb/usb_defs.h>
+#include <halm/usb/usb_request.h>
+#include <halm/usb/usb_trace.h>
+#include <xcore/memory.h>
+#include <assert.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
+#  define MEM_ALIGNMENT CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
+#endif
+
+/* Transfer descriptors of multi-packet controllers cover at least 16 kB */
+#define MAX_TRANSFER_SIZE 16384
+/* Transfer block size should be a multiple of the maximum packet size */
+#define NTB_SIZE_ALIGNMENT 512
+/*----------------------------------------------------------------------------*/
+struct CdcNcmStreamConfig
+{
+  /** Mandatory: pointer to a parent object. */
+  struct CdcNcm *parent;
+};
+
+struct CdcNcmStream
+{
+  struct Stream base;
+
+  /* Parent interface */
+  struct CdcNcm *parent;
+};
+
+/* Datagram descriptor stored at the end of the transmit block buffer */
+struct DatagramRecord
+{
+  struct StreamRequest *request;
+  uint16_t index;
+  uint16_t length;
+};
+
+struct TransferBlock
+{
+  struct UsbRequest base;
+
+  /* Beginning of the block buffer */
+  uint8_t *data;
+  /* Length of the received block or the length of the transmitted data */
+  uint16_t length;
+  /* Offset of the current datagram pointer table in the received block */
+  uint16_t ndp;
+  /* Index of the next entry in the table or count of transmitted datagrams */
+  uint16_t entry;
+};
+
+struct CdcNcm
+{
+  struct Interface base;
+
+  /* Lower half of the driver */
+  struct CdcNcmBase *driver;
+
+  void (*callback)(void *);
+  void *callbackArgument;
+
+  /* Input and output streams */
+  struct CdcNcmStream *rxStream;
+  struct CdcNcmStream *txStream;
+
+  /* Queue for pending receive stream requests */
+  PointerQueue rxRequestQueue;
+  /* Queue for received blocks with unread datagrams */
+  PointerQueue rxBlockQueue;
+  /* Pool for free receive blocks */
+  PointerArray rxBlockPool;
+  /* Queue for completed transmit blocks waiting for the endpoint */
+  PointerQueue txBlockQueue;
+  /* Pool for free transmit blocks */
+  PointerArray txBlockPool;
+  /* Pool for notification requests */
+  PointerArray notificationPool;
+
+  /* Pointer to the array of transfer blocks */
+  struct TransferBlock *blocks;
+  /* Memory for block and notification buffers */
+  void *arena;
+  /* Notification requests */
+  struct UsbRequest notifications[2];
+
+  /* Receive block being filled by the endpoint */
+  struct TransferBlock *rxTransfer;
+  /* Transmit block being filled with datagrams */
+  struct TransferBlock *txBlock;
+  /* Transmit block being sent by the endpoint */
+  struct TransferBlock *txTransfer;
+
+  struct UsbEndpoint *notificationEp;
+  struct UsbEndpoint *rxDataEp;
+  struct UsbEndpoint *txDataEp;
+
+  /* Address of the network interface on the host side */
+  uint64_t address;
+  /* Maximum size of transfer blocks */
+  uint16_t ntbSize;
+  /* Sequence number of the next transmit block */
+  uint16_t txSequence;
+
+  /* Alternate setting with data endpoints is selected by the host */
+  bool active;
+  /* Device suspended due to error or external request */
+  bool suspended;
+};
+/*----------------------------------------------------------------------------*/
+static inline size_t alignBufferSize(size_t);
+static inline size_t alignDatagramOffset(size_t);
+static void armRxBlock(struct CdcNcm *);
+static bool canAppendDatagram(const struct CdcNcm *,
+    const struct TransferBlock *, size_t);
+static void cdcDataReceived(void *, struct UsbRequest *, enum UsbRequestStatus);
+static void cdcDataSent(void *, struct UsbRequest *, enum UsbRequestStatus);
+static void cdcNotificationSent(void *, struct UsbRequest *,
+    enum UsbRequestStatus);
+static void completeTxBlock(struct CdcNcm *, struct TransferBlock *,
+    enum StreamRequestStatus);
+static bool findNextDatagram(struct TransferBlock *, uint16_t *, uint16_t *);
+static void finalizeTxBlock(struct CdcNcm *, struct TransferBlock *);
+static inline size_t getPacketSize(const struct CdcNcm *);
+static inline struct DatagramRecord *getRecord(const struct CdcNcm *,
+    const struct TransferBlock *, size_t);
+static size_t getTransferSize(const struct CdcNcm *, size_t);
+static inline uint16_t getTxLimit(const struct CdcNcm *);
+static bool parseBlockHeader(struct TransferBlock *);
+static void processRxBlocks(struct CdcNcm *);
+static void resetEndpoints(struct CdcNcm *);
+static void resetTxBlocks(struct CdcNcm *);
+static void sendNotification(struct CdcNcm *, const void *, size_t);
+static void sendTxBlock(struct CdcNcm *, struct TransferBlock *);
+static void startInterface(struct CdcNcm *);
+static bool validateDatagramTable(const struct TransferBlock *, uint16_t);
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceInit(void *, const void *);
+static void interfaceDeinit(void *);
+static void interfaceSetCallback(void *, void (*)(void *), void *);
+static enum Result interfaceGetParam(void *, int, void *);
+static enum Result interfaceSetParam(void *, int, const void *);
+
+static enum Result streamInit(void *, const void *);
+static void rxStreamClear(void *);
+static void txStreamClear(void *);
+static enum Result rxStreamEnqueue(void *, struct StreamRequest *);
+static enum Result txStreamEnqueue(void *, struct StreamRequest *);
+/*----------------------------------------------------------------------------*/
+const struct InterfaceClass * const CdcNcm = &(const struct InterfaceClass){
+    .size = sizeof(struct CdcNcm),
+    .init = interfaceInit,
+    .deinit = interfaceDeinit,
+
+    .setCallback = interfaceSetCallback,
+    .getParam = interfaceGetParam,
+    .setParam = interfaceSetParam,
+    .read = NULL,
+    .write = NULL
+};
+
+const struct StreamClass * const CdcNcmRxStream =
+    &(const struct StreamClass){
+    .size = sizeof(struct CdcNcmStream),
+    .init = streamInit,
+    .deinit = NULL, /* Default destructor */
+
+    .clear = rxStreamClear,
+    .enqueue = rxStreamEnqueue
+};
+
+const struct StreamClass * const CdcNcmTxStream =
+    &(const struct StreamClass){
+    .size = sizeof(struct CdcNcmStream),
+    .init = streamInit,
+    .deinit = NULL, /* Default destructor */
+
+    .clear = txStreamClear,
+    .enqueue = txStreamEnqueue
+};
+/*----------------------------------------------------------------------------*/
+static inline size_t alignBufferSize(size_t size)
+{
+#ifdef MEM_ALIGNMENT
+  size += MEM_ALIGNMENT - 1;
+  size -= size % MEM_ALIGNMENT;
+#endif
+
+  return size;
+}
+/*----------------------------------------------------------------------------*/
+static inline size_t alignDatagramOffset(size_t offset)
+{
+  return (offset + CDC_NCM_NDP_ALIGNMENT - 1) & ~(CDC_NCM_NDP_ALIGNMENT - 1);
+}
+/*----------------------------------------------------------------------------*/
+static void armRxBlock(struct CdcNcm *interface)
+{
+  if (!interface->active || interface->suspended
+      || interface->rxTransfer != NULL
+      || pointerArrayEmpty(&interface->rxBlockPool))
+  {
+    return;
+  }
+
+  struct TransferBlock * const block =
+      pointerArrayBack(&interface->rxBlockPool);
+  pointerArrayPopBack(&interface->rxBlockPool);
+
+  block->length = 0;
+  block->ndp = 0;
+  block->entry = 0;
+  block->base.buffer = block->data;
+  block->base.capacity = getTransferSize(interface, interface->ntbSize);
+  block->base.length = 0;
+
+  interface->rxTransfer = block;
+
+  if (usbEpEnqueue(interface->rxDataEp, &block->base) != E_OK)
+  {
+    /* Hardware error occurred, suspend the interface and wait for reset */
+    interface->rxTransfer = NULL;
+    interface->suspended = true;
+    pointerArrayPushBack(&interface->rxBlockPool, block);
+
+    usbTrace("cdc_ncm: suspended in receive function");
+  }
+}
+/*----------------------------------------------------------------------------*/
+static bool canAppendDatagram(const struct CdcNcm *interface,
+    const struct TransferBlock *block, size_t length)
+{
+  const size_t count = block->entry + 1;
+  const size_t offset = alignDatagramOffset(block->length);
+
+  /* Datagram table with a terminating entry is placed after the datagrams */
+  const size_t end = alignDatagramOffset(offset + length)
+      + sizeof(struct CdcNdp16) + (count + 1) * sizeof(struct CdcNdp16Entry);
+  /* Datagram records are stored at the end of the buffer */
+  const size_t records = (size_t)interface->ntbSize
+      - count * sizeof(struct DatagramRecord);
+
+  /* One more byte may be used as a padding to avoid zero-length packets */
+  return end <= getTxLimit(interface) && end < records;
+}
+/*----------------------------------------------------------------------------*/
+static void cdcDataReceived(void *argument, struct UsbRequest *request,
+    enum UsbRequestStatus status)
+{
+  struct CdcNcm * const interface = argument;
+  struct TransferBlock * const block = (struct TransferBlock *)request;
+  bool valid = false;
+
+  if (status == USB_REQUEST_COMPLETED)
+  {
+    const bool full = request->length == request->capacity;
+
+    block->length += request->length;
+
+    /* Transfer block ends with a short packet or when the buffer is full */
+    if (full && block->length < interface->ntbSize)
+    {
+      request->buffer = block->data + block->length;
+      request->capacity = getTransferSize(interface,
+          interface->ntbSize - block->length);
+      request->length = 0;
+
+      if (usbEpEnqueue(interface->rxDataEp, request) == E_OK)
+        return;
+
+      interface->suspended = true;
+      usbTrace("cdc_ncm: suspended in read callback");
+    }
+    else
+    {
+      valid = parseBlockHeader(block);
+    }
+  }
+  else if (status != USB_REQUEST_CANCELLED)
+  {
+    interface->suspended = true;
+    usbTrace("cdc_ncm: suspended in read callback");
+  }
+
+  interface->rxTransfer = NULL;
+
+  if (valid)
+    pointerQueuePushBack(&interface->rxBlockQueue, block);
+  else
+    pointerArrayPushBack(&interface->rxBlockPool, block);
+
+  armRxBlock(interface);
+  processRxBlocks(interface);
+}
+/*----------------------------------------------------------------------------*/
+static void cdcDataSent(void *argument, struct UsbRequest *request,
+    enum UsbRequestStatus status)
+{
+  struct CdcNcm * const interface = argument;
+  struct TransferBlock * const block = (struct TransferBlock *)request;
+  enum StreamRequestStatus result = STREAM_REQUEST_COMPLETED;
+
+  if (status == USB_REQUEST_COMPLETED)
+  {
+    const size_t sent =
+        (const uint8_t *)request->buffer + request->length - block->data;
+
+    /* Large blocks are sent in several steps */
+    if (sent < block->length)
+    {
+      request->buffer = block->data + sent;
+      request->length = getTransferSize(interface, block->length - sent);
+
+      if (usbEpEnqueue(interface->txDataEp, request) == E_OK)
+        return;
+
+      interface->suspended = true;
+      usbTrace("cdc_ncm: suspended in write callback");
+      result = STREAM_REQUEST_FAILED;
+    }
+  }
+  else if (status == USB_REQUEST_CANCELLED)
+  {
+    result = STREAM_REQUEST_CANCELLED;
+  }
+  else
+  {
+    interface->suspended = true;
+    usbTrace("cdc_ncm: suspended in write callback");
+    result = STREAM_REQUEST_FAILED;
+  }
+
+  interface->txTransfer = NULL;
+  completeTxBlock(interface, block, result);
+
+  const bool ready = interface->active && !interface->suspended;
+
+  if (ready && !pointerQueueEmpty(&interface->txBlockQueue))
+  {
+    struct TransferBlock * const next =
+        pointerQueueFront(&interface->txBlockQueue);
+
+    pointerQueuePopFront(&interface->txBlockQueue);
+    sendTxBlock(interface, next);
+  }
+  else if (ready && interface->txBlock != NULL)
+  {
+    struct TransferBlock * const next = interface->txBlock;
+
+    interface->txBlock = NULL;
+    sendTxBlock(interface, next);
+  }
+  else if (pointerArrayFull(&interface->txBlockPool))
+  {
+    /* Notify when all data has been sent */
+    if (interface->callback != NULL)
+      interface->callback(interface->callbackArgument);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void cdcNotificationSent(void *argument, struct UsbRequest *request,
+    enum UsbRequestStatus status)
+{
+  struct CdcNcm * const interface = argument;
+
+  pointerArrayPushBack(&interface->notificationPool, request);
+
+  if (status != USB_REQUEST_COMPLETED && status != USB_REQUEST_CANCELLED)
+  {
+    interface->suspended = true;
+    usbTrace("cdc_ncm: suspended in notify callback");
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void completeTxBlock(struct CdcNcm *interface,
+    struct TransferBlock *block, enum StreamRequestStatus status)
+{
+  for (size_t index = 0; index < block->entry; ++index)
+  {
+    struct StreamRequest * const request =
+        getRecord(interface, block, index)->request;
+
+    request->callback(request->argument, request, status);
+  }
+
+  pointerArrayPushBack(&interface->txBlockPool, block);
+}
+/*----------------------------------------------------------------------------*/
+static bool findNextDatagram(struct TransferBlock *block, uint16_t *index,
+    uint16_t *length)
+{
+  while (block->ndp)
+  {
+    struct CdcNdp16 table;
+    memcpy(&table, block->data + block->ndp, sizeof(table));
+
+    const size_t count = (fromLittleEndian16(table.length)
+        - sizeof(struct CdcNdp16)) / sizeof(struct CdcNdp16Entry);
+
+    while (block->entry < count)
+    {
+      struct CdcNdp16Entry entry;
+      memcpy(&entry, block->data + block->ndp + sizeof(struct CdcNdp16)
+          + block->entry * sizeof(struct CdcNdp16Entry), sizeof(entry));
+
+      const uint16_t datagramIndex = fromLittleEndian16(entry.index);
+      const uint16_t datagramLength = fromLittleEndian16(entry.length);
+
+      /* Zero index or length terminates the table */
+      if (!datagramIndex || !datagramLength)
+        break;
+
+      if (datagramIndex >= sizeof(struct CdcNth16)
+          && datagramLength <= CDC_NCM_MAX_SEGMENT_SIZE
+          && (size_t)datagramIndex + datagramLength <= block->length)
+      {
+        *index = datagramIndex;
+        *length = datagramLength;
+        return true;
+      }
+
+      /* Skip malformed entry */
+      ++block->entry;
+    }
+
+    /* Tables should be placed in ascending order to avoid loops */
+    const uint16_t next = fromLittleEndian16(table.nextNdpIndex);
+
+    if (next > block->ndp && validateDatagramTable(block, next))
+      block->ndp = next;
+    else
+      block->ndp = 0;
+
+    block->entry = 0;
+  }
+
+  return false;
+}
+/*----------------------------------------------------------------------------*/
+static void finalizeTxBlock(struct CdcNcm *interface,
+    struct TransferBlock *block)
+{
+  const size_t count = block->entry;
+  const uint16_t offset = (uint16_t)alignDatagramOffset(block->length);
+  const uint16_t tableLength = (uint16_t)(sizeof(struct CdcNdp16)
+      + (count + 1) * sizeof(struct CdcNdp16Entry));
+  uint8_t *position = block->data + offset;
+
+  /* Fill the datagram table */
+  const struct CdcNdp16 table = {
+      .signature = TO_LITTLE_ENDIAN_32(CDC_NCM_NDP16_NOCRC_SIGNATURE),
+      .length = toLittleEndian16(tableLength),
+      .nextNdpIndex = 0
+  };
+
+  memcpy(position, &table, sizeof(table));
+  position += sizeof(table);
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    const struct DatagramRecord * const record =
+        getRecord(interface, block, index);
+    const struct CdcNdp16Entry entry = {
+        .index = toLittleEndian16(record->index),
+        .length = toLittleEndian16(record->length)
+    };
+
+    memcpy(position, &entry, sizeof(entry));
+    position += sizeof(entry);
+  }
+
+  memset(position, 0, sizeof(struct CdcNdp16Entry));
+  position += sizeof(struct CdcNdp16Entry);
+
+  /* Pad the block to finish the transfer with a short packet */
+  uint16_t length = (uint16_t)(position - block->data);
+
+  if (!(length % getPacketSize(interface)) && length < getTxLimit(interface))
+    block->data[length++] = 0;
+
+  /* Fill the transfer header */
+  const struct CdcNth16 header = {
+      .signature = TO_LITTLE_ENDIAN_32(CDC_NCM_NTH16_SIGNATURE),
+      .headerLength = TO_LITTLE_ENDIAN_16(sizeof(struct CdcNth16)),
+      .sequence = toLittleEndian16(interface->txSequence++),
+      .blockLength = toLittleEndian16(length),
+      .ndpIndex = toLittleEndian16(offset)
+  };
+
+  memcpy(block->data, &header, sizeof(header));
+  block->length = length;
+}
+/*----------------------------------------------------------------------------*/
+static inline size_t getPacketSize(const struct CdcNcm *interface)
+{
+  return cdcNcmBaseGetUsbSpeed(interface->driver) == USB_HS ?
+      CDC_DATA_EP_SIZE_HS : CDC_DATA_EP_SIZE;
+}
+/*----------------------------------------------------------------------------*/
+static inline struct DatagramRecord *getRecord(const struct CdcNcm *interface,
+    const struct TransferBlock *block, size_t index)
+{
+  return (struct DatagramRecord *)(block->data + interface->ntbSize)
+      - (index + 1);
+}
+/*----------------------------------------------------------------------------*/
+static size_t getTransferSize(const struct CdcNcm *interface, size_t left)
+{
+#ifdef CONFIG_PLATFORM_USB_DEVICE_MULTI_PACKET
+  (void)interface;
+  return MIN(left, MAX_TRANSFER_SIZE);
+#else
+  return MIN(left, getPacketSize(interface));
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static inline uint16_t getTxLimit(const struct CdcNcm *interface)
+{
+  return cdcNcmBaseGetNtbInputSize(interface->driver);
+}
+/*----------------------------------------------------------------------------*/
+static bool parseBlockHeader(struct TransferBlock *block)
+{
+  struct CdcNth16 header;
+
+  if (block->length < sizeof(header))
+    return false;
+  memcpy(&header, block->data, sizeof(header));
+
+  const uint16_t blockLength = fromLittleEndian16(header.blockLength);
+  const uint16_t ndpIndex = fromLittleEndian16(header.ndpIndex);
+
+  if (header.signature != TO_LITTLE_ENDIAN_32(CDC_NCM_NTH16_SIGNATURE)
+      || fromLittleEndian16(header.headerLength) != sizeof(header)
+      || blockLength > block->length)
+  {
+    usbTrace("cdc_ncm: incorrect transfer header");
+    return false;
+  }
+
+  /* Block length may be zero when the block ends with a short packet */
+  if (blockLength)
+    block->length = blockLength;
+
+  if (!validateDatagramTable(block, ndpIndex))
+  {
+    usbTrace("cdc_ncm: incorrect datagram table");
+    return false;
+  }
+
+  block->ndp = ndpIndex;
+  block->entry = 0;
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static void processRxBlocks(struct CdcNcm *interface)
+{
+  while (!pointerQueueEmpty(&interface->rxBlockQueue))
+  {
+    struct TransferBlock * const block =
+        pointerQueueFront(&interface->rxBlockQueue);
+    uint16_t index;
+    uint16_t length;
+
+    if (findNextDatagram(block, &index, &length))
+    {
+      if (pointerQueueEmpty(&interface->rxRequestQueue))
+        break;
+
+      struct StreamRequest * const request =
+          pointerQueueFront(&interface->rxRequestQueue);
+
+      ++block->entry;
+
+      /* Datagrams that do not fit into the request buffer are dropped */
+      if (length <= request->capacity)
+      {
+        pointerQueuePopFront(&interface->rxRequestQueue);
+
+        memcpy(request->buffer, block->data + index, length);
+        request->length = length;
+        request->callback(request->argument, request,
+            STREAM_REQUEST_COMPLETED);
+      }
+    }
+    else
+    {
+      /* All datagrams were read, return the block to the endpoint */
+      pointerQueuePopFront(&interface->rxBlockQueue);
+      pointerArrayPushBack(&interface->rxBlockPool, block);
+      armRxBlock(interface);
+    }
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void resetEndpoints(struct CdcNcm *interface)
+{
+  interface->active = false;
+
+  /* Return queued blocks to pools */
+  usbEpClear(interface->rxDataEp);
+  usbEpClear(interface->txDataEp);
+  resetTxBlocks(interface);
+
+  while (!pointerQueueEmpty(&interface->rxBlockQueue))
+  {
+    pointerArrayPushBack(&interface->rxBlockPool,
+        pointerQueueFront(&interface->rxBlockQueue));
+    pointerQueuePopFront(&interface->rxBlockQueue);
+  }
+
+  usbEpDisable(interface->rxDataEp);
+  usbEpDisable(interface->txDataEp);
+}
+/*----------------------------------------------------------------------------*/
+static void resetTxBlocks(struct CdcNcm *interface)
+{
+  while (!pointerQueueEmpty(&interface->txBlockQueue))
+  {
+    struct TransferBlock * const block =
+        pointerQueueFront(&interface->txBlockQueue);
+
+    pointerQueuePopFront(&interface->txBlockQueue);
+    completeTxBlock(interface, block, STREAM_REQUEST_CANCELLED);
+  }
+
+  if (interface->txBlock != NULL)
+  {
+    completeTxBlock(interface, interface->txBlock, STREAM_REQUEST_CANCELLED);
+    interface->txBlock = NULL;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void sendNotification(struct CdcNcm *interface, const void *payload,
+    size_t length)
+{
+  struct UsbRequest *request;
+  IrqState state;
+
+  /* Critical section */
+  state = irqSave();
+  if (pointerArrayEmpty(&interface->notificationPool))
+  {
+    irqRestore(state);
+    return;
+  }
+  request = pointerArrayBack(&interface->notificationPool);
+  pointerArrayPopBack(&interface->notificationPool);
+  irqRestore(state);
+
+  request->length = (uint16_t)length;
+  memcpy(request->buffer, payload, length);
+
+  if (usbEpEnqueue(interface->notificationEp, request) != E_OK)
+  {
+    /* Hardware error occurred, suspend the interface and wait for reset */
+    interface->suspended = true;
+
+    state = irqSave();
+    pointerArrayPushBack(&interface->notificationPool, request);
+    irqRestore(state);
+
+    usbTrace("cdc_ncm: suspended in notify function");
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void sendTxBlock(struct CdcNcm *interface, struct TransferBlock *block)
+{
+  finalizeTxBlock(interface, block);
+
+  block->base.buffer = block->data;
+  block->base.length = (uint16_t)getTransferSize(interface, block->length);
+
+  interface->txTransfer = block;
+
+  if (usbEpEnqueue(interface->txDataEp, &block->base) != E_OK)
+  {
+    /* Hardware error occurred, suspend the interface and wait for reset */
+    interface->txTransfer = NULL;
+    interface->suspended = true;
+    completeTxBlock(interface, block, STREAM_REQUEST_FAILED);
+
+    usbTrace("cdc_ncm: suspended in write function");
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void startInterface(struct CdcNcm *interface)
+{
+  const uint16_t index =
+      toLittleEndian16(cdcNcmBaseGetInterfaceIndex(interface->driver));
+  const uint32_t rate = cdcNcmBaseGetUsbSpeed(interface->driver) == USB_HS ?
+      480000000 : 12000000;
+  const size_t packetSize = getPacketSize(interface);
+
+  usbEpEnable(interface->rxDataEp, ENDPOINT_TYPE_BULK, packetSize);
+  usbEpEnable(interface->txDataEp, ENDPOINT_TYPE_BULK, packetSize);
+
+  const IrqState state = irqSave();
+  interface->active = true;
+  armRxBlock(interface);
+  irqRestore(state);
+
+  /* Report link parameters before the connection state */
+  const struct CdcSpeedChange speed = {
+      .header = {
+          .requestType = REQUEST_RECIPIENT(REQUEST_RECIPIENT_INTERFACE)
+              | REQUEST_TYPE(REQUEST_TYPE_CLASS)
+              | REQUEST_DIRECTION(REQUEST_DIRECTION_TO_HOST),
+          .request = CDC_CONNECTION_SPEED_CHANGE,
+          .value = 0,
+          .index = index,
+          .length = TO_LITTLE_ENDIAN_16(8)
+      },
+      .downlinkBitRate = toLittleEndian32(rate),
+      .uplinkBitRate = toLittleEndian32(rate)
+  };
+  const struct CdcNotification connection = {
+      .requestType = REQUEST_RECIPIENT(REQUEST_RECIPIENT_INTERFACE)
+          | REQUEST_TYPE(REQUEST_TYPE_CLASS)
+          | REQUEST_DIRECTION(REQUEST_DIRECTION_TO_HOST),
+      .request = CDC_NETWORK_CONNECTION,
+      .value = TO_LITTLE_ENDIAN_16(1),
+      .index = index,
+      .length = 0
+  };
+
+  sendNotification(interface, &speed, sizeof(speed));
+  sendNotification(interface, &connection, sizeof(connection));
+}
+/*----------------------------------------------------------------------------*/
+static bool validateDatagramTable(const struct TransferBlock *block,
+    uint16_t offset)
+{
+  struct CdcNdp16 table;
+
+  if (offset < sizeof(struct CdcNth16) || offset % CDC_NCM_NDP_ALIGNMENT
+      || (size_t)offset + sizeof(table) > block->length)
+  {
+    return false;
+  }
+  memcpy(&table, block->data + offset, sizeof(table));
+
+  const uint16_t length = fromLittleEndian16(table.length);
+
+  /* Tables with the CRC are not supported */
+  return table.signature == TO_LITTLE_ENDIAN_32(CDC_NCM_NDP16_NOCRC_SIGNATURE)
+      && length >= sizeof(table) + 2 * sizeof(struct CdcNdp16Entry)
+      && !(length % CDC_NCM_NDP_ALIGNMENT)
+      && (size_t)offset + length <= block->length;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceInit(void *object, const void *configBase)
+{
+  const struct CdcNcmConfig * const config = configBase;
+  assert(config != NULL);
+  assert(config->device != NULL);
+  assert(config->rxBuffers && config->txBuffers);
+
+  struct CdcNcm * const interface = object;
+  const size_t ntbSize = config->ntbSize ?
+      config->ntbSize : CDC_NCM_MIN_NTB_SIZE;
+
+  if (ntbSize < CDC_NCM_MIN_NTB_SIZE || ntbSize > UINT16_MAX
+      || ntbSize % NTB_SIZE_ALIGNMENT)
+  {
+    return E_VALUE;
+  }
+
+  const struct CdcNcmBaseConfig driverConfig = {
+      .owner = interface,
+      .device = config->device,
+      .address = config->address,
+      .ntbSize = (uint16_t)ntbSize,
+      .endpoints = {
+          .interrupt = config->endpoints.interrupt,
+          .rx = config->endpoints.rx,
+          .tx = config->endpoints.tx
+      }
+  };
+  const struct CdcNcmStreamConfig streamConfig = {
+      .parent = interface
+  };
+
+  if (!pointerQueueInit(&interface->rxRequestQueue, config->rxSize))
+    return E_MEMORY;
+  if (!pointerQueueInit(&interface->rxBlockQueue, config->rxBuffers))
+    return E_MEMORY;
+  if (!pointerArrayInit(&interface->rxBlockPool, config->rxBuffers))
+    return E_MEMORY;
+  if (!pointerQueueInit(&interface->txBlockQueue, config->txBuffers))
+    return E_MEMORY;
+  if (!pointerArrayInit(&interface->txBlockPool, config->txBuffers))
+    return E_MEMORY;
+  if (!pointerArrayInit(&interface->notificationPool,
+      ARRAY_SIZE(interface->notifications)))
+  {
+    return E_MEMORY;
+  }
+
+  interface->callback = NULL;
+  interface->callbackArgument = NULL;
+  interface->rxTransfer = NULL;
+  interface->txBlock = NULL;
+  interface->txTransfer = NULL;
+  interface->address = config->address;
+  interface->ntbSize = (uint16_t)ntbSize;
+  interface->txSequence = 0;
+  interface->active = false;
+  interface->suspended = true;
+
+  interface->notificationEp = usbDevCreateEndpoint(config->device,
+      config->endpoints.interrupt);
+  if (interface->notificationEp == NULL)
+    return E_ERROR;
+  interface->rxDataEp = usbDevCreateEndpoint(config->device,
+      config->endpoints.rx);
+  if (interface->rxDataEp == NULL)
+    return E_ERROR;
+  interface->txDataEp = usbDevCreateEndpoint(config->device,
+      config->endpoints.tx);
+  if (interface->txDataEp == NULL)
+    return E_ERROR;
+
+  interface->rxStream = init(CdcNcmRxStream, &streamConfig);
+  if (interface->rxStream == NULL)
+    return E_ERROR;
+  interface->txStream = init(CdcNcmTxStream, &streamConfig);
+  if (interface->txStream == NULL)
+    return E_ERROR;
+
+  const size_t count = config->rxBuffers + config->txBuffers;
+  const size_t blockSize = alignBufferSize(ntbSize);
+  const size_t notificationSize =
+      alignBufferSize(sizeof(struct CdcSpeedChange));
+  const size_t arenaSize = count * blockSize
+      + ARRAY_SIZE(interface->notifications) * notificationSize;
+
+  /* Allocate transfer blocks and buffers */
+  interface->blocks = malloc(count * sizeof(struct TransferBlock));
+  if (interface->blocks == NULL)
+    return E_MEMORY;
+
+#ifdef MEM_ALIGNMENT
+  interface->arena = memalign(MEM_ALIGNMENT, arenaSize);
+#else
+  interface->arena = malloc(arenaSize);
+#endif
+  if (interface->arena == NULL)
+    return E_MEMORY;
+
+  /* Add blocks and requests to containers */
+  struct TransferBlock *block = interface->blocks;
+  uint8_t *payload = interface->arena;
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    const bool rx = index < config->rxBuffers;
+
+    usbRequestInit(&block->base, payload, (uint16_t)ntbSize,
+        rx ? cdcDataReceived : cdcDataSent, interface);
+    block->data = payload;
+    block->length = 0;
+    block->ndp = 0;
+    block->entry = 0;
+
+    if (rx)
+      pointerArrayPushBack(&interface->rxBlockPool, block);
+    else
+      pointerArrayPushBack(&interface->txBlockPool, block);
+
+    ++block;
+    payload += blockSize;
+  }
+
+  for (size_t index = 0; index < ARRAY_SIZE(interface->notifications);
+      ++index)
+  {
+    struct UsbRequest * const request = &interface->notifications[index];
+
+    usbRequestInit(request, payload, sizeof(struct CdcSpeedChange),
+        cdcNotificationSent, interface);
+    pointerArrayPushBack(&interface->notificationPool, request);
+
+    payload += notificationSize;
+  }
+
+  /* Lower half of the driver should be initialized after all other parts */
+  interface->driver = init(CdcNcmBase, &driverConfig);
+  return interface->driver != NULL ? E_OK : E_ERROR;
+}
+/*----------------------------------------------------------------------------*/
+static void interfaceDeinit(void *object)
+{
+  struct CdcNcm * const interface = object;
+
+  /* Call destructor for USB driver part */
+  deinit(interface->driver);
+
+  /* Return blocks and requests from endpoint queues to local pools */
+  resetEndpoints(interface);
+  usbEpClear(interface->notificationEp);
+
+  /* All blocks must be in the associated containers after EP clearing */
+  assert(pointerArrayFull(&interface->rxBlockPool));
+  assert(pointerArrayFull(&interface->txBlockPool));
+  assert(pointerArrayFull(&interface->notificationPool));
+
+  /* Free memory allocated for transfer blocks */
+  free(interface->arena);
+  free(interface->blocks);
+
+  /* Delete streams */
+  deinit(interface->txStream);
+  deinit(interface->rxStream);
+
+  /* Delete endpoints */
+  deinit(interface->txDataEp);
+  deinit(interface->rxDataEp);
+  deinit(interface->notificationEp);
+
+  /* Delete queues and pools */
+  pointerArrayDeinit(&interface->notificationPool);
+  pointerArrayDeinit(&interface->txBlockPool);
+  pointerQueueDeinit(&interface->txBlockQueue);
+  pointerArrayDeinit(&interface->rxBlockPool);
+  pointerQueueDeinit(&interface->rxBlockQueue);
+  pointerQueueDeinit(&interface->rxRequestQueue);
+}
+/*----------------------------------------------------------------------------*/
+static void interfaceSetCallback(void *object, void (*callback)(void *),
+    void *argument)
+{
+  struct CdcNcm * const interface = object;
+
+  interface->callbackArgument = argument;
+  interface->callback = callback;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceGetParam(void *object, int parameter, void *data)
+{
+  struct CdcNcm * const interface = object;
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_ADDRESS_64:
+      *(uint64_t *)data = interface->address;
+      return E_OK;
+
+    case IF_RATE:
+      *(uint32_t *)data =
+          cdcNcmBaseGetUsbSpeed(interface->driver) == USB_HS ?
+              480000000 : 12000000;
+      return E_OK;
+
+    default:
+      break;
+  }
+
+  switch ((enum CdcNcmParameter)parameter)
+  {
+    case IF_CDC_NCM_STATUS:
+    {
+      uint8_t status = 0;
+
+      if (interface->active)
+        status |= CDC_NCM_CONNECTED;
+      if (interface->suspended)
+        status |= CDC_NCM_SUSPENDED;
+
+      *(uint8_t *)data = status;
+      return E_OK;
+    }
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result interfaceSetParam(void *, int, const void *)
+{
+  return E_INVALID;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result streamInit(void *object, const void *configBase)
+{
+  const struct CdcNcmStreamConfig * const config = configBase;
+  struct CdcNcmStream * const stream = object;
+
+  stream->parent = config->parent;
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void rxStreamClear(void *object)
+{
+  struct CdcNcmStream * const stream = object;
+  struct CdcNcm * const interface = stream->parent;
+  const IrqState state = irqSave();
+
+  while (!pointerQueueEmpty(&interface->rxRequestQueue))
+  {
+    struct StreamRequest * const request =
+        pointerQueueFront(&interface->rxRequestQueue);
+    pointerQueuePopFront(&interface->rxRequestQueue);
+
+    request->callback(request->argument, request, STREAM_REQUEST_CANCELLED);
+  }
+
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+static void txStreamClear(void *object)
+{
+  struct CdcNcmStream * const stream = object;
+  struct CdcNcm * const interface = stream->parent;
+  const IrqState state = irqSave();
+
+  /* Blocks that are already queued in the endpoint will be sent */
+  resetTxBlocks(interface);
+
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result rxStreamEnqueue(void *object, struct StreamRequest *request)
+{
+  assert(request != NULL && request->callback != NULL);
+  assert(request->capacity);
+
+  struct CdcNcmStream * const stream = object;
+  struct CdcNcm * const interface = stream->parent;
+  const IrqState state = irqSave();
+
+  if (pointerQueueFull(&interface->rxRequestQueue))
+  {
+    irqRestore(state);
+    return E_FULL;
+  }
+
+  pointerQueuePushBack(&interface->rxRequestQueue, request);
+  processRxBlocks(interface);
+
+  irqRestore(state);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result txStreamEnqueue(void *object, struct StreamRequest *request)
+{
+  assert(request != NULL && request->callback != NULL);
+
+  struct CdcNcmStream * const stream = object;
+  struct CdcNcm * const interface = stream->parent;
+
+  if (!request->length || request->length > CDC_NCM_MAX_SEGMENT_SIZE)
+    return E_VALUE;
+
+  const IrqState state = irqSave();
+  struct TransferBlock *block = interface->txBlock;
+
+  if (!interface->active || interface->suspended)
+  {
+    irqRestore(state);
+    return E_IDLE;
+  }
+
+  if (block != NULL && !canAppendDatagram(interface, block, request->length))
+  {
+    /* Keep the current block when there is no free block to replace it */
+    if (pointerArrayEmpty(&interface->txBlockPool))
+    {
+      irqRestore(state);
+      return E_FULL;
+    }
+
+    /*
+     * Only one block at a time may be queued in the endpoint, other
+     * completed blocks wait in the software queue in order of completion.
+     */
+    interface->txBlock = NULL;
+    if (interface->txTransfer != NULL)
+      pointerQueuePushBack(&interface->txBlockQueue, block);
+    else
+      sendTxBlock(interface, block);
+    block = NULL;
+  }
+
+  if (block == NULL)
+  {
+    if (pointerArrayEmpty(&interface->txBlockPool))
+    {
+      irqRestore(state);
+      return E_FULL;
+    }
+
+    block = pointerArrayBack(&interface->txBlockPool);
+    pointerArrayPopBack(&interface->txBlockPool);
+
+    block->length = sizeof(struct CdcNth16);
+    block->entry = 0;
+    interface->txBlock = block;
+  }
+
+  /* Datagrams are aligned, the table is written when the block is sent */
+  const uint16_t offset = (uint16_t)alignDatagramOffset(block->length);
+  struct DatagramRecord * const record =
+      getRecord(interface, block, block->entry++);
+
+  record->request = request;
+  record->index = offset;
+  record->length = (uint16_t)request->length;
+
+  memcpy(block->data + offset, request->buffer, request->length);
+  block->length = offset + (uint16_t)request->length;
+
+  /* Datagrams are collected in the block while the endpoint is busy */
+  if (interface->txTransfer == NULL)
+  {
+    interface->txBlock = NULL;
+    sendTxBlock(interface, block);
+  }
+
+  irqRestore(state);
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+struct Stream *cdcNcmGetInput(struct CdcNcm *interface)
+{
+  return (struct Stream *)interface->rxStream;
+}
+/*----------------------------------------------------------------------------*/
+struct Stream *cdcNcmGetOutput(struct CdcNcm *interface)
+{
+  return (struct Stream *)interface->txStream;
+}
+/*----------------------------------------------------------------------------*/
+void cdcNcmOnEvent(struct CdcNcm *interface, unsigned int event)
+{
+  switch ((enum UsbDeviceEvent)event)
+  {
+    case USB_DEVICE_EVENT_RESET:
+      resetEndpoints(interface);
+      usbEpClear(interface->notificationEp);
+      usbEpEnable(interface->notificationEp, ENDPOINT_TYPE_INTERRUPT,
+          CDC_NOTIFICATION_EP_SIZE);
+
+      interface->suspended = false;
+      usbTrace("cdc_ncm: reset completed");
+      break;
+
+    case USB_DEVICE_EVENT_SUSPEND:
+      interface->suspended = true;
+      usbTrace("cdc_ncm: suspended");
+      break;
+
+    case USB_DEVICE_EVENT_RESUME:
+    {
+      const IrqState state = irqSave();
+
+      interface->suspended = false;
+      armRxBlock(interface);
+      irqRestore(state);
+
+      usbTrace("cdc_ncm: resumed");
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  if (interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
+void cdcNcmOnInterfaceChanged(struct CdcNcm *interface, bool active)
+{
+  resetEndpoints(interface);
+
+  /* Sequence numbers start from zero after Alternate Setting 0 is selected */
+  if (!active)
+    interface->txSequence = 0;
+
+  if (active)
+  {
+    startInterface(interface);
+    usbTrace("cdc_ncm: data interface enabled");
+  }
+  else
+    usbTrace("cdc_ncm: data interface disabled");
+
+  if (interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
@@ -0,0 +1,695 @@
+/*
+ * cdc_ncm_base.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/usb/cdc_ncm.h>
+#include <halm/usb/cdc_ncm_base.h>
+#include <halm/usb/cdc_ncm_defs.h>
+#include <halm/usb/usb_defs.h>
+#include <halm/usb/usb_request.h>
+#include <halm/usb/usb_string.h>
+#include <halm/usb/usb_trace.h>
+#include <xcore/memory.h>
+#include <assert.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+struct CdcNcmBase
+{
+  struct UsbDriver base;
+
+  /* Upper-half driver */
+  struct CdcNcm *owner;
+  /* USB peripheral */
+  struct UsbDevice *device;
+
+  /* Addresses of endpoints */
+  struct
+  {
+    uint8_t interrupt;
+    uint8_t rx;
+    uint8_t tx;
+  } endpoints;
+
+  /* MAC address of the host interface in text form */
+  char address[13];
+  /* Index of the MAC address string */
+  uint8_t addressIndex;
+
+  /* Maximum size of the transfer block supported by the device */
+  uint16_t ntbSize;
+  /* Maximum size of the IN transfer block selected by the host */
+  uint16_t ntbInputSize;
+
+  /* Number of the first interface in the device */
+  uint8_t controlInterfaceIndex;
+  /* Speed of the USB interface */
+  enum UsbSpeed speed;
+  /* Alternate setting with data endpoints is selected */
+  bool active;
+};
+/*----------------------------------------------------------------------------*/
+static void interfaceAssociationDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void deviceDescriptor(const void *, struct UsbDescriptor *, void *);
+static void configDescriptor(const void *, struct UsbDescriptor *, void *);
+static void controlInterfaceDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void cdcHeaderDescriptor(const void *, struct UsbDescriptor *, void *);
+static void unionDescriptor(const void *, struct UsbDescriptor *, void *);
+static void ethernetDescriptor(const void *, struct UsbDescriptor *, void *);
+static void ncmDescriptor(const void *, struct UsbDescriptor *, void *);
+static void notificationEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void dataInterfaceDescriptor(const void *, struct UsbDescriptor *,
+    void *, uint8_t);
+static void dataInterfaceAlt0Descriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void dataInterfaceAlt1Descriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void dataEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *, uint8_t);
+static void bulkReceiveEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void bulkTransmitEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+/*----------------------------------------------------------------------------*/
+static void addressString(const void *, enum UsbLangId, struct UsbDescriptor *,
+    void *);
+static enum Result handleClassRequest(struct CdcNcmBase *,
+    const struct UsbSetupPacket *, void *, uint16_t *);
+static enum Result handleDataInterfaceRequest(struct CdcNcmBase *,
+    const struct UsbSetupPacket *, void *, uint16_t *);
+static void resetParameters(struct CdcNcmBase *);
+/*----------------------------------------------------------------------------*/
+static enum Result driverInit(void *, const void *);
+static void driverDeinit(void *);
+static enum Result driverControl(void *, const struct UsbSetupPacket *,
+    void *, uint16_t *, uint16_t);
+static const UsbDescriptorFunctor *driverDescribe(const void *);
+static void driverNotify(void *, unsigned int);
+/*----------------------------------------------------------------------------*/
+const struct UsbDriverClass * const CdcNcmBase = &(const struct UsbDriverClass){
+    .size = sizeof(struct CdcNcmBase),
+    .init = driverInit,
+    .deinit = driverDeinit,
+
+    .control = driverControl,
+    .describe = driverDescribe,
+    .notify = driverNotify
+};
+/*----------------------------------------------------------------------------*/
+static const UsbDescriptorFunctor deviceDescriptorTable[] = {
+    deviceDescriptor,
+    configDescriptor,
+
+    interfaceAssociationDescriptor,
+
+    controlInterfaceDescriptor,
+    cdcHeaderDescriptor,
+    unionDescriptor,
+    ethernetDescriptor,
+    ncmDescriptor,
+    notificationEndpointDescriptor,
+    dataInterfaceAlt0Descriptor,
+    dataInterfaceAlt1Descriptor,
+    bulkReceiveEndpointDescriptor,
+    bulkTransmitEndpointDescriptor,
+    NULL
+};
+/*----------------------------------------------------------------------------*/
+static void interfaceAssociationDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct UsbInterfaceAssociationDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION;
+
+  if (payload != NULL)
+  {
+    const struct UsbInterfaceAssociationDescriptor descriptor = {
+        .length = sizeof(struct UsbInterfaceAssociationDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION,
+        .firstInterface = driver->controlInterfaceIndex,
+        .interfaceCount = 2,
+        .functionClass = USB_CLASS_CDC,
+        .functionSubClass = CDC_NCM_SUBCLASS,
+        .functionProtocol = 0,
+        .function = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void deviceDescriptor(const void *, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct UsbDeviceDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_DEVICE;
+
+  if (payload != NULL)
+  {
+    static const struct UsbDeviceDescriptor descriptor = {
+        .length = sizeof(struct UsbDeviceDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_DEVICE,
+        .usb = TO_LITTLE_ENDIAN_16(0x0200),
+        .deviceClass = USB_CLASS_CDC,
+        .deviceSubClass = 0,
+        .deviceProtocol = 0,
+        .maxPacketSize = TO_LITTLE_ENDIAN_16(CDC_CONTROL_EP_SIZE),
+        .idVendor = 0,
+        .idProduct = 0,
+        .device = TO_LITTLE_ENDIAN_16(0x0100),
+        .manufacturer = 0,
+        .product = 0,
+        .serialNumber = 0,
+        .numConfigurations = 1
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void configDescriptor(const void *, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct UsbConfigurationDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CONFIGURATION;
+
+  if (payload != NULL)
+  {
+    static const struct UsbConfigurationDescriptor descriptor = {
+        .length = sizeof(struct UsbConfigurationDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CONFIGURATION,
+        .totalLength = TO_LITTLE_ENDIAN_16(
+            sizeof(struct UsbConfigurationDescriptor)
+            + sizeof(struct UsbInterfaceAssociationDescriptor)
+            + sizeof(struct UsbInterfaceDescriptor) * 3
+            + sizeof(struct UsbEndpointDescriptor) * 3
+            + sizeof(struct CdcHeaderDescriptor)
+            + sizeof(struct CdcUnionDescriptor)
+            + sizeof(struct CdcEthernetDescriptor)
+            + sizeof(struct CdcNcmDescriptor)),
+        .numInterfaces = 2,
+        .configurationValue = 1,
+        .configuration = 0,
+        .attributes = 0,
+        .maxPower = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void controlInterfaceDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct UsbInterfaceDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
+
+  if (payload != NULL)
+  {
+    const struct UsbInterfaceDescriptor descriptor = {
+        .length = sizeof(struct UsbInterfaceDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
+        .interfaceNumber = driver->controlInterfaceIndex,
+        .alternateSettings = 0,
+        .numEndpoints = 1,
+        .interfaceClass = USB_CLASS_CDC,
+        .interfaceSubClass = CDC_NCM_SUBCLASS,
+        .interfaceProtocol = 0,
+        .interface = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void cdcHeaderDescriptor(const void *, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct CdcHeaderDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
+
+  if (payload != NULL)
+  {
+    const struct CdcHeaderDescriptor descriptor = {
+        .length = sizeof(struct CdcHeaderDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+        .descriptorSubType = CDC_SUBTYPE_HEADER,
+        .cdc = TO_LITTLE_ENDIAN_16(0x0110)
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void unionDescriptor(const void *object, struct UsbDescriptor *header,
+    void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct CdcUnionDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
+
+  if (payload != NULL)
+  {
+    const struct CdcUnionDescriptor descriptor = {
+        .length = sizeof(struct CdcUnionDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+        .descriptorSubType = CDC_SUBTYPE_UNION,
+        .masterInterface0 = driver->controlInterfaceIndex,
+        .slaveInterface0 = driver->controlInterfaceIndex + 1
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void ethernetDescriptor(const void *object, struct UsbDescriptor *header,
+    void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct CdcEthernetDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
+
+  if (payload != NULL)
+  {
+    const struct CdcEthernetDescriptor descriptor = {
+        .length = sizeof(struct CdcEthernetDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+        .descriptorSubType = CDC_SUBTYPE_ETHERNET,
+        .macAddress = driver->addressIndex,
+        .ethernetStatistics = 0,
+        .maxSegmentSize = TO_LITTLE_ENDIAN_16(CDC_NCM_MAX_SEGMENT_SIZE),
+        .numberMCFilters = 0,
+        .numberPowerFilters = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void ncmDescriptor(const void *, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct CdcNcmDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
+
+  if (payload != NULL)
+  {
+    const struct CdcNcmDescriptor descriptor = {
+        .length = sizeof(struct CdcNcmDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+        .descriptorSubType = CDC_SUBTYPE_NCM,
+        .ncmVersion = TO_LITTLE_ENDIAN_16(0x0100),
+        .networkCapabilities = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void notificationEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct UsbEndpointDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_ENDPOINT;
+
+  if (payload != NULL)
+  {
+    const struct UsbEndpointDescriptor descriptor = {
+        .length = sizeof(struct UsbEndpointDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_ENDPOINT,
+        .endpointAddress = driver->endpoints.interrupt,
+        .attributes = ENDPOINT_DESCRIPTOR_TYPE(ENDPOINT_TYPE_INTERRUPT),
+        .maxPacketSize = TO_LITTLE_ENDIAN_16(CDC_NOTIFICATION_EP_SIZE),
+        .interval = 8
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void dataInterfaceDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload, uint8_t alternate)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct UsbInterfaceDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
+
+  if (payload != NULL)
+  {
+    /* Data endpoints are available only in the second alternate setting */
+    const struct UsbInterfaceDescriptor descriptor = {
+        .length = sizeof(struct UsbInterfaceDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
+        .interfaceNumber = driver->controlInterfaceIndex + 1,
+        .alternateSettings = alternate,
+        .numEndpoints = alternate ? 2 : 0,
+        .interfaceClass = USB_CLASS_CDC_DATA,
+        .interfaceSubClass = 0,
+        .interfaceProtocol = CDC_NCM_DATA_PROTOCOL,
+        .interface = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void dataInterfaceAlt0Descriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  dataInterfaceDescriptor(object, header, payload, 0);
+}
+/*----------------------------------------------------------------------------*/
+static void dataInterfaceAlt1Descriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  dataInterfaceDescriptor(object, header, payload, 1);
+}
+/*----------------------------------------------------------------------------*/
+static void dataEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload, uint8_t ep)
+{
+  const struct CdcNcmBase * const driver = object;
+
+  header->length = sizeof(struct UsbEndpointDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_ENDPOINT;
+
+  if (payload != NULL)
+  {
+    const struct UsbEndpointDescriptor descriptor = {
+        .length = sizeof(struct UsbEndpointDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_ENDPOINT,
+        .endpointAddress = ep,
+        .attributes = ENDPOINT_DESCRIPTOR_TYPE(ENDPOINT_TYPE_BULK),
+        .maxPacketSize = driver->speed == USB_HS ?
+            TO_LITTLE_ENDIAN_16(CDC_DATA_EP_SIZE_HS)
+                : TO_LITTLE_ENDIAN_16(CDC_DATA_EP_SIZE),
+        .interval = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void bulkReceiveEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+  dataEndpointDescriptor(object, header, payload, driver->endpoints.rx);
+}
+/*----------------------------------------------------------------------------*/
+static void bulkTransmitEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct CdcNcmBase * const driver = object;
+  dataEndpointDescriptor(object, header, payload, driver->endpoints.tx);
+}
+/*----------------------------------------------------------------------------*/
+static void addressString(const void *argument, enum UsbLangId,
+    struct UsbDescriptor *header, void *payload)
+{
+  usbStringWrap(header, payload, argument);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result handleClassRequest(struct CdcNcmBase *driver,
+    const struct UsbSetupPacket *packet, void *response,
+    uint16_t *responseLength)
+{
+  if (packet->index != driver->controlInterfaceIndex)
+    return E_INVALID;
+
+  enum Result res = E_OK;
+
+  switch (packet->request)
+  {
+    case CDC_GET_NTB_PARAMETERS:
+    {
+      const struct CdcNtbParameters parameters = {
+          .length = TO_LITTLE_ENDIAN_16(sizeof(struct CdcNtbParameters)),
+          .ntbFormatsSupported = TO_LITTLE_ENDIAN_16(CDC_NCM_NTB16_FORMAT),
+          .ntbInMaxSize = toLittleEndian32(driver->ntbSize),
+          .ndpInDivisor = TO_LITTLE_ENDIAN_16(CDC_NCM_NDP_DIVISOR),
+          .ndpInPayloadRemainder = 0,
+          .ndpInAlignment = TO_LITTLE_ENDIAN_16(CDC_NCM_NDP_ALIGNMENT),
+          .reserved = 0,
+          .ntbOutMaxSize = toLittleEndian32(driver->ntbSize),
+          .ndpOutDivisor = TO_LITTLE_ENDIAN_16(CDC_NCM_NDP_DIVISOR),
+          .ndpOutPayloadRemainder = 0,
+          .ndpOutAlignment = TO_LITTLE_ENDIAN_16(CDC_NCM_NDP_ALIGNMENT),
+          .ntbOutMaxDatagrams = 0
+      };
+
+      memcpy(response, &parameters, sizeof(parameters));
+      *responseLength = sizeof(parameters);
+
+      usbTrace("cdc_ncm at %u: NTB parameters requested",
+          driver->controlInterfaceIndex);
+      break;
+    }
+
+    case CDC_GET_NTB_INPUT_SIZE:
+    {
+      const uint32_t size = toLittleEndian32(driver->ntbInputSize);
+
+      memcpy(response, &size, sizeof(size));
+      *responseLength = sizeof(size);
+      break;
+    }
+
+    case CDC_SET_NTB_INPUT_SIZE:
+    {
+      uint32_t size;
+
+      /* Optional maximum datagram count is ignored */
+      if (packet->length >= sizeof(size))
+      {
+        memcpy(&size, response, sizeof(size));
+        size = fromLittleEndian32(size);
+
+        if (size >= CDC_NCM_MIN_NTB_SIZE && size <= driver->ntbSize)
+          driver->ntbInputSize = (uint16_t)size;
+        else
+          res = E_VALUE;
+
+        usbTrace("cdc_ncm at %u: NTB input size %u",
+            driver->controlInterfaceIndex, size);
+      }
+      else
+      {
+        res = E_VALUE; /* Incorrect packet */
+      }
+
+      break;
+    }
+
+    case CDC_GET_NTB_FORMAT:
+    {
+      /* Only 16-bit transfer blocks are supported */
+      const uint16_t format = 0;
+
+      memcpy(response, &format, sizeof(format));
+      *responseLength = sizeof(format);
+      break;
+    }
+
+    case CDC_SET_NTB_FORMAT:
+      if (packet->value != 0)
+        res = E_VALUE;
+      break;
+
+    case CDC_SET_ETHERNET_PACKET_FILTER:
+      /* Filtering is left to the network stack of the device */
+      usbTrace("cdc_ncm at %u: packet filter %04X",
+          driver->controlInterfaceIndex, packet->value);
+      break;
+
+    default:
+      usbTrace("cdc_ncm at %u: unknown request %02X",
+          driver->controlInterfaceIndex, packet->request);
+      res = E_INVALID;
+      break;
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result handleDataInterfaceRequest(struct CdcNcmBase *driver,
+    const struct UsbSetupPacket *packet, void *buffer,
+    uint16_t *responseLength)
+{
+  enum Result res = E_OK;
+
+  switch (packet->request)
+  {
+    case REQUEST_GET_INTERFACE:
+      *(uint8_t *)buffer = driver->active ? 1 : 0;
+      *responseLength = 1;
+      break;
+
+    case REQUEST_SET_INTERFACE:
+      usbTrace("cdc_ncm: set interface %u", packet->value);
+
+      /* Two alternative interfaces are supported */
+      if (packet->value < 2)
+      {
+        driver->active = packet->value == 1;
+
+        /* Function parameters are reset with the first alternate setting */
+        if (!driver->active)
+          resetParameters(driver);
+
+        cdcNcmOnInterfaceChanged(driver->owner, driver->active);
+      }
+      else
+        res = E_VALUE;
+      break;
+
+    default:
+      res = E_INVALID;
+      break;
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static void resetParameters(struct CdcNcmBase *driver)
+{
+  driver->ntbInputSize = driver->ntbSize;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result driverInit(void *object, const void *configBase)
+{
+  const struct CdcNcmBaseConfig * const config = configBase;
+  assert(config->owner != NULL);
+  assert(config->ntbSize >= CDC_NCM_MIN_NTB_SIZE);
+
+  struct CdcNcmBase * const driver = object;
+
+  driver->owner = config->owner;
+  driver->device = config->device;
+  driver->endpoints.interrupt = config->endpoints.interrupt;
+  driver->endpoints.tx = config->endpoints.tx;
+  driver->endpoints.rx = config->endpoints.rx;
+  driver->ntbSize = config->ntbSize;
+  driver->speed = USB_FS;
+  driver->active = false;
+  resetParameters(driver);
+
+  /* The first octet of the address is stored in the least significant byte */
+  for (size_t index = 0; index < 6; ++index)
+  {
+    static const char digits[] = "0123456789ABCDEF";
+    const uint8_t value = (uint8_t)(config->address >> (index * 8));
+
+    driver->address[index * 2] = digits[value >> 4];
+    driver->address[index * 2 + 1] = digits[value & 0x0F];
+  }
+  driver->address[12] = '\0';
+
+  const UsbStringIndex index = usbDevStringAppend(driver->device,
+      usbStringBuildCustom(addressString, driver->address, 0));
+
+  driver->addressIndex = index > 0 ? (uint8_t)index : 0;
+  driver->controlInterfaceIndex = usbDevGetInterface(driver->device);
+
+  return usbDevBind(driver->device, driver);
+}
+/*----------------------------------------------------------------------------*/
+static void driverDeinit(void *object)
+{
+  struct CdcNcmBase * const driver = object;
+
+  usbDevUnbind(driver->device, driver);
+
+  if (driver->addressIndex)
+  {
+    usbDevStringErase(driver->device,
+        usbStringBuildCustom(addressString, driver->address,
+            driver->addressIndex));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result driverControl(void *object,
+    const struct UsbSetupPacket *packet, void *buffer, uint16_t *responseLength,
+    uint16_t)
+{
+  struct CdcNcmBase * const driver = object;
+  const uint8_t recipient = REQUEST_RECIPIENT_VALUE(packet->requestType);
+  const uint8_t type = REQUEST_TYPE_VALUE(packet->requestType);
+
+  if (type == REQUEST_TYPE_CLASS)
+    return handleClassRequest(driver, packet, buffer, responseLength);
+
+  if (type == REQUEST_TYPE_STANDARD
+      && recipient == REQUEST_RECIPIENT_INTERFACE
+      && (uint8_t)packet->index == driver->controlInterfaceIndex + 1)
+  {
+    return handleDataInterfaceRequest(driver, packet, buffer, responseLength);
+  }
+
+  return E_INVALID;
+}
+/*----------------------------------------------------------------------------*/
+static const UsbDescriptorFunctor *driverDescribe(const void *)
+{
+  return deviceDescriptorTable;
+}
+/*----------------------------------------------------------------------------*/
+static void driverNotify(void *object, unsigned int event)
+{
+  struct CdcNcmBase * const driver = object;
+
+#ifdef CONFIG_USB_DEVICE_HS
+  if (event == USB_DEVICE_EVENT_PORT_CHANGE)
+  {
+    driver->speed = usbDevGetSpeed(driver->device);
+
+    usbTrace("cdc_ncm: current speed is %s",
+        driver->speed == USB_HS ? "HS" : "FS");
+  }
+#endif
+
+  switch ((enum UsbDeviceEvent)event)
+  {
+    case USB_DEVICE_EVENT_RESET:
+      driver->active = false;
+      resetParameters(driver);
+      cdcNcmOnEvent(driver->owner, event);
+      break;
+
+    case USB_DEVICE_EVENT_SUSPEND:
+    case USB_DEVICE_EVENT_RESUME:
+      cdcNcmOnEvent(driver->owner, event);
+      break;
+
+    default:
+      break;
+  }
+}
+/*----------------------------------------------------------------------------*/
+uint8_t cdcNcmBaseGetInterfaceIndex(const struct CdcNcmBase *driver)
+{
+  return driver->controlInterfaceIndex;
+}
+/*----------------------------------------------------------------------------*/
+uint16_t cdcNcmBaseGetNtbInputSize(const struct CdcNcmBase *driver)
+{
+  return driver->ntbInputSize;
+}
+/*----------------------------------------------------------------------------*/
+enum UsbSpeed cdcNcmBaseGetUsbSpeed(const struct CdcNcmBase *driver)
+{
+  return driver->speed;
+}
@@ -31,6 +31,7 @@ static void configDescriptor(const void *, struct UsbDescriptor *, void *);
 /*----------------------------------------------------------------------------*/
 static void computeDescriptionProperties(const void *, uint16_t *, uint8_t *);
 static uint16_t extendConfigurationDescriptor(const void *, uint8_t *);
+static uint8_t getAlternateSetting(const void *, UsbDescriptorFunctor);
 static enum Result handleDeviceRequest(struct CompositeDeviceProxy *,
     const struct UsbSetupPacket *, void *, uint16_t *, uint16_t);
 static enum Result lookupDescriptor(struct CompositeDeviceProxy *,
@@ -176,7 +177,9 @@ static void computeDescriptionProperties(const void *driver, uint16_t *length,
         break;
 
       case DESCRIPTOR_TYPE_INTERFACE:
-        ++descriptionInterfaces;
+        /* Alternate settings share the number of the interface */
+        if (!getAlternateSetting(driver, *entry))
+          ++descriptionInterfaces;
         [[fallthrough]];
       default:
         descriptionLength += header.length;
@@ -221,6 +224,16 @@ static uint16_t extendConfigurationDescriptor(const void *driver,
   return total;
 }
 /*----------------------------------------------------------------------------*/
+static uint8_t getAlternateSetting(const void *driver,
+    UsbDescriptorFunctor functor)
+{
+  struct UsbInterfaceDescriptor descriptor;
+  struct UsbDescriptor header;
+
+  functor(driver, &header, &descriptor);
+  return descriptor.alternateSettings;
+}
+/*----------------------------------------------------------------------------*/
 static enum Result handleDeviceRequest(struct CompositeDeviceProxy *driver,
     const struct UsbSetupPacket *packet, void *response,
     uint16_t *responseLength, uint16_t maxResponseLength)
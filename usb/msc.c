@@ -8,6 +8,7 @@
 #include <halm/usb/msc.h>
 #include <halm/usb/msc_datapath.h>
 #include <halm/usb/msc_private.h>
+#include <halm/usb/msc_scsi.h>
 #include <halm/usb/usb_defs.h>
 #include <halm/usb/usb_trace.h>
 #include <xcore/memory.h>
@@ -21,29 +22,13 @@
 #  define MEM_ALIGNMENT CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
 #endif
 
-enum Flags
-{
-  FLAG_LOCKED     = 0x01,
-  FLAG_READONLY   = 0x02,
-  FLAG_ATTENTION  = 0x04,
-  FLAG_FAILURE    = 0x08
-};
-
 enum State
 {
   STATE_IDLE,
-  STATE_TEST_UNIT_READY,
-  STATE_REQUEST_SENSE,
-  STATE_INQUIRY,
-  STATE_MODE_SENSE,
-  STATE_MEDIUM_REMOVAL,
-  STATE_READ_FORMAT_CAPACITIES,
-  STATE_READ_CAPACITY,
-  STATE_READ_SETUP,
   STATE_READ,
-  STATE_WRITE_SETUP,
   STATE_WRITE,
-  STATE_VERIFY,
+  STATE_PARAMETERS,
+  STATE_DISCARD,
   STATE_ACK,
   STATE_ACK_STALL,
   STATE_COMPLETED,
@@ -59,26 +44,18 @@ struct StateEntry
 };
 /*----------------------------------------------------------------------------*/
 static inline void *allocBufferMemory(size_t);
-static inline uint32_t fromBigEndian24(const uint8_t *, uint32_t);
-static inline void toBigEndian24(uint8_t *, uint32_t);
 /*----------------------------------------------------------------------------*/
-static void dispatch(struct Msc *);
+static void dispatch(void *);
 
 static enum State stateIdleEnter(struct Msc *);
 static enum State stateIdleRun(struct Msc *);
-static enum State stateTestUnitReadyEnter(struct Msc *);
-static enum State stateRequestSenseEnter(struct Msc *);
-static enum State stateInquiryEnter(struct Msc *);
-static enum State stateMediumRemovalEnter(struct Msc *);
-static enum State stateModeSenseEnter(struct Msc *);
 static enum State stateReadWriteRun(struct Msc *);
-static enum State stateReadFormatCapacitiesEnter(struct Msc *);
-static enum State stateReadCapacityEnter(struct Msc *);
-static enum State stateReadSetupEnter(struct Msc *);
 static enum State stateReadEnter(struct Msc *);
-static enum State stateVerifyEnter(struct Msc *);
-static enum State stateWriteSetupEnter(struct Msc *);
 static enum State stateWriteEnter(struct Msc *);
+static enum State stateParametersEnter(struct Msc *);
+static enum State stateParametersRun(struct Msc *);
+static enum State stateDiscardEnter(struct Msc *);
+static enum State stateDiscardRun(struct Msc *);
 static enum State stateAckEnter(struct Msc *);
 static enum State stateAckRun(struct Msc *);
 static enum State stateAckStallRun(struct Msc *);
@@ -90,6 +67,7 @@ static enum State stateErrorRun(struct Msc *);
 static enum State stateSuspendEnter(struct Msc *);
 /*----------------------------------------------------------------------------*/
 static inline bool isInputDataValid(size_t, uint8_t);
+static enum State processCommand(struct Msc *);
 static enum State sendResponse(struct Msc *, uint32_t, uint32_t,
     const void *, size_t);
 /*----------------------------------------------------------------------------*/
@@ -131,25 +109,17 @@ static const UsbDescriptorFunctor deviceDescriptorTable[] = {
 };
 /*----------------------------------------------------------------------------*/
 static const struct StateEntry stateTable[] = {
-    [STATE_IDLE]                    = {stateIdleEnter, stateIdleRun},
-    [STATE_TEST_UNIT_READY]         = {stateTestUnitReadyEnter, NULL},
-    [STATE_REQUEST_SENSE]           = {stateRequestSenseEnter, NULL},
-    [STATE_INQUIRY]                 = {stateInquiryEnter, NULL},
-    [STATE_MODE_SENSE]              = {stateModeSenseEnter, NULL},
-    [STATE_MEDIUM_REMOVAL]          = {stateMediumRemovalEnter, NULL},
-    [STATE_READ_FORMAT_CAPACITIES]  = {stateReadFormatCapacitiesEnter, NULL},
-    [STATE_READ_CAPACITY]           = {stateReadCapacityEnter, NULL},
-    [STATE_READ_SETUP]              = {stateReadSetupEnter, NULL},
-    [STATE_READ]                    = {stateReadEnter, stateReadWriteRun},
-    [STATE_WRITE_SETUP]             = {stateWriteSetupEnter, NULL},
-    [STATE_WRITE]                   = {stateWriteEnter, stateReadWriteRun},
-    [STATE_VERIFY]                  = {stateVerifyEnter, NULL},
-    [STATE_ACK]                     = {stateAckEnter, stateAckRun},
-    [STATE_ACK_STALL]               = {NULL, stateAckStallRun},
-    [STATE_COMPLETED]               = {NULL, stateCompletedRun},
-    [STATE_FAILURE]                 = {stateFailureEnter, stateFailureRun},
-    [STATE_ERROR]                   = {stateErrorEnter, stateErrorRun},
-    [STATE_SUSPEND]                 = {stateSuspendEnter, NULL}
+    [STATE_IDLE]       = {stateIdleEnter, stateIdleRun},
+    [STATE_READ]       = {stateReadEnter, stateReadWriteRun},
+    [STATE_WRITE]      = {stateWriteEnter, stateReadWriteRun},
+    [STATE_PARAMETERS] = {stateParametersEnter, stateParametersRun},
+    [STATE_DISCARD]    = {stateDiscardEnter, stateDiscardRun},
+    [STATE_ACK]        = {stateAckEnter, stateAckRun},
+    [STATE_ACK_STALL]  = {NULL, stateAckStallRun},
+    [STATE_COMPLETED]  = {NULL, stateCompletedRun},
+    [STATE_FAILURE]    = {stateFailureEnter, stateFailureRun},
+    [STATE_ERROR]      = {stateErrorEnter, stateErrorRun},
+    [STATE_SUSPEND]    = {stateSuspendEnter, NULL}
 };
 /*----------------------------------------------------------------------------*/
 static inline void *allocBufferMemory(size_t size)
@@ -161,18 +131,6 @@ static inline void *allocBufferMemory(size_t size)
 #endif
 }
 /*----------------------------------------------------------------------------*/
-static inline uint32_t fromBigEndian24(const uint8_t *input, uint32_t mask)
-{
-  return ((input[0] << 16) | (input[1] << 8) | input[2]) & mask;
-}
-/*----------------------------------------------------------------------------*/
-static inline void toBigEndian24(uint8_t *output, uint32_t input)
-{
-  output[0] = (uint8_t)(input >> 16);
-  output[1] = (uint8_t)(input >> 8);
-  output[2] = (uint8_t)input;
-}
-/*----------------------------------------------------------------------------*/
 static enum State stateIdleEnter(struct Msc *driver)
 {
   memset(driver->buffer, 0, sizeof(struct CBW));
@@ -199,238 +157,11 @@ static enum State stateIdleRun(struct Msc *driver)
   driver->context.cbw.tag = cbw->tag;
   driver->context.cbw.flags = cbw->flags;
   driver->context.cbw.lun = cbw->lun;
-  memcpy(driver->context.cbw.cb.raw, cbw->cb, sizeof(cbw->cb));
+  memcpy(driver->context.cbw.cb, cbw->cb, sizeof(cbw->cb));
 
   driver->context.left = cbw->dataTransferLength;
 
-  if (driver->context.cbw.lun >= ARRAY_SIZE(driver->lun))
-    return STATE_FAILURE;
-
-  switch (driver->context.cbw.cb.raw[0])
-  {
-    case SCSI_TEST_UNIT_READY:
-      return STATE_TEST_UNIT_READY;
-
-    case SCSI_REQUEST_SENSE:
-      return STATE_REQUEST_SENSE;
-
-    case SCSI_INQUIRY:
-      return STATE_INQUIRY;
-
-    case SCSI_MODE_SENSE6:
-      return STATE_MODE_SENSE;
-
-    case SCSI_MODE_SENSE10:
-      return STATE_MODE_SENSE;
-
-    case SCSI_MEDIUM_REMOVAL:
-      return STATE_MEDIUM_REMOVAL;
-
-    case SCSI_READ_FORMAT_CAPACITIES:
-      return STATE_READ_FORMAT_CAPACITIES;
-
-    case SCSI_READ_CAPACITY10:
-      return STATE_READ_CAPACITY;
-
-    case SCSI_READ6:
-    case SCSI_READ10:
-    case SCSI_READ12:
-      return STATE_READ_SETUP;
-
-    case SCSI_WRITE6:
-    case SCSI_WRITE10:
-    case SCSI_WRITE12:
-      return STATE_WRITE_SETUP;
-
-    case SCSI_VERIFY10:
-      return STATE_VERIFY;
-
-    default:
-      driver->lun[driver->context.cbw.lun].sense = SCSI_SK_ILLEGAL_REQUEST;
-      driver->lun[driver->context.cbw.lun].asc = SCSI_ASC_IR_INVALIDCOMMAND;
-
-      usbTrace("msc: unsupported command 0x%02X",
-          driver->context.cbw.cb.raw[0]);
-      return STATE_FAILURE;
-  }
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateTestUnitReadyEnter(struct Msc *driver)
-{
-  if (!driver->context.cbw.length)
-  {
-    const size_t index = driver->context.cbw.lun;
-
-    usbTrace("msc: test unit ready");
-
-    if (!driver->lun[index].interface)
-    {
-      driver->lun[index].sense = SCSI_SK_NOT_READY;
-      driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-      return STATE_FAILURE;
-    }
-    else if (driver->lun[index].flags & FLAG_ATTENTION)
-    {
-      driver->lun[index].flags &= ~FLAG_ATTENTION;
-
-      driver->lun[index].sense = SCSI_SK_UNIT_ATTENTION;
-      driver->lun[index].asc = SCSI_ASC_UA_READYTRANSITION;
-      return STATE_FAILURE;
-    }
-    else
-      return STATE_ACK;
-  }
-  else
-    return STATE_ERROR;
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateRequestSenseEnter(struct Msc *driver)
-{
-  if (!isInputDataValid(driver->context.cbw.length, driver->context.cbw.flags))
-    return STATE_ERROR;
-
-  struct RequestSenseData response;
-  const size_t index = driver->context.cbw.lun;
-
-  memset(&response, 0, sizeof(response));
-  response.responseCode = 0x70;
-  response.additionalSenseLength = sizeof(struct RequestSenseData) - 8;
-
-  if (index >= ARRAY_SIZE(driver->lun))
-  {
-    response.flags = SCSI_SK_ILLEGAL_REQUEST;
-    response.additionalSenseCode = (uint8_t)(SCSI_ASC_IR_INVALIDLUN >> 8);
-    response.additionalSenseCodeQualifier = (uint8_t)SCSI_ASC_IR_INVALIDLUN;
-  }
-  else
-  {
-    response.flags = driver->lun[index].sense;
-    response.additionalSenseCode = (uint8_t)(driver->lun[index].asc >> 8);
-    response.additionalSenseCodeQualifier = (uint8_t)driver->lun[index].asc;
-
-    /* Clear error */
-    driver->lun[index].sense = SCSI_SK_NO_SENSE;
-    driver->lun[index].asc = SCSI_ASC_NOSENSE;
-  }
-
-  usbTrace("msc: request sense 0x%06X", response.flags << 16
-      | response.additionalSenseCode << 8
-      | response.additionalSenseCodeQualifier);
-
-  memcpy(driver->buffer, &response, sizeof(response));
-  return sendResponse(driver, driver->context.cbw.tag,
-      driver->context.cbw.length, driver->buffer, sizeof(response));
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateInquiryEnter(struct Msc *driver)
-{
-  if (!isInputDataValid(driver->context.cbw.length, driver->context.cbw.flags))
-    return STATE_ERROR;
-
-  static const char version[] = "1.00";
-  struct InquiryData response;
-
-  memset(&response, 0, sizeof(response));
-
-  response.peripheralDeviceType = PDT_DIRECT_ACCESS_BLOCK_DEVICE;
-  response.version = 0;
-  response.additionalLength = 32;
-
-  response.flags0 = INQUIRY_FLAGS_0_RMB;
-  /* Response Data Format should be set to a fixed value of 2 */
-  response.flags1 = INQUIRY_FLAGS_1_RDF(2);
-  response.flags2 = INQUIRY_FLAGS_2_SCCS;
-  response.flags3 = 0x00;
-  response.flags4 = 0x00;
-
-  memset(response.vendorIdentification, ' ',
-      sizeof(response.vendorIdentification));
-  memset(response.productIdentification, ' ',
-      sizeof(response.productIdentification));
-  memcpy(response.productRevisionLevel, version,
-      sizeof(response.productRevisionLevel));
-
-  usbTrace("msc: inquiry");
-
-  memcpy(driver->buffer, &response, sizeof(response));
-  return sendResponse(driver, driver->context.cbw.tag,
-      driver->context.cbw.length, driver->buffer, sizeof(response));
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateMediumRemovalEnter(struct Msc *driver)
-{
-  const struct PreventAllowMediumRemovalCommand * const command =
-      &driver->context.cbw.cb.mediumRemoval;
-  const size_t index = driver->context.cbw.lun;
-
-  if (driver->lun[index].interface)
-  {
-    uint8_t flags = driver->lun[index].flags;
-
-    if (MEDIUMREMOVAL_FLAGS_PREVENT_VALUE(command->flags1) == PAMR_LOCK)
-      flags |= FLAG_LOCKED;
-    else
-      flags &= ~FLAG_LOCKED;
-
-    if (flags != driver->lun[index].flags)
-    {
-      driver->lun[index].flags = flags;
-
-      if (driver->callback != NULL)
-        driver->callback(driver->callbackArgument);
-    }
-
-    usbTrace("msc: medium removal state %u", (flags & FLAG_LOCKED) != 0);
-    return STATE_ACK;
-  }
-  else
-  {
-    driver->lun[index].sense = SCSI_SK_NOT_READY;
-    driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-    return STATE_FAILURE;
-  }
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateModeSenseEnter(struct Msc *driver)
-{
-  if (!isInputDataValid(driver->context.cbw.length, driver->context.cbw.flags))
-    return STATE_ERROR;
-
-  size_t length;
-
-  if (driver->context.cbw.cb.raw[0] == SCSI_MODE_SENSE6)
-  {
-    struct ModeParameterHeader6 response;
-
-    response.modeDataLength = 3;
-    response.mediumType = 0;
-    response.deviceSpecificParameter = 0;
-    response.blockDescriptorLength = 0;
-
-    usbTrace("msc: mode sense 6");
-
-    memcpy(driver->buffer, &response, sizeof(response));
-    length = sizeof(response);
-  }
-  else
-  {
-    struct ModeParameterHeader10 response;
-
-    memset(&response, 0, sizeof(response)); /* Clear reserved fields */
-    response.modeDataLength = TO_BIG_ENDIAN_16(6);
-    response.mediumType = 0;
-    response.deviceSpecificParameter = 0;
-    response.flags = 0;
-    response.blockDescriptorLength = TO_BIG_ENDIAN_16(0);
-
-    usbTrace("msc: mode sense 10");
-
-    memcpy(driver->buffer, &response, sizeof(response));
-    length = sizeof(response);
-  }
-
-  return sendResponse(driver, driver->context.cbw.tag,
-      driver->context.cbw.length, driver->buffer, length);
+  return processCommand(driver);
 }
 /*----------------------------------------------------------------------------*/
 static enum State stateReadWriteRun(struct Msc *driver)
@@ -448,20 +179,14 @@ static enum State stateReadWriteRun(struct Msc *driver)
 
     default:
     {
-      const size_t index = driver->context.cbw.lun;
+      struct MscUnit * const unit = &driver->lun[driver->context.cbw.lun];
 
       if (driver->context.state == STATE_WRITE)
-      {
-        driver->lun[index].sense = SCSI_SK_MEDIUM_ERROR;
-        driver->lun[index].asc = SCSI_ASC_ME_WRITEFAULT;
-      }
+        scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
       else
-      {
-        driver->lun[index].sense = SCSI_SK_MEDIUM_ERROR;
-        driver->lun[index].asc = SCSI_ASC_ME_READERROR;
-      }
+        scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_READERROR);
 
-      driver->lun[index].flags |= FLAG_FAILURE;
+      unit->flags |= FLAG_FAILURE;
       if (driver->callback != NULL)
         driver->callback(driver->callbackArgument);
 
@@ -470,312 +195,110 @@ static enum State stateReadWriteRun(struct Msc *driver)
   }
 }
 /*----------------------------------------------------------------------------*/
-static enum State stateReadFormatCapacitiesEnter(struct Msc *driver)
+static enum State stateReadEnter(struct Msc *driver)
 {
-  if (!isInputDataValid(driver->context.cbw.length, driver->context.cbw.flags))
-    return STATE_ERROR;
-
-  const size_t index = driver->context.cbw.lun;
+  struct MscUnit * const unit = &driver->lun[driver->context.cbw.lun];
+  const bool queued = datapathReadAndSendData(driver->datapath, unit,
+      driver->buffer, driver->bufferSize,
+      driver->context.position, driver->context.left);
 
-  if (driver->lun[index].interface)
+  if (!queued)
   {
-    /* TODO MSC constants */
-    struct ReadFormatCapacitiesData response;
-
-    memset(response.header.reserved, 0, sizeof(response.header.reserved));
-    response.header.capacityListLength = 8;
-
-    response.descriptors[0].numberOfBlocks =
-        toBigEndian32(driver->lun[index].blocks);
-    /* Descriptor Type: Formatted Medium */
-    response.descriptors[0].flags = 0x02;
-    toBigEndian24(response.descriptors[0].blockLength, driver->blockSize);
+    scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_READERROR);
 
-    usbTrace("msc: read format capacity, %"PRIu32" blocks",
-        driver->lun[index].blocks);
-
-    memcpy(driver->buffer, &response, sizeof(response));
-    return sendResponse(driver, driver->context.cbw.tag,
-        driver->context.cbw.length, driver->buffer, sizeof(response));
-  }
-  else
-  {
-    driver->lun[index].sense = SCSI_SK_NOT_READY;
-    driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-    return STATE_FAILURE;
-  }
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateReadCapacityEnter(struct Msc *driver)
-{
-  if (!isInputDataValid(driver->context.cbw.length, driver->context.cbw.flags))
-    return STATE_ERROR;
-
-  const struct ReadCapacity10Command * const command =
-      &driver->context.cbw.cb.readCapacity10;
-  const size_t index = driver->context.cbw.lun;
+    unit->flags |= FLAG_FAILURE;
+    if (driver->callback != NULL)
+      driver->callback(driver->callbackArgument);
 
-  if ((!(command->flags1 & READCAPACITY10_FLAGS_1_PMI) && command->lba)
-      || (command->lba > driver->lun[index].blocks - 1))
-  {
-    driver->lun[index].sense = SCSI_SK_ILLEGAL_REQUEST;
-    driver->lun[index].asc = SCSI_ASC_IR_INVALIDFIELDINCBA;
     return STATE_FAILURE;
   }
-
-  if (driver->lun[index].interface)
-  {
-    struct ReadCapacityData response;
-
-    response.lastLogicalBlockAddress =
-        toBigEndian32(driver->lun[index].blocks - 1);
-    response.blockLength = toBigEndian32(driver->blockSize);
-
-    usbTrace("msc: read capacity, %"PRIu32" blocks",
-        driver->lun[index].blocks);
-
-    memcpy(driver->buffer, &response, sizeof(response));
-    return sendResponse(driver, driver->context.cbw.tag,
-        driver->context.cbw.length, driver->buffer, sizeof(response));
-  }
   else
-  {
-    driver->lun[index].sense = SCSI_SK_NOT_READY;
-    driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-    return STATE_FAILURE;
-  }
-}
-/*----------------------------------------------------------------------------*/
-static enum State stateReadSetupEnter(struct Msc *driver)
-{
-  const size_t index = driver->context.cbw.lun;
-
-  if (!driver->lun[index].interface)
-  {
-    driver->lun[index].sense = SCSI_SK_NOT_READY;
-    driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-    return STATE_FAILURE;
-  }
-
-  uint32_t logicalBlockAddress = 0;
-  uint32_t numberOfBlocks = 0;
-
-  switch (driver->context.cbw.cb.raw[0])
-  {
-    case SCSI_READ6:
-    {
-      const struct Read6Command * const command =
-          &driver->context.cbw.cb.read6;
-
-      logicalBlockAddress =
-          fromBigEndian24(command->logicalBlockAddress, READ6_LBA_MASK);
-      numberOfBlocks = !command->transferLength ? 256 : command->transferLength;
-      break;
-    }
-
-    case SCSI_READ10:
-    {
-      const struct Read10Command * const command =
-          &driver->context.cbw.cb.read10;
-
-      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
-      numberOfBlocks = fromBigEndian16(command->transferLength);
-      break;
-    }
-
-    case SCSI_READ12:
-    {
-      const struct Read12Command * const command =
-          &driver->context.cbw.cb.read12;
-
-      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
-      numberOfBlocks = fromBigEndian32(command->transferLength);
-      break;
-    }
-  }
-
-  const uint32_t transferLength = numberOfBlocks * driver->blockSize;
-
-  if (driver->context.cbw.length != transferLength || !transferLength)
-  {
-    driver->lun[index].sense = SCSI_SK_ILLEGAL_REQUEST;
-    driver->lun[index].asc = SCSI_ASC_IR_INVALIDFIELDINCBA;
-    return STATE_FAILURE;
-  }
-  if (logicalBlockAddress + numberOfBlocks > driver->lun[index].blocks)
-  {
-    driver->lun[index].sense = SCSI_SK_ILLEGAL_REQUEST;
-    driver->lun[index].asc = SCSI_ASC_IR_LBAOUTOFRANGE;
-    return STATE_FAILURE;
-  }
-
-  driver->context.position =
-      (uint64_t)logicalBlockAddress * driver->blockSize;
-
-  usbTrace("msc: read command, start block %"PRIu32", count %"PRIu32,
-      (uint32_t)(driver->context.position / driver->blockSize),
-      transferLength / driver->blockSize);
-
-  return STATE_READ;
+    return STATE_READ;
 }
 /*----------------------------------------------------------------------------*/
-static enum State stateReadEnter(struct Msc *driver)
+static enum State stateWriteEnter(struct Msc *driver)
 {
-  const bool queued = datapathReadAndSendData(driver->datapath,
+  struct MscUnit * const unit = &driver->lun[driver->context.cbw.lun];
+  const bool queued = datapathReceiveAndWriteData(driver->datapath, unit,
       driver->buffer, driver->bufferSize,
       driver->context.position, driver->context.left);
 
   if (!queued)
   {
-    const size_t index = driver->context.cbw.lun;
+    scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
 
-    driver->lun[index].sense = SCSI_SK_MEDIUM_ERROR;
-    driver->lun[index].asc = SCSI_ASC_ME_READERROR;
-
-    driver->lun[index].flags |= FLAG_FAILURE;
+    unit->flags |= FLAG_FAILURE;
     if (driver->callback != NULL)
       driver->callback(driver->callbackArgument);
 
     return STATE_FAILURE;
   }
   else
-    return STATE_READ;
+    return STATE_WRITE;
 }
 /*----------------------------------------------------------------------------*/
-static enum State stateVerifyEnter(struct Msc *driver)
+static enum State stateParametersEnter(struct Msc *driver)
 {
-  const size_t index = driver->context.cbw.lun;
-
-  if (!driver->lun[index].interface)
-  {
-    driver->lun[index].sense = SCSI_SK_NOT_READY;
-    driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-    return STATE_FAILURE;
-  }
-
-  const struct Verify10Command * const command =
-      &driver->context.cbw.cb.verify10;
-
-  if ((command->flags & VERIFY10_BYTCHK_MASK) == 0)
+  if (datapathReceiveControl(driver->datapath, driver->buffer,
+      driver->context.left))
   {
-    const uint32_t logicalBlockAddress =
-        fromBigEndian32(command->logicalBlockAddress);
-    const uint16_t numberOfBlocks =
-        fromBigEndian16(command->verificationLength);
-
-    usbTrace("msc: verify command, start block %"PRIu32", count %"PRIu16,
-        logicalBlockAddress, numberOfBlocks);
-
-    if (logicalBlockAddress + numberOfBlocks > driver->lun[index].blocks)
-    {
-      driver->lun[index].sense = SCSI_SK_ILLEGAL_REQUEST;
-      driver->lun[index].asc = SCSI_ASC_IR_INVALIDCOMMAND;
-      return STATE_FAILURE;
-    }
-    else
-      return STATE_ACK;
+    return STATE_PARAMETERS;
   }
   else
-  {
-    usbTrace("msc: incorrect verify command flags 0x%02X", command->flags);
-    return STATE_ERROR;
-  }
+    return STATE_SUSPEND;
 }
 /*----------------------------------------------------------------------------*/
-static enum State stateWriteSetupEnter(struct Msc *driver)
+static enum State stateParametersRun(struct Msc *driver)
 {
-  const size_t index = driver->context.cbw.lun;
-
-  if (!driver->lun[index].interface)
-  {
-    driver->lun[index].sense = SCSI_SK_NOT_READY;
-    driver->lun[index].asc = SCSI_ASC_NR_MEDIUMNOTPRESENT;
-    return STATE_FAILURE;
-  }
-
-  uint32_t logicalBlockAddress = 0;
-  uint32_t numberOfBlocks = 0;
+  /* Verify completion of the transfer */
+  const enum Result status = datapathStatus(driver->datapath);
 
-  switch (driver->context.cbw.cb.raw[0])
-  {
-    case SCSI_WRITE6:
-    {
-      const struct Write6Command * const command =
-          &driver->context.cbw.cb.write6;
+  if (status == E_ERROR)
+    return STATE_SUSPEND;
+  if (status != E_OK)
+    return STATE_ERROR;
 
-      logicalBlockAddress =
-          fromBigEndian24(command->logicalBlockAddress, 0x1FFFFF);
-      numberOfBlocks = !command->transferLength ? 256 : command->transferLength;
-      break;
-    }
+  struct MscUnit * const unit = &driver->lun[driver->context.cbw.lun];
+  const enum ScsiAction action = scsiProcessParameters(unit,
+      driver->context.cbw.cb, driver->buffer, driver->context.left);
 
-    case SCSI_WRITE10:
-    {
-      const struct Write10Command * const command =
-          &driver->context.cbw.cb.write10;
+  driver->context.left = 0;
 
-      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
-      numberOfBlocks = fromBigEndian16(command->transferLength);
-      break;
-    }
+  switch (action)
+  {
+    case SCSI_ACTION_ACK:
+      return STATE_ACK;
 
-    case SCSI_WRITE12:
-    {
-      const struct Write12Command * const command =
-          &driver->context.cbw.cb.write12;
+    case SCSI_ACTION_DISCARD:
+      return STATE_DISCARD;
 
-      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
-      numberOfBlocks = fromBigEndian32(command->transferLength);
-      break;
-    }
+    default:
+      return STATE_FAILURE;
   }
+}
+/*----------------------------------------------------------------------------*/
+static enum State stateDiscardEnter(struct Msc *driver)
+{
+  struct MscUnit * const unit = &driver->lun[driver->context.cbw.lun];
 
-  const uint32_t transferLength = numberOfBlocks * driver->blockSize;
-
-  if (driver->context.cbw.length != transferLength || !transferLength)
+  /* Parameter list is still stored in the buffer */
+  if (datapathDiscardBlocks(driver->datapath, unit, driver->buffer,
+      driver->context.cbw.length))
   {
-    driver->lun[index].sense = SCSI_SK_ILLEGAL_REQUEST;
-    driver->lun[index].asc = SCSI_ASC_IR_INVALIDFIELDINCBA;
-    return STATE_FAILURE;
+    return STATE_DISCARD;
   }
-  if (logicalBlockAddress + numberOfBlocks > driver->lun[index].blocks)
+  else
   {
-    driver->lun[index].sense = SCSI_SK_ILLEGAL_REQUEST;
-    driver->lun[index].asc = SCSI_ASC_IR_INVALIDCOMMAND;
+    scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
     return STATE_FAILURE;
   }
-
-  driver->context.position =
-      (uint64_t)logicalBlockAddress * driver->blockSize;
-
-  usbTrace("msc: write command, start block %"PRIu32", count %"PRIu32,
-      (uint32_t)(driver->context.position / driver->blockSize),
-      transferLength / driver->blockSize);
-
-  return STATE_WRITE;
 }
 /*----------------------------------------------------------------------------*/
-static enum State stateWriteEnter(struct Msc *driver)
+static enum State stateDiscardRun(struct Msc *driver)
 {
-  const bool queued = datapathReceiveAndWriteData(driver->datapath,
-      driver->buffer, driver->bufferSize,
-      driver->context.position, driver->context.left);
-
-  if (!queued)
-  {
-    const size_t index = driver->context.cbw.lun;
-
-    driver->lun[index].sense = SCSI_SK_MEDIUM_ERROR;
-    driver->lun[index].asc = SCSI_ASC_ME_WRITEFAULT;
-
-    driver->lun[index].flags |= FLAG_FAILURE;
-    if (driver->callback != NULL)
-      driver->callback(driver->callbackArgument);
-
-    return STATE_FAILURE;
-  }
-  else
-    return STATE_WRITE;
+  /* Sense data are stored in the logical unit when erasing failed */
+  return datapathStatus(driver->datapath) == E_OK ?
+      STATE_ACK : STATE_FAILURE;
 }
 /*----------------------------------------------------------------------------*/
 static enum State stateAckEnter(struct Msc *driver)
@@ -866,8 +389,9 @@ static enum State stateSuspendEnter(struct Msc *driver)
   return STATE_SUSPEND;
 }
 /*----------------------------------------------------------------------------*/
-static void dispatch(struct Msc *driver)
+static void dispatch(void *argument)
 {
+  struct Msc * const driver = argument;
   enum State current = driver->context.state;
   enum State previous = current;
 
@@ -895,6 +419,63 @@ static inline bool isInputDataValid(size_t length, uint8_t flags)
   return length && (flags & CBW_FLAG_DIRECTION_TO_HOST);
 }
 /*----------------------------------------------------------------------------*/
+static enum State processCommand(struct Msc *driver)
+{
+  const size_t index = driver->context.cbw.lun;
+  struct MscUnit * const unit =
+      index < driver->lunCount ? &driver->lun[index] : NULL;
+  const uint8_t flags = unit != NULL ? unit->flags : 0;
+  struct ScsiTransfer transfer;
+
+  const enum ScsiAction action = scsiProcessCommand(unit,
+      driver->context.cbw.cb, driver->buffer, &transfer);
+
+  if (unit != NULL && unit->flags != flags && driver->callback != NULL)
+    driver->callback(driver->callbackArgument);
+
+  switch (action)
+  {
+    case SCSI_ACTION_ACK:
+      return driver->context.cbw.length ? STATE_ERROR : STATE_ACK;
+
+    case SCSI_ACTION_RESPONSE:
+      if (!isInputDataValid(driver->context.cbw.length,
+          driver->context.cbw.flags))
+      {
+        return STATE_ERROR;
+      }
+
+      return sendResponse(driver, driver->context.cbw.tag,
+          driver->context.cbw.length, driver->buffer, transfer.length);
+
+    case SCSI_ACTION_READ:
+    case SCSI_ACTION_WRITE:
+      if (driver->context.cbw.length != transfer.length)
+      {
+        scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST,
+            SCSI_ASC_IR_INVALIDFIELDINCBA);
+        return STATE_FAILURE;
+      }
+
+      driver->context.position = transfer.position;
+      return action == SCSI_ACTION_READ ? STATE_READ : STATE_WRITE;
+
+    case SCSI_ACTION_PARAMETERS:
+      if (driver->context.cbw.length != transfer.length
+          || (driver->context.cbw.flags & CBW_FLAG_DIRECTION_TO_HOST))
+      {
+        scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST,
+            SCSI_ASC_IR_INVALIDFIELDINCBA);
+        return STATE_FAILURE;
+      }
+
+      return STATE_PARAMETERS;
+
+    default:
+      return STATE_FAILURE;
+  }
+}
+/*----------------------------------------------------------------------------*/
 static enum State sendResponse(struct Msc *driver, uint32_t tag,
     uint32_t residue, const void *buffer, size_t length)
 {
@@ -1068,7 +649,7 @@ static enum Result handleClassRequest(struct Msc *driver,
     case MSC_REQUEST_GET_MAX_LUN:
       usbTrace("msc at %u: max LUN requested", driver->interfaceIndex);
 
-      response[0] = ARRAY_SIZE(driver->lun) - 1;
+      response[0] = driver->lunCount - 1;
       *responseLength = 1;
       return E_OK;
 
@@ -1108,7 +689,22 @@ static enum Result driverInit(void *object, const void *configBase)
   const struct MscConfig * const config = configBase;
   assert(config != NULL);
   assert(config->device != NULL);
-  assert(config->size && !(config->size & (MSC_BLOCK_SIZE - 1)));
+  assert(config->luns <= MSC_MAX_LUN_COUNT);
+  assert(!config->depth || config->depth >= MSC_MIN_QUERY_COUNT);
+
+  const uint16_t logicalBlockSize = config->block.logical ?
+      config->block.logical : MSC_BLOCK_SIZE;
+  const uint16_t physicalBlockSize = config->block.physical ?
+      config->block.physical : logicalBlockSize;
+
+  assert(logicalBlockSize >= MSC_BLOCK_SIZE
+      && logicalBlockSize <= MSC_MAX_BLOCK_SIZE
+      && !(logicalBlockSize & (logicalBlockSize - 1)));
+  assert(physicalBlockSize >= logicalBlockSize
+      && !(physicalBlockSize & (physicalBlockSize - 1)));
+  assert(config->size && !(config->size & (logicalBlockSize - 1)));
+  assert(config->size >= logicalBlockSize
+      * (config->depth ? config->depth : MSC_MIN_QUERY_COUNT));
 
   struct Msc * const driver = object;
 
@@ -1116,7 +712,6 @@ static enum Result driverInit(void *object, const void *configBase)
   driver->callbackArgument = NULL;
   driver->bufferSize = config->size;
   driver->device = config->device;
-  driver->blockSize = MSC_BLOCK_SIZE;
   driver->packetSize = MSC_DATA_EP_SIZE;
   driver->endpoints.rx = config->endpoints.rx;
   driver->endpoints.tx = config->endpoints.tx;
@@ -1134,8 +729,13 @@ static enum Result driverInit(void *object, const void *configBase)
     driver->preallocated = true;
   }
 
-  for (size_t index = 0; index < ARRAY_SIZE(driver->lun); ++index)
-    mscDetachUnit(driver, index);
+  driver->lunCount = config->luns ? config->luns : 1;
+  driver->lun = malloc(driver->lunCount * sizeof(struct MscUnit));
+  if (driver->lun == NULL)
+    return E_MEMORY;
+
+  for (size_t index = 0; index < driver->lunCount; ++index)
+    scsiInitUnit(&driver->lun[index], logicalBlockSize, physicalBlockSize);
 
   /* Initialize context, suspend state machine */
   memset(&driver->context.cbw, 0, sizeof(driver->context.cbw));
@@ -1152,7 +752,9 @@ static enum Result driverInit(void *object, const void *configBase)
   if (driver->datapath == NULL)
     return E_MEMORY;
 
-  const enum Result res = datapathInit(driver->datapath, driver, dispatch);
+  const enum Result res = datapathInit(driver->datapath,
+      driver->rxEp, driver->txEp, dispatch, driver,
+      config->depth ? config->depth : MSC_MIN_QUERY_COUNT);
   if (res != E_OK)
     return res;
 
@@ -1172,11 +774,14 @@ static void driverDeinit(void *object)
 
   /* Delete query handler */
   datapathDeinit(driver->datapath);
+  free(driver->datapath);
 
   /* Delete endpoints */
   deinit(driver->txEp);
   deinit(driver->rxEp);
 
+  free(driver->lun);
+
   if (!driver->preallocated)
     free(driver->buffer);
 }
@@ -1215,6 +820,7 @@ static void driverNotify(void *object, unsigned int event)
     else
       driver->packetSize = TO_LITTLE_ENDIAN_16(MSC_DATA_EP_SIZE);
 
+    datapathSetPacketSize(driver->datapath, driver->packetSize);
     usbTrace("msc: current speed is %s", speed == USB_HS ? "HS" : "FS");
   }
 #endif
@@ -1230,52 +836,70 @@ static void driverNotify(void *object, unsigned int event)
 /*----------------------------------------------------------------------------*/
 enum Result mscAttachUnit(struct Msc *driver, uint8_t index, void *interface)
 {
-  assert(index < ARRAY_SIZE(driver->lun));
-  assert(interface != NULL);
-
-  uint64_t capacity;
-  const enum Result res = ifGetParam(interface, IF_SIZE_64, &capacity);
-
-  if (res == E_OK)
-  {
-    const IrqState state = irqSave();
+  return mscAttachMappedUnit(driver, index, interface, NULL);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Attach a storage with memory-mapped content. Read data is sent directly
+ * from the memory, therefore the content should always be up to date:
+ * storages with write-back caches or deferred writes should be attached
+ * with the generic function.
+ * @param driver Pointer to a driver object.
+ * @param index Index of the logical unit.
+ * @param interface Storage interface.
+ * @param memory Pointer to the beginning of the storage content.
+ * @return @b E_OK on success.
+ */
+enum Result mscAttachMappedUnit(struct Msc *driver, uint8_t index,
+    void *interface, const void *memory)
+{
+  const struct MscUnitConfig config = {
+      .interface = interface,
+      .memory = memory,
+      .discard = MSC_DISCARD_NONE
+  };
 
-    driver->lun[index].interface = interface;
-    driver->lun[index].blocks = capacity / driver->blockSize;
-    driver->lun[index].sense = SCSI_SK_NO_SENSE;
-    driver->lun[index].asc = SCSI_ASC_NOSENSE;
-    driver->lun[index].flags = FLAG_ATTENTION;
+  return mscAttachConfiguredUnit(driver, index, &config);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Attach a storage with additional logical unit settings.
+ * @param driver Pointer to a driver object.
+ * @param index Index of the logical unit.
+ * @param config Pointer to a logical unit configuration.
+ * @return @b E_OK on success.
+ */
+enum Result mscAttachConfiguredUnit(struct Msc *driver, uint8_t index,
+    const struct MscUnitConfig *config)
+{
+  assert(index < driver->lunCount);
+  assert(config != NULL && config->interface != NULL);
 
-    irqRestore(state);
-  }
+  const IrqState state = irqSave();
+  const enum Result res = scsiAttachUnit(&driver->lun[index], config);
+  irqRestore(state);
 
   return res;
 }
 /*----------------------------------------------------------------------------*/
 void mscDetachUnit(struct Msc *driver, uint8_t index)
 {
-  assert(index < ARRAY_SIZE(driver->lun));
+  assert(index < driver->lunCount);
 
   const IrqState state = irqSave();
-
-  driver->lun[index].interface = NULL;
-  driver->lun[index].blocks = 0;
-  driver->lun[index].sense = SCSI_SK_NO_SENSE;
-  driver->lun[index].asc = SCSI_ASC_NOSENSE;
-  driver->lun[index].flags = 0;
-
+  scsiDetachUnit(&driver->lun[index]);
   irqRestore(state);
 }
 /*----------------------------------------------------------------------------*/
 bool mscIsUnitFailed(const struct Msc *driver, uint8_t index)
 {
-  assert(index < ARRAY_SIZE(driver->lun));
+  assert(index < driver->lunCount);
   return (driver->lun[index].flags & FLAG_FAILURE) != 0;
 }
 /*----------------------------------------------------------------------------*/
 bool mscIsUnitLocked(const struct Msc *driver, uint8_t index)
 {
-  assert(index < ARRAY_SIZE(driver->lun));
+  assert(index < driver->lunCount);
   return (driver->lun[index].flags & FLAG_LOCKED) != 0;
 }
 /*----------------------------------------------------------------------------*/
@@ -8,9 +8,14 @@
 #include <halm/usb/msc.h>
 #include <halm/usb/msc_datapath.h>
 #include <halm/usb/msc_private.h>
+#include <halm/usb/msc_scsi.h>
 #include <halm/usb/usb_defs.h>
 #include <halm/usb/usb_trace.h>
+#include <halm/wq.h>
+#include <assert.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 /*----------------------------------------------------------------------------*/
 static bool enqueueUsbRx(struct MscQueryHandler *, uintptr_t, size_t,
     UsbRequestCallback, UsbRequestCallback, size_t *);
@@ -22,13 +27,15 @@ static void fillStorageReadQueue(struct MscQueryHandler *);
 static void fillUsbReadQueue(struct MscQueryHandler *);
 static void handleIncomingFlow(struct MscQueryHandler *);
 static void handleOutgoingFlow(struct MscQueryHandler *);
-static void makePingPongTransfer(struct MscQueryHandler *, void *, size_t,
+static void makePipelinedTransfer(struct MscQueryHandler *, void *, size_t,
     uint64_t, size_t);
 static size_t prepareDataRx(struct MscQueryHandler *, struct UsbRequest *,
     uintptr_t, size_t, UsbRequestCallback, UsbRequestCallback);
 static size_t prepareDataTx(struct MscQueryHandler *, struct UsbRequest *,
     uintptr_t, size_t, UsbRequestCallback, UsbRequestCallback);
+static void releaseUnusedQueries(struct MscQueryHandler *, size_t);
 static void resetTransferPool(struct MscQueryHandler *);
+static void storageDiscardTask(void *);
 static bool storageRead(struct MscQueryHandler *, struct MscQuery *);
 static void storageReadCallback(void *);
 static bool storageWrite(struct MscQueryHandler *, struct MscQuery *);
@@ -48,7 +55,6 @@ static bool enqueueUsbRx(struct MscQueryHandler *handler,
     uintptr_t buffer, size_t length, UsbRequestCallback silent,
     UsbRequestCallback last, size_t *queued)
 {
-  struct Msc * const driver = handler->driver;
   uintptr_t position = buffer;
 
   usbTrace("msc: OUT %"PRIu32, length);
@@ -61,7 +67,7 @@ static bool enqueueUsbRx(struct MscQueryHandler *handler,
     const size_t prepared = prepareDataRx(handler, request, position, length,
         silent, last);
 
-    if (usbEpEnqueue(driver->rxEp, request) == E_OK)
+    if (usbEpEnqueue(handler->rxEp, request) == E_OK)
     {
       length -= prepared;
       position += prepared;
@@ -101,7 +107,6 @@ static bool enqueueUsbTx(struct MscQueryHandler *handler,
     uintptr_t buffer, size_t length, UsbRequestCallback silent,
     UsbRequestCallback last, size_t *queued)
 {
-  struct Msc * const driver = handler->driver;
   uintptr_t position = buffer;
 
   usbTrace("msc: IN %"PRIu32, length);
@@ -114,7 +119,7 @@ static bool enqueueUsbTx(struct MscQueryHandler *handler,
     const size_t prepared = prepareDataTx(handler, request, position, length,
         silent, last);
 
-    if (usbEpEnqueue(driver->txEp, request) == E_OK)
+    if (usbEpEnqueue(handler->txEp, request) == E_OK)
     {
       length -= prepared;
       position += prepared;
@@ -198,7 +203,7 @@ static void handleIncomingFlow(struct MscQueryHandler *handler)
     {
       /* Transfer failed, notify parent FSM */
       handler->currentStatus = E_INTERFACE;
-      handler->trampoline(handler->driver);
+      handler->trampoline(handler->argument);
       return;
     }
   }
@@ -217,7 +222,7 @@ static void handleIncomingFlow(struct MscQueryHandler *handler)
       {
         /* Transfer failed, notify parent FSM */
         handler->currentStatus = E_INTERFACE;
-        handler->trampoline(handler->driver);
+        handler->trampoline(handler->argument);
         return;
       }
     }
@@ -227,7 +232,7 @@ static void handleIncomingFlow(struct MscQueryHandler *handler)
   {
     /* Transfer completed, invoke parent FSM */
     handler->currentStatus = E_OK;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
@@ -243,7 +248,7 @@ static void handleOutgoingFlow(struct MscQueryHandler *handler)
     {
       /* Transfer failed, notify parent FSM */
       handler->currentStatus = E_INTERFACE;
-      handler->trampoline(handler->driver);
+      handler->trampoline(handler->argument);
       return;
     }
   }
@@ -262,7 +267,7 @@ static void handleOutgoingFlow(struct MscQueryHandler *handler)
       {
         /* Transfer failed, notify parent FSM */
         handler->currentStatus = E_INTERFACE;
-        handler->trampoline(handler->driver);
+        handler->trampoline(handler->argument);
         return;
       }
     }
@@ -272,11 +277,11 @@ static void handleOutgoingFlow(struct MscQueryHandler *handler)
   {
     /* Transfer completed, invoke parent FSM */
     handler->currentStatus = E_OK;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
-static void makePingPongTransfer(struct MscQueryHandler *handler,
+static void makePipelinedTransfer(struct MscQueryHandler *handler,
     void *buffer, size_t bufferLength, uint64_t storagePosition,
     size_t transferLength)
 {
@@ -284,28 +289,36 @@ static void makePingPongTransfer(struct MscQueryHandler *handler,
   handler->currentQueryLength = transferLength;
   handler->currentQueryPosition = storagePosition;
 
-  const size_t transferChunkLength = bufferLength / 2;
-
-  handler->queries[0] = (struct MscQuery){
-      .data = (uintptr_t)buffer,
-      .capacity = transferChunkLength,
-      .length = 0
-  };
-  handler->queries[1] = (struct MscQuery){
-      .data = (uintptr_t)buffer + transferChunkLength,
-      .capacity = transferChunkLength,
-      .length = 0
-  };
+  /*
+   * Each part of the buffer should contain an integer number of logical
+   * blocks. Parts are aligned to physical blocks when the buffer is large
+   * enough, therefore aligned host transfers are passed to the storage
+   * without splitting physical blocks.
+   */
+  const struct MscUnit * const unit = handler->unit;
+  const size_t physicalBlockSize = (size_t)unit->blockSize << unit->exponent;
+  const size_t partLength = bufferLength / handler->queryCount;
+  const size_t transferChunkLength = partLength >= physicalBlockSize ?
+      partLength & ~(physicalBlockSize - 1) :
+      partLength & ~((size_t)unit->blockSize - 1);
+
+  for (size_t index = 0; index < handler->queryCount; ++index)
+  {
+    handler->queries[index] = (struct MscQuery){
+        .data = (uintptr_t)buffer + index * transferChunkLength,
+        .capacity = transferChunkLength,
+        .length = 0
+    };
 
-  pointerArrayPushBack(&handler->queryPool, &handler->queries[0]);
-  pointerArrayPushBack(&handler->queryPool, &handler->queries[1]);
+    pointerArrayPushBack(&handler->queryPool, &handler->queries[index]);
+  }
 }
 /*----------------------------------------------------------------------------*/
 static size_t prepareDataRx(struct MscQueryHandler *handler,
     struct UsbRequest *request, uintptr_t buffer, size_t left,
     UsbRequestCallback silent, UsbRequestCallback last)
 {
-  const size_t length = MIN(left, handler->driver->packetSize);
+  const size_t length = MIN(left, handler->packetSize);
 
   request->buffer = (void *)buffer;
   request->capacity = length;
@@ -319,7 +332,7 @@ static size_t prepareDataTx(struct MscQueryHandler *handler,
     struct UsbRequest *request, uintptr_t buffer, size_t left,
     UsbRequestCallback silent, UsbRequestCallback last)
 {
-  const size_t length = MIN(left, handler->driver->packetSize);
+  const size_t length = MIN(left, handler->packetSize);
 
   request->buffer = (void *)buffer;
   request->capacity = length;
@@ -330,6 +343,23 @@ static size_t prepareDataTx(struct MscQueryHandler *handler,
   return length;
 }
 /*----------------------------------------------------------------------------*/
+static void releaseUnusedQueries(struct MscQueryHandler *handler,
+    size_t first)
+{
+  for (size_t index = first; index < handler->queryCount; ++index)
+  {
+    handler->queries[index] = (struct MscQuery){
+        .position = 0,
+        .data = 0,
+        .capacity = 0,
+        .length = 0,
+        .offset = 0
+    };
+
+    pointerArrayPushBack(&handler->queryPool, &handler->queries[index]);
+  }
+}
+/*----------------------------------------------------------------------------*/
 static void resetTransferPool(struct MscQueryHandler *handler)
 {
   pointerArrayClear(&handler->queryPool);
@@ -341,23 +371,52 @@ static void resetTransferPool(struct MscQueryHandler *handler)
   handler->currentStatus = E_BUSY;
 }
 /*----------------------------------------------------------------------------*/
+static void storageDiscardTask(void *argument)
+{
+  struct MscQueryHandler * const handler = argument;
+  struct MscUnit * const unit = handler->unit;
+
+  /* Completion of erase operations is polled, callback is not used */
+  ifSetCallback(unit->interface, NULL, NULL);
+
+  const enum ScsiAction action = scsiDiscardBlocks(unit,
+      handler->parameters, handler->parameterLength);
+  const IrqState state = irqSave();
+
+  handler->storageBusy = false;
+
+  if (handler->currentStatus != E_IDLE)
+  {
+    usbTrace("msc: storage discard %s",
+        action == SCSI_ACTION_ACK ? "done" : "failed");
+
+    handler->currentStatus = action == SCSI_ACTION_ACK ? E_OK : E_INTERFACE;
+  }
+
+  /* Aborted transfer is reported with the idle status */
+  handler->trampoline(handler->argument);
+
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
 static bool storageRead(struct MscQueryHandler *handler,
     struct MscQuery *query)
 {
-  const size_t index = handler->driver->context.cbw.lun;
-  struct Interface * const interface = handler->driver->lun[index].interface;
+  const struct MscUnit * const unit = handler->unit;
+  struct Interface * const interface = unit->interface;
 
   usbTrace("msc: read storage block %"PRIu32", count %"PRIu32,
-      (uint32_t)(query->position / handler->driver->blockSize),
-      (uint32_t)(query->length / handler->driver->blockSize));
+      (uint32_t)(query->position / unit->blockSize),
+      (uint32_t)(query->length / unit->blockSize));
 
   ifSetCallback(interface, storageReadCallback, handler);
 
   if (ifSetParam(interface, IF_POSITION_64, &query->position) != E_OK)
     return false;
 
-  return ifRead(interface, (void *)query->data, query->length) ==
-      query->length;
+  handler->storageBusy = ifRead(interface, (void *)query->data,
+      query->length) == query->length;
+  return handler->storageBusy;
 }
 /*----------------------------------------------------------------------------*/
 static void storageReadCallback(void *argument)
@@ -365,16 +424,22 @@ static void storageReadCallback(void *argument)
   struct MscQueryHandler * const handler = argument;
   const IrqState state = irqSave();
 
-  const size_t index = handler->driver->context.cbw.lun;
-  struct Interface * const interface = handler->driver->lun[index].interface;
+  struct Interface * const interface = handler->unit->interface;
 
-  if (ifGetParam(interface, IF_STATUS, NULL) != E_OK)
+  handler->storageBusy = false;
+
+  if (handler->currentStatus == E_IDLE)
+  {
+    /* Transfer was aborted, notify parent FSM when the storage is idle */
+    handler->trampoline(handler->argument);
+  }
+  else if (ifGetParam(interface, IF_STATUS, NULL) != E_OK)
   {
     usbTrace("msc: storage read failed");
 
     /* Transfer failed, notify parent FSM */
     handler->currentStatus = E_INTERFACE;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
   else
   {
@@ -397,20 +462,21 @@ static void storageReadCallback(void *argument)
 static bool storageWrite(struct MscQueryHandler *handler,
     struct MscQuery *query)
 {
-  const size_t index = handler->driver->context.cbw.lun;
-  struct Interface * const interface = handler->driver->lun[index].interface;
+  const struct MscUnit * const unit = handler->unit;
+  struct Interface * const interface = unit->interface;
 
   usbTrace("msc: write storage block %"PRIu32", count %"PRIu32,
-      (uint32_t)(query->position / handler->driver->blockSize),
-      (uint32_t)(query->length / handler->driver->blockSize));
+      (uint32_t)(query->position / unit->blockSize),
+      (uint32_t)(query->length / unit->blockSize));
 
   ifSetCallback(interface, storageWriteCallback, handler);
 
   if (ifSetParam(interface, IF_POSITION_64, &query->position) != E_OK)
     return false;
 
-  return ifWrite(interface, (const void *)query->data, query->length) ==
-      query->length;
+  handler->storageBusy = ifWrite(interface, (const void *)query->data,
+      query->length) == query->length;
+  return handler->storageBusy;
 }
 /*----------------------------------------------------------------------------*/
 static void storageWriteCallback(void *argument)
@@ -418,16 +484,22 @@ static void storageWriteCallback(void *argument)
   struct MscQueryHandler * const handler = argument;
   const IrqState state = irqSave();
 
-  const size_t index = handler->driver->context.cbw.lun;
-  struct Interface * const interface = handler->driver->lun[index].interface;
+  struct Interface * const interface = handler->unit->interface;
 
-  if (ifGetParam(interface, IF_STATUS, NULL) != E_OK)
+  handler->storageBusy = false;
+
+  if (handler->currentStatus == E_IDLE)
+  {
+    /* Transfer was aborted, notify parent FSM when the storage is idle */
+    handler->trampoline(handler->argument);
+  }
+  else if (ifGetParam(interface, IF_STATUS, NULL) != E_OK)
   {
     usbTrace("msc: storage write failed");
 
     /* Transfer failed, notify parent FSM */
     handler->currentStatus = E_INTERFACE;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
   else
   {
@@ -459,14 +531,14 @@ static void usbControlCallback(void *argument, struct UsbRequest *request,
     handler->currentStatus = request->length == request->capacity ?
         E_OK : E_VALUE;
     pointerArrayPushBack(&handler->usbPool, request);
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
   else if (status != USB_REQUEST_CANCELLED)
   {
     pointerArrayPushBack(&handler->usbPool, request);
 
     handler->currentStatus = E_ERROR;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
@@ -491,7 +563,7 @@ static void usbRxLastCallback(void *argument, struct UsbRequest *request,
   else if (status != USB_REQUEST_CANCELLED)
   {
     handler->currentStatus = E_ERROR;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
@@ -512,7 +584,7 @@ static void usbRxSilentCallback(void *argument, struct UsbRequest *request,
   else if (status != USB_REQUEST_CANCELLED)
   {
     handler->currentStatus = E_ERROR;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
@@ -536,7 +608,7 @@ static void usbTxLastCallback(void *argument, struct UsbRequest *request,
   else if (status != USB_REQUEST_CANCELLED)
   {
     handler->currentStatus = E_ERROR;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
@@ -557,13 +629,16 @@ static void usbTxSilentCallback(void *argument, struct UsbRequest *request,
   else if (status != USB_REQUEST_CANCELLED)
   {
     handler->currentStatus = E_ERROR;
-    handler->trampoline(handler->driver);
+    handler->trampoline(handler->argument);
   }
 }
 /*----------------------------------------------------------------------------*/
 enum Result datapathInit(struct MscQueryHandler *handler,
-    struct Msc *driver, void (*trampoline)(struct Msc *))
+    struct UsbEndpoint *rxEp, struct UsbEndpoint *txEp,
+    void (*trampoline)(void *), void *argument, size_t depth)
 {
+  assert(depth >= MSC_MIN_QUERY_COUNT);
+
   if (!pointerArrayInit(&handler->usbPool, DATA_QUEUE_SIZE))
     return E_MEMORY;
   if (!pointerQueueInit(&handler->usbQueue, DATA_QUEUE_SIZE))
@@ -577,14 +652,25 @@ enum Result datapathInit(struct MscQueryHandler *handler,
     pointerArrayPushBack(&handler->usbPool, request);
   }
 
-  handler->driver = driver;
   handler->trampoline = trampoline;
+  handler->argument = argument;
+  handler->rxEp = rxEp;
+  handler->txEp = txEp;
+  handler->unit = NULL;
+  handler->packetSize = MSC_DATA_EP_SIZE;
+  handler->currentStatus = E_IDLE;
+  handler->storageBusy = false;
+
+  handler->queryCount = depth;
+  handler->queries = malloc(depth * sizeof(struct MscQuery));
+  if (handler->queries == NULL)
+    return E_MEMORY;
 
-  if (!pointerArrayInit(&handler->queryPool, 2))
+  if (!pointerArrayInit(&handler->queryPool, depth))
     return E_MEMORY;
-  if (!pointerQueueInit(&handler->storageQueries, 2))
+  if (!pointerQueueInit(&handler->storageQueries, depth))
     return E_MEMORY;
-  if (!pointerQueueInit(&handler->usbQueries, 2))
+  if (!pointerQueueInit(&handler->usbQueries, depth))
     return E_MEMORY;
 
   return E_OK;
@@ -595,6 +681,7 @@ void datapathDeinit(struct MscQueryHandler *handler)
   pointerQueueDeinit(&handler->usbQueries);
   pointerQueueDeinit(&handler->storageQueries);
   pointerArrayDeinit(&handler->queryPool);
+  free(handler->queries);
 
   pointerQueueDeinit(&handler->usbQueue);
   pointerArrayDeinit(&handler->usbPool);
@@ -605,6 +692,30 @@ enum Result datapathStatus(const struct MscQueryHandler *handler)
   return handler->currentStatus;
 }
 /*----------------------------------------------------------------------------*/
+void datapathSetPacketSize(struct MscQueryHandler *handler, uint16_t size)
+{
+  handler->packetSize = size;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Stop the data stage of the current transfer. USB requests are cancelled
+ * immediately while the storage operation in progress is allowed to finish.
+ * @param handler Pointer to a query handler.
+ * @return @b true when the transfer is stopped, @b false when the parent
+ * state machine will be invoked with @b E_IDLE status after the completion
+ * of the storage operation.
+ */
+bool datapathAbort(struct MscQueryHandler *handler)
+{
+  usbEpClear(handler->rxEp);
+  usbEpClear(handler->txEp);
+
+  handler->currentQueryLength = 0;
+  handler->currentStatus = E_IDLE;
+
+  return !handler->storageBusy;
+}
+/*----------------------------------------------------------------------------*/
 bool datapathReceiveControl(struct MscQueryHandler *handler, void *buffer,
     size_t length)
 {
@@ -642,6 +753,7 @@ bool datapathSendResponseAndStatus(struct MscQueryHandler *handler,
 
   pointerQueuePushBack(&handler->usbQueries, &handler->queries[0]);
   pointerQueuePushBack(&handler->usbQueries, &handler->queries[1]);
+  releaseUnusedQueries(handler, 2);
 
   return enqueueUsbTxRequests(handler, &handler->queries[0]);
 }
@@ -658,16 +770,9 @@ bool datapathSendResponse(struct MscQueryHandler *handler,
       .length = length,
       .offset = 0
   };
-  handler->queries[1] = (struct MscQuery){
-      .position = 0,
-      .data = 0,
-      .capacity = 0,
-      .length = 0,
-      .offset = 0
-  };
 
   pointerQueuePushBack(&handler->usbQueries, &handler->queries[0]);
-  pointerArrayPushBack(&handler->queryPool, &handler->queries[1]);
+  releaseUnusedQueries(handler, 1);
 
   return enqueueUsbTxRequests(handler, &handler->queries[0]);
 }
@@ -692,25 +797,19 @@ bool datapathSendStatus(struct MscQueryHandler *handler,
       .length = sizeof(handler->csw),
       .offset = 0
   };
-  handler->queries[1] = (struct MscQuery){
-      .position = 0,
-      .data = 0,
-      .capacity = 0,
-      .length = 0,
-      .offset = 0
-  };
 
   pointerQueuePushBack(&handler->usbQueries, &handler->queries[0]);
-  pointerArrayPushBack(&handler->queryPool, &handler->queries[1]);
+  releaseUnusedQueries(handler, 1);
 
   return enqueueUsbTxRequests(handler, &handler->queries[0]);
 }
 /*----------------------------------------------------------------------------*/
 bool datapathReceiveAndWriteData(struct MscQueryHandler *handler,
-    void *buffer, size_t bufferLength, uint64_t storagePosition,
-    size_t transferLength)
+    struct MscUnit *unit, void *buffer, size_t bufferLength,
+    uint64_t storagePosition, size_t transferLength)
 {
-  makePingPongTransfer(handler, buffer, bufferLength,
+  handler->unit = unit;
+  makePipelinedTransfer(handler, buffer, bufferLength,
       storagePosition, transferLength);
   fillUsbReadQueue(handler);
 
@@ -718,10 +817,19 @@ bool datapathReceiveAndWriteData(struct MscQueryHandler *handler,
 }
 /*----------------------------------------------------------------------------*/
 bool datapathReadAndSendData(struct MscQueryHandler *handler,
-    void *buffer, size_t bufferLength, uint64_t storagePosition,
-    size_t transferLength)
+    struct MscUnit *unit, void *buffer, size_t bufferLength,
+    uint64_t storagePosition, size_t transferLength)
 {
-  makePingPongTransfer(handler, buffer, bufferLength,
+  if (unit->address)
+  {
+    /* Send data directly from the memory of the storage */
+    return datapathSendResponse(handler,
+        (const void *)(unit->address + (uintptr_t)storagePosition),
+        transferLength);
+  }
+
+  handler->unit = unit;
+  makePipelinedTransfer(handler, buffer, bufferLength,
       storagePosition, transferLength);
   fillStorageReadQueue(handler);
 
@@ -732,3 +840,34 @@ bool datapathReadAndSendData(struct MscQueryHandler *handler,
 
   return storageRead(handler, query);
 }
+/*----------------------------------------------------------------------------*/
+/**
+ * Discard blocks listed in the Unmap parameter list. Erase operations are
+ * performed by the work queue of the logical unit, the parent state machine
+ * is invoked after their completion.
+ * @param handler Pointer to a query handler.
+ * @param unit Logical unit with the configured work queue.
+ * @param buffer Validated parameter list, it is copied by the function.
+ * @param length Length of the parameter list.
+ * @return @b true when the operation is queued.
+ */
+bool datapathDiscardBlocks(struct MscQueryHandler *handler,
+    struct MscUnit *unit, const void *buffer, size_t length)
+{
+  if (unit->wq == NULL || length > sizeof(handler->parameters))
+    return false;
+
+  memcpy(handler->parameters, buffer, length);
+  handler->parameterLength = length;
+  handler->unit = unit;
+  handler->currentStatus = E_BUSY;
+  handler->storageBusy = true;
+
+  if (wqAdd(unit->wq, storageDiscardTask, handler) != E_OK)
+  {
+    handler->storageBusy = false;
+    return false;
+  }
+
+  return true;
+}
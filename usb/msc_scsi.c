@@ -0,0 +1,1121 @@
+/*
+ * msc_scsi.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/generic/flash.h>
+#include <halm/generic/mmcsd.h>
+#include <halm/usb/msc.h>
+#include <halm/usb/msc_private.h>
+#include <halm/usb/msc_scsi.h>
+#include <halm/usb/usb_trace.h>
+#include <xcore/asm.h>
+#include <xcore/memory.h>
+#include <inttypes.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+static inline uint32_t fromBigEndian24(const uint8_t *, uint32_t);
+static inline void toBigEndian24(uint8_t *, uint32_t);
+static enum Result discardBlocks(struct MscUnit *, uint64_t, uint32_t);
+static size_t getUnmapDescriptorCount(const void *, size_t);
+static bool isUnitReady(struct MscUnit *);
+static size_t makeVpdPage(const struct MscUnit *, uint8_t, void *);
+static void probeDiscardSupport(struct MscUnit *, uint64_t,
+    enum MscDiscard);
+static enum ScsiAction processUnmapParameters(struct MscUnit *,
+    const void *, size_t);
+static enum ScsiAction setupStorageTransfer(struct MscUnit *, uint64_t,
+    uint32_t, struct ScsiTransfer *);
+static enum Result waitStorageIdle(struct Interface *);
+
+static enum ScsiAction commandInquiry(struct MscUnit *, const uint8_t *,
+    void *, struct ScsiTransfer *);
+static enum ScsiAction commandMediumRemoval(struct MscUnit *, const uint8_t *);
+static enum ScsiAction commandModeSense(struct MscUnit *, const uint8_t *,
+    void *, struct ScsiTransfer *);
+static enum ScsiAction commandRead(struct MscUnit *, const uint8_t *,
+    struct ScsiTransfer *);
+static enum ScsiAction commandReadCapacity(struct MscUnit *, const uint8_t *,
+    void *, struct ScsiTransfer *);
+static enum ScsiAction commandReadCapacity16(struct MscUnit *,
+    const uint8_t *, void *, struct ScsiTransfer *);
+static enum ScsiAction commandReadFormatCapacities(struct MscUnit *,
+    const uint8_t *, void *, struct ScsiTransfer *);
+static enum ScsiAction commandRequestSense(struct MscUnit *, const uint8_t *,
+    void *, struct ScsiTransfer *);
+static enum ScsiAction commandSynchronizeCache(struct MscUnit *,
+    const uint8_t *);
+static enum ScsiAction commandTestUnitReady(struct MscUnit *);
+static enum ScsiAction commandUnmap(struct MscUnit *, const uint8_t *,
+    struct ScsiTransfer *);
+static enum ScsiAction commandVerify(struct MscUnit *, const uint8_t *);
+static enum ScsiAction commandWrite(struct MscUnit *, const uint8_t *,
+    struct ScsiTransfer *);
+/*----------------------------------------------------------------------------*/
+static inline uint32_t fromBigEndian24(const uint8_t *input, uint32_t mask)
+{
+  return ((input[0] << 16) | (input[1] << 8) | input[2]) & mask;
+}
+/*----------------------------------------------------------------------------*/
+static inline void toBigEndian24(uint8_t *output, uint32_t input)
+{
+  output[0] = (uint8_t)(input >> 16);
+  output[1] = (uint8_t)(input >> 8);
+  output[2] = (uint8_t)input;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result discardBlocks(struct MscUnit *unit,
+    uint64_t logicalBlockAddress, uint32_t numberOfBlocks)
+{
+  const uint64_t end =
+      (logicalBlockAddress + numberOfBlocks) * unit->blockSize;
+  uint64_t position = logicalBlockAddress * unit->blockSize;
+
+  /* Partially covered erase units are left intact */
+  position = (position + unit->granularity - 1) / unit->granularity
+      * unit->granularity;
+
+  for (; position + unit->granularity <= end; position += unit->granularity)
+  {
+    /* Erase operations may complete asynchronously */
+    enum Result res = waitStorageIdle(unit->interface);
+
+    if (res != E_OK)
+      return res;
+
+    if (unit->discard == MSC_DISCARD_MMCSD)
+    {
+      res = ifSetParam(unit->interface, IF_MMCSD_ERASE_64, &position);
+    }
+    else
+    {
+      const uint32_t address = (uint32_t)position;
+      res = ifSetParam(unit->interface, IF_FLASH_ERASE_SECTOR, &address);
+    }
+
+    if (res != E_OK)
+      return res;
+  }
+
+  return waitStorageIdle(unit->interface);
+}
+/*----------------------------------------------------------------------------*/
+static size_t getUnmapDescriptorCount(const void *buffer, size_t length)
+{
+  const struct UnmapParameterListHeader * const header = buffer;
+
+  /* Truncated block descriptors are ignored */
+  return MIN(fromBigEndian16(header->blockDescriptorDataLength),
+      length - sizeof(struct UnmapParameterListHeader))
+      / sizeof(struct UnmapBlockDescriptor);
+}
+/*----------------------------------------------------------------------------*/
+static bool isUnitReady(struct MscUnit *unit)
+{
+  if (unit->interface == NULL)
+  {
+    scsiSetSense(unit, SCSI_SK_NOT_READY, SCSI_ASC_NR_MEDIUMNOTPRESENT);
+    return false;
+  }
+  else
+    return true;
+}
+/*----------------------------------------------------------------------------*/
+static size_t makeVpdPage(const struct MscUnit *unit, uint8_t page,
+    void *buffer)
+{
+  switch (page)
+  {
+    case SCSI_VPD_SUPPORTED_PAGES:
+    {
+      static const uint8_t pages[] = {
+          SCSI_VPD_SUPPORTED_PAGES,
+          SCSI_VPD_BLOCK_LIMITS,
+          SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS,
+          SCSI_VPD_LOGICAL_BLOCK_PROVISIONING
+      };
+      const struct VpdPageHeader header = {
+          .peripheralDeviceType = PDT_DIRECT_ACCESS_BLOCK_DEVICE,
+          .pageCode = page,
+          .pageLength = TO_BIG_ENDIAN_16(sizeof(pages))
+      };
+
+      memcpy(buffer, &header, sizeof(header));
+      memcpy((uint8_t *)buffer + sizeof(header), pages, sizeof(pages));
+      return sizeof(header) + sizeof(pages);
+    }
+
+    case SCSI_VPD_BLOCK_LIMITS:
+    {
+      struct BlockLimitsVpdPage response;
+
+      memset(&response, 0, sizeof(response));
+      response.header.peripheralDeviceType = PDT_DIRECT_ACCESS_BLOCK_DEVICE;
+      response.header.pageCode = page;
+      response.header.pageLength =
+          TO_BIG_ENDIAN_16(sizeof(response) - sizeof(response.header));
+      /* Transfers should be aligned to physical blocks */
+      response.optimalTransferLengthGranularity =
+          toBigEndian16((uint16_t)(1 << unit->exponent));
+
+      if (unit->discard != MSC_DISCARD_NONE)
+      {
+        const uint32_t granularity = unit->granularity / unit->blockSize;
+
+        response.maximumUnmapLbaCount =
+            toBigEndian32(granularity * MSC_UNMAP_GRANULE_COUNT);
+        response.maximumUnmapBlockDescriptorCount =
+            TO_BIG_ENDIAN_32(MSC_UNMAP_DESCRIPTOR_COUNT);
+        response.optimalUnmapGranularity = toBigEndian32(granularity);
+        response.unmapGranularityAlignment =
+            TO_BIG_ENDIAN_32(BLOCKLIMITS_UGAVALID);
+      }
+
+      memcpy(buffer, &response, sizeof(response));
+      return sizeof(response);
+    }
+
+    case SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS:
+    {
+      struct BlockDeviceCharacteristicsVpdPage response;
+
+      memset(&response, 0, sizeof(response));
+      response.header.peripheralDeviceType = PDT_DIRECT_ACCESS_BLOCK_DEVICE;
+      response.header.pageCode = page;
+      response.header.pageLength =
+          TO_BIG_ENDIAN_16(sizeof(response) - sizeof(response.header));
+      response.mediumRotationRate = TO_BIG_ENDIAN_16(BDC_NON_ROTATING_MEDIUM);
+
+      memcpy(buffer, &response, sizeof(response));
+      return sizeof(response);
+    }
+
+    case SCSI_VPD_LOGICAL_BLOCK_PROVISIONING:
+    {
+      struct LogicalBlockProvisioningVpdPage response;
+
+      memset(&response, 0, sizeof(response));
+      response.header.peripheralDeviceType = PDT_DIRECT_ACCESS_BLOCK_DEVICE;
+      response.header.pageCode = page;
+      response.header.pageLength =
+          TO_BIG_ENDIAN_16(sizeof(response) - sizeof(response.header));
+
+      if (unit->discard != MSC_DISCARD_NONE)
+      {
+        response.flags = LBP_FLAGS_LBPU;
+        response.provisioningType = LBP_PROVISIONING_TYPE_THIN;
+      }
+
+      memcpy(buffer, &response, sizeof(response));
+      return sizeof(response);
+    }
+
+    default:
+      return 0;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void probeDiscardSupport(struct MscUnit *unit, uint64_t capacity,
+    enum MscDiscard discard)
+{
+  uint32_t granularity = 0;
+
+  /*
+   * Parameter identifiers of different interface classes overlap,
+   * therefore only parameters of the configured class are used.
+   */
+  switch (discard)
+  {
+    case MSC_DISCARD_FLASH:
+      /* Flash interface uses 32-bit sector addresses */
+      if (capacity > UINT32_MAX || ifGetParam(unit->interface,
+          IF_FLASH_SECTOR_SIZE, &granularity) != E_OK)
+      {
+        granularity = 0;
+      }
+      break;
+
+    case MSC_DISCARD_MMCSD:
+      if (ifGetParam(unit->interface, IF_MMCSD_ERASE_GROUP_SIZE,
+          &granularity) != E_OK)
+      {
+        granularity = 0;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  if (!granularity || granularity % unit->blockSize)
+  {
+    unit->discard = MSC_DISCARD_NONE;
+    unit->granularity = 0;
+  }
+  else
+  {
+    unit->discard = (uint8_t)discard;
+    unit->granularity = granularity;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction processUnmapParameters(struct MscUnit *unit,
+    const void *buffer, size_t length)
+{
+  const struct UnmapBlockDescriptor * const descriptors =
+      (const struct UnmapBlockDescriptor *)((const uint8_t *)buffer
+          + sizeof(struct UnmapParameterListHeader));
+
+  if (length < sizeof(struct UnmapParameterListHeader))
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_PARAMETERLENGTH);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  const size_t count = getUnmapDescriptorCount(buffer, length);
+  const uint64_t limit =
+      (uint64_t)(unit->granularity / unit->blockSize) * MSC_UNMAP_GRANULE_COUNT;
+  uint64_t total = 0;
+
+  /* Validate all descriptors before discarding any data */
+  for (size_t index = 0; index < count; ++index)
+  {
+    const uint64_t logicalBlockAddress =
+        fromBigEndian64(descriptors[index].logicalBlockAddress);
+    const uint32_t numberOfBlocks =
+        fromBigEndian32(descriptors[index].numberOfBlocks);
+
+    if (logicalBlockAddress > unit->blocks
+        || numberOfBlocks > unit->blocks - logicalBlockAddress)
+    {
+      scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_LBAOUTOFRANGE);
+      return SCSI_ACTION_FAILURE;
+    }
+
+    total += numberOfBlocks;
+  }
+
+  if (total > limit)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDFIELDINPL);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  /* Erase operations are performed later outside of the interrupt context */
+  return total ? SCSI_ACTION_DISCARD : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction setupStorageTransfer(struct MscUnit *unit,
+    uint64_t logicalBlockAddress, uint32_t numberOfBlocks,
+    struct ScsiTransfer *transfer)
+{
+  if (logicalBlockAddress > unit->blocks
+      || numberOfBlocks > unit->blocks - logicalBlockAddress)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_LBAOUTOFRANGE);
+    return SCSI_ACTION_FAILURE;
+  }
+  if (numberOfBlocks > UINT32_MAX / unit->blockSize)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDFIELDINCBA);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  transfer->position = logicalBlockAddress * unit->blockSize;
+  transfer->length = numberOfBlocks * unit->blockSize;
+
+  return SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result waitStorageIdle(struct Interface *interface)
+{
+  enum Result res;
+
+  while ((res = ifGetParam(interface, IF_STATUS, NULL)) == E_BUSY)
+    barrier();
+
+  /* Storages without status reporting complete operations synchronously */
+  return res == E_INVALID ? E_OK : res;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandInquiry(struct MscUnit *unit,
+    const uint8_t *cb, void *buffer, struct ScsiTransfer *transfer)
+{
+  const struct InquiryCommand * const command =
+      (const struct InquiryCommand *)cb;
+  static const char version[] = "1.00";
+  const size_t allocationLength = fromBigEndian16(command->allocationLength);
+  struct InquiryData response;
+
+  if (command->flags & INQUIRY_EVPD)
+  {
+    const size_t length = unit != NULL ?
+        makeVpdPage(unit, command->pageCode, buffer) : 0;
+
+    if (!length)
+    {
+      usbTrace("scsi: unsupported VPD page 0x%02X", command->pageCode);
+
+      if (unit != NULL)
+      {
+        scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST,
+            SCSI_ASC_IR_INVALIDFIELDINCBA);
+      }
+      return SCSI_ACTION_FAILURE;
+    }
+
+    usbTrace("scsi: inquiry, VPD page 0x%02X", command->pageCode);
+
+    transfer->length = MIN(length, allocationLength);
+    return transfer->length ? SCSI_ACTION_RESPONSE : SCSI_ACTION_ACK;
+  }
+  else if (command->pageCode)
+  {
+    if (unit != NULL)
+    {
+      scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST,
+          SCSI_ASC_IR_INVALIDFIELDINCBA);
+    }
+    return SCSI_ACTION_FAILURE;
+  }
+
+  memset(&response, 0, sizeof(response));
+
+  if (unit != NULL)
+  {
+    response.peripheralDeviceType = PDT_DIRECT_ACCESS_BLOCK_DEVICE;
+  }
+  else
+  {
+    /* Peripheral Qualifier 011b: logical unit is not supported */
+    response.peripheralDeviceType = 0x60 | PDT_UNKNOWN_DEVICE;
+  }
+
+  /* Version of the SPC-4 standard */
+  response.version = 0x06;
+  response.additionalLength = 32;
+
+  response.flags0 = INQUIRY_FLAGS_0_RMB;
+  /* Response Data Format should be set to a fixed value of 2 */
+  response.flags1 = INQUIRY_FLAGS_1_RDF(2);
+  response.flags2 = INQUIRY_FLAGS_2_SCCS;
+  response.flags3 = 0x00;
+  response.flags4 = 0x00;
+
+  memset(response.vendorIdentification, ' ',
+      sizeof(response.vendorIdentification));
+  memset(response.productIdentification, ' ',
+      sizeof(response.productIdentification));
+  memcpy(response.productRevisionLevel, version,
+      sizeof(response.productRevisionLevel));
+
+  usbTrace("scsi: inquiry");
+
+  memcpy(buffer, &response, sizeof(response));
+  transfer->length = MIN(sizeof(response), allocationLength);
+
+  return transfer->length ? SCSI_ACTION_RESPONSE : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandMediumRemoval(struct MscUnit *unit,
+    const uint8_t *cb)
+{
+  const struct PreventAllowMediumRemovalCommand * const command =
+      (const struct PreventAllowMediumRemovalCommand *)cb;
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  if (MEDIUMREMOVAL_FLAGS_PREVENT_VALUE(command->flags1) == PAMR_LOCK)
+    unit->flags |= FLAG_LOCKED;
+  else
+    unit->flags &= ~FLAG_LOCKED;
+
+  usbTrace("scsi: medium removal state %u",
+      (unit->flags & FLAG_LOCKED) != 0);
+  return SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandModeSense(struct MscUnit *,
+    const uint8_t *cb, void *buffer, struct ScsiTransfer *transfer)
+{
+  size_t allocationLength;
+  size_t length;
+
+  if (cb[0] == SCSI_MODE_SENSE6)
+  {
+    const struct ModeSense6Command * const command =
+        (const struct ModeSense6Command *)cb;
+    struct ModeParameterHeader6 response;
+
+    response.modeDataLength = 3;
+    response.mediumType = 0;
+    response.deviceSpecificParameter = 0;
+    response.blockDescriptorLength = 0;
+
+    usbTrace("scsi: mode sense 6");
+
+    memcpy(buffer, &response, sizeof(response));
+    allocationLength = command->allocationLength;
+    length = sizeof(response);
+  }
+  else
+  {
+    const struct ModeSense10Command * const command =
+        (const struct ModeSense10Command *)cb;
+    struct ModeParameterHeader10 response;
+
+    memset(&response, 0, sizeof(response)); /* Clear reserved fields */
+    response.modeDataLength = TO_BIG_ENDIAN_16(6);
+    response.mediumType = 0;
+    response.deviceSpecificParameter = 0;
+    response.flags = 0;
+    response.blockDescriptorLength = TO_BIG_ENDIAN_16(0);
+
+    usbTrace("scsi: mode sense 10");
+
+    memcpy(buffer, &response, sizeof(response));
+    allocationLength = fromBigEndian16(command->allocationLength);
+    length = sizeof(response);
+  }
+
+  transfer->length = MIN(length, allocationLength);
+  return transfer->length ? SCSI_ACTION_RESPONSE : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandRead(struct MscUnit *unit, const uint8_t *cb,
+    struct ScsiTransfer *transfer)
+{
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  uint64_t logicalBlockAddress = 0;
+  uint32_t numberOfBlocks = 0;
+
+  switch (cb[0])
+  {
+    case SCSI_READ6:
+    {
+      const struct Read6Command * const command =
+          (const struct Read6Command *)cb;
+
+      logicalBlockAddress =
+          fromBigEndian24(command->logicalBlockAddress, READ6_LBA_MASK);
+      numberOfBlocks = !command->transferLength ? 256 : command->transferLength;
+      break;
+    }
+
+    case SCSI_READ10:
+    {
+      const struct Read10Command * const command =
+          (const struct Read10Command *)cb;
+
+      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
+      numberOfBlocks = fromBigEndian16(command->transferLength);
+      break;
+    }
+
+    case SCSI_READ12:
+    {
+      const struct Read12Command * const command =
+          (const struct Read12Command *)cb;
+
+      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
+      numberOfBlocks = fromBigEndian32(command->transferLength);
+      break;
+    }
+
+    case SCSI_READ16:
+    {
+      const struct Read16Command * const command =
+          (const struct Read16Command *)cb;
+
+      logicalBlockAddress = fromBigEndian64(command->logicalBlockAddress);
+      numberOfBlocks = fromBigEndian32(command->transferLength);
+      break;
+    }
+  }
+
+  if (setupStorageTransfer(unit, logicalBlockAddress, numberOfBlocks,
+      transfer) != SCSI_ACTION_ACK)
+  {
+    return SCSI_ACTION_FAILURE;
+  }
+
+  usbTrace("scsi: read command, start block %"PRIu64", count %"PRIu32,
+      logicalBlockAddress, numberOfBlocks);
+
+  return transfer->length ? SCSI_ACTION_READ : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandReadCapacity(struct MscUnit *unit,
+    const uint8_t *cb, void *buffer, struct ScsiTransfer *transfer)
+{
+  const struct ReadCapacity10Command * const command =
+      (const struct ReadCapacity10Command *)cb;
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  if (!(command->flags1 & READCAPACITY10_FLAGS_1_PMI) && command->lba)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDFIELDINCBA);
+    return SCSI_ACTION_FAILURE;
+  }
+  if (fromBigEndian32(command->lba) > unit->blocks - 1)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_LBAOUTOFRANGE);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  struct ReadCapacityData response;
+
+  /* Hosts should use Read Capacity (16) for larger logical units */
+  response.lastLogicalBlockAddress = unit->blocks - 1 > UINT32_MAX ?
+      TO_BIG_ENDIAN_32(UINT32_MAX) : toBigEndian32((uint32_t)unit->blocks - 1);
+  response.blockLength = toBigEndian32(unit->blockSize);
+
+  usbTrace("scsi: read capacity, %"PRIu64" blocks", unit->blocks);
+
+  memcpy(buffer, &response, sizeof(response));
+  transfer->length = sizeof(response);
+
+  return SCSI_ACTION_RESPONSE;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandReadCapacity16(struct MscUnit *unit,
+    const uint8_t *cb, void *buffer, struct ScsiTransfer *transfer)
+{
+  const struct ReadCapacity16Command * const command =
+      (const struct ReadCapacity16Command *)cb;
+  const uint64_t lba = fromBigEndian64(command->lba);
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  if (!(command->flags & READCAPACITY16_FLAGS_PMI) && lba)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDFIELDINCBA);
+    return SCSI_ACTION_FAILURE;
+  }
+  if (lba > unit->blocks - 1)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_LBAOUTOFRANGE);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  struct ReadCapacity16Data response;
+
+  memset(&response, 0, sizeof(response));
+  response.lastLogicalBlockAddress = toBigEndian64(unit->blocks - 1);
+  response.blockLength = toBigEndian32(unit->blockSize);
+  response.flags1 = READCAPACITY16_FLAGS_1_LBPPBE(unit->exponent);
+
+  if (unit->discard != MSC_DISCARD_NONE)
+    response.flags2 = READCAPACITY16_FLAGS_2_LBPME;
+
+  usbTrace("scsi: read capacity 16, %"PRIu64" blocks", unit->blocks);
+
+  memcpy(buffer, &response, sizeof(response));
+  transfer->length = MIN(sizeof(response),
+      fromBigEndian32(command->allocationLength));
+
+  return transfer->length ? SCSI_ACTION_RESPONSE : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandReadFormatCapacities(struct MscUnit *unit,
+    const uint8_t *cb, void *buffer, struct ScsiTransfer *transfer)
+{
+  const struct ReadFormatCapacitiesCommand * const command =
+      (const struct ReadFormatCapacitiesCommand *)cb;
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  struct
+  {
+    struct CapacityListHeader header;
+    struct CapacityDescriptor descriptor;
+  } response;
+
+  memset(response.header.reserved, 0, sizeof(response.header.reserved));
+  response.header.capacityListLength = sizeof(response.descriptor);
+
+  response.descriptor.numberOfBlocks =
+      toBigEndian32((uint32_t)MIN(unit->blocks, UINT32_MAX));
+  /* Descriptor Type: Formatted Medium */
+  response.descriptor.flags = 0x02;
+  toBigEndian24(response.descriptor.blockLength, unit->blockSize);
+
+  usbTrace("scsi: read format capacity, %"PRIu64" blocks", unit->blocks);
+
+  memcpy(buffer, &response, sizeof(response));
+  transfer->length = MIN(sizeof(response),
+      fromBigEndian16(command->allocationLength));
+
+  return transfer->length ? SCSI_ACTION_RESPONSE : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandRequestSense(struct MscUnit *unit,
+    const uint8_t *cb, void *buffer, struct ScsiTransfer *transfer)
+{
+  const struct RequestSenseCommand * const command =
+      (const struct RequestSenseCommand *)cb;
+  const size_t length = scsiGetSenseData(unit, buffer);
+
+  transfer->length = MIN(length, command->allocationLength);
+  return transfer->length ? SCSI_ACTION_RESPONSE : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandSynchronizeCache(struct MscUnit *unit,
+    const uint8_t *cb)
+{
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  uint64_t logicalBlockAddress;
+  uint32_t numberOfBlocks;
+
+  if (cb[0] == SCSI_SYNCHRONIZE_CACHE10)
+  {
+    const struct SynchronizeCache10Command * const command =
+        (const struct SynchronizeCache10Command *)cb;
+
+    logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
+    numberOfBlocks = fromBigEndian16(command->numberOfBlocks);
+  }
+  else
+  {
+    const struct SynchronizeCache16Command * const command =
+        (const struct SynchronizeCache16Command *)cb;
+
+    logicalBlockAddress = fromBigEndian64(command->logicalBlockAddress);
+    numberOfBlocks = fromBigEndian32(command->numberOfBlocks);
+  }
+
+  /* Zero number of blocks selects all blocks up to the end of the medium */
+  if (logicalBlockAddress > unit->blocks
+      || numberOfBlocks > unit->blocks - logicalBlockAddress)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_LBAOUTOFRANGE);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  usbTrace("scsi: synchronize cache, start block %"PRIu64", count %"PRIu32,
+      logicalBlockAddress, numberOfBlocks);
+
+  /*
+   * Write commands are completed only after the storage write is finished,
+   * cached data is flushed by interfaces that support the parameter.
+   */
+  const enum Result res = ifSetParam(unit->interface, IF_FLASH_SYNC, NULL);
+
+  if (res != E_OK && res != E_INVALID)
+  {
+    scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  return SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandTestUnitReady(struct MscUnit *unit)
+{
+  usbTrace("scsi: test unit ready");
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  if (unit->flags & FLAG_ATTENTION)
+  {
+    unit->flags &= ~FLAG_ATTENTION;
+
+    scsiSetSense(unit, SCSI_SK_UNIT_ATTENTION, SCSI_ASC_UA_READYTRANSITION);
+    return SCSI_ACTION_FAILURE;
+  }
+  else
+    return SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandUnmap(struct MscUnit *unit, const uint8_t *cb,
+    struct ScsiTransfer *transfer)
+{
+  const struct UnmapCommand * const command =
+      (const struct UnmapCommand *)cb;
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  if (unit->discard == MSC_DISCARD_NONE)
+  {
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDCOMMAND);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  const size_t length = fromBigEndian16(command->parameterListLength);
+
+  if (!length)
+    return SCSI_ACTION_ACK;
+
+  if (length > sizeof(struct UnmapParameterListHeader)
+      + MSC_UNMAP_DESCRIPTOR_COUNT * sizeof(struct UnmapBlockDescriptor))
+  {
+    usbTrace("scsi: unmap parameter list too long, %u bytes",
+        (unsigned int)length);
+
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDFIELDINCBA);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  transfer->length = length;
+  return SCSI_ACTION_PARAMETERS;
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandVerify(struct MscUnit *unit, const uint8_t *cb)
+{
+  const struct Verify10Command * const command =
+      (const struct Verify10Command *)cb;
+
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  if ((command->flags & VERIFY10_BYTCHK_MASK) != 0)
+  {
+    usbTrace("scsi: incorrect verify command flags 0x%02X", command->flags);
+
+    scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDFIELDINCBA);
+    return SCSI_ACTION_FAILURE;
+  }
+
+  const uint32_t logicalBlockAddress =
+      fromBigEndian32(command->logicalBlockAddress);
+  const uint16_t numberOfBlocks =
+      fromBigEndian16(command->verificationLength);
+  struct ScsiTransfer transfer;
+
+  usbTrace("scsi: verify command, start block %"PRIu32", count %"PRIu16,
+      logicalBlockAddress, numberOfBlocks);
+
+  return setupStorageTransfer(unit, logicalBlockAddress, numberOfBlocks,
+      &transfer);
+}
+/*----------------------------------------------------------------------------*/
+static enum ScsiAction commandWrite(struct MscUnit *unit, const uint8_t *cb,
+    struct ScsiTransfer *transfer)
+{
+  if (!isUnitReady(unit))
+    return SCSI_ACTION_FAILURE;
+
+  uint64_t logicalBlockAddress = 0;
+  uint32_t numberOfBlocks = 0;
+
+  switch (cb[0])
+  {
+    case SCSI_WRITE6:
+    {
+      const struct Write6Command * const command =
+          (const struct Write6Command *)cb;
+
+      logicalBlockAddress =
+          fromBigEndian24(command->logicalBlockAddress, READ6_LBA_MASK);
+      numberOfBlocks = !command->transferLength ? 256 : command->transferLength;
+      break;
+    }
+
+    case SCSI_WRITE10:
+    {
+      const struct Write10Command * const command =
+          (const struct Write10Command *)cb;
+
+      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
+      numberOfBlocks = fromBigEndian16(command->transferLength);
+      break;
+    }
+
+    case SCSI_WRITE12:
+    {
+      const struct Write12Command * const command =
+          (const struct Write12Command *)cb;
+
+      logicalBlockAddress = fromBigEndian32(command->logicalBlockAddress);
+      numberOfBlocks = fromBigEndian32(command->transferLength);
+      break;
+    }
+
+    case SCSI_WRITE16:
+    {
+      const struct Write16Command * const command =
+          (const struct Write16Command *)cb;
+
+      logicalBlockAddress = fromBigEndian64(command->logicalBlockAddress);
+      numberOfBlocks = fromBigEndian32(command->transferLength);
+      break;
+    }
+  }
+
+  if (setupStorageTransfer(unit, logicalBlockAddress, numberOfBlocks,
+      transfer) != SCSI_ACTION_ACK)
+  {
+    return SCSI_ACTION_FAILURE;
+  }
+
+  usbTrace("scsi: write command, start block %"PRIu64", count %"PRIu32,
+      logicalBlockAddress, numberOfBlocks);
+
+  return transfer->length ? SCSI_ACTION_WRITE : SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Process SCSI command.
+ * @param unit Pointer to a logical unit addressed by the command or NULL
+ * when the logical unit is not supported.
+ * @param cb Command descriptor block.
+ * @param buffer Buffer for the response, it should be large enough to hold
+ * the longest response.
+ * @param transfer Parameters of the data stage.
+ * @return Action to be performed by the transport.
+ */
+enum ScsiAction scsiProcessCommand(struct MscUnit *unit, const uint8_t *cb,
+    void *buffer, struct ScsiTransfer *transfer)
+{
+  transfer->position = 0;
+  transfer->length = 0;
+
+  switch (cb[0])
+  {
+    case SCSI_REQUEST_SENSE:
+      return commandRequestSense(unit, cb, buffer, transfer);
+
+    case SCSI_INQUIRY:
+      return commandInquiry(unit, cb, buffer, transfer);
+
+    default:
+      break;
+  }
+
+  /* Other commands are not allowed for unsupported logical units */
+  if (unit == NULL)
+    return SCSI_ACTION_FAILURE;
+
+  switch (cb[0])
+  {
+    case SCSI_TEST_UNIT_READY:
+      return commandTestUnitReady(unit);
+
+    case SCSI_MODE_SENSE6:
+    case SCSI_MODE_SENSE10:
+      return commandModeSense(unit, cb, buffer, transfer);
+
+    case SCSI_MEDIUM_REMOVAL:
+      return commandMediumRemoval(unit, cb);
+
+    case SCSI_READ_FORMAT_CAPACITIES:
+      return commandReadFormatCapacities(unit, cb, buffer, transfer);
+
+    case SCSI_READ_CAPACITY10:
+      return commandReadCapacity(unit, cb, buffer, transfer);
+
+    case SCSI_SERVICE_ACTION_IN16:
+      if ((cb[1] & READCAPACITY16_SA_MASK) == SCSI_SAI_READ_CAPACITY16)
+        return commandReadCapacity16(unit, cb, buffer, transfer);
+      break;
+
+    case SCSI_READ6:
+    case SCSI_READ10:
+    case SCSI_READ12:
+    case SCSI_READ16:
+      return commandRead(unit, cb, transfer);
+
+    case SCSI_WRITE6:
+    case SCSI_WRITE10:
+    case SCSI_WRITE12:
+    case SCSI_WRITE16:
+      return commandWrite(unit, cb, transfer);
+
+    case SCSI_VERIFY10:
+      return commandVerify(unit, cb);
+
+    case SCSI_SYNCHRONIZE_CACHE10:
+    case SCSI_SYNCHRONIZE_CACHE16:
+      return commandSynchronizeCache(unit, cb);
+
+    case SCSI_UNMAP:
+      return commandUnmap(unit, cb, transfer);
+
+    default:
+      break;
+  }
+
+  usbTrace("scsi: unsupported command 0x%02X", cb[0]);
+
+  scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDCOMMAND);
+  return SCSI_ACTION_FAILURE;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Process parameter list of a command received from the host.
+ * @param unit Pointer to a logical unit addressed by the command.
+ * @param cb Command descriptor block.
+ * @param buffer Buffer with the parameter list.
+ * @param length Length of the parameter list.
+ * @return Action to be performed by the transport, either acknowledgement
+ * or failure.
+ */
+enum ScsiAction scsiProcessParameters(struct MscUnit *unit, const uint8_t *cb,
+    const void *buffer, size_t length)
+{
+  if (cb[0] == SCSI_UNMAP)
+    return processUnmapParameters(unit, buffer, length);
+
+  scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_IR_INVALIDCOMMAND);
+  return SCSI_ACTION_FAILURE;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Discard blocks listed in the validated Unmap parameter list. Erase
+ * operations may take a long time, therefore the function should be
+ * called from a thread context after @b SCSI_ACTION_DISCARD is returned
+ * by the @b scsiProcessParameters function.
+ * @param unit Pointer to a logical unit.
+ * @param buffer Parameter list received from the host.
+ * @param length Length of the parameter list.
+ * @return @b SCSI_ACTION_ACK on success or @b SCSI_ACTION_FAILURE when
+ * the storage failed, sense data are stored in the logical unit.
+ */
+enum ScsiAction scsiDiscardBlocks(struct MscUnit *unit, const void *buffer,
+    size_t length)
+{
+  const struct UnmapBlockDescriptor * const descriptors =
+      (const struct UnmapBlockDescriptor *)((const uint8_t *)buffer
+          + sizeof(struct UnmapParameterListHeader));
+  const size_t count = getUnmapDescriptorCount(buffer, length);
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    const uint64_t logicalBlockAddress =
+        fromBigEndian64(descriptors[index].logicalBlockAddress);
+    const uint32_t numberOfBlocks =
+        fromBigEndian32(descriptors[index].numberOfBlocks);
+
+    usbTrace("scsi: unmap, start block %"PRIu64", count %"PRIu32,
+        logicalBlockAddress, numberOfBlocks);
+
+    if (discardBlocks(unit, logicalBlockAddress, numberOfBlocks) != E_OK)
+    {
+      scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
+      return SCSI_ACTION_FAILURE;
+    }
+  }
+
+  return SCSI_ACTION_ACK;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Prepare fixed format sense data and clear the pending error.
+ * @param unit Pointer to a logical unit or NULL for unsupported logical units.
+ * @param buffer Buffer for the sense data.
+ * @return Length of the sense data.
+ */
+size_t scsiGetSenseData(struct MscUnit *unit, void *buffer)
+{
+  struct RequestSenseData response;
+
+  memset(&response, 0, sizeof(response));
+  response.responseCode = 0x70;
+  response.additionalSenseLength = sizeof(struct RequestSenseData) - 8;
+
+  if (unit == NULL)
+  {
+    response.flags = SCSI_SK_ILLEGAL_REQUEST;
+    response.additionalSenseCode = (uint8_t)(SCSI_ASC_IR_INVALIDLUN >> 8);
+    response.additionalSenseCodeQualifier = (uint8_t)SCSI_ASC_IR_INVALIDLUN;
+  }
+  else
+  {
+    response.flags = unit->sense;
+    response.additionalSenseCode = (uint8_t)(unit->asc >> 8);
+    response.additionalSenseCodeQualifier = (uint8_t)unit->asc;
+
+    /* Clear error */
+    unit->sense = SCSI_SK_NO_SENSE;
+    unit->asc = SCSI_ASC_NOSENSE;
+  }
+
+  usbTrace("scsi: request sense 0x%06X", response.flags << 16
+      | response.additionalSenseCode << 8
+      | response.additionalSenseCodeQualifier);
+
+  memcpy(buffer, &response, sizeof(response));
+  return sizeof(response);
+}
+/*----------------------------------------------------------------------------*/
+void scsiSetSense(struct MscUnit *unit, uint8_t sense, uint16_t asc)
+{
+  unit->sense = sense;
+  unit->asc = asc;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Attach a storage interface to the logical unit.
+ * @param unit Pointer to a logical unit.
+ * @param interface Storage interface.
+ * @param memory Memory-mapped content of the storage or NULL. When the
+ * pointer is set, read data is sent directly from the memory, bypassing
+ * the storage interface.
+ * @return @b E_OK on success.
+ */
+enum Result scsiAttachUnit(struct MscUnit *unit,
+    const struct MscUnitConfig *config)
+{
+  uint64_t capacity;
+  const enum Result res = ifGetParam(config->interface, IF_SIZE_64,
+      &capacity);
+
+  if (res == E_OK)
+  {
+    unit->interface = config->interface;
+    unit->wq = config->wq;
+    unit->address = (uintptr_t)config->memory;
+    unit->blocks = capacity / unit->blockSize;
+    probeDiscardSupport(unit, capacity,
+        config->wq != NULL ? config->discard : MSC_DISCARD_NONE);
+    unit->sense = SCSI_SK_NO_SENSE;
+    unit->asc = SCSI_ASC_NOSENSE;
+    unit->flags = FLAG_ATTENTION;
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+void scsiDetachUnit(struct MscUnit *unit)
+{
+  unit->interface = NULL;
+  unit->wq = NULL;
+  unit->address = 0;
+  unit->blocks = 0;
+  unit->granularity = 0;
+  unit->sense = SCSI_SK_NO_SENSE;
+  unit->asc = SCSI_ASC_NOSENSE;
+  unit->flags = 0;
+  unit->discard = MSC_DISCARD_NONE;
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Initialize logical unit geometry and leave the unit detached.
+ * @param unit Pointer to a logical unit.
+ * @param logical Size of the logical block in bytes.
+ * @param physical Size of the physical block in bytes, it should be
+ * a power of two multiple of the logical block size.
+ */
+void scsiInitUnit(struct MscUnit *unit, uint16_t logical, uint16_t physical)
+{
+  uint8_t exponent = 0;
+
+  while (((uint32_t)logical << exponent) < physical)
+    ++exponent;
+
+  unit->blockSize = logical;
+  unit->exponent = exponent;
+  scsiDetachUnit(unit);
+}
@@ -21,6 +21,14 @@
 #ifdef CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
 #  define MEM_ALIGNMENT CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
 #endif
+
+/* Time constant of the fill level filter in read calls, one call per frame */
+#define FB_FILTER             (1L << 7)
+/* Inverse proportional and integral gains of the feedback controller */
+#define FB_GAIN_P             (1L << 10)
+#define FB_GAIN_I             (1L << 21)
+/* Maximum deviation of the feedback from the nominal rate, 1/32 */
+#define FB_RANGE              (1L << 11)
 /*----------------------------------------------------------------------------*/
 struct Uac
 {
@@ -49,16 +57,28 @@ struct Uac
   unsigned short sampleRateCount;
   unsigned short sampleRateIndex;
 
+  /* Stream formats, one alternate setting per format */
+  struct UacFormat formats[UAC_MAX_FORMATS];
+  uint8_t formatCount;
+
   size_t queuedRxBytes;
   size_t queuedTxBytes;
 
   /* Rate feedback multiplier in Q16.16 format */
   uint32_t feedback;
+  /* Accumulated fill level error of the feedback controller */
+  int64_t feedbackIntegral;
+  /* Filtered fill level error of the feedback controller */
+  int32_t feedbackLevel;
+  /* Feedback is calculated by the driver */
+  bool feedbackControl;
   /* Device suspended due to error or external request */
   bool suspended;
 
   struct
   {
+    /* Stream format changed */
+    bool format;
     /* Sample Rate changed */
     bool rate;
     /* Start of Frame received */
@@ -74,13 +94,20 @@ static void feedbackDataSent(void *, struct UsbRequest *,
     enum UsbRequestStatus);
 
 static void *allocBufferMemory(size_t, size_t, size_t, size_t, size_t *);
-static inline size_t getBufferSize(uint32_t);
 static inline size_t getFeedbackBufferSize(void);
-static inline size_t getMaxBufferSize(uint32_t);
+static inline size_t getFrameSize(const struct UacFormat *);
+static inline size_t getMaxBufferSize(uint32_t, size_t);
+static size_t getMaxFrameSize(const struct Uac *);
 static uint32_t getMaxSampleRate(const struct Uac *);
+static inline size_t getPacketSamples(uint32_t);
+static bool enableRxEndpoint(struct Uac *);
+static void enableTxEndpoint(struct Uac *);
+static bool parseFormats(struct Uac *, const struct UacFormat *, size_t);
 static bool parseSampleRates(struct Uac *, const uint32_t *);
 static bool resetEndpoints(struct Uac *);
+static void resetRateFeedback(struct Uac *);
 static bool sendRateFeedback(struct Uac *);
+static void updateRateFeedback(struct Uac *);
 /*----------------------------------------------------------------------------*/
 static enum Result interfaceInit(void *, const void *);
 static void interfaceDeinit(void *);
@@ -163,6 +190,58 @@ static void feedbackDataSent(void *argument, struct UsbRequest *request,
   }
 }
 /*----------------------------------------------------------------------------*/
+static bool enableRxEndpoint(struct Uac *interface)
+{
+  const size_t packetSize = uacBaseGetRxPacketSize(interface->driver);
+
+  /* Requests are returned to the queue, pending data is discarded */
+  usbEpClear(interface->rxDataEp);
+  interface->queuedRxBytes = 0;
+
+  /* Alternate Setting 0 has no isochronous bandwidth */
+  if (!packetSize)
+  {
+    usbEpDisable(interface->rxDataEp);
+    return true;
+  }
+
+  usbEpEnable(interface->rxDataEp, ENDPOINT_TYPE_ISOCHRONOUS,
+      (uint16_t)packetSize);
+
+  /* Fill OUT endpoint queue */
+  while (!pointerQueueEmpty(&interface->rxRequestQueue))
+  {
+    struct UsbRequest * const request =
+        pointerQueueFront(&interface->rxRequestQueue);
+    pointerQueuePopFront(&interface->rxRequestQueue);
+
+    if (usbEpEnqueue(interface->rxDataEp, request) != E_OK)
+    {
+      pointerQueuePushBack(&interface->rxRequestQueue, request);
+      return false;
+    }
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static void enableTxEndpoint(struct Uac *interface)
+{
+  const size_t packetSize = uacBaseGetTxPacketSize(interface->driver);
+
+  usbEpClear(interface->txDataEp);
+  interface->queuedTxBytes = 0;
+
+  /* Alternate Setting 0 has no isochronous bandwidth */
+  if (packetSize)
+  {
+    usbEpEnable(interface->txDataEp, ENDPOINT_TYPE_ISOCHRONOUS,
+        (uint16_t)packetSize);
+  }
+  else
+    usbEpDisable(interface->txDataEp);
+}
+/*----------------------------------------------------------------------------*/
 static void *allocBufferMemory(size_t requestCount, size_t audioBufferCount,
     size_t audioBufferSize, size_t feedbackBufferCount, size_t *padding)
 {
@@ -186,15 +265,6 @@ static void *allocBufferMemory(size_t requestCount, size_t audioBufferCount,
 #endif
 }
 /*----------------------------------------------------------------------------*/
-static inline size_t getBufferSize(uint32_t rate)
-{
-  /*
-   * Returns the size of the single buffer, 1 kHz isochronous packet rate,
-   * stereo configuration with S16_LE samples.
-   */
-  return ((rate + 999) / 1000) * sizeof(int16_t) * 2;
-}
-/*----------------------------------------------------------------------------*/
 static inline size_t getFeedbackBufferSize(void)
 {
 #if defined(MEM_ALIGNMENT) && MEM_ALIGNMENT >= UAC_FEEDBACK_EP_SIZE
@@ -204,9 +274,14 @@ static inline size_t getFeedbackBufferSize(void)
 #endif
 }
 /*----------------------------------------------------------------------------*/
-static inline size_t getMaxBufferSize(uint32_t rate)
+static inline size_t getFrameSize(const struct UacFormat *format)
+{
+  return (size_t)format->channels * format->size;
+}
+/*----------------------------------------------------------------------------*/
+static inline size_t getMaxBufferSize(uint32_t rate, size_t frame)
 {
-  size_t size = getBufferSize(rate);
+  size_t size = getPacketSamples(rate) * frame;
 
 #ifdef MEM_ALIGNMENT
   size += MEM_ALIGNMENT - 1;
@@ -216,6 +291,21 @@ static inline size_t getMaxBufferSize(uint32_t rate)
   return size;
 }
 /*----------------------------------------------------------------------------*/
+static size_t getMaxFrameSize(const struct Uac *interface)
+{
+  size_t maxFrameSize = 0;
+
+  for (size_t index = 0; index < interface->formatCount; ++index)
+  {
+    const size_t frameSize = getFrameSize(&interface->formats[index]);
+
+    if (frameSize > maxFrameSize)
+      maxFrameSize = frameSize;
+  }
+
+  return maxFrameSize;
+}
+/*----------------------------------------------------------------------------*/
 static uint32_t getMaxSampleRate(const struct Uac *interface)
 {
   size_t maxSampleRate = 0;
@@ -229,6 +319,54 @@ static uint32_t getMaxSampleRate(const struct Uac *interface)
   return maxSampleRate;
 }
 /*----------------------------------------------------------------------------*/
+static inline size_t getPacketSamples(uint32_t rate)
+{
+  /*
+   * Returns the number of samples per channel in the single buffer,
+   * 1 kHz isochronous packet rate. One additional sample allows the host
+   * to follow the rate feedback.
+   */
+  return (rate + 999) / 1000 + 1;
+}
+/*----------------------------------------------------------------------------*/
+static bool parseFormats(struct Uac *interface,
+    const struct UacFormat *formats, size_t samples)
+{
+  static const struct UacFormat defaultFormats[] = {
+      {
+          .channels = 2,
+          .size = sizeof(int16_t),
+          .resolution = 16
+      }, {
+          .channels = 0
+      }
+  };
+
+  size_t formatCount = 0;
+
+  if (formats == NULL)
+    formats = defaultFormats;
+
+  for (const struct UacFormat *entry = formats; entry->channels; ++entry)
+  {
+    if (formatCount == UAC_MAX_FORMATS)
+      return false;
+    if (!entry->size || entry->size > sizeof(uint32_t))
+      return false;
+    if (!entry->resolution || entry->resolution > entry->size * 8)
+      return false;
+
+    /* High-bandwidth isochronous endpoints are not supported */
+    if (samples * getFrameSize(entry) > UAC_DATA_EP_SIZE_HS)
+      return false;
+
+    interface->formats[formatCount++] = *entry;
+  }
+
+  interface->formatCount = (uint8_t)formatCount;
+  return formatCount > 0;
+}
+/*----------------------------------------------------------------------------*/
 static bool parseSampleRates(struct Uac *interface, const uint32_t *rates)
 {
   size_t sampleRateCount = 0;
@@ -254,12 +392,11 @@ static bool parseSampleRates(struct Uac *interface, const uint32_t *rates)
 /*----------------------------------------------------------------------------*/
 static bool resetEndpoints(struct Uac *interface)
 {
-  const size_t maxPacketSize = uacBaseGetPacketSize(interface->driver);
   bool completed = true;
 
   interface->suspended = true;
 
-  /* Enable endpoints */
+  /* Data endpoints are sized for the selected alternate settings */
   if (interface->fbDataEp != NULL)
   {
     usbEpClear(interface->fbDataEp);
@@ -267,31 +404,9 @@ static bool resetEndpoints(struct Uac *interface)
         UAC_FEEDBACK_EP_SIZE);
   }
   if (interface->txDataEp != NULL)
-  {
-    usbEpClear(interface->txDataEp);
-    usbEpEnable(interface->txDataEp, ENDPOINT_TYPE_ISOCHRONOUS, maxPacketSize);
-  }
-
+    enableTxEndpoint(interface);
   if (interface->rxDataEp != NULL)
-  {
-    usbEpClear(interface->rxDataEp);
-    usbEpEnable(interface->rxDataEp, ENDPOINT_TYPE_ISOCHRONOUS, maxPacketSize);
-
-    /* Fill OUT endpoint queue */
-    while (!pointerQueueEmpty(&interface->rxRequestQueue))
-    {
-      struct UsbRequest * const request =
-          pointerQueueFront(&interface->rxRequestQueue);
-      pointerQueuePopFront(&interface->rxRequestQueue);
-
-      if (usbEpEnqueue(interface->rxDataEp, request) != E_OK)
-      {
-        completed = false;
-        pointerQueuePushBack(&interface->rxRequestQueue, request);
-        break;
-      }
-    }
-  }
+    completed = enableRxEndpoint(interface);
 
   if (completed)
     interface->suspended = false;
@@ -299,6 +414,15 @@ static bool resetEndpoints(struct Uac *interface)
   return completed;
 }
 /*----------------------------------------------------------------------------*/
+static void resetRateFeedback(struct Uac *interface)
+{
+  interface->feedbackIntegral = 0;
+  interface->feedbackLevel = 0;
+
+  if (interface->feedbackControl)
+    interface->feedback = 1 << 16;
+}
+/*----------------------------------------------------------------------------*/
 static bool sendRateFeedback(struct Uac *interface)
 {
   if (pointerArrayEmpty(&interface->fbRequestPool))
@@ -312,11 +436,11 @@ static bool sendRateFeedback(struct Uac *interface)
       interface->sampleRateArray[interface->sampleRateIndex];
   const uint64_t samplesPerSecondScaled =
       (uint64_t)currentSampleRate * interface->feedback;
-  const uint32_t fractionOffset = 16 + RATE_FB_MUL
-      - (hs ? RATE_FB_OFFSET_HS : RATE_FB_OFFSET);
+  /* Samples per frame at Full Speed and per microframe at High Speed */
+  const uint32_t divisor = hs ?
+      (8000 << (16 - RATE_FB_OFFSET_HS)) : (1000 << (16 - RATE_FB_OFFSET));
   const uint32_t samplesPerFrameScaled =
-      (uint32_t)((samplesPerSecondScaled * ((1 << RATE_FB_MUL) * 1000)
-          + (1 << (RATE_FB_MUL - 1))) >> fractionOffset);
+      (uint32_t)((samplesPerSecondScaled + divisor / 2) / divisor);
   IrqState state;
 
   /* Critical section */
@@ -330,11 +454,13 @@ static bool sendRateFeedback(struct Uac *interface)
   {
     /* Q16.16 format, 4 bytes */
     memcpy(request->buffer, &buffer, 4);
+    request->length = 4;
   }
   else
   {
     /* Q10.14 format, 3 bytes */
     memcpy(request->buffer, &buffer, 3);
+    request->length = 3;
   }
 
   if (usbEpEnqueue(interface->fbDataEp, request) != E_OK)
@@ -353,6 +479,44 @@ static bool sendRateFeedback(struct Uac *interface)
   return true;
 }
 /*----------------------------------------------------------------------------*/
+static void updateRateFeedback(struct Uac *interface)
+{
+  static const int64_t integralLimit = (int64_t)FB_RANGE * FB_GAIN_I;
+
+  const uint32_t rate = interface->sampleRateArray[interface->sampleRateIndex];
+  const size_t frame = getFrameSize(uacBaseGetRxFormat(interface->driver));
+  const size_t target = pointerQueueCapacity(&interface->rxRequestQueue)
+      * getPacketSamples(rate) * frame / 2;
+
+  /* Deviation of the fill level from the target in frames, Q16.16 format */
+  const int32_t sample = (int32_t)(
+      ((int64_t)interface->queuedRxBytes - (int64_t)target)
+      * ((1000L << 16) / (long)frame) / (int64_t)rate);
+
+  /* Packet granularity is suppressed with an exponential moving average */
+  const int32_t error = interface->feedbackLevel
+      + (sample - interface->feedbackLevel) / FB_FILTER;
+  interface->feedbackLevel = error;
+
+  int64_t integral = interface->feedbackIntegral + error;
+
+  if (integral > integralLimit)
+    integral = integralLimit;
+  else if (integral < -integralLimit)
+    integral = -integralLimit;
+  interface->feedbackIntegral = integral;
+
+  /* Host should slow down when the buffer level is above the target */
+  int32_t feedback = (1L << 16) - error / FB_GAIN_P
+      - (int32_t)(integral / FB_GAIN_I);
+
+  if (feedback > (1L << 16) + FB_RANGE)
+    feedback = (1L << 16) + FB_RANGE;
+  else if (feedback < (1L << 16) - FB_RANGE)
+    feedback = (1L << 16) - FB_RANGE;
+  interface->feedback = (uint32_t)feedback;
+}
+/*----------------------------------------------------------------------------*/
 static enum Result interfaceInit(void *object, const void *configBase)
 {
   const struct UacConfig * const config = configBase;
@@ -364,6 +528,11 @@ static enum Result interfaceInit(void *object, const void *configBase)
 
   if (!parseSampleRates(interface, config->rates))
     return E_VALUE;
+  if (!parseFormats(interface, config->formats,
+      getPacketSamples(getMaxSampleRate(interface))))
+  {
+    return E_VALUE;
+  }
 
   if (config->endpoints.fb)
   {
@@ -409,13 +578,18 @@ static enum Result interfaceInit(void *object, const void *configBase)
   interface->queuedRxBytes = 0;
   interface->queuedTxBytes = 0;
   interface->feedback = 1 << 16;
+  interface->feedbackIntegral = 0;
+  interface->feedbackLevel = 0;
+  interface->feedbackControl = config->feedback;
   interface->suspended = true;
+  interface->events.format = false;
   interface->events.rate = false;
   interface->events.sof = false;
 
   const uint32_t maxSampleRate = getMaxSampleRate(interface);
-  const size_t audioBufferSize = getMaxBufferSize(maxSampleRate);
-  const size_t audioPacketSize = getBufferSize(maxSampleRate);
+  const size_t maxFrameSize = getMaxFrameSize(interface);
+  const size_t audioBufferSize = getMaxBufferSize(maxSampleRate, maxFrameSize);
+  const size_t audioPacketSize = getPacketSamples(maxSampleRate) * maxFrameSize;
   const size_t fbBuffers = interface->fbDataEp != NULL ? 1 : 0;
   const size_t rxBuffers = interface->rxDataEp != NULL ? config->rxBuffers : 0;
   const size_t txBuffers = interface->txDataEp != NULL ? config->txBuffers : 0;
@@ -486,7 +660,9 @@ static enum Result interfaceInit(void *object, const void *configBase)
           .rx = config->endpoints.rx,
           .tx = config->endpoints.tx
       },
-      .packet = audioPacketSize
+      .formats = interface->formats,
+      .count = interface->formatCount,
+      .samples = getPacketSamples(maxSampleRate)
   };
 
   interface->driver = init(UacBase, &driverConfig);
@@ -557,7 +733,7 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
       {
         const size_t buffers = pointerQueueCapacity(&interface->rxRequestQueue)
             - pointerQueueSize(&interface->rxRequestQueue);
-        *(size_t *)data = buffers * uacBaseGetPacketSize(interface->driver);
+        *(size_t *)data = buffers * uacBaseGetRxPacketSize(interface->driver);
       }
       else
         *(size_t *)data = 0;
@@ -567,7 +743,7 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
       if (!interface->suspended)
       {
         const size_t buffers = pointerArraySize(&interface->txRequestPool);
-        *(size_t *)data = buffers * uacBaseGetPacketSize(interface->driver);
+        *(size_t *)data = buffers * uacBaseGetTxPacketSize(interface->driver);
       }
       else
         *(size_t *)data = 0;
@@ -588,6 +764,34 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
 
   switch ((enum UacParameter)parameter)
   {
+    case IF_UAC_FEEDBACK:
+      *(uint32_t *)data = interface->feedback;
+      return E_OK;
+
+    case IF_UAC_RX_FORMAT:
+    {
+      const struct UacFormat * const format =
+          uacBaseGetRxFormat(interface->driver);
+
+      if (format == NULL)
+        return E_IDLE;
+
+      *(uint8_t *)data = (uint8_t)(format - interface->formats);
+      return E_OK;
+    }
+
+    case IF_UAC_TX_FORMAT:
+    {
+      const struct UacFormat * const format =
+          uacBaseGetTxFormat(interface->driver);
+
+      if (format == NULL)
+        return E_IDLE;
+
+      *(uint8_t *)data = (uint8_t)(format - interface->formats);
+      return E_OK;
+    }
+
     case IF_UAC_STATUS:
     {
       uint8_t status = 0;
@@ -602,6 +806,11 @@ static enum Result interfaceGetParam(void *object, int parameter, void *data)
         interface->events.rate = false;
         status |= UAC_RATE;
       }
+      if (interface->events.format)
+      {
+        interface->events.format = false;
+        status |= UAC_FORMAT;
+      }
 
       if (interface->suspended)
       {
@@ -637,6 +846,9 @@ static enum Result interfaceSetParam(void *object, int parameter,
   switch ((enum UacParameter)parameter)
   {
     case IF_UAC_FEEDBACK:
+      if (interface->feedbackControl)
+        return E_BUSY;
+
       interface->feedback = *(const uint32_t *)data;
       return E_OK;
 
@@ -650,13 +862,21 @@ size_t interfaceRead(void *object, void *buffer, size_t length)
   struct Uac * const interface = object;
   uint8_t *bufferPosition = buffer;
 
-  assert(length >= getBufferSize(
-      interface->sampleRateArray[interface->sampleRateIndex]));
-
   if (interface->suspended || interface->rxDataEp == NULL)
     return 0;
   if (!uacBaseIsRxActive(interface->driver))
+  {
+    resetRateFeedback(interface);
     return 0;
+  }
+
+  assert(length >= getPacketSamples(
+      interface->sampleRateArray[interface->sampleRateIndex])
+      * getFrameSize(uacBaseGetRxFormat(interface->driver)));
+
+  /* Fill level is sampled before the data is consumed */
+  if (interface->feedbackControl)
+    updateRateFeedback(interface);
 
   while (!pointerQueueEmpty(&interface->rxRequestQueue))
   {
@@ -703,7 +923,7 @@ size_t interfaceWrite(void *object, const void *buffer, size_t length)
 {
   struct Uac * const interface = object;
   const uint8_t *bufferPosition = buffer;
-  const size_t maxPacketSize = uacBaseGetPacketSize(interface->driver);
+  const size_t maxPacketSize = uacBaseGetTxPacketSize(interface->driver);
 
   if (interface->suspended || interface->txDataEp == NULL)
     return 0;
@@ -759,6 +979,8 @@ void uacOnEvent(struct Uac *interface, unsigned int event)
       {
         interface->sampleRateIndex = 0;
         interface->suspended = false;
+        resetRateFeedback(interface);
+        interface->events.format = true;
         interface->events.rate = true;
         interface->events.sof = false;
         usbTrace("uac: reset completed");
@@ -785,6 +1007,30 @@ void uacOnEvent(struct Uac *interface, unsigned int event)
     interface->callback(interface->callbackArgument);
 }
 /*----------------------------------------------------------------------------*/
+void uacOnFormatSet(struct Uac *interface, bool in)
+{
+  /* Endpoint is reconfigured for the packet size of the new setting */
+  if (in)
+  {
+    if (interface->txDataEp != NULL)
+      enableTxEndpoint(interface);
+  }
+  else
+  {
+    if (interface->rxDataEp != NULL && !enableRxEndpoint(interface))
+    {
+      interface->suspended = true;
+      usbTrace("uac: suspended in format handler");
+    }
+  }
+
+  interface->events.format = true;
+  resetRateFeedback(interface);
+
+  if (interface->callback != NULL)
+    interface->callback(interface->callbackArgument);
+}
+/*----------------------------------------------------------------------------*/
 uint32_t uacOnSampleRateGet(const struct Uac *interface, size_t index)
 {
   return (index < interface->sampleRateCount) ?
@@ -804,6 +1050,7 @@ bool uacOnSampleRateSet(struct Uac *interface, uint32_t rate)
     {
       interface->events.rate = true;
       interface->sampleRateIndex = index;
+      resetRateFeedback(interface);
 
       if (interface->callback != NULL)
         interface->callback(interface->callbackArgument);
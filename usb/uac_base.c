@@ -7,12 +7,52 @@
 #include <halm/usb/uac.h>
 #include <halm/usb/uac_base.h>
 #include <halm/usb/uac_defs.h>
+#include <halm/usb/usb_control_defs.h>
 #include <halm/usb/usb_defs.h>
 #include <halm/usb/usb_trace.h>
 #include <xcore/memory.h>
 #include <assert.h>
 #include <string.h>
 /*----------------------------------------------------------------------------*/
+#define DEFINE_SETTING_DESCRIPTORS(setting) \
+    static void inStreamInterfaceAlt##setting##Descriptor(const void *object, \
+        struct UsbDescriptor *header, void *payload) \
+    { \
+      streamInterfaceDescriptor(object, true, setting, header, payload); \
+    } \
+    static void inAudioStreamingInterface##setting##Descriptor( \
+        const void *object, struct UsbDescriptor *header, void *payload) \
+    { \
+      audioStreamingInterfaceDescriptor(object, true, setting, header, \
+          payload); \
+    } \
+    static void inStreamEndpoint##setting##Descriptor(const void *object, \
+        struct UsbDescriptor *header, void *payload) \
+    { \
+      streamEndpointDescriptor(object, true, setting, header, payload); \
+    } \
+    static void outStreamInterfaceAlt##setting##Descriptor(const void *object, \
+        struct UsbDescriptor *header, void *payload) \
+    { \
+      streamInterfaceDescriptor(object, false, setting, header, payload); \
+    } \
+    static void outAudioStreamingInterface##setting##Descriptor( \
+        const void *object, struct UsbDescriptor *header, void *payload) \
+    { \
+      audioStreamingInterfaceDescriptor(object, false, setting, header, \
+          payload); \
+    } \
+    static void outStreamEndpoint##setting##Descriptor(const void *object, \
+        struct UsbDescriptor *header, void *payload) \
+    { \
+      streamEndpointDescriptor(object, false, setting, header, payload); \
+    } \
+    static void audioFormat##setting##Descriptor(const void *object, \
+        struct UsbDescriptor *header, void *payload) \
+    { \
+      audioFormatDescriptor(object, setting, header, payload); \
+    }
+/*----------------------------------------------------------------------------*/
 enum
 {
   UNIT_CLOCK_SOURCE         = 0x01,
@@ -33,8 +73,17 @@ struct UacBase
   /* USB peripheral */
   struct UsbDevice *device;
 
-  /* Maximum packet size in bytes for 1 kHz frame rate */
-  uint16_t maxPacketSize;
+  /* Stream formats */
+  const struct UacFormat *formats;
+  /* Maximum number of samples per channel in a packet */
+  uint16_t samples;
+  /* Number of stream formats */
+  uint8_t count;
+
+  /* Format indices of alternate settings, starting from setting 1 */
+  uint8_t settings[UAC_MAX_FORMATS];
+  /* Number of alternate settings with streaming endpoints */
+  uint8_t settingCount;
 
   /* Addresses of endpoints */
   struct
@@ -49,20 +98,27 @@ struct UacBase
   /* Speed of the USB interface */
   enum UsbSpeed speed;
 
-  /* Alternate Setting 1 is activated for input path */
-  bool rxActive;
-  /* Alternate Setting 1 is activated for output path */
-  bool txActive;
+  /* Active alternate setting of the output path or zero */
+  uint8_t rxSetting;
+  /* Active alternate setting of the input path or zero */
+  uint8_t txSetting;
 
   /* Enable input path */
   bool in;
   /* Enable output path */
   bool out;
 
-  UsbDescriptorFunctor table[26];
+  UsbDescriptorFunctor table[15 + UAC_MAX_FORMATS * 11];
 };
 /*----------------------------------------------------------------------------*/
 static void buildDescriptorTable(struct UacBase *);
+static uint32_t getChannelConfig(uint8_t);
+static size_t getConfigLength(const struct UacBase *, size_t);
+static const struct UacFormat *getFormat(const struct UacBase *, uint8_t);
+static size_t getFormatPacketSize(const struct UacBase *,
+    const struct UacFormat *);
+static uint8_t getMaxChannels(const struct UacBase *);
+static void updateStreamSettings(struct UacBase *);
 /*----------------------------------------------------------------------------*/
 static void interfaceAssociationDescriptor(const void *, struct UsbDescriptor *,
     void *);
@@ -88,33 +144,83 @@ static void outFeatureUnitDescriptor(const void *, struct UsbDescriptor *,
 static void outOutputTerminalDescriptor(const void *, struct UsbDescriptor *,
     void *);
 
-static void inStreamInterfaceAlt0Descriptor(const void *,
+static void audioFormatDescriptor(const struct UacBase *, uint8_t,
     struct UsbDescriptor *, void *);
-static void inStreamInterfaceAlt1Descriptor(const void *,
+static void audioStreamingInterfaceDescriptor(const struct UacBase *, bool,
+    uint8_t, struct UsbDescriptor *, void *);
+static void streamEndpointDescriptor(const struct UacBase *, bool, uint8_t,
     struct UsbDescriptor *, void *);
-static void inAudioStreamingInterfaceDescriptor(const void *,
+static void streamInterfaceDescriptor(const struct UacBase *, bool, uint8_t,
+    struct UsbDescriptor *, void *);
+
+static void inStreamInterfaceAlt0Descriptor(const void *,
     struct UsbDescriptor *, void *);
-static void inAudioFormatDescriptor(const void *, struct UsbDescriptor *,
-    void *);
-static void inStreamEndpointDescriptor(const void *, struct UsbDescriptor *,
-    void *);
 static void inStreamEndpointCSDescriptor(const void *, struct UsbDescriptor *,
     void *);
 
 static void outStreamInterfaceAlt0Descriptor(const void *,
     struct UsbDescriptor *, void *);
-static void outStreamInterfaceAlt1Descriptor(const void *,
-    struct UsbDescriptor *, void *);
-static void outAudioStreamingInterfaceDescriptor(const void *,
-    struct UsbDescriptor *, void *);
-static void outAudioFormatDescriptor(const void *, struct UsbDescriptor *,
-    void *);
-static void outStreamEndpointDescriptor(const void *, struct UsbDescriptor *,
-    void *);
 static void outStreamEndpointCSDescriptor(const void *, struct UsbDescriptor *,
     void *);
 static void outStreamEndpointDescriptorFB(const void *, struct UsbDescriptor *,
     void *);
+
+DEFINE_SETTING_DESCRIPTORS(1)
+DEFINE_SETTING_DESCRIPTORS(2)
+DEFINE_SETTING_DESCRIPTORS(3)
+DEFINE_SETTING_DESCRIPTORS(4)
+
+/* Interface, class-specific interface, format and endpoint descriptors */
+static const UsbDescriptorFunctor inSettingDescriptors[][4] = {
+    {
+        inStreamInterfaceAlt1Descriptor,
+        inAudioStreamingInterface1Descriptor,
+        audioFormat1Descriptor,
+        inStreamEndpoint1Descriptor
+    }, {
+        inStreamInterfaceAlt2Descriptor,
+        inAudioStreamingInterface2Descriptor,
+        audioFormat2Descriptor,
+        inStreamEndpoint2Descriptor
+    }, {
+        inStreamInterfaceAlt3Descriptor,
+        inAudioStreamingInterface3Descriptor,
+        audioFormat3Descriptor,
+        inStreamEndpoint3Descriptor
+    }, {
+        inStreamInterfaceAlt4Descriptor,
+        inAudioStreamingInterface4Descriptor,
+        audioFormat4Descriptor,
+        inStreamEndpoint4Descriptor
+    }
+};
+
+static const UsbDescriptorFunctor outSettingDescriptors[][4] = {
+    {
+        outStreamInterfaceAlt1Descriptor,
+        outAudioStreamingInterface1Descriptor,
+        audioFormat1Descriptor,
+        outStreamEndpoint1Descriptor
+    }, {
+        outStreamInterfaceAlt2Descriptor,
+        outAudioStreamingInterface2Descriptor,
+        audioFormat2Descriptor,
+        outStreamEndpoint2Descriptor
+    }, {
+        outStreamInterfaceAlt3Descriptor,
+        outAudioStreamingInterface3Descriptor,
+        audioFormat3Descriptor,
+        outStreamEndpoint3Descriptor
+    }, {
+        outStreamInterfaceAlt4Descriptor,
+        outAudioStreamingInterface4Descriptor,
+        audioFormat4Descriptor,
+        outStreamEndpoint4Descriptor
+    }
+};
+
+static_assert(ARRAY_SIZE(inSettingDescriptors) == UAC_MAX_FORMATS,
+    "Incorrect descriptor table size");
 /*----------------------------------------------------------------------------*/
 static enum Result handleCommonInterfaceRequest(struct UacBase *,
     const struct UsbSetupPacket *, void *, uint16_t *);
@@ -167,30 +273,182 @@ static void buildDescriptorTable(struct UacBase *driver)
   if (driver->in)
   {
     *entry++ = inStreamInterfaceAlt0Descriptor;
-    *entry++ = inStreamInterfaceAlt1Descriptor;
-    *entry++ = inAudioStreamingInterfaceDescriptor;
-    *entry++ = inAudioFormatDescriptor;
-    *entry++ = inStreamEndpointDescriptor;
-    *entry++ = inStreamEndpointCSDescriptor;
+
+    for (size_t setting = 0; setting < driver->settingCount; ++setting)
+    {
+      memcpy(entry, inSettingDescriptors[setting],
+          sizeof(inSettingDescriptors[setting]));
+      entry += ARRAY_SIZE(inSettingDescriptors[setting]);
+
+      *entry++ = inStreamEndpointCSDescriptor;
+    }
   }
 
   if (driver->out)
   {
     *entry++ = outStreamInterfaceAlt0Descriptor;
-    *entry++ = outStreamInterfaceAlt1Descriptor;
-    *entry++ = outAudioStreamingInterfaceDescriptor;
-    *entry++ = outAudioFormatDescriptor;
-    *entry++ = outStreamEndpointDescriptor;
-    *entry++ = outStreamEndpointCSDescriptor;
 
-    if (driver->endpoints.fb)
-      *entry++ = outStreamEndpointDescriptorFB;
+    for (size_t setting = 0; setting < driver->settingCount; ++setting)
+    {
+      memcpy(entry, outSettingDescriptors[setting],
+          sizeof(outSettingDescriptors[setting]));
+      entry += ARRAY_SIZE(outSettingDescriptors[setting]);
+
+      *entry++ = outStreamEndpointCSDescriptor;
+
+      if (driver->endpoints.fb)
+        *entry++ = outStreamEndpointDescriptorFB;
+    }
   }
 
   assert((size_t)(entry - driver->table) < ARRAY_SIZE(driver->table));
   *entry = NULL;
 }
 /*----------------------------------------------------------------------------*/
+static uint32_t getChannelConfig(uint8_t channels)
+{
+  static const uint32_t STEREO = AUDIO_CHANNEL_L | AUDIO_CHANNEL_R;
+  static const uint32_t QUAD = STEREO | AUDIO_CHANNEL_LS | AUDIO_CHANNEL_RS;
+  static const uint32_t SURROUND_5_1 = QUAD | AUDIO_CHANNEL_C
+      | AUDIO_CHANNEL_LFE;
+  static const uint32_t SURROUND_7_1 = SURROUND_5_1 | AUDIO_CHANNEL_SL
+      | AUDIO_CHANNEL_SR;
+
+  /* Other channel counts have no predefined spatial locations */
+  switch (channels)
+  {
+    case 2:
+      return STEREO;
+
+    case 4:
+      return QUAD;
+
+    case 6:
+      return SURROUND_5_1;
+
+    case 8:
+      return SURROUND_7_1;
+
+    default:
+      return AUDIO_CHANNEL_M;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static size_t getConfigLength(const struct UacBase *driver, size_t settings)
+{
+  static const size_t settingLength =
+      /* streamInterfaceDescriptor */
+      sizeof(struct UsbInterfaceDescriptor)
+      /* audioStreamingInterfaceDescriptor */
+      + sizeof(struct AudioStreamingInterfaceDescriptor)
+      /* audioFormatDescriptor */
+      + sizeof(struct AudioTypeIFormatDescriptor)
+      /* streamEndpointDescriptor */
+      + sizeof(struct UsbEndpointDescriptor)
+      /* Class-specific endpoint descriptor */
+      + sizeof(struct ClassSpecificAudioDataEndpointDescriptor);
+
+  size_t length = sizeof(struct UsbConfigurationDescriptor)
+      /* interfaceAssociationDescriptor */
+      + sizeof(struct UsbInterfaceAssociationDescriptor)
+      /* controlInterfaceDescriptor */
+      + sizeof(struct UsbInterfaceDescriptor)
+      /* controlInterfaceCSDescriptor */
+      + sizeof(struct AudioControlInterface)
+      /* clockSourceDescriptor */
+      + sizeof(struct AudioClockSourceDescriptor);
+
+  if (driver->in)
+  {
+    length +=
+        /* inInputTerminalDescriptor */
+        sizeof(struct AudioInputTerminalDescriptor)
+        /* inFeatureUnitDescriptor */
+        + sizeof(struct AudioFeatureUnitDescriptorCH0)
+        /* inOutputTerminalDescriptor */
+        + sizeof(struct AudioOutputTerminalDescriptor)
+        /* inStreamInterfaceAlt0Descriptor */
+        + sizeof(struct UsbInterfaceDescriptor)
+        /* Descriptors of each alternate setting */
+        + settings * settingLength;
+  }
+  if (driver->out)
+  {
+    length +=
+        /* outInputTerminalDescriptor */
+        sizeof(struct AudioInputTerminalDescriptor)
+        /* outFeatureUnitDescriptor */
+        + sizeof(struct AudioFeatureUnitDescriptorCH0)
+        /* outOutputTerminalDescriptor */
+        + sizeof(struct AudioOutputTerminalDescriptor)
+        /* outStreamInterfaceAlt0Descriptor */
+        + sizeof(struct UsbInterfaceDescriptor)
+        /* Descriptors of each alternate setting */
+        + settings * settingLength;
+
+    if (driver->endpoints.fb)
+    {
+      /* outStreamEndpointDescriptorFB */
+      length += settings * sizeof(struct UsbEndpointDescriptor);
+    }
+  }
+
+  return length;
+}
+/*----------------------------------------------------------------------------*/
+static const struct UacFormat *getFormat(const struct UacBase *driver,
+    uint8_t setting)
+{
+  assert(setting <= driver->settingCount);
+
+  if (setting)
+    return &driver->formats[driver->settings[setting - 1]];
+  else
+    return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static size_t getFormatPacketSize(const struct UacBase *driver,
+    const struct UacFormat *format)
+{
+  if (format != NULL)
+    return (size_t)driver->samples * format->channels * format->size;
+  else
+    return 0;
+}
+/*----------------------------------------------------------------------------*/
+static uint8_t getMaxChannels(const struct UacBase *driver)
+{
+  uint8_t channels = 0;
+
+  for (uint8_t setting = 1; setting <= driver->settingCount; ++setting)
+  {
+    const struct UacFormat * const format = getFormat(driver, setting);
+
+    if (format->channels > channels)
+      channels = format->channels;
+  }
+
+  return channels;
+}
+/*----------------------------------------------------------------------------*/
+static void updateStreamSettings(struct UacBase *driver)
+{
+  const size_t limit = driver->speed == USB_HS ?
+      UAC_DATA_EP_SIZE_HS : UAC_DATA_EP_SIZE;
+  uint8_t count = 0;
+
+  /* Formats exceeding the bandwidth of the current speed are not reported */
+  for (uint8_t index = 0; index < driver->count; ++index)
+  {
+    if (getFormatPacketSize(driver, &driver->formats[index]) <= limit)
+      driver->settings[count++] = index;
+    else
+      usbTrace("uac: format %u is not supported", index);
+  }
+
+  driver->settingCount = count;
+}
+/*----------------------------------------------------------------------------*/
 static void interfaceAssociationDescriptor(const void *object,
     struct UsbDescriptor *header, void *payload)
 {
@@ -260,82 +518,18 @@ static void configDescriptor(const void *object, struct UsbDescriptor *header,
 
   if (payload)
   {
-    struct UsbConfigurationDescriptor descriptor = {
+    const struct UsbConfigurationDescriptor descriptor = {
         .length = sizeof(struct UsbConfigurationDescriptor),
         .descriptorType = DESCRIPTOR_TYPE_CONFIGURATION,
-        .totalLength = sizeof(struct UsbConfigurationDescriptor)
-            /* interfaceAssociationDescriptor */
-            + sizeof(struct UsbInterfaceAssociationDescriptor)
-            /* controlInterfaceDescriptor */
-            + sizeof(struct UsbInterfaceDescriptor)
-            /* controlInterfaceCSDescriptor */
-            + sizeof(struct AudioControlInterface)
-            /* clockSourceDescriptor */
-            + sizeof(struct AudioClockSourceDescriptor),
-
-        .numInterfaces = 1,
+        .totalLength = toLittleEndian16(
+            (uint16_t)getConfigLength(driver, driver->settingCount)),
+        .numInterfaces = 1 + (driver->in ? 1 : 0) + (driver->out ? 1 : 0),
         .configurationValue = 1,
         .configuration = 0,
         .attributes = 0,
         .maxPower = 0
     };
 
-    if (driver->in)
-    {
-      ++descriptor.numInterfaces;
-
-      descriptor.totalLength +=
-          /* inInputTerminalDescriptor */
-          sizeof(struct AudioInputTerminalDescriptor)
-          /* inFeatureUnitDescriptor */
-          + sizeof(struct AudioFeatureUnitDescriptorCH0)
-          /* inOutputTerminalDescriptor */
-          + sizeof(struct AudioOutputTerminalDescriptor)
-          /* inStreamInterfaceAlt0Descriptor */
-          + sizeof(struct UsbInterfaceDescriptor)
-          /* inStreamInterfaceAlt1Descriptor */
-          + sizeof(struct UsbInterfaceDescriptor)
-          /* inAudioStreamingInterfaceDescriptor */
-          + sizeof(struct AudioStreamingInterfaceDescriptor)
-          /* inAudioFormatDescriptor */
-          + sizeof(struct AudioTypeIFormatDescriptor)
-          /* inStreamEndpointDescriptor */
-          + sizeof(struct UsbEndpointDescriptor)
-          /* inStreamEndpointCSDescriptor */
-          + sizeof(struct ClassSpecificAudioDataEndpointDescriptor);
-    }
-    if (driver->out)
-    {
-      ++descriptor.numInterfaces;
-
-      descriptor.totalLength +=
-          /* outInputTerminalDescriptor */
-          sizeof(struct AudioInputTerminalDescriptor)
-          /* outFeatureUnitDescriptor */
-          + sizeof(struct AudioFeatureUnitDescriptorCH0)
-          /* outOutputTerminalDescriptor */
-          + sizeof(struct AudioOutputTerminalDescriptor)
-          /* outStreamInterfaceAlt0Descriptor */
-          + sizeof(struct UsbInterfaceDescriptor)
-          /* outStreamInterfaceAlt1Descriptor */
-          + sizeof(struct UsbInterfaceDescriptor)
-          /* outAudioStreamingInterfaceDescriptor */
-          + sizeof(struct AudioStreamingInterfaceDescriptor)
-          /* outAudioFormatDescriptor */
-          + sizeof(struct AudioTypeIFormatDescriptor)
-          /* outStreamEndpointDescriptor */
-          + sizeof(struct UsbEndpointDescriptor)
-          /* outStreamEndpointCSDescriptor */
-          + sizeof(struct ClassSpecificAudioDataEndpointDescriptor);
-
-      if (driver->endpoints.fb)
-      {
-        /* outStreamEndpointDescriptorFB */
-        descriptor.totalLength += sizeof(struct UsbEndpointDescriptor);
-      }
-    }
-
-    descriptor.totalLength = toLittleEndian16(descriptor.totalLength);
     memcpy(payload, &descriptor, sizeof(descriptor));
   }
 }
@@ -440,15 +634,18 @@ static void clockSourceDescriptor(const void *, struct UsbDescriptor *header,
   }
 }
 /*----------------------------------------------------------------------------*/
-static void inInputTerminalDescriptor(const void *,
+static void inInputTerminalDescriptor(const void *object,
     struct UsbDescriptor *header, void *payload)
 {
+  const struct UacBase * const driver = object;
+
   header->length = sizeof(struct AudioInputTerminalDescriptor);
   header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
 
   if (payload)
   {
-    static const struct AudioInputTerminalDescriptor descriptor = {
+    const uint8_t channels = getMaxChannels(driver);
+    const struct AudioInputTerminalDescriptor descriptor = {
         .length = sizeof(struct AudioInputTerminalDescriptor),
         .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
         .descriptorSubType = AUDIO_CS_CONTROL_DESCRIPTOR_SUBTYPE_INPUT_TERMINAL,
@@ -457,8 +654,8 @@ static void inInputTerminalDescriptor(const void *,
         .terminalType = TO_LITTLE_ENDIAN_16(AUDIO_TERMINAL_MICROPHONE),
         .assocTerminal = 0,
         .cSourceID = UNIT_CLOCK_SOURCE,
-        .nrChannels = 2,
-        .channelConfig = TO_LITTLE_ENDIAN_32(AUDIO_CHANNEL_L | AUDIO_CHANNEL_R),
+        .nrChannels = channels,
+        .channelConfig = toLittleEndian32(getChannelConfig(channels)),
         .channelNames = 0,
         .controls = 0,
         .terminal = 0
@@ -519,15 +716,18 @@ static void inOutputTerminalDescriptor(const void *,
   }
 }
 /*----------------------------------------------------------------------------*/
-static void outInputTerminalDescriptor(const void *,
+static void outInputTerminalDescriptor(const void *object,
     struct UsbDescriptor *header, void *payload)
 {
+  const struct UacBase * const driver = object;
+
   header->length = sizeof(struct AudioInputTerminalDescriptor);
   header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
 
   if (payload)
   {
-    static const struct AudioInputTerminalDescriptor descriptor = {
+    const uint8_t channels = getMaxChannels(driver);
+    const struct AudioInputTerminalDescriptor descriptor = {
         .length = sizeof(struct AudioInputTerminalDescriptor),
         .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
         .descriptorSubType = AUDIO_CS_CONTROL_DESCRIPTOR_SUBTYPE_INPUT_TERMINAL,
@@ -536,8 +736,8 @@ static void outInputTerminalDescriptor(const void *,
         .terminalType = TO_LITTLE_ENDIAN_16(AUDIO_TERMINAL_USB_STREAMING),
         .assocTerminal = 0,
         .cSourceID = UNIT_CLOCK_SOURCE,
-        .nrChannels = 2,
-        .channelConfig = TO_LITTLE_ENDIAN_32(AUDIO_CHANNEL_L | AUDIO_CHANNEL_R),
+        .nrChannels = channels,
+        .channelConfig = toLittleEndian32(getChannelConfig(channels)),
         .channelNames = 0,
         .controls = 0,
         .terminal = 0
@@ -598,77 +798,49 @@ static void outOutputTerminalDescriptor(const void *,
   }
 }
 /*----------------------------------------------------------------------------*/
-static void inStreamInterfaceAlt0Descriptor(const void *object,
-    struct UsbDescriptor *header, void *payload)
+static void audioFormatDescriptor(const struct UacBase *driver,
+    uint8_t setting, struct UsbDescriptor *header, void *payload)
 {
-  const struct UacBase * const driver = object;
-
-  header->length = sizeof(struct UsbInterfaceDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
+  header->length = sizeof(struct AudioTypeIFormatDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
 
   if (payload)
   {
-    const struct UsbInterfaceDescriptor descriptor = {
-        .length = sizeof(struct UsbInterfaceDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
-        .interfaceNumber = driver->controlInterfaceIndex + 1,
-        .alternateSettings = 0,
-        .numEndpoints = 0,
-        .interfaceClass = USB_CLASS_AUDIO,
-        .interfaceSubClass = AUDIO_SUBCLASS_AUDIOSTREAMING,
-        .interfaceProtocol = AUDIO_PROTOCOL_IP_VERSION_02_00,
-        .interface = 0
-    };
-
-    memcpy(payload, &descriptor, sizeof(descriptor));
-  }
-}
-/*----------------------------------------------------------------------------*/
-static void inStreamInterfaceAlt1Descriptor(const void *object,
-    struct UsbDescriptor *header, void *payload)
-{
-  const struct UacBase * const driver = object;
-
-  header->length = sizeof(struct UsbInterfaceDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
+    const struct UacFormat * const format = getFormat(driver, setting);
+    const struct AudioTypeIFormatDescriptor descriptor = {
+        .length = sizeof(struct AudioTypeIFormatDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+        .descriptorSubType = AUDIO_CS_STREAMING_DESCRIPTOR_SUBTYPE_FORMAT_TYPE,
 
-  if (payload)
-  {
-    const struct UsbInterfaceDescriptor descriptor = {
-        .length = sizeof(struct UsbInterfaceDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
-        .interfaceNumber = driver->controlInterfaceIndex + 1,
-        .alternateSettings = 1,
-        .numEndpoints = 1,
-        .interfaceClass = USB_CLASS_AUDIO,
-        .interfaceSubClass = AUDIO_SUBCLASS_AUDIOSTREAMING,
-        .interfaceProtocol = AUDIO_PROTOCOL_IP_VERSION_02_00,
-        .interface = 0
+        .formatType = AUDIO_FORMAT_TYPE_I,
+        .subSlotSize = format->size,
+        .bitResolution = format->resolution
     };
 
     memcpy(payload, &descriptor, sizeof(descriptor));
   }
 }
 /*----------------------------------------------------------------------------*/
-static void inAudioStreamingInterfaceDescriptor(const void *,
-    struct UsbDescriptor *header, void *payload)
+static void audioStreamingInterfaceDescriptor(const struct UacBase *driver,
+    bool in, uint8_t setting, struct UsbDescriptor *header, void *payload)
 {
   header->length = sizeof(struct AudioStreamingInterfaceDescriptor);
   header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
 
   if (payload)
   {
+    const struct UacFormat * const format = getFormat(driver, setting);
     const struct AudioStreamingInterfaceDescriptor descriptor = {
         .length = sizeof(struct AudioStreamingInterfaceDescriptor),
         .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
         .descriptorSubType = AUDIO_CS_STREAMING_DESCRIPTOR_SUBTYPE_GENERAL,
 
-        .terminalLink = UNIT_IN_OUTPUT_TERMINAL,
+        .terminalLink = in ? UNIT_IN_OUTPUT_TERMINAL : UNIT_OUT_INPUT_TERMINAL,
         .controls = 0,
         .formatType = AUDIO_FORMAT_TYPE_I,
         .formats = TO_LITTLE_ENDIAN_32(AUDIO_FORMAT_TYPE_I_PCM),
-        .nrChannels = 2,
-        .channelConfig = TO_LITTLE_ENDIAN_32(AUDIO_CHANNEL_L | AUDIO_CHANNEL_R),
+        .nrChannels = format->channels,
+        .channelConfig = toLittleEndian32(getChannelConfig(format->channels)),
         .channelNames = 0
     };
 
@@ -676,45 +848,23 @@ static void inAudioStreamingInterfaceDescriptor(const void *,
   }
 }
 /*----------------------------------------------------------------------------*/
-static void inAudioFormatDescriptor(const void *, struct UsbDescriptor *header,
-    void *payload)
-{
-  header->length = sizeof(struct AudioTypeIFormatDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
-
-  if (payload)
-  {
-    const struct AudioTypeIFormatDescriptor descriptor = {
-        .length = sizeof(struct AudioTypeIFormatDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
-        .descriptorSubType = AUDIO_CS_STREAMING_DESCRIPTOR_SUBTYPE_FORMAT_TYPE,
-
-        .formatType = AUDIO_FORMAT_TYPE_I,
-        .subSlotSize = 2, // TODO From bit resolution
-        .bitResolution = 16
-    };
-
-    memcpy(payload, &descriptor, sizeof(descriptor));
-  }
-}
-/*----------------------------------------------------------------------------*/
-static void inStreamEndpointDescriptor(const void *object,
-    struct UsbDescriptor *header, void *payload)
+static void streamEndpointDescriptor(const struct UacBase *driver, bool in,
+    uint8_t setting, struct UsbDescriptor *header, void *payload)
 {
-  const struct UacBase * const driver = object;
-
   header->length = sizeof(struct UsbEndpointDescriptor);
   header->descriptorType = DESCRIPTOR_TYPE_ENDPOINT;
 
   if (payload)
   {
+    const size_t packetSize =
+        getFormatPacketSize(driver, getFormat(driver, setting));
     const struct UsbEndpointDescriptor descriptor = {
         .length = sizeof(struct UsbEndpointDescriptor),
         .descriptorType = DESCRIPTOR_TYPE_ENDPOINT,
-        .endpointAddress = driver->endpoints.tx,
+        .endpointAddress = in ? driver->endpoints.tx : driver->endpoints.rx,
         .attributes = ENDPOINT_DESCRIPTOR_TYPE(ENDPOINT_TYPE_ISOCHRONOUS)
-            | ENDPOINT_DESCRIPTOR_ASYNC,
-        .maxPacketSize = toLittleEndian16(driver->maxPacketSize),
+            | ENDPOINT_DESCRIPTOR_ASYNC, // TODO Adaptive mode for output
+        .maxPacketSize = toLittleEndian16((uint16_t)packetSize),
         /* Interval is 2 ^ (4 - 1) microframes for HS devices */
         .interval = usbDevGetSpeed(driver->device) == USB_HS ? 4 : 1
     };
@@ -723,59 +873,9 @@ static void inStreamEndpointDescriptor(const void *object,
   }
 }
 /*----------------------------------------------------------------------------*/
-static void inStreamEndpointCSDescriptor(const void *,
-    struct UsbDescriptor *header, void *payload)
-{
-  header->length = sizeof(struct ClassSpecificAudioDataEndpointDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_CS_ENDPOINT;
-
-  if (payload)
-  {
-    const struct ClassSpecificAudioDataEndpointDescriptor descriptor = {
-        .length = sizeof(struct ClassSpecificAudioDataEndpointDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_CS_ENDPOINT,
-        .descriptorSubType = AUDIO_CS_ENDPOINT_DESCRIPTOR_SUBTYPE_GENERAL,
-        .attributes = 0,
-        .controls = 0,
-        .lockDelayUnits = 0,
-        .lockDelay = 0
-    };
-
-    memcpy(payload, &descriptor, sizeof(descriptor));
-  }
-}
-/*----------------------------------------------------------------------------*/
-static void outStreamInterfaceAlt0Descriptor(const void *object,
-    struct UsbDescriptor *header, void *payload)
-{
-  const struct UacBase * const driver = object;
-
-  header->length = sizeof(struct UsbInterfaceDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
-
-  if (payload)
-  {
-    const struct UsbInterfaceDescriptor descriptor = {
-        .length = sizeof(struct UsbInterfaceDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
-        .interfaceNumber = driver->controlInterfaceIndex + (driver->in ? 2 : 1),
-        .alternateSettings = 0,
-        .numEndpoints = 0,
-        .interfaceClass = USB_CLASS_AUDIO,
-        .interfaceSubClass = AUDIO_SUBCLASS_AUDIOSTREAMING,
-        .interfaceProtocol = AUDIO_PROTOCOL_IP_VERSION_02_00,
-        .interface = 0
-    };
-
-    memcpy(payload, &descriptor, sizeof(descriptor));
-  }
-}
-/*----------------------------------------------------------------------------*/
-static void outStreamInterfaceAlt1Descriptor(const void *object,
-    struct UsbDescriptor *header, void *payload)
+static void streamInterfaceDescriptor(const struct UacBase *driver, bool in,
+    uint8_t setting, struct UsbDescriptor *header, void *payload)
 {
-  const struct UacBase * const driver = object;
-
   header->length = sizeof(struct UsbInterfaceDescriptor);
   header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
 
@@ -784,93 +884,61 @@ static void outStreamInterfaceAlt1Descriptor(const void *object,
     struct UsbInterfaceDescriptor descriptor = {
         .length = sizeof(struct UsbInterfaceDescriptor),
         .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
-        .interfaceNumber = driver->controlInterfaceIndex + (driver->in ? 2 : 1),
-        .alternateSettings = 1,
-        .numEndpoints = 1,
+        .interfaceNumber = driver->controlInterfaceIndex
+            + ((in || !driver->in) ? 1 : 2),
+        .alternateSettings = setting,
+        .numEndpoints = 0,
         .interfaceClass = USB_CLASS_AUDIO,
         .interfaceSubClass = AUDIO_SUBCLASS_AUDIOSTREAMING,
         .interfaceProtocol = AUDIO_PROTOCOL_IP_VERSION_02_00,
         .interface = 0
     };
 
-    if (driver->endpoints.fb)
+    /* Alternate Setting 0 has no endpoints */
+    if (setting)
+    {
       ++descriptor.numEndpoints;
 
+      if (!in && driver->endpoints.fb)
+        ++descriptor.numEndpoints;
+    }
+
     memcpy(payload, &descriptor, sizeof(descriptor));
   }
 }
 /*----------------------------------------------------------------------------*/
-static void outAudioStreamingInterfaceDescriptor(const void *,
+static void inStreamInterfaceAlt0Descriptor(const void *object,
     struct UsbDescriptor *header, void *payload)
 {
-  header->length = sizeof(struct AudioStreamingInterfaceDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
-
-  if (payload)
-  {
-    const struct AudioStreamingInterfaceDescriptor descriptor = {
-        .length = sizeof(struct AudioStreamingInterfaceDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
-        .descriptorSubType = AUDIO_CS_STREAMING_DESCRIPTOR_SUBTYPE_GENERAL,
-
-        .terminalLink = UNIT_OUT_INPUT_TERMINAL,
-        .controls = 0,
-        .formatType = AUDIO_FORMAT_TYPE_I,
-        .formats = TO_LITTLE_ENDIAN_32(AUDIO_FORMAT_TYPE_I_PCM),
-        .nrChannels = 2,
-        .channelConfig = TO_LITTLE_ENDIAN_32(AUDIO_CHANNEL_L | AUDIO_CHANNEL_R),
-        .channelNames = 0
-    };
-
-    memcpy(payload, &descriptor, sizeof(descriptor));
-  }
+  streamInterfaceDescriptor(object, true, 0, header, payload);
 }
 /*----------------------------------------------------------------------------*/
-static void outAudioFormatDescriptor(const void *, struct UsbDescriptor *header,
-    void *payload)
+static void inStreamEndpointCSDescriptor(const void *,
+    struct UsbDescriptor *header, void *payload)
 {
-  header->length = sizeof(struct AudioTypeIFormatDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE;
+  header->length = sizeof(struct ClassSpecificAudioDataEndpointDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CS_ENDPOINT;
 
   if (payload)
   {
-    const struct AudioTypeIFormatDescriptor descriptor = {
-        .length = sizeof(struct AudioTypeIFormatDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
-        .descriptorSubType = AUDIO_CS_STREAMING_DESCRIPTOR_SUBTYPE_FORMAT_TYPE,
-
-        .formatType = AUDIO_FORMAT_TYPE_I,
-        .subSlotSize = 2, // TODO From bit resolution
-        .bitResolution = 16
+    const struct ClassSpecificAudioDataEndpointDescriptor descriptor = {
+        .length = sizeof(struct ClassSpecificAudioDataEndpointDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CS_ENDPOINT,
+        .descriptorSubType = AUDIO_CS_ENDPOINT_DESCRIPTOR_SUBTYPE_GENERAL,
+        .attributes = 0,
+        .controls = 0,
+        .lockDelayUnits = 0,
+        .lockDelay = 0
     };
 
     memcpy(payload, &descriptor, sizeof(descriptor));
   }
 }
 /*----------------------------------------------------------------------------*/
-static void outStreamEndpointDescriptor(const void *object,
+static void outStreamInterfaceAlt0Descriptor(const void *object,
     struct UsbDescriptor *header, void *payload)
 {
-  const struct UacBase * const driver = object;
-
-  header->length = sizeof(struct UsbEndpointDescriptor);
-  header->descriptorType = DESCRIPTOR_TYPE_ENDPOINT;
-
-  if (payload)
-  {
-    const struct UsbEndpointDescriptor descriptor = {
-        .length = sizeof(struct UsbEndpointDescriptor),
-        .descriptorType = DESCRIPTOR_TYPE_ENDPOINT,
-        .endpointAddress = driver->endpoints.rx,
-        .attributes = ENDPOINT_DESCRIPTOR_TYPE(ENDPOINT_TYPE_ISOCHRONOUS)
-            | ENDPOINT_DESCRIPTOR_ASYNC, // TODO Adaptive mode
-        .maxPacketSize = toLittleEndian16(driver->maxPacketSize),
-        /* Interval is 2 ^ (4 - 1) microframes for HS devices */
-        .interval = usbDevGetSpeed(driver->device) == USB_HS ? 4 : 1
-    };
-
-    memcpy(payload, &descriptor, sizeof(descriptor));
-  }
+  streamInterfaceDescriptor(object, false, 0, header, payload);
 }
 /*----------------------------------------------------------------------------*/
 static void outStreamEndpointCSDescriptor(const void *,
@@ -1121,16 +1189,24 @@ static enum Result handleInInterfaceRequest(struct UacBase *driver,
   switch (packet->request)
   {
     case REQUEST_GET_INTERFACE:
-      *(uint8_t *)buffer = (driver->txActive ? 1 : 0);
+      *(uint8_t *)buffer = driver->txSetting;
       *responseLength = 1;
       break;
 
     case REQUEST_SET_INTERFACE:
       usbTrace("uac: set interface %u", packet->value);
 
-      /* Two alternative interfaces are supported */
-      if (packet->value < 2)
-        driver->txActive = (packet->value == 1);
+      /* Alternate Setting 0 and one setting per stream format */
+      if (packet->value <= driver->settingCount)
+      {
+        const uint8_t setting = (uint8_t)packet->value;
+
+        if (driver->txSetting != setting)
+        {
+          driver->txSetting = setting;
+          uacOnFormatSet(driver->owner, true);
+        }
+      }
       else
         res = E_VALUE;
       break;
@@ -1152,16 +1228,24 @@ static enum Result handleOutInterfaceRequest(struct UacBase *driver,
   switch (packet->request)
   {
     case REQUEST_GET_INTERFACE:
-      *(uint8_t *)buffer = (driver->rxActive ? 1 : 0);
+      *(uint8_t *)buffer = driver->rxSetting;
       *responseLength = 1;
       break;
 
     case REQUEST_SET_INTERFACE:
       usbTrace("uac: set interface %u", packet->value);
 
-      /* Two alternative interfaces are supported */
-      if (packet->value < 2)
-        driver->rxActive = (packet->value == 1);
+      /* Alternate Setting 0 and one setting per stream format */
+      if (packet->value <= driver->settingCount)
+      {
+        const uint8_t setting = (uint8_t)packet->value;
+
+        if (driver->rxSetting != setting)
+        {
+          driver->rxSetting = setting;
+          uacOnFormatSet(driver->owner, false);
+        }
+      }
       else
         res = E_VALUE;
       break;
@@ -1178,23 +1262,43 @@ static enum Result driverInit(void *object, const void *configBase)
 {
   const struct UacBaseConfig * const config = configBase;
   assert(config->owner != NULL);
+  assert(config->count && config->count <= UAC_MAX_FORMATS);
+  assert(config->samples <= UINT16_MAX);
 
   struct UacBase * const driver = object;
 
   driver->owner = config->owner;
   driver->device = config->device;
-  driver->maxPacketSize = config->packet;
+  driver->formats = config->formats;
+  driver->samples = (uint16_t)config->samples;
+  driver->count = (uint8_t)config->count;
   driver->endpoints.fb = config->endpoints.fb;
   driver->endpoints.tx = config->endpoints.tx;
   driver->endpoints.rx = config->endpoints.rx;
   driver->controlInterfaceIndex = usbDevGetInterface(driver->device);
   driver->speed = USB_FS;
 
-  driver->rxActive = false;
-  driver->txActive = false;
+  driver->rxSetting = 0;
+  driver->txSetting = 0;
   driver->in = driver->endpoints.tx != 0;
   driver->out = driver->endpoints.rx != 0;
 
+  updateStreamSettings(driver);
+
+#ifdef CONFIG_USB_DEVICE_HS
+  /* All formats are available at High Speed */
+  const size_t settings = driver->count;
+#else
+  const size_t settings = driver->settingCount;
+#endif
+
+  /* Configuration descriptor should fit into the control buffer */
+  if (getConfigLength(driver, settings) > CONTROL_PAYLOAD_SIZE)
+  {
+    usbTrace("uac: configuration descriptor is too long");
+    return E_VALUE;
+  }
+
   buildDescriptorTable(driver);
   return usbDevBind(driver->device, driver);
 }
@@ -1259,6 +1363,12 @@ static void driverNotify(void *object, unsigned int event)
   {
     driver->speed = usbDevGetSpeed(driver->device);
 
+    /* Set of available formats depends on the bus speed */
+    driver->rxSetting = 0;
+    driver->txSetting = 0;
+    updateStreamSettings(driver);
+    buildDescriptorTable(driver);
+
     usbTrace("uac: current speed is %s",
         driver->speed == USB_HS ? "HS" : "FS");
   }
@@ -1273,8 +1383,8 @@ static void driverNotify(void *object, unsigned int event)
     case USB_DEVICE_EVENT_RESET:
     case USB_DEVICE_EVENT_SUSPEND:
     case USB_DEVICE_EVENT_RESUME:
-      driver->rxActive = false;
-      driver->txActive = false;
+      driver->rxSetting = 0;
+      driver->txSetting = 0;
       uacOnEvent(driver->owner, event);
       break;
 
@@ -1288,9 +1398,24 @@ uint8_t uacBaseGetInterfaceIndex(const struct UacBase *driver)
   return driver->controlInterfaceIndex;
 }
 /*----------------------------------------------------------------------------*/
-size_t uacBaseGetPacketSize(const struct UacBase *driver)
+const struct UacFormat *uacBaseGetRxFormat(const struct UacBase *driver)
+{
+  return getFormat(driver, driver->rxSetting);
+}
+/*----------------------------------------------------------------------------*/
+size_t uacBaseGetRxPacketSize(const struct UacBase *driver)
+{
+  return getFormatPacketSize(driver, getFormat(driver, driver->rxSetting));
+}
+/*----------------------------------------------------------------------------*/
+const struct UacFormat *uacBaseGetTxFormat(const struct UacBase *driver)
+{
+  return getFormat(driver, driver->txSetting);
+}
+/*----------------------------------------------------------------------------*/
+size_t uacBaseGetTxPacketSize(const struct UacBase *driver)
 {
-  return driver->maxPacketSize;
+  return getFormatPacketSize(driver, getFormat(driver, driver->txSetting));
 }
 /*----------------------------------------------------------------------------*/
 enum UsbSpeed uacBaseGetUsbSpeed(const struct UacBase *driver)
@@ -1300,10 +1425,10 @@ enum UsbSpeed uacBaseGetUsbSpeed(const struct UacBase *driver)
 /*----------------------------------------------------------------------------*/
 bool uacBaseIsRxActive(const struct UacBase *driver)
 {
-  return driver->rxActive;
+  return driver->rxSetting != 0;
 }
 /*----------------------------------------------------------------------------*/
 bool uacBaseIsTxActive(const struct UacBase *driver)
 {
-  return driver->txActive;
+  return driver->txSetting != 0;
 }
@@ -0,0 +1,1133 @@
+/*
+ * uas.c
+ * Copyright (C) 2024 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <halm/irq.h>
+#include <halm/usb/msc.h>
+#include <halm/usb/msc_datapath.h>
+#include <halm/usb/msc_private.h>
+#include <halm/usb/msc_scsi.h>
+#include <halm/usb/uas.h>
+#include <halm/usb/uas_defs.h>
+#include <halm/usb/usb_defs.h>
+#include <halm/usb/usb_request.h>
+#include <halm/usb/usb_trace.h>
+#include <xcore/memory.h>
+#include <assert.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
+#  define MEM_ALIGNMENT CONFIG_PLATFORM_USB_DEVICE_BUFFER_ALIGNMENT
+#endif
+
+#define DEFAULT_COMMAND_COUNT 4
+
+struct UasCommandSlot
+{
+  uint8_t payload[UAS_COMMAND_IU_SIZE];
+  struct UsbRequest request;
+  struct Uas *driver;
+};
+
+struct UasStatusSlot
+{
+  union
+  {
+    struct UasIuHeader header;
+    struct UasResponseIu response;
+    struct UasSenseIu sense;
+  } payload;
+
+  struct UsbRequest request;
+};
+/*----------------------------------------------------------------------------*/
+static inline void *allocBufferMemory(size_t);
+static inline const struct UasCommandIu *getCommandIu(
+    const struct UasCommandSlot *);
+static struct MscUnit *getUnit(struct Uas *, const uint8_t *);
+/*----------------------------------------------------------------------------*/
+static void abortCurrentCommand(struct Uas *, const uint8_t *, uint16_t,
+    bool);
+static void dispatch(void *);
+static void executeCommand(struct Uas *);
+static void finishCommand(struct Uas *);
+static void handleCommandIu(struct Uas *, struct UasCommandSlot *, size_t);
+static void handleTaskManagementIu(struct Uas *, struct UasCommandSlot *,
+    size_t);
+static bool isTagActive(const struct Uas *, uint16_t);
+static bool isTaskSetActive(const struct Uas *, const uint8_t *);
+static void removePendingCommands(struct Uas *, const uint8_t *, uint16_t,
+    bool);
+static void startNextCommand(struct Uas *);
+/*----------------------------------------------------------------------------*/
+static bool enqueueCommandSlot(struct Uas *, struct UasCommandSlot *);
+static bool sendReadyIu(struct Uas *, uint8_t, uint16_t);
+static bool sendResponseIu(struct Uas *, uint16_t, uint8_t);
+static bool sendSenseIu(struct Uas *, uint16_t, struct MscUnit *, uint8_t);
+static bool sendStatusIu(struct Uas *, const void *, size_t);
+static void commandReceived(void *, struct UsbRequest *,
+    enum UsbRequestStatus);
+static void statusSent(void *, struct UsbRequest *, enum UsbRequestStatus);
+/*----------------------------------------------------------------------------*/
+static void deviceDescriptor(const void *, struct UsbDescriptor *, void *);
+static void configDescriptor(const void *, struct UsbDescriptor *, void *);
+static void interfaceDescriptor(const void *, struct UsbDescriptor *, void *);
+static void commandEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void commandPipeDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void statusEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void statusPipeDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void txEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void txPipeDescriptor(const void *, struct UsbDescriptor *, void *);
+static void rxEndpointDescriptor(const void *, struct UsbDescriptor *,
+    void *);
+static void rxPipeDescriptor(const void *, struct UsbDescriptor *, void *);
+static void makeEndpointDescriptor(const struct Uas *, uint8_t,
+    struct UsbDescriptor *, void *);
+static void makePipeDescriptor(uint8_t, struct UsbDescriptor *, void *);
+/*----------------------------------------------------------------------------*/
+static void resetBuffers(struct Uas *);
+static void resetEndpoints(struct Uas *);
+/*----------------------------------------------------------------------------*/
+static enum Result driverInit(void *, const void *);
+static void driverDeinit(void *);
+static enum Result driverControl(void *, const struct UsbSetupPacket *,
+    void *, uint16_t *, uint16_t);
+static const UsbDescriptorFunctor *driverDescribe(const void *);
+static void driverNotify(void *, unsigned int);
+/*----------------------------------------------------------------------------*/
+const struct UsbDriverClass * const Uas = &(const struct UsbDriverClass){
+    .size = sizeof(struct Uas),
+    .init = driverInit,
+    .deinit = driverDeinit,
+
+    .control = driverControl,
+    .describe = driverDescribe,
+    .notify = driverNotify
+};
+/*----------------------------------------------------------------------------*/
+static const UsbDescriptorFunctor deviceDescriptorTable[] = {
+    deviceDescriptor,
+    configDescriptor,
+    interfaceDescriptor,
+    commandEndpointDescriptor,
+    commandPipeDescriptor,
+    statusEndpointDescriptor,
+    statusPipeDescriptor,
+    txEndpointDescriptor,
+    txPipeDescriptor,
+    rxEndpointDescriptor,
+    rxPipeDescriptor,
+    NULL
+};
+/*----------------------------------------------------------------------------*/
+static inline void *allocBufferMemory(size_t size)
+{
+#ifdef MEM_ALIGNMENT
+  return memalign(MEM_ALIGNMENT, size);
+#else
+  return malloc(size);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static inline const struct UasCommandIu *getCommandIu(
+    const struct UasCommandSlot *slot)
+{
+  return (const struct UasCommandIu *)slot->payload;
+}
+/*----------------------------------------------------------------------------*/
+static struct MscUnit *getUnit(struct Uas *driver, const uint8_t *lun)
+{
+  /* Only single level LUN structure with peripheral addressing is supported */
+  for (size_t index = 2; index < 8; ++index)
+  {
+    if (lun[index])
+      return NULL;
+  }
+
+  if (!lun[0] && lun[1] < driver->lunCount)
+    return &driver->lun[lun[1]];
+  else
+    return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static void abortCurrentCommand(struct Uas *driver, const uint8_t *lun,
+    uint16_t tag, bool all)
+{
+  if (driver->current == NULL)
+    return;
+
+  const struct UasCommandIu * const iu = getCommandIu(driver->current);
+  const bool matched = (lun == NULL || !memcmp(iu->lun, lun, 8))
+      && (all || iu->tag == tag);
+
+  if (!matched)
+    return;
+
+  usbTrace("uas: command aborted, tag %u", fromBigEndian16(iu->tag));
+
+  /*
+   * Aborted command is completed without status. When the storage is busy,
+   * the command is finished later by the dispatcher.
+   */
+  if (datapathAbort(driver->datapath))
+  {
+    finishCommand(driver);
+    startNextCommand(driver);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void dispatch(void *argument)
+{
+  struct Uas * const driver = argument;
+
+  if (driver->current == NULL)
+    return;
+
+  const struct UasCommandIu * const iu = getCommandIu(driver->current);
+  struct MscUnit * const unit = getUnit(driver, iu->lun);
+  const enum Result status = datapathStatus(driver->datapath);
+
+  switch (status)
+  {
+    case E_OK:
+    {
+      enum ScsiAction action = SCSI_ACTION_ACK;
+
+      if (driver->action == SCSI_ACTION_PARAMETERS)
+      {
+        action = scsiProcessParameters(unit, iu->cb, driver->buffer,
+            driver->parameterLength);
+      }
+
+      if (action == SCSI_ACTION_DISCARD)
+      {
+        /* Status is sent after completion of erase operations */
+        driver->action = (uint8_t)action;
+
+        if (datapathDiscardBlocks(driver->datapath, unit, driver->buffer,
+            driver->parameterLength))
+        {
+          return;
+        }
+
+        scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
+        action = SCSI_ACTION_FAILURE;
+      }
+
+      sendSenseIu(driver, iu->tag, unit, action == SCSI_ACTION_ACK ?
+          UAS_STATUS_GOOD : UAS_STATUS_CHECK_CONDITION);
+      break;
+    }
+
+    case E_ERROR:
+      /* USB error, status can not be delivered to the host */
+      usbTrace("uas: data stage failed, tag %u", fromBigEndian16(iu->tag));
+      break;
+
+    case E_IDLE:
+      /* Command was aborted by the task management function */
+      break;
+
+    default:
+      /*
+       * Sense data for an unsupported logical unit is generated on demand,
+       * sense data for a failed discard are stored by the erase function.
+       */
+      if (unit != NULL && driver->action == SCSI_ACTION_PARAMETERS)
+      {
+        /* Parameter list is shorter than expected */
+        scsiSetSense(unit, SCSI_SK_ILLEGAL_REQUEST,
+            SCSI_ASC_IR_PARAMETERLENGTH);
+      }
+      else if (unit != NULL && driver->action != SCSI_ACTION_DISCARD)
+      {
+        if (driver->action == SCSI_ACTION_WRITE)
+          scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
+        else
+          scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_READERROR);
+
+        unit->flags |= FLAG_FAILURE;
+        if (driver->callback != NULL)
+          driver->callback(driver->callbackArgument);
+      }
+
+      sendSenseIu(driver, iu->tag, unit, UAS_STATUS_CHECK_CONDITION);
+      break;
+  }
+
+  finishCommand(driver);
+  startNextCommand(driver);
+}
+/*----------------------------------------------------------------------------*/
+static void executeCommand(struct Uas *driver)
+{
+  const struct UasCommandIu * const iu = getCommandIu(driver->current);
+  struct MscUnit * const unit = getUnit(driver, iu->lun);
+  const uint8_t flags = unit != NULL ? unit->flags : 0;
+  struct ScsiTransfer transfer;
+  bool queued;
+
+  const enum ScsiAction action = scsiProcessCommand(unit, iu->cb,
+      driver->buffer, &transfer);
+
+  if (unit != NULL && unit->flags != flags && driver->callback != NULL)
+    driver->callback(driver->callbackArgument);
+
+  driver->action = (uint8_t)action;
+
+  switch (action)
+  {
+    case SCSI_ACTION_ACK:
+      sendSenseIu(driver, iu->tag, unit, UAS_STATUS_GOOD);
+      finishCommand(driver);
+      return;
+
+    case SCSI_ACTION_RESPONSE:
+      queued = sendReadyIu(driver, UAS_IU_READ_READY, iu->tag)
+          && datapathSendResponse(driver->datapath, driver->buffer,
+              transfer.length);
+      break;
+
+    case SCSI_ACTION_READ:
+      queued = sendReadyIu(driver, UAS_IU_READ_READY, iu->tag)
+          && datapathReadAndSendData(driver->datapath, unit,
+              driver->buffer, driver->bufferSize,
+              transfer.position, transfer.length);
+      break;
+
+    case SCSI_ACTION_WRITE:
+      queued = sendReadyIu(driver, UAS_IU_WRITE_READY, iu->tag)
+          && datapathReceiveAndWriteData(driver->datapath, unit,
+              driver->buffer, driver->bufferSize,
+              transfer.position, transfer.length);
+      break;
+
+    case SCSI_ACTION_PARAMETERS:
+      driver->parameterLength = (uint16_t)transfer.length;
+      queued = sendReadyIu(driver, UAS_IU_WRITE_READY, iu->tag)
+          && datapathReceiveControl(driver->datapath, driver->buffer,
+              transfer.length);
+      break;
+
+    default:
+      sendSenseIu(driver, iu->tag, unit, UAS_STATUS_CHECK_CONDITION);
+      finishCommand(driver);
+      return;
+  }
+
+  if (!queued)
+  {
+    usbTrace("uas: data stage setup failed, tag %u",
+        fromBigEndian16(iu->tag));
+
+    if (unit != NULL
+        && (action == SCSI_ACTION_READ || action == SCSI_ACTION_WRITE))
+    {
+      if (action == SCSI_ACTION_WRITE)
+        scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_WRITEFAULT);
+      else
+        scsiSetSense(unit, SCSI_SK_MEDIUM_ERROR, SCSI_ASC_ME_READERROR);
+
+      unit->flags |= FLAG_FAILURE;
+      if (driver->callback != NULL)
+        driver->callback(driver->callbackArgument);
+    }
+
+    sendSenseIu(driver, iu->tag, unit, UAS_STATUS_CHECK_CONDITION);
+    finishCommand(driver);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void finishCommand(struct Uas *driver)
+{
+  struct UasCommandSlot * const slot = driver->current;
+
+  driver->current = NULL;
+  enqueueCommandSlot(driver, slot);
+}
+/*----------------------------------------------------------------------------*/
+static void handleCommandIu(struct Uas *driver, struct UasCommandSlot *slot,
+    size_t length)
+{
+  const struct UasCommandIu * const iu = getCommandIu(slot);
+
+  if (length < sizeof(struct UasCommandIu) || iu->additionalLength)
+  {
+    usbTrace("uas: incorrect command IU");
+
+    sendResponseIu(driver, iu->tag, UAS_RC_INVALID_IU);
+    enqueueCommandSlot(driver, slot);
+  }
+  else if (isTagActive(driver, iu->tag))
+  {
+    usbTrace("uas: overlapped tag %u", fromBigEndian16(iu->tag));
+
+    sendResponseIu(driver, iu->tag, UAS_RC_OVERLAPPED_TAG);
+    enqueueCommandSlot(driver, slot);
+  }
+  else
+  {
+    pointerQueuePushBack(&driver->pendingCommands, slot);
+    startNextCommand(driver);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void handleTaskManagementIu(struct Uas *driver,
+    struct UasCommandSlot *slot, size_t length)
+{
+  const struct UasTaskManagementIu * const iu =
+      (const struct UasTaskManagementIu *)slot->payload;
+  const uint16_t tag = iu->tag;
+  uint8_t code;
+
+  if (length < sizeof(struct UasTaskManagementIu))
+  {
+    code = UAS_RC_INVALID_IU;
+  }
+  else if (getUnit(driver, iu->lun) == NULL
+      && iu->function != UAS_TMF_IT_NEXUS_RESET)
+  {
+    code = UAS_RC_INCORRECT_LUN;
+  }
+  else
+  {
+    usbTrace("uas: task management function 0x%02X", iu->function);
+
+    switch (iu->function)
+    {
+      case UAS_TMF_ABORT_TASK:
+        removePendingCommands(driver, iu->lun, iu->taskTag, false);
+        abortCurrentCommand(driver, iu->lun, iu->taskTag, false);
+        code = UAS_RC_TMF_COMPLETE;
+        break;
+
+      case UAS_TMF_ABORT_TASK_SET:
+      case UAS_TMF_CLEAR_TASK_SET:
+      case UAS_TMF_LOGICAL_UNIT_RESET:
+        removePendingCommands(driver, iu->lun, 0, true);
+        abortCurrentCommand(driver, iu->lun, 0, true);
+        code = UAS_RC_TMF_COMPLETE;
+        break;
+
+      case UAS_TMF_IT_NEXUS_RESET:
+        removePendingCommands(driver, NULL, 0, true);
+        abortCurrentCommand(driver, NULL, 0, true);
+        code = UAS_RC_TMF_COMPLETE;
+        break;
+
+      case UAS_TMF_QUERY_TASK:
+        code = isTagActive(driver, iu->taskTag) ?
+            UAS_RC_TMF_SUCCEEDED : UAS_RC_TMF_COMPLETE;
+        break;
+
+      case UAS_TMF_QUERY_TASK_SET:
+        code = isTaskSetActive(driver, iu->lun) ?
+            UAS_RC_TMF_SUCCEEDED : UAS_RC_TMF_COMPLETE;
+        break;
+
+      default:
+        code = UAS_RC_TMF_NOT_SUPPORTED;
+        break;
+    }
+  }
+
+  enqueueCommandSlot(driver, slot);
+  sendResponseIu(driver, tag, code);
+}
+/*----------------------------------------------------------------------------*/
+static bool isTagActive(const struct Uas *driver, uint16_t tag)
+{
+  if (driver->current != NULL && getCommandIu(driver->current)->tag == tag)
+    return true;
+
+  /* Pending commands are rotated through the queue to keep their order */
+  PointerQueue * const queue = (PointerQueue *)&driver->pendingCommands;
+  const size_t count = pointerQueueSize(queue);
+  bool found = false;
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    struct UasCommandSlot * const slot = pointerQueueFront(queue);
+    pointerQueuePopFront(queue);
+
+    if (getCommandIu(slot)->tag == tag)
+      found = true;
+
+    pointerQueuePushBack(queue, slot);
+  }
+
+  return found;
+}
+/*----------------------------------------------------------------------------*/
+static bool isTaskSetActive(const struct Uas *driver, const uint8_t *lun)
+{
+  if (driver->current != NULL
+      && !memcmp(getCommandIu(driver->current)->lun, lun, 8))
+  {
+    return true;
+  }
+
+  PointerQueue * const queue = (PointerQueue *)&driver->pendingCommands;
+  const size_t count = pointerQueueSize(queue);
+  bool found = false;
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    struct UasCommandSlot * const slot = pointerQueueFront(queue);
+    pointerQueuePopFront(queue);
+
+    if (!memcmp(getCommandIu(slot)->lun, lun, 8))
+      found = true;
+
+    pointerQueuePushBack(queue, slot);
+  }
+
+  return found;
+}
+/*----------------------------------------------------------------------------*/
+static void removePendingCommands(struct Uas *driver, const uint8_t *lun,
+    uint16_t tag, bool all)
+{
+  const size_t count = pointerQueueSize(&driver->pendingCommands);
+
+  for (size_t index = 0; index < count; ++index)
+  {
+    struct UasCommandSlot * const slot =
+        pointerQueueFront(&driver->pendingCommands);
+    const struct UasCommandIu * const iu = getCommandIu(slot);
+
+    pointerQueuePopFront(&driver->pendingCommands);
+
+    const bool matched = (lun == NULL || !memcmp(iu->lun, lun, 8))
+        && (all || iu->tag == tag);
+
+    if (matched)
+    {
+      /* Aborted command is completed without status */
+      usbTrace("uas: command aborted, tag %u", fromBigEndian16(iu->tag));
+      enqueueCommandSlot(driver, slot);
+    }
+    else
+      pointerQueuePushBack(&driver->pendingCommands, slot);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void startNextCommand(struct Uas *driver)
+{
+  while (driver->current == NULL
+      && !pointerQueueEmpty(&driver->pendingCommands))
+  {
+    driver->current = pointerQueueFront(&driver->pendingCommands);
+    pointerQueuePopFront(&driver->pendingCommands);
+
+    executeCommand(driver);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static bool enqueueCommandSlot(struct Uas *driver,
+    struct UasCommandSlot *slot)
+{
+  slot->request.length = 0;
+  return usbEpEnqueue(driver->commandEp, &slot->request) == E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static bool sendReadyIu(struct Uas *driver, uint8_t id, uint16_t tag)
+{
+  const struct UasIuHeader iu = {
+      .id = id,
+      .reserved = 0,
+      .tag = tag
+  };
+
+  return sendStatusIu(driver, &iu, sizeof(iu));
+}
+/*----------------------------------------------------------------------------*/
+static bool sendResponseIu(struct Uas *driver, uint16_t tag, uint8_t code)
+{
+  const struct UasResponseIu iu = {
+      .id = UAS_IU_RESPONSE,
+      .reserved = 0,
+      .tag = tag,
+      .additionalInfo = {0},
+      .code = code
+  };
+
+  return sendStatusIu(driver, &iu, sizeof(iu));
+}
+/*----------------------------------------------------------------------------*/
+static bool sendSenseIu(struct Uas *driver, uint16_t tag,
+    struct MscUnit *unit, uint8_t status)
+{
+  struct UasSenseIu iu;
+  size_t length = offsetof(struct UasSenseIu, data);
+
+  memset(&iu, 0, sizeof(iu));
+  iu.id = UAS_IU_SENSE;
+  iu.tag = tag;
+  iu.status = status;
+
+  if (status != UAS_STATUS_GOOD)
+  {
+    const size_t senseLength = scsiGetSenseData(unit, iu.data);
+
+    iu.length = toBigEndian16((uint16_t)senseLength);
+    length += senseLength;
+  }
+
+  return sendStatusIu(driver, &iu, length);
+}
+/*----------------------------------------------------------------------------*/
+static bool sendStatusIu(struct Uas *driver, const void *iu, size_t length)
+{
+  if (pointerArrayEmpty(&driver->statusPool))
+  {
+    usbTrace("uas: status queue overflow");
+    return false;
+  }
+
+  struct UsbRequest * const request = pointerArrayBack(&driver->statusPool);
+  pointerArrayPopBack(&driver->statusPool);
+
+  memcpy(request->buffer, iu, length);
+  request->length = (uint16_t)length;
+
+  if (usbEpEnqueue(driver->statusEp, request) != E_OK)
+  {
+    pointerArrayPushBack(&driver->statusPool, request);
+    return false;
+  }
+  else
+    return true;
+}
+/*----------------------------------------------------------------------------*/
+static void commandReceived(void *argument, struct UsbRequest *request,
+    enum UsbRequestStatus status)
+{
+  struct UasCommandSlot * const slot = argument;
+  struct Uas * const driver = slot->driver;
+
+  if (status != USB_REQUEST_COMPLETED)
+  {
+    /* Cancelled slots are returned to the endpoint after the reset */
+    if (status != USB_REQUEST_CANCELLED)
+      enqueueCommandSlot(driver, slot);
+    return;
+  }
+
+  const IrqState state = irqSave();
+  const struct UasIuHeader * const header =
+      (const struct UasIuHeader *)slot->payload;
+
+  if (request->length < sizeof(struct UasIuHeader))
+  {
+    enqueueCommandSlot(driver, slot);
+  }
+  else if (header->id == UAS_IU_COMMAND)
+  {
+    handleCommandIu(driver, slot, request->length);
+  }
+  else if (header->id == UAS_IU_TASK_MANAGEMENT)
+  {
+    handleTaskManagementIu(driver, slot, request->length);
+  }
+  else
+  {
+    usbTrace("uas: unsupported IU 0x%02X", header->id);
+
+    sendResponseIu(driver, header->tag, UAS_RC_INVALID_IU);
+    enqueueCommandSlot(driver, slot);
+  }
+
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+static void statusSent(void *argument, struct UsbRequest *request,
+    enum UsbRequestStatus)
+{
+  struct Uas * const driver = argument;
+  pointerArrayPushBack(&driver->statusPool, request);
+}
+/*----------------------------------------------------------------------------*/
+static void deviceDescriptor(const void *, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct UsbDeviceDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_DEVICE;
+
+  if (payload != NULL)
+  {
+    static const struct UsbDeviceDescriptor descriptor = {
+        .length = sizeof(struct UsbDeviceDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_DEVICE,
+        .usb = TO_LITTLE_ENDIAN_16(0x0200),
+        .deviceClass = USB_CLASS_PER_INTERFACE,
+        .deviceSubClass = 0,
+        .deviceProtocol = 0,
+        .maxPacketSize = TO_LITTLE_ENDIAN_16(MSC_CONTROL_EP_SIZE),
+        .idVendor = 0,
+        .idProduct = 0,
+        .device = TO_LITTLE_ENDIAN_16(0x0100),
+        .manufacturer = 0,
+        .product = 0,
+        .serialNumber = 0,
+        .numConfigurations = 1
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void configDescriptor(const void *, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct UsbConfigurationDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_CONFIGURATION;
+
+  if (payload != NULL)
+  {
+    static const struct UsbConfigurationDescriptor descriptor = {
+        .length = sizeof(struct UsbConfigurationDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_CONFIGURATION,
+        .totalLength = TO_LITTLE_ENDIAN_16(
+            sizeof(struct UsbConfigurationDescriptor)
+            + sizeof(struct UsbInterfaceDescriptor)
+            + sizeof(struct UsbEndpointDescriptor) * 4
+            + sizeof(struct UasPipeUsageDescriptor) * 4),
+        .numInterfaces = 1,
+        .configurationValue = 1,
+        .configuration = 0,
+        .attributes = 0,
+        .maxPower = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void interfaceDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct Uas * const driver = object;
+
+  header->length = sizeof(struct UsbInterfaceDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_INTERFACE;
+
+  if (payload != NULL)
+  {
+    const struct UsbInterfaceDescriptor descriptor = {
+        .length = sizeof(struct UsbInterfaceDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_INTERFACE,
+        .interfaceNumber = driver->interfaceIndex,
+        .alternateSettings = 0,
+        .numEndpoints = 4,
+        .interfaceClass = USB_CLASS_MASS_STORAGE,
+        .interfaceSubClass = MSC_SUBCLASS_SCSI,
+        .interfaceProtocol = MSC_PROTOCOL_UAS,
+        .interface = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void commandEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct Uas * const driver = object;
+  makeEndpointDescriptor(driver, driver->endpoints.command, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void commandPipeDescriptor(const void *,
+    struct UsbDescriptor *header, void *payload)
+{
+  makePipeDescriptor(UAS_PIPE_COMMAND, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void statusEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct Uas * const driver = object;
+  makeEndpointDescriptor(driver, driver->endpoints.status, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void statusPipeDescriptor(const void *,
+    struct UsbDescriptor *header, void *payload)
+{
+  makePipeDescriptor(UAS_PIPE_STATUS, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void txEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct Uas * const driver = object;
+  makeEndpointDescriptor(driver, driver->endpoints.tx, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void txPipeDescriptor(const void *,
+    struct UsbDescriptor *header, void *payload)
+{
+  makePipeDescriptor(UAS_PIPE_DATA_IN, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void rxEndpointDescriptor(const void *object,
+    struct UsbDescriptor *header, void *payload)
+{
+  const struct Uas * const driver = object;
+  makeEndpointDescriptor(driver, driver->endpoints.rx, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void rxPipeDescriptor(const void *,
+    struct UsbDescriptor *header, void *payload)
+{
+  makePipeDescriptor(UAS_PIPE_DATA_OUT, header, payload);
+}
+/*----------------------------------------------------------------------------*/
+static void makeEndpointDescriptor(const struct Uas *driver, uint8_t address,
+    struct UsbDescriptor *header, void *payload)
+{
+  header->length = sizeof(struct UsbEndpointDescriptor);
+  header->descriptorType = DESCRIPTOR_TYPE_ENDPOINT;
+
+  if (payload != NULL)
+  {
+    const struct UsbEndpointDescriptor descriptor = {
+        .length = sizeof(struct UsbEndpointDescriptor),
+        .descriptorType = DESCRIPTOR_TYPE_ENDPOINT,
+        .endpointAddress = address,
+        .attributes = ENDPOINT_DESCRIPTOR_TYPE(ENDPOINT_TYPE_BULK),
+        .maxPacketSize = toLittleEndian16(driver->packetSize),
+        .interval = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void makePipeDescriptor(uint8_t pipe, struct UsbDescriptor *header,
+    void *payload)
+{
+  header->length = sizeof(struct UasPipeUsageDescriptor);
+  header->descriptorType = UAS_DESCRIPTOR_TYPE_PIPE_USAGE;
+
+  if (payload != NULL)
+  {
+    const struct UasPipeUsageDescriptor descriptor = {
+        .length = sizeof(struct UasPipeUsageDescriptor),
+        .descriptorType = UAS_DESCRIPTOR_TYPE_PIPE_USAGE,
+        .pipeId = pipe,
+        .reserved = 0
+    };
+
+    memcpy(payload, &descriptor, sizeof(descriptor));
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void resetBuffers(struct Uas *driver)
+{
+  /* Return queued requests to pools */
+  usbEpClear(driver->commandEp);
+  usbEpClear(driver->statusEp);
+  usbEpClear(driver->rxEp);
+  usbEpClear(driver->txEp);
+
+  /* Drop all queued commands */
+  pointerQueueClear(&driver->pendingCommands);
+  driver->current = NULL;
+
+  for (size_t index = 0; index < driver->commandCount; ++index)
+    enqueueCommandSlot(driver, &driver->commands[index]);
+}
+/*----------------------------------------------------------------------------*/
+static void resetEndpoints(struct Uas *driver)
+{
+  usbEpEnable(driver->commandEp, ENDPOINT_TYPE_BULK, driver->packetSize);
+  usbEpEnable(driver->statusEp, ENDPOINT_TYPE_BULK, driver->packetSize);
+  usbEpEnable(driver->rxEp, ENDPOINT_TYPE_BULK, driver->packetSize);
+  usbEpEnable(driver->txEp, ENDPOINT_TYPE_BULK, driver->packetSize);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result driverInit(void *object, const void *configBase)
+{
+  const struct UasConfig * const config = configBase;
+  assert(config != NULL);
+  assert(config->device != NULL);
+  assert(config->luns <= MSC_MAX_LUN_COUNT);
+  assert(!config->depth || config->depth >= MSC_MIN_QUERY_COUNT);
+
+  const uint16_t logicalBlockSize = config->block.logical ?
+      config->block.logical : MSC_BLOCK_SIZE;
+  const uint16_t physicalBlockSize = config->block.physical ?
+      config->block.physical : logicalBlockSize;
+
+  assert(logicalBlockSize >= MSC_BLOCK_SIZE
+      && logicalBlockSize <= MSC_MAX_BLOCK_SIZE
+      && !(logicalBlockSize & (logicalBlockSize - 1)));
+  assert(physicalBlockSize >= logicalBlockSize
+      && !(physicalBlockSize & (physicalBlockSize - 1)));
+  assert(config->size && !(config->size & (logicalBlockSize - 1)));
+  assert(config->size >= logicalBlockSize
+      * (config->depth ? config->depth : MSC_MIN_QUERY_COUNT));
+
+  struct Uas * const driver = object;
+
+  driver->callback = NULL;
+  driver->callbackArgument = NULL;
+  driver->bufferSize = config->size;
+  driver->device = config->device;
+  driver->current = NULL;
+  driver->packetSize = MSC_DATA_EP_SIZE;
+  driver->commandCount = config->commands ?
+      config->commands : DEFAULT_COMMAND_COUNT;
+  driver->action = SCSI_ACTION_ACK;
+  driver->parameterLength = 0;
+  driver->endpoints.command = config->endpoints.command;
+  driver->endpoints.status = config->endpoints.status;
+  driver->endpoints.rx = config->endpoints.rx;
+  driver->endpoints.tx = config->endpoints.tx;
+
+  if (config->arena == NULL)
+  {
+    driver->buffer = allocBufferMemory(driver->bufferSize);
+    if (driver->buffer == NULL)
+      return E_MEMORY;
+    driver->preallocated = false;
+  }
+  else
+  {
+    driver->buffer = config->arena;
+    driver->preallocated = true;
+  }
+
+  driver->lunCount = config->luns ? config->luns : 1;
+  driver->lun = malloc(driver->lunCount * sizeof(struct MscUnit));
+  if (driver->lun == NULL)
+    return E_MEMORY;
+
+  for (size_t index = 0; index < driver->lunCount; ++index)
+    scsiInitUnit(&driver->lun[index], logicalBlockSize, physicalBlockSize);
+
+  /* Command slots are allocated in one block */
+  driver->commands = malloc(driver->commandCount
+      * sizeof(struct UasCommandSlot));
+  if (driver->commands == NULL)
+    return E_MEMORY;
+  if (!pointerQueueInit(&driver->pendingCommands, driver->commandCount))
+    return E_MEMORY;
+
+  for (size_t index = 0; index < driver->commandCount; ++index)
+  {
+    struct UasCommandSlot * const slot = &driver->commands[index];
+
+    slot->driver = driver;
+    usbRequestInit(&slot->request, slot->payload, sizeof(slot->payload),
+        commandReceived, slot);
+  }
+
+  /* Each queued command may require a status, one more for task management */
+  const size_t statusCount = driver->commandCount + 1;
+
+  driver->statuses = malloc(statusCount * sizeof(struct UasStatusSlot));
+  if (driver->statuses == NULL)
+    return E_MEMORY;
+  if (!pointerArrayInit(&driver->statusPool, statusCount))
+    return E_MEMORY;
+
+  for (size_t index = 0; index < statusCount; ++index)
+  {
+    struct UasStatusSlot * const slot = &driver->statuses[index];
+
+    usbRequestInit(&slot->request, &slot->payload, sizeof(slot->payload),
+        statusSent, driver);
+    pointerArrayPushBack(&driver->statusPool, &slot->request);
+  }
+
+  driver->commandEp = usbDevCreateEndpoint(driver->device,
+      driver->endpoints.command);
+  if (driver->commandEp == NULL)
+    return E_ERROR;
+  driver->statusEp = usbDevCreateEndpoint(driver->device,
+      driver->endpoints.status);
+  if (driver->statusEp == NULL)
+    return E_ERROR;
+  driver->rxEp = usbDevCreateEndpoint(driver->device, driver->endpoints.rx);
+  if (driver->rxEp == NULL)
+    return E_ERROR;
+  driver->txEp = usbDevCreateEndpoint(driver->device, driver->endpoints.tx);
+  if (driver->txEp == NULL)
+    return E_ERROR;
+
+  driver->datapath = malloc(sizeof(struct MscQueryHandler));
+  if (driver->datapath == NULL)
+    return E_MEMORY;
+
+  const enum Result res = datapathInit(driver->datapath,
+      driver->rxEp, driver->txEp, dispatch, driver,
+      config->depth ? config->depth : MSC_MIN_QUERY_COUNT);
+  if (res != E_OK)
+    return res;
+
+  driver->interfaceIndex = usbDevGetInterface(driver->device);
+  return usbDevBind(driver->device, driver);
+}
+/*----------------------------------------------------------------------------*/
+static void driverDeinit(void *object)
+{
+  struct Uas * const driver = object;
+
+  usbDevUnbind(driver->device, driver);
+
+  /* Clear endpoint queues */
+  usbEpClear(driver->txEp);
+  usbEpClear(driver->rxEp);
+  usbEpClear(driver->statusEp);
+  usbEpClear(driver->commandEp);
+
+  /* Delete query handler */
+  datapathDeinit(driver->datapath);
+  free(driver->datapath);
+
+  /* Delete endpoints */
+  deinit(driver->txEp);
+  deinit(driver->rxEp);
+  deinit(driver->statusEp);
+  deinit(driver->commandEp);
+
+  pointerArrayDeinit(&driver->statusPool);
+  free(driver->statuses);
+  pointerQueueDeinit(&driver->pendingCommands);
+  free(driver->commands);
+  free(driver->lun);
+
+  if (!driver->preallocated)
+    free(driver->buffer);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result driverControl(void *, const struct UsbSetupPacket *,
+    void *, uint16_t *, uint16_t)
+{
+  /* UAS has no class-specific requests */
+  return E_INVALID;
+}
+/*----------------------------------------------------------------------------*/
+static const UsbDescriptorFunctor *driverDescribe(const void *)
+{
+  return deviceDescriptorTable;
+}
+/*----------------------------------------------------------------------------*/
+static void driverNotify(void *object, unsigned int event)
+{
+  struct Uas * const driver = object;
+
+#ifdef MEM_ALIGNMENT
+  static_assert(!(MSC_DATA_EP_SIZE_HS % MEM_ALIGNMENT)
+      && !(MSC_DATA_EP_SIZE % MEM_ALIGNMENT), "Incorrect buffer size");
+#endif
+
+#ifdef CONFIG_USB_DEVICE_HS
+  if (event == USB_DEVICE_EVENT_PORT_CHANGE)
+  {
+    const enum UsbSpeed speed = usbDevGetSpeed(driver->device);
+
+    if (speed == USB_HS)
+      driver->packetSize = MSC_DATA_EP_SIZE_HS;
+    else
+      driver->packetSize = MSC_DATA_EP_SIZE;
+
+    datapathSetPacketSize(driver->datapath, driver->packetSize);
+    usbTrace("uas: current speed is %s", speed == USB_HS ? "HS" : "FS");
+  }
+#endif
+
+  if (event == USB_DEVICE_EVENT_RESET)
+  {
+    resetEndpoints(driver);
+    resetBuffers(driver);
+
+    usbTrace("uas: reset completed");
+  }
+}
+/*----------------------------------------------------------------------------*/
+enum Result uasAttachUnit(struct Uas *driver, uint8_t index, void *interface)
+{
+  return uasAttachMappedUnit(driver, index, interface, NULL);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Attach a storage with memory-mapped content. Read data is sent directly
+ * from the memory, therefore the content should always be up to date:
+ * storages with write-back caches or deferred writes should be attached
+ * with the generic function.
+ * @param driver Pointer to a driver object.
+ * @param index Index of the logical unit.
+ * @param interface Storage interface.
+ * @param memory Pointer to the beginning of the storage content.
+ * @return @b E_OK on success.
+ */
+enum Result uasAttachMappedUnit(struct Uas *driver, uint8_t index,
+    void *interface, const void *memory)
+{
+  const struct MscUnitConfig config = {
+      .interface = interface,
+      .memory = memory,
+      .discard = MSC_DISCARD_NONE
+  };
+
+  return uasAttachConfiguredUnit(driver, index, &config);
+}
+/*----------------------------------------------------------------------------*/
+/**
+ * Attach a storage with additional logical unit settings.
+ * @param driver Pointer to a driver object.
+ * @param index Index of the logical unit.
+ * @param config Pointer to a logical unit configuration.
+ * @return @b E_OK on success.
+ */
+enum Result uasAttachConfiguredUnit(struct Uas *driver, uint8_t index,
+    const struct MscUnitConfig *config)
+{
+  assert(index < driver->lunCount);
+  assert(config != NULL && config->interface != NULL);
+
+  const IrqState state = irqSave();
+  const enum Result res = scsiAttachUnit(&driver->lun[index], config);
+  irqRestore(state);
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+void uasDetachUnit(struct Uas *driver, uint8_t index)
+{
+  assert(index < driver->lunCount);
+
+  const IrqState state = irqSave();
+  scsiDetachUnit(&driver->lun[index]);
+  irqRestore(state);
+}
+/*----------------------------------------------------------------------------*/
+bool uasIsUnitFailed(const struct Uas *driver, uint8_t index)
+{
+  assert(index < driver->lunCount);
+  return (driver->lun[index].flags & FLAG_FAILURE) != 0;
+}
+/*----------------------------------------------------------------------------*/
+bool uasIsUnitLocked(const struct Uas *driver, uint8_t index)
+{
+  assert(index < driver->lunCount);
+  return (driver->lun[index].flags & FLAG_LOCKED) != 0;
+}
+/*----------------------------------------------------------------------------*/
+void uasSetCallback(struct Uas *driver, void (*callback)(void *),
+    void *argument)
+{
+  driver->callbackArgument = argument;
+  driver->callback = callback;
+}
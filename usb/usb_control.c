@@ -20,6 +20,14 @@
 /*----------------------------------------------------------------------------*/
 DEFINE_LIST(struct UsbString, String, string)
 /*----------------------------------------------------------------------------*/
+struct CacheHeader
+{
+  /* Descriptor type and index */
+  uint16_t keyword;
+  /* Length of the descriptor data */
+  uint16_t length;
+};
+/*----------------------------------------------------------------------------*/
 struct UsbControl
 {
   struct Entity base;
@@ -39,6 +47,13 @@ struct UsbControl
   /* Single OUT request */
   struct UsbRequest *outRequest;
 
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  /* Serialized descriptors, each one is prepended with a cache header */
+  uint8_t *cache;
+  /* Size of the serialized data */
+  size_t cacheSize;
+#endif
+
 #ifdef CONFIG_USB_DEVICE_STRINGS
   /* List of descriptor strings */
   StringList strings;
@@ -60,7 +75,7 @@ struct UsbControl
     /* Setup packet header */
     struct UsbSetupPacket packet;
     /* Control packet payload */
-    uint8_t payload[(REQUEST_POOL_SIZE - 1) * EP0_PACKET_SIZE];
+    uint8_t payload[CONTROL_PAYLOAD_SIZE];
   } context;
 
   struct UsbRequest requestPool[REQUEST_POOL_SIZE];
@@ -72,6 +87,8 @@ struct UsbControl
 #endif
 };
 /*----------------------------------------------------------------------------*/
+static enum Result dispatchRequest(struct UsbControl *,
+    const struct UsbSetupPacket *, void *, uint16_t *, uint16_t);
 static enum Result driverControl(struct UsbControl *,
     const struct UsbSetupPacket *, void *, uint16_t *, uint16_t);
 static void fillConfigurationDescriptor(struct UsbControl *, void *);
@@ -99,6 +116,13 @@ static void copySetupPacket(struct UsbSetupPacket *,
 static void resetDevice(struct UsbControl *);
 static void sendResponse(struct UsbControl *, const uint8_t *, uint16_t);
 
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+static bool cacheFetch(const struct UsbControl *, uint16_t, void *,
+    uint16_t *);
+static void cacheReset(struct UsbControl *);
+static void cacheStore(struct UsbControl *, uint16_t, const void *, uint16_t);
+#endif
+
 #ifdef CONFIG_USB_DEVICE_STRINGS
 static const struct UsbString *findStringByIndex(struct UsbControl *,
     UsbStringIndex);
@@ -114,7 +138,7 @@ const struct EntityClass * const UsbControl = &(const struct EntityClass){
     .deinit = controlDeinit
 };
 /*----------------------------------------------------------------------------*/
-static enum Result driverControl(struct UsbControl *control,
+static enum Result dispatchRequest(struct UsbControl *control,
     const struct UsbSetupPacket *packet, void *buffer, uint16_t *responseLength,
     uint16_t maxResponseLength)
 {
@@ -144,11 +168,57 @@ static enum Result driverControl(struct UsbControl *control,
     }
   }
 
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result driverControl(struct UsbControl *control,
+    const struct UsbSetupPacket *packet, void *buffer, uint16_t *responseLength,
+    uint16_t maxResponseLength)
+{
+  const uint8_t recipient = REQUEST_RECIPIENT_VALUE(packet->requestType);
+  const uint8_t type = REQUEST_TYPE_VALUE(packet->requestType);
+  const bool standard = type == REQUEST_TYPE_STANDARD;
+  const bool descriptor = standard && recipient == REQUEST_RECIPIENT_DEVICE
+      && packet->request == REQUEST_GET_DESCRIPTOR;
+  enum Result res;
+
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  /* String descriptors depend on the language identifier and are not cached */
+  const bool cacheable = descriptor
+      && DESCRIPTOR_TYPE(packet->value) != DESCRIPTOR_TYPE_STRING;
+
+  if (cacheable && cacheFetch(control, packet->value, buffer, responseLength))
+  {
+    res = E_OK;
+  }
+  else
+  {
+    res = dispatchRequest(control, packet, buffer, responseLength,
+        maxResponseLength);
+
+    if (res == E_OK)
+    {
+      if (cacheable)
+      {
+        cacheStore(control, packet->value, buffer, *responseLength);
+      }
+      else if (standard && recipient == REQUEST_RECIPIENT_INTERFACE
+          && packet->request == REQUEST_SET_INTERFACE)
+      {
+        /* Descriptors may depend on alternate settings */
+        cacheReset(control);
+      }
+    }
+  }
+#else
+  res = dispatchRequest(control, packet, buffer, responseLength,
+      maxResponseLength);
+#endif
+
   if (res != E_OK)
     return res;
 
-  if (type == REQUEST_TYPE_STANDARD && recipient == REQUEST_RECIPIENT_DEVICE
-      && packet->request == REQUEST_GET_DESCRIPTOR)
+  if (descriptor)
   {
     /* Post-process device and configuration descriptors */
     switch (DESCRIPTOR_TYPE(packet->value))
@@ -438,6 +508,64 @@ static enum Result handleStringRequest(struct UsbControl *control,
 }
 #endif
 /*----------------------------------------------------------------------------*/
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+static bool cacheFetch(const struct UsbControl *control, uint16_t keyword,
+    void *response, uint16_t *responseLength)
+{
+  const uint8_t *position = control->cache;
+  const uint8_t * const end = position + control->cacheSize;
+
+  while (position < end)
+  {
+    struct CacheHeader header;
+
+    memcpy(&header, position, sizeof(header));
+    position += sizeof(header);
+
+    if (header.keyword == keyword)
+    {
+      memcpy(response, position, header.length);
+      *responseLength = header.length;
+      return true;
+    }
+
+    position += header.length;
+  }
+
+  return false;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+static void cacheReset(struct UsbControl *control)
+{
+  control->cacheSize = 0;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+static void cacheStore(struct UsbControl *control, uint16_t keyword,
+    const void *data, uint16_t length)
+{
+  const struct CacheHeader header = {
+      .keyword = keyword,
+      .length = length
+  };
+  const size_t size = control->cacheSize + sizeof(header) + length;
+
+  /* Descriptor will be generated again when there is not enough space */
+  if (size <= CONFIG_USB_DEVICE_DESCRIPTOR_CACHE_SIZE)
+  {
+    uint8_t * const position = control->cache + control->cacheSize;
+
+    memcpy(position, &header, sizeof(header));
+    memcpy(position + sizeof(header), data, length);
+
+    control->cacheSize = size;
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
 static void controlInHandler(void *argument, struct UsbRequest *request,
     enum UsbRequestStatus)
 {
@@ -547,6 +675,11 @@ static const struct UsbString *findStringByIndex(struct UsbControl *control,
 /*----------------------------------------------------------------------------*/
 static void resetDevice(struct UsbControl *control)
 {
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  /* Bus reset may change the speed of the device */
+  cacheReset(control);
+#endif
+
   usbEpClear(control->ep0in);
   usbEpClear(control->ep0out);
 
@@ -606,21 +739,40 @@ enum Result usbControlBindDriver(struct UsbControl *control, void *driver)
   assert(driver != NULL);
   assert(control->driver == NULL);
 
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  cacheReset(control);
+#endif
+
   control->driver = driver;
   return E_OK;
 }
 /*----------------------------------------------------------------------------*/
 void usbControlUnbindDriver(struct UsbControl *control)
 {
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  cacheReset(control);
+#endif
+
   control->driver = NULL;
 }
 /*----------------------------------------------------------------------------*/
 void usbControlNotify(struct UsbControl *control, unsigned int event)
 {
   if (event == USB_DEVICE_EVENT_RESET)
+  {
     resetDevice(control);
-  else if (control->driver != NULL)
-    usbDriverNotify(control->driver, event);
+  }
+  else
+  {
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+    /* Speed of the device is updated after the port change */
+    if (event == USB_DEVICE_EVENT_PORT_CHANGE)
+      cacheReset(control);
+#endif
+
+    if (control->driver != NULL)
+      usbDriverNotify(control->driver, event);
+  }
 }
 /*----------------------------------------------------------------------------*/
 void usbControlSetPower(struct UsbControl *control, unsigned int current)
@@ -718,6 +870,14 @@ static enum Result controlInit(void *object, const void *configBase)
   control->context.left = 0;
   memset(&control->context.packet, 0, sizeof(control->context.packet));
 
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  /* Cache is filled from the interrupt context and should not grow */
+  control->cache = malloc(CONFIG_USB_DEVICE_DESCRIPTOR_CACHE_SIZE);
+  if (control->cache == NULL)
+    return E_MEMORY;
+  control->cacheSize = 0;
+#endif
+
   /* Create control endpoints */
 
   control->ep0in = usbDevCreateEndpoint(control->owner,
@@ -780,6 +940,10 @@ static void controlDeinit(void *object)
   free(control->requestArena);
 #endif
 
+#ifdef CONFIG_USB_DEVICE_DESCRIPTOR_CACHE
+  free(control->cache);
+#endif
+
 #ifdef CONFIG_USB_DEVICE_STRINGS
   stringListDeinit(&control->strings);
 #endif